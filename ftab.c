@@ -16,6 +16,10 @@
 
 
 #define _USE_MATH_DEFINES
+#ifndef WINDOWS
+/* sched_getaffinity and pthread_setaffinity_np */
+#define _GNU_SOURCE
+#endif
 
 #include <assert.h>
 #include <math.h>
@@ -27,14 +31,44 @@
 #include <time.h>
 
 #ifndef WINDOWS
+#include <pthread.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <unistd.h>
+#ifdef __linux__
+#ifdef __has_include
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#define FTAB_URING
+#endif
+#endif
+#endif
+#else
+#include <io.h>
+#define read _read
+#endif
+
+#ifdef FTAB_ZLIB
+#include <zlib.h>
+#endif
+
+#ifdef FTAB_ZSTD
+#include <zstd.h>
 #endif
 
 #include "ftab.h"
 #include "ftab_config.h"
 
 typedef uint8_t u8;
+typedef uint16_t u16;
 typedef uint32_t u32;
+typedef int32_t i32;
 typedef uint64_t u64;
 typedef int64_t i64;
 typedef double f64;
@@ -121,6 +155,358 @@ getline(char **lineptr, size_t *n, FILE *stream) {
 *                    ============================
 */
 
+/*                          THREADING
+ *                          =========
+ *
+ * All parallel work goes through an execution context, ftab_ctx_t,
+ * that owns a pool of persistent worker threads. A job is split into
+ * ntasks tasks, fn(arg, task, ntasks), which idle workers, and the
+ * calling thread, claim one at a time. Jobs on the same context are
+ * run one at a time and a job started from within a task is run
+ * serially, so the number of threads never exceeds the size of the
+ * pool.
+ */
+
+/* Work function for run_parallel. Called once per task with the
+ * task number and the total number of tasks */
+typedef void (*ftab_work_fn)(void * arg, int thread, int nthreads);
+
+struct ftab_ctx {
+    int nthreads; /* Including the calling thread */
+#ifndef WINDOWS
+    int nworkers;
+    pthread_t * workers;
+    pthread_mutex_t run; /* Held while a job is running */
+    pthread_mutex_t mutex;
+    pthread_cond_t wake;
+    pthread_cond_t done;
+    ftab_work_fn fn;
+    void * arg;
+    int ntasks;
+    int next; /* Next task to claim */
+    int finished;
+    int shutdown;
+#endif
+};
+
+#ifndef WINDOWS
+/* Set for pool workers and for the caller while it runs tasks */
+static __thread int ctx_in_task = 0;
+static __thread ftab_ctx_t * ctx_current = NULL;
+static ftab_ctx_t * ctx_default = NULL;
+static pthread_once_t ctx_default_once = PTHREAD_ONCE_INIT;
+#else
+static ftab_ctx_t ctx_serial = {1};
+#endif
+
+/* Number of CPUs that this process may use, taking the affinity mask
+ * and a cgroup (v2) CPU quota into account */
+static int ftab_ncpu(void)
+{
+#ifdef WINDOWS
+    return 1;
+#else
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+#ifdef __linux__
+    cpu_set_t set;
+    if(sched_getaffinity(0, sizeof(set), &set) == 0 && CPU_COUNT(&set) > 0)
+    {
+        n = CPU_COUNT(&set) < n ? CPU_COUNT(&set) : n;
+    }
+    FILE * fid = fopen("/sys/fs/cgroup/cpu.max", "r");
+    if(fid != NULL)
+    {
+        long quota = 0;
+        long period = 0;
+        if(fscanf(fid, "%ld %ld", &quota, &period) == 2 && quota > 0 && period > 0)
+        {
+            long q = (quota + period - 1) / period;
+            n = q < n ? q : n;
+        }
+        fclose(fid);
+    }
+#endif
+    return n < 1 ? 1 : (int) n;
+#endif
+}
+
+#ifndef WINDOWS
+/* Claim and run tasks of the current job until there are none left.
+ * Called with ctx->mutex locked. */
+static void ctx_run_tasks(ftab_ctx_t * ctx)
+{
+    while(ctx->next < ctx->ntasks)
+    {
+        int task = ctx->next++;
+        pthread_mutex_unlock(&ctx->mutex);
+        int in_task = ctx_in_task;
+        ctx_in_task = 1;
+        ctx->fn(ctx->arg, task, ctx->ntasks);
+        ctx_in_task = in_task;
+        pthread_mutex_lock(&ctx->mutex);
+        if(++ctx->finished == ctx->ntasks)
+        {
+            pthread_cond_broadcast(&ctx->done);
+        }
+    }
+}
+
+static void * ctx_worker(void * _ctx)
+{
+    ftab_ctx_t * ctx = _ctx;
+    ctx_in_task = 1;
+    pthread_mutex_lock(&ctx->mutex);
+    while(1)
+    {
+        while(!ctx->shutdown && ctx->next >= ctx->ntasks)
+        {
+            pthread_cond_wait(&ctx->wake, &ctx->mutex);
+        }
+        if(ctx->shutdown)
+        {
+            break;
+        }
+        ctx_run_tasks(ctx);
+    }
+    pthread_mutex_unlock(&ctx->mutex);
+    return NULL;
+}
+#endif
+
+ftab_ctx_t * ftab_ctx_new(int nthreads)
+{
+    if(nthreads < 1)
+    {
+        nthreads = ftab_ncpu();
+    }
+    ftab_ctx_t * ctx = calloc(1, sizeof(ftab_ctx_t));
+    assert(ctx != NULL);
+    ctx->nthreads = nthreads;
+#ifdef WINDOWS
+    ctx->nthreads = 1;
+#else
+    pthread_mutex_init(&ctx->run, NULL);
+    pthread_mutex_init(&ctx->mutex, NULL);
+    pthread_cond_init(&ctx->wake, NULL);
+    pthread_cond_init(&ctx->done, NULL);
+    ctx->workers = calloc(nthreads, sizeof(pthread_t));
+    assert(ctx->workers != NULL);
+    for(int kk = 1; kk < nthreads; kk++)
+    {
+        if(pthread_create(ctx->workers + ctx->nworkers, NULL, ctx_worker, ctx) != 0)
+        {
+            break;
+        }
+        ctx->nworkers++;
+    }
+    ctx->nthreads = ctx->nworkers + 1;
+#endif
+    return ctx;
+}
+
+void ftab_ctx_free(ftab_ctx_t * ctx)
+{
+    if(ctx == NULL)
+    {
+        return;
+    }
+#ifndef WINDOWS
+    pthread_mutex_lock(&ctx->mutex);
+    ctx->shutdown = 1;
+    pthread_cond_broadcast(&ctx->wake);
+    pthread_mutex_unlock(&ctx->mutex);
+    for(int kk = 0; kk < ctx->nworkers; kk++)
+    {
+        pthread_join(ctx->workers[kk], NULL);
+    }
+    free(ctx->workers);
+    pthread_mutex_destroy(&ctx->run);
+    pthread_mutex_destroy(&ctx->mutex);
+    pthread_cond_destroy(&ctx->wake);
+    pthread_cond_destroy(&ctx->done);
+    if(ctx_current == ctx)
+    {
+        ctx_current = NULL;
+    }
+#endif
+    free(ctx);
+}
+
+int ftab_ctx_nthreads(const ftab_ctx_t * ctx)
+{
+    return ctx == NULL ? 0 : ctx->nthreads;
+}
+
+int ftab_ctx_set_affinity(ftab_ctx_t * ctx, const int * cpus, int ncpus)
+{
+    if(ctx == NULL || cpus == NULL || ncpus < 1)
+    {
+        return EXIT_FAILURE;
+    }
+#if !defined(WINDOWS) && defined(__linux__)
+    int status = EXIT_SUCCESS;
+    /* The calling thread is left as it is */
+    for(int kk = 0; kk < ctx->nworkers; kk++)
+    {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpus[(kk + 1) % ncpus], &set);
+        if(pthread_setaffinity_np(ctx->workers[kk], sizeof(set), &set) != 0)
+        {
+            status = EXIT_FAILURE;
+        }
+    }
+    return status;
+#else
+    fprintf(stderr, "ftab: CPU affinity is not supported on this platform\n");
+    return EXIT_FAILURE;
+#endif
+}
+
+#ifndef WINDOWS
+static void ctx_default_init(void)
+{
+    int nthreads = 0;
+    const char * env = getenv("FTAB_NUM_THREADS");
+    if(env != NULL)
+    {
+        nthreads = atoi(env);
+    }
+    ctx_default = ftab_ctx_new(nthreads);
+}
+#endif
+
+void ftab_ctx_use(ftab_ctx_t * ctx)
+{
+#ifndef WINDOWS
+    ctx_current = ctx;
+#else
+    (void) ctx;
+#endif
+}
+
+/* The context used by the calling thread */
+static ftab_ctx_t * ctx_get(void)
+{
+#ifdef WINDOWS
+    return &ctx_serial;
+#else
+    if(ctx_current != NULL)
+    {
+        return ctx_current;
+    }
+    pthread_once(&ctx_default_once, ctx_default_init);
+    return ctx_default;
+#endif
+}
+
+#ifndef WINDOWS
+/* Hand a job to the workers. Finish with ctx_wait */
+static void ctx_submit(ftab_ctx_t * ctx, int ntasks, ftab_work_fn fn, void * arg)
+{
+    pthread_mutex_lock(&ctx->run);
+    pthread_mutex_lock(&ctx->mutex);
+    ctx->fn = fn;
+    ctx->arg = arg;
+    ctx->ntasks = ntasks;
+    ctx->next = 0;
+    ctx->finished = 0;
+    pthread_cond_broadcast(&ctx->wake);
+    pthread_mutex_unlock(&ctx->mutex);
+}
+
+/* Start a job where all tasks run concurrently, without the caller
+ * taking part. Returns EXIT_FAILURE, and starts nothing, if there are
+ * not enough workers. Finish with ctx_wait(ctx, 0). */
+static int ctx_start(ftab_ctx_t * ctx, int ntasks, ftab_work_fn fn, void * arg)
+{
+    if(ctx_in_task || ntasks > ctx->nworkers)
+    {
+        return EXIT_FAILURE;
+    }
+    ctx_submit(ctx, ntasks, fn, arg);
+    return EXIT_SUCCESS;
+}
+
+/* Help with the remaining tasks and wait for the job to finish */
+static void ctx_wait(ftab_ctx_t * ctx, int help)
+{
+    pthread_mutex_lock(&ctx->mutex);
+    if(help)
+    {
+        ctx_run_tasks(ctx);
+    }
+    while(ctx->finished < ctx->ntasks)
+    {
+        pthread_cond_wait(&ctx->done, &ctx->mutex);
+    }
+    ctx->ntasks = 0;
+    ctx->next = 0;
+    pthread_mutex_unlock(&ctx->mutex);
+    pthread_mutex_unlock(&ctx->run);
+}
+#endif
+
+/* Run the tasks 0, ..., nthreads-1 of fn on the pool of the current
+ * context, including the calling thread, and wait for all of them to
+ * finish. */
+static void run_parallel(int nthreads, ftab_work_fn fn, void * arg)
+{
+#ifndef WINDOWS
+    ftab_ctx_t * ctx = ctx_get();
+    if(nthreads > 1 && !ctx_in_task && ctx->nworkers > 0)
+    {
+        ctx_submit(ctx, nthreads, fn, arg);
+        ctx_wait(ctx, 1);
+        return;
+    }
+#endif
+    /* Serial fallback */
+    for(int kk = 0; kk < nthreads; kk++)
+    {
+        fn(arg, kk, nthreads);
+    }
+}
+
+/* Number of tasks to use for n items, at least min_per_thread items
+ * per task and at most one per thread of the context. */
+static int nthreads_for(size_t n, size_t min_per_thread)
+{
+    size_t nt = n / min_per_thread;
+    size_t ncpu = ctx_get()->nthreads;
+    nt = nt > ncpu ? ncpu : nt;
+    return nt < 1 ? 1 : (int) nt;
+}
+
+/* The range [*first, *last) of n items for a thread */
+static void thread_range(size_t n, int thread, int nthreads,
+                         size_t * first, size_t * last)
+{
+    *first = n * (size_t) thread / nthreads;
+    *last = n * (size_t) (thread+1) / nthreads;
+}
+
+typedef struct {
+    void * dst;
+    const void * src;
+    size_t n;
+} ftab_memcpy_job_t;
+
+static void memcpy_worker(void * _J, int thread, int nthreads)
+{
+    ftab_memcpy_job_t * J = _J;
+    size_t first, last;
+    thread_range(J->n, thread, nthreads, &first, &last);
+    memcpy((u8 *) J->dst + first, (const u8 *) J->src + first, last - first);
+}
+
+/* memcpy, in parallel for large copies */
+static void par_memcpy(void * dst, const void * src, size_t n)
+{
+    ftab_memcpy_job_t J = {dst, src, n};
+    run_parallel(nthreads_for(n, 1 << 22), memcpy_worker, &J);
+}
+
 int ftab_has_data(const ftab_t * T)
 {
     if(T == NULL)
@@ -143,24 +529,6 @@ int ftab_has_data(const ftab_t * T)
 }
 
 
-/* Count the number of newlines in a file */
-static size_t count_newlines(const char * fname)
-{
-    FILE * fid = fopen(fname, "r");
-    assert(fid != NULL);
-    size_t N = 0;
-    int c = EOF;
-    while( (c = fgetc(fid) ) != EOF )
-    {
-        if( c == '\n')
-        {
-            N++;
-        }
-    }
-    fclose(fid);
-    return N;
-}
-
 static void
 trim_whitespace(char * str)
 {
@@ -242,98 +610,531 @@ void ftab_head(ftab_t * T, int64_t n)
     T->nrow = n;
 }
 
-void ftab_free(ftab_t * T)
+/*                         MISSING VALUES
+ *                         ==============
+ *
+ * T->valid has one bitmap per column, bit r is set if row r has a
+ * value. Columns without missing values have no bitmap and T->valid
+ * is NULL if no column has any, so tables without missing values
+ * cost nothing and the others 1 bit per cell. Missing cells contain
+ * NAN so that code that does not look at the bitmaps still skips
+ * them. The bits of rows >= T->nrow are undefined, functions that add
+ * rows set them.
+ */
+
+struct ftab_valid {
+    size_t cap; /* Number of rows that fit in each bitmap */
+    u8 ** bits; /* One per column, NULL if the column has no missing values */
+};
+
+/* Parsed empty fields are marked by this NAN until they are recorded */
+#define FTAB_MISSING_BITS 0x7fc0f7abu
+
+static inline int bit_get(const u8 * B, size_t r)
 {
-    if(T == NULL)
-    {
-        return;
-    }
+    return (B[r/8] >> (r % 8)) & 1;
+}
 
-    free(T->T);
+static inline void bit_set(u8 * B, size_t r)
+{
+    B[r/8] |= (u8) (1u << (r % 8));
+}
 
-    if(T->colnames != NULL)
+static inline void bit_clear(u8 * B, size_t r)
+{
+    B[r/8] &= (u8) ~(1u << (r % 8));
+}
+
+/* Set the bits [first, first + n) */
+static void bits_fill(u8 * B, size_t first, size_t n)
+{
+    size_t r = first;
+    size_t end = first + n;
+    while(r < end && r % 8 != 0)
     {
-        for(size_t kk = 0; kk < T->ncol; kk++)
-        {
-            free(T->colnames[kk]);
-        }
-        free(T->colnames);
+        bit_set(B, r++);
     }
+    if(end - r >= 8)
+    {
+        memset(B + r/8, 0xff, (end - r) / 8);
+        r += (end - r) / 8 * 8;
+    }
+    while(r < end)
+    {
+        bit_set(B, r++);
+    }
+}
 
-    free(T);
-    return;
+static void valid_free(ftab_t * T)
+{
+    if(T->valid == NULL)
+    {
+        return;
+    }
+    for(size_t cc = 0; cc < T->ncol; cc++)
+    {
+        free(T->valid->bits[cc]);
+    }
+    free(T->valid->bits);
+    free(T->valid);
+    T->valid = NULL;
 }
 
-int ftab_write_tsv(const ftab_t * T, const char * fname)
+/* Make room for nrow rows in all bitmaps */
+static void valid_reserve(ftab_t * T, size_t nrow)
 {
-    FILE * fid = fopen(fname, "w");
-    if(fid == NULL)
+    struct ftab_valid * V = T->valid;
+    if(V == NULL || nrow <= V->cap)
     {
-        return EXIT_FAILURE;
+        return;
     }
-    int ret = ftab_print(fid, T, "\t");
-    fclose(fid);
-    return ret;
+    size_t cap = V->cap + V->cap / 2;
+    cap = cap < nrow ? nrow : cap;
+    for(size_t cc = 0; cc < T->ncol; cc++)
+    {
+        if(V->bits[cc] != NULL)
+        {
+            V->bits[cc] = realloc(V->bits[cc], cap/8 + 1);
+            assert(V->bits[cc] != NULL);
+        }
+    }
+    V->cap = cap;
 }
 
-int ftab_write_csv(const ftab_t * T, const char * fname)
+/* The bitmap of a column, created with all rows valid if needed */
+static u8 * valid_col(ftab_t * T, size_t col)
 {
-    FILE * fid = fopen(fname, "w");
-    if(fid == NULL)
+    if(T->valid == NULL)
     {
-        return EXIT_FAILURE;
+        T->valid = calloc(1, sizeof(struct ftab_valid));
+        assert(T->valid != NULL);
+        T->valid->bits = calloc(T->ncol, sizeof(u8*));
+        assert(T->valid->bits != NULL);
+        T->valid->cap = T->nrow;
     }
-    int ret = ftab_print(fid, T, ",");
-    fclose(fid);
-    return ret;
+    struct ftab_valid * V = T->valid;
+    if(V->bits[col] == NULL)
+    {
+        V->bits[col] = calloc(V->cap/8 + 1, 1);
+        assert(V->bits[col] != NULL);
+        bits_fill(V->bits[col], 0, T->nrow);
+    }
+    return V->bits[col];
 }
 
-int ftab_print(FILE * fid, const ftab_t * T, const char * sep)
+/* Rows [first, first + n) were added with values in all columns */
+static void valid_append(ftab_t * T, size_t first, size_t n)
 {
-    /* Write column names if they exist, otherwise col_1 etc */
-    for(size_t cc = 0; cc<T->ncol; cc++)
+    if(T->valid == NULL)
     {
-        int colname = 0;
-        if(T->colnames != NULL)
-        {
-            if(T->colnames[cc] != NULL)
-            {
-                fprintf(fid, "%s", T->colnames[cc]);
-                colname = 1;
-            }
-        }
-        if(colname == 0)
-        {
-            fprintf(fid, "col_%zu", cc+1);
-        }
-        if(cc+1 != T->ncol)
+        return;
+    }
+    valid_reserve(T, first + n);
+    for(size_t cc = 0; cc < T->ncol; cc++)
+    {
+        if(T->valid->bits[cc] != NULL)
         {
-            fprintf(fid, "%s", sep);
+            bits_fill(T->valid->bits[cc], first, n);
         }
     }
-    fprintf(fid, "\n");
+}
 
-    /* Write rows */
-    for(size_t rr = 0; rr<T->nrow; rr++)
+/* Copy the missing values of n rows from column scol of S, starting
+ * at row sfirst, to D. D must have room for the rows. */
+static void valid_copy(ftab_t * D, size_t dfirst, size_t dcol,
+                       const ftab_t * S, size_t sfirst, size_t scol,
+                       size_t n)
+{
+    if(S->valid == NULL || S->valid->bits[scol] == NULL)
     {
-        for(size_t cc = 0; cc<T->ncol; cc++)
+        return;
+    }
+    const u8 * SB = S->valid->bits[scol];
+    u8 * DB = valid_col(D, dcol);
+    for(size_t kk = 0; kk < n; kk++)
+    {
+        if(bit_get(SB, sfirst + kk))
         {
-            fprintf(fid, "%f", T->T[rr*T->ncol + cc]);
-            if(cc+1 != T->ncol)
-            {
-                fprintf(fid, "%s", sep);
-            }
+            bit_set(DB, dfirst + kk);
+        } else {
+            bit_clear(DB, dfirst + kk);
         }
-        fprintf(fid, "\n");
     }
-    return EXIT_SUCCESS;
 }
 
-ftab_t * ftab_new(int ncol)
+/* Keep the rows where selection > 0, in place. nrow is the number of
+ * rows before the selection */
+static void valid_select(ftab_t * T, const u8 * selection, size_t nrow)
 {
-    if(ncol < 1)
+    if(T->valid == NULL)
     {
-        fprintf(stderr, "ftab_new requires at least 1 column\n");
+        return;
+    }
+    for(size_t cc = 0; cc < T->ncol; cc++)
+    {
+        u8 * B = T->valid->bits[cc];
+        if(B == NULL)
+        {
+            continue;
+        }
+        size_t out = 0;
+        for(size_t kk = 0; kk < nrow; kk++)
+        {
+            if(selection[kk] > 0)
+            {
+                if(bit_get(B, kk))
+                {
+                    bit_set(B, out);
+                } else {
+                    bit_clear(B, out);
+                }
+                out++;
+            }
+        }
+    }
+}
+
+/* Record the cells of rows [first, T->nrow) that the parser marked
+ * with FTAB_MISSING_BITS */
+static void valid_record(ftab_t * T, size_t first)
+{
+    const float * V = T->T + first*T->ncol;
+    size_t n = (T->nrow - first)*T->ncol;
+    /* Most blocks have none */
+    int any = 0;
+    for(size_t kk = 0; kk < n; kk++)
+    {
+        u32 u;
+        memcpy(&u, V + kk, sizeof(u32));
+        any |= u == FTAB_MISSING_BITS;
+    }
+    if(!any)
+    {
+        return;
+    }
+    for(size_t kk = 0; kk < n; kk++)
+    {
+        u32 u;
+        memcpy(&u, V + kk, sizeof(u32));
+        if(u == FTAB_MISSING_BITS)
+        {
+            size_t row = first + kk / T->ncol;
+            size_t col = kk % T->ncol;
+            bit_clear(valid_col(T, col), row);
+            T->T[row*T->ncol + col] = NAN;
+        }
+    }
+}
+
+int ftab_is_missing(const ftab_t * T, size_t row, size_t col)
+{
+    if(T == NULL || T->valid == NULL || col >= T->ncol || row >= T->nrow
+       || T->valid->bits[col] == NULL)
+    {
+        return 0;
+    }
+    return !bit_get(T->valid->bits[col], row);
+}
+
+void ftab_set_missing(ftab_t * T, size_t row, size_t col)
+{
+    if(T == NULL || col >= T->ncol || row >= T->nrow)
+    {
+        return;
+    }
+    bit_clear(valid_col(T, col), row);
+    T->T[row*T->ncol + col] = NAN;
+}
+
+size_t ftab_count_missing(const ftab_t * T, size_t col)
+{
+    if(T == NULL || T->valid == NULL || col >= T->ncol
+       || T->valid->bits[col] == NULL)
+    {
+        return 0;
+    }
+    const u8 * B = T->valid->bits[col];
+    size_t nvalid = 0;
+    for(size_t kk = 0; kk < T->nrow; kk++)
+    {
+        nvalid += bit_get(B, kk);
+    }
+    return T->nrow - nvalid;
+}
+
+/* Release T->T, which might be memory mapped */
+static void free_data(ftab_t * T)
+{
+#ifndef WINDOWS
+    if(T->map != NULL)
+    {
+        munmap(T->map, T->map_size);
+        T->map = NULL;
+        T->map_size = 0;
+        T->T = NULL;
+        return;
+    }
+#endif
+    free(T->T);
+    T->T = NULL;
+}
+
+/* Make sure that T->T can be passed to realloc. Mapped data is
+ * copied to the heap. */
+static int own_data(ftab_t * T)
+{
+    if(T->map == NULL)
+    {
+        return EXIT_SUCCESS;
+    }
+    size_t nalloc = T->nrow_alloc > 0 ? T->nrow_alloc : 1;
+    float * data = malloc(nalloc*T->ncol*sizeof(float));
+    if(data == NULL)
+    {
+        return EXIT_FAILURE;
+    }
+    memcpy(data, T->T, T->nrow*T->ncol*sizeof(float));
+    free_data(T);
+    T->T = data;
+    T->nrow_alloc = nalloc;
+    return EXIT_SUCCESS;
+}
+
+void ftab_free(ftab_t * T)
+{
+    if(T == NULL)
+    {
+        return;
+    }
+
+    free_data(T);
+
+    if(T->colnames != NULL)
+    {
+        for(size_t kk = 0; kk < T->ncol; kk++)
+        {
+            free(T->colnames[kk]);
+        }
+        free(T->colnames);
+    }
+    valid_free(T);
+
+    free(T);
+    return;
+}
+
+/* Defined with the asynchronous I/O */
+static int write_dlm(const ftab_t * T, const char * fname, const char * sep);
+
+int ftab_write_tsv(const ftab_t * T, const char * fname)
+{
+    return write_dlm(T, fname, "\t");
+}
+
+int ftab_write_csv(const ftab_t * T, const char * fname)
+{
+    return write_dlm(T, fname, ",");
+}
+
+/* Growing text buffer used by the writers */
+typedef struct {
+    char * s;
+    size_t len;
+    size_t cap;
+} ftab_strbuf_t;
+
+static int sb_reserve(ftab_strbuf_t * sb, size_t n)
+{
+    if(sb->len + n + 1 <= sb->cap)
+    {
+        return EXIT_SUCCESS;
+    }
+    size_t cap = sb->cap < 4096 ? 4096 : sb->cap;
+    while(sb->len + n + 1 > cap)
+    {
+        cap *= 2;
+    }
+    char * s = realloc(sb->s, cap);
+    if(s == NULL)
+    {
+        return EXIT_FAILURE;
+    }
+    sb->s = s;
+    sb->cap = cap;
+    return EXIT_SUCCESS;
+}
+
+static int sb_append(ftab_strbuf_t * sb, const char * str, size_t n)
+{
+    if(sb_reserve(sb, n))
+    {
+        return EXIT_FAILURE;
+    }
+    memcpy(sb->s + sb->len, str, n);
+    sb->len += n;
+    sb->s[sb->len] = '\0';
+    return EXIT_SUCCESS;
+}
+
+static int sb_append_float(ftab_strbuf_t * sb, float value)
+{
+    /* Large enough for most values, FLT_MAX needs 46 */
+    if(sb_reserve(sb, 64))
+    {
+        return EXIT_FAILURE;
+    }
+    int n = snprintf(sb->s + sb->len, sb->cap - sb->len, "%f", value);
+    if(n < 0)
+    {
+        return EXIT_FAILURE;
+    }
+    if((size_t) n >= sb->cap - sb->len)
+    {
+        if(sb_reserve(sb, n))
+        {
+            return EXIT_FAILURE;
+        }
+        snprintf(sb->s + sb->len, sb->cap - sb->len, "%f", value);
+    }
+    sb->len += n;
+    return EXIT_SUCCESS;
+}
+
+/* Write column names if they exist, otherwise col_1 etc */
+static int
+format_header(ftab_strbuf_t * sb, const ftab_t * T, const char * sep)
+{
+    size_t seplen = strlen(sep);
+    for(size_t cc = 0; cc<T->ncol; cc++)
+    {
+        int colname = 0;
+        if(T->colnames != NULL)
+        {
+            if(T->colnames[cc] != NULL)
+            {
+                if(sb_append(sb, T->colnames[cc], strlen(T->colnames[cc])))
+                {
+                    return EXIT_FAILURE;
+                }
+                colname = 1;
+            }
+        }
+        if(colname == 0)
+        {
+            char name[32];
+            int n = snprintf(name, sizeof(name), "col_%zu", cc+1);
+            if(sb_append(sb, name, n))
+            {
+                return EXIT_FAILURE;
+            }
+        }
+        if(cc+1 != T->ncol)
+        {
+            if(sb_append(sb, sep, seplen))
+            {
+                return EXIT_FAILURE;
+            }
+        }
+    }
+    return sb_append(sb, "\n", 1);
+}
+
+/* Format the rows [first, last) */
+static int
+format_rows(ftab_strbuf_t * sb, const ftab_t * T, const char * sep,
+            size_t first, size_t last)
+{
+    size_t seplen = strlen(sep);
+    u8 ** valid = T->valid == NULL ? NULL : T->valid->bits;
+    for(size_t rr = first; rr<last; rr++)
+    {
+        for(size_t cc = 0; cc<T->ncol; cc++)
+        {
+            /* Missing values are left empty */
+            int missing = valid != NULL && valid[cc] != NULL
+                && !bit_get(valid[cc], rr);
+            if(!missing && sb_append_float(sb, T->T[rr*T->ncol + cc]))
+            {
+                return EXIT_FAILURE;
+            }
+            if(cc+1 != T->ncol)
+            {
+                if(sb_append(sb, sep, seplen))
+                {
+                    return EXIT_FAILURE;
+                }
+            }
+        }
+        if(sb_append(sb, "\n", 1))
+        {
+            return EXIT_FAILURE;
+        }
+    }
+    return EXIT_SUCCESS;
+}
+
+/* Write the rows [first, nrow), preceded by the header if
+ * header != 0 */
+static int
+print_rows(FILE * fid, const ftab_t * T, const char * sep,
+           size_t first, int header)
+{
+    ftab_strbuf_t sb = {0};
+    int status = header ? format_header(&sb, T, sep) : EXIT_SUCCESS;
+
+    /* Write rows, a chunk at a time */
+    size_t chunk = 1 + (1 << 16) / (T->ncol + 1);
+    for(size_t rr = first; rr<T->nrow && status == EXIT_SUCCESS; rr += chunk)
+    {
+        size_t last = rr + chunk < T->nrow ? rr + chunk : T->nrow;
+        status = format_rows(&sb, T, sep, rr, last);
+        if(status == EXIT_SUCCESS && fwrite(sb.s, 1, sb.len, fid) != sb.len)
+        {
+            status = EXIT_FAILURE;
+        }
+        sb.len = 0;
+    }
+    if(status == EXIT_SUCCESS && sb.len > 0)
+    {
+        if(fwrite(sb.s, 1, sb.len, fid) != sb.len)
+        {
+            status = EXIT_FAILURE;
+        }
+    }
+    free(sb.s);
+    return status;
+}
+
+int ftab_print(FILE * fid, const ftab_t * T, const char * sep)
+{
+    return print_rows(fid, T, sep, 0, 1);
+}
+
+char * ftab_write_buffer(const ftab_t * T, const char * sep, size_t * len)
+{
+    if(T == NULL || sep == NULL)
+    {
+        return NULL;
+    }
+    ftab_strbuf_t sb = {0};
+    if(format_header(&sb, T, sep)
+       || format_rows(&sb, T, sep, 0, T->nrow))
+    {
+        free(sb.s);
+        return NULL;
+    }
+    if(len != NULL)
+    {
+        *len = sb.len;
+    }
+    return sb.s;
+}
+
+ftab_t * ftab_new(int ncol)
+{
+    if(ncol < 1)
+    {
+        fprintf(stderr, "ftab_new requires at least 1 column\n");
         return NULL;
     }
     ftab_t * T = calloc(1, sizeof(ftab_t));
@@ -359,7 +1160,8 @@ parse_col_names(ftab_t * T,
     char * line = strdup(_line);
     assert(line != NULL);
     int ncol = 1;
-    for(size_t kk = 0; kk<strlen(line); kk++)
+    size_t len = strlen(line);
+    for(size_t kk = 0; kk<len; kk++)
     {
         if(line[kk] == dlm[0])
         {
@@ -400,6 +1202,10 @@ parse_col_names(ftab_t * T,
 int ftab_get_col(const ftab_t * T, const char * name)
 {
     int ret = -1;
+    if(T == NULL || name == NULL || T->colnames == NULL)
+    {
+        return ret;
+    }
     for(size_t kk = 0; kk<T->ncol; kk++)
     {
         if(T->colnames[kk] == NULL)
@@ -419,625 +1225,12693 @@ int ftab_get_col(const ftab_t * T, const char * name)
     return ret;
 }
 
-static int
-parse_floats(char * l,
-             float * row,
-             int nval,
-             const char * dlm)
+/*                        STREAMING READER
+ *                        ================
+ *
+ * All loaders go through a byte source (ftab_src_t) so that the size
+ * of the input does not have to be known in advance. gzip and zstd
+ * compressed input is detected from the magic bytes and decompressed
+ * on the fly.
+ *
+ * When threads are available a producer thread reads (and
+ * decompresses) the input into blocks that always end at a line
+ * break. The blocks are parsed by a set of worker threads while the
+ * calling thread appends the parsed rows to the table in input order.
+ */
+
+#define FTAB_BLOCK_SIZE ((size_t) 1 << 22)
+#define FTAB_SRC_BUFSIZE ((size_t) 1 << 16)
+
+typedef enum {
+    FTAB_CODEC_NONE,
+    FTAB_CODEC_GZIP,
+    FTAB_CODEC_ZSTD
+} ftab_codec_t;
+
+typedef struct ftab_src ftab_src_t;
+typedef struct ftab_aread ftab_aread_t;
+struct ftab_src {
+    /* Raw read from the underlying file/descriptor. Returns the
+     * number of bytes read, 0 at end of file and -1 on error */
+    i64 (*raw_read)(ftab_src_t *, char *, size_t);
+    int fd;
+    FILE * fid;
+    const char * mem;
+    size_t mem_len;
+    size_t mem_pos;
+    ftab_aread_t * ar;
+    int raw_eof;
+    ftab_codec_t codec;
+    /* Raw bytes not yet consumed, also used for the magic bytes */
+    char * in;
+    size_t in_pos;
+    size_t in_len;
+#ifdef FTAB_ZLIB
+    z_stream zs;
+    int gz_member; /* Inside a gzip member, i.e., before Z_STREAM_END */
+#endif
+#ifdef FTAB_ZSTD
+    ZSTD_DStream * zds;
+    int zstd_frame; /* The last ZSTD_decompressStream did not end a frame */
+#endif
+};
+
+static i64 src_raw_read_FILE(ftab_src_t * src, char * buf, size_t n)
 {
-    char * f = strsep(&l, dlm);
-    if(f == NULL)
+    size_t nread = fread(buf, 1, n, src->fid);
+    if(nread == 0 && ferror(src->fid))
     {
-        return 0;
+        return -1;
     }
-    //    printf("0/%d: %s\n", nval, f);
-    row[0] = atof(f);
-    for(int kk = 1; kk<nval; kk++)
+    return nread;
+}
+
+static i64 src_raw_read_fd(ftab_src_t * src, char * buf, size_t n)
+{
+    while(1)
     {
-        f = strsep(&l, dlm);
-        //      printf("%d: %s\n", kk, f);
-        if(f == NULL)
+        i64 nread = read(src->fd, buf, n);
+        if(nread < 0 && errno == EINTR)
         {
-            return 0;
+            continue;
         }
-        row[kk] = atof(f);
+        return nread;
     }
-
-    //   exit(EXIT_FAILURE);
-    return 1;
 }
 
+static i64 src_raw_read_mem(ftab_src_t * src, char * buf, size_t n)
+{
+    size_t nc = src->mem_len - src->mem_pos;
+    nc = nc < n ? nc : n;
+    memcpy(buf, src->mem + src->mem_pos, nc);
+    src->mem_pos += nc;
+    return nc;
+}
 
-static ftab_t *
-ftab_from_dlm(const char * fname,
-              const char * dlm)
+/* Fill the raw input buffer. Returns the number of available bytes */
+static i64 src_fill(ftab_src_t * src)
 {
-    FILE * fid = fopen(fname, "r");
-    if(fid == NULL)
+    if(src->in_pos < src->in_len)
     {
-        fprintf(stderr, "Can not open %s\n", fname);
-        return NULL;
+        return src->in_len - src->in_pos;
     }
-    ftab_t * T = calloc(1, sizeof(ftab_t));
-    assert(T != NULL);
-    // Get number of columns
-    char * line = NULL;
-    size_t len = 0;
-    i64 nread = getline(&line, &len, fid);
-    if(nread <= 0)
+    src->in_pos = 0;
+    src->in_len = 0;
+    if(src->raw_eof)
     {
-        fprintf(stderr, "Empty header line\n");
-        free(line);
-        free(T);
-        fclose(fid);
-        return NULL;
+        return 0;
     }
-
-    int ncols = parse_col_names(T, line, dlm);
-
-    // printf("%zu columns\n", T->ncol);
-    size_t nrows = count_newlines(fname)+1;
-    // printf("at most %zu lines\n", nrows);
-
-    // Allocate memory
-    T->T = calloc(nrows*ncols, sizeof(float));
-    assert(T->T != NULL);
-    T->ncol = ncols;
-    T->nrow_alloc = nrows;
-    // T->nrow = nrows; // set later
-
-    // Read
-    int row = 0;
-    while( getline(&line, &len, fid) > 0)
+    i64 nread = src->raw_read(src, src->in, FTAB_SRC_BUFSIZE);
+    if(nread < 0)
     {
-        if(strlen(line) == 0)
-        {
-            continue;
-        }
-        row += parse_floats(line, T->T + row*T->ncol, T->ncol, dlm);
+        return -1;
     }
-    T->nrow = row;
-    //printf("Returning a %zux%zu table\n", T->nrow, T->ncol);
-    free(line);
-    fclose(fid);
-    return T;
+    if(nread == 0)
+    {
+        src->raw_eof = 1;
+    }
+    src->in_len = nread;
+    return nread;
 }
 
-
-ftab_t * ftab_from_csv(const char * fname)
+static int src_init(ftab_src_t * src)
 {
-    return ftab_from_dlm(fname, ",");
-}
+    src->in = calloc(FTAB_SRC_BUFSIZE, 1);
+    if(src->in == NULL)
+    {
+        return EXIT_FAILURE;
+    }
+    /* Look for magic bytes */
+    while(src->in_len < 4 && !src->raw_eof)
+    {
+        i64 nread = src->raw_read(src, src->in + src->in_len,
+                                  4 - src->in_len);
+        if(nread < 0)
+        {
+            return EXIT_FAILURE;
+        }
+        if(nread == 0)
+        {
+            src->raw_eof = 1;
+        }
+        src->in_len += nread;
+    }
+    const u8 * m = (const u8 *) src->in;
+    src->codec = FTAB_CODEC_NONE;
+    if(src->in_len >= 2 && m[0] == 0x1f && m[1] == 0x8b)
+    {
+        src->codec = FTAB_CODEC_GZIP;
+    }
+    if(src->in_len >= 4 && m[0] == 0x28 && m[1] == 0xb5
+       && m[2] == 0x2f && m[3] == 0xfd)
+    {
+        src->codec = FTAB_CODEC_ZSTD;
+    }
 
-ftab_t * ftab_from_tsv(const char * fname)
-{
-    return ftab_from_dlm(fname, "\t");
-}
+    if(src->codec == FTAB_CODEC_GZIP)
+    {
+#ifdef FTAB_ZLIB
+        /* 15+32: Any window size, automatic gzip/zlib detection */
+        if(inflateInit2(&src->zs, 15+32) != Z_OK)
+        {
+            return EXIT_FAILURE;
+        }
+#else
+        fprintf(stderr, "ftab: gzip input but built without zlib\n");
+        return EXIT_FAILURE;
+#endif
+    }
 
-typedef struct{
-    float value;
-    size_t idx;
-} ftab_sort_pair;
+    if(src->codec == FTAB_CODEC_ZSTD)
+    {
+#ifdef FTAB_ZSTD
+        src->zds = ZSTD_createDStream();
+        if(src->zds == NULL)
+        {
+            return EXIT_FAILURE;
+        }
+        ZSTD_initDStream(src->zds);
+#else
+        fprintf(stderr, "ftab: zstd input but built without zstd\n");
+        return EXIT_FAILURE;
+#endif
+    }
+    return EXIT_SUCCESS;
+}
 
-int ftab_sort_pair_cmp(const void * _A, const void * _B)
+static void src_close(ftab_src_t * src)
 {
-    ftab_sort_pair * A = (ftab_sort_pair*) _A;
-    ftab_sort_pair * B = (ftab_sort_pair*) _B;
-
-    //printf("idx: %zu, value: %f\n", A->idx, A->value);
-    //printf("idx: %zu, value: %f\n", B->idx, B->value);
-    //exit(1);
-    float fa = A->value;
-    float fb = B->value;
-    if(fa == fb)
+#ifdef FTAB_ZLIB
+    if(src->codec == FTAB_CODEC_GZIP)
     {
-        return 0;
+        inflateEnd(&src->zs);
     }
-    if(fa < fb)
+#endif
+#ifdef FTAB_ZSTD
+    if(src->codec == FTAB_CODEC_ZSTD)
     {
-        return 1;
+        ZSTD_freeDStream(src->zds);
     }
-    return -1;
+#endif
+    free(src->in);
+    src->in = NULL;
 }
 
-void ftab_sort(ftab_t * T, int col)
+#ifdef FTAB_ZLIB
+static i64 src_read_gzip(ftab_src_t * src, char * buf, size_t n)
 {
-    if(col == -1)
+    z_stream * zs = &src->zs;
+    zs->next_out = (Bytef *) buf;
+    zs->avail_out = n;
+    while(zs->avail_out > 0)
     {
-        fprintf(stderr, "ftab_sort: Can't use column %d for sorting\n", col);
-        exit(EXIT_FAILURE);
+        i64 avail = src_fill(src);
+        if(avail < 0)
+        {
+            return -1;
+        }
+        if(avail == 0)
+        {
+            if(src->gz_member)
+            {
+                fprintf(stderr, "ftab: gzip error: truncated input\n");
+                return -1;
+            }
+            break;
+        }
+        zs->next_in = (Bytef *) src->in + src->in_pos;
+        zs->avail_in = avail;
+        src->gz_member = 1;
+        int ret = inflate(zs, Z_NO_FLUSH);
+        src->in_pos = src->in_len - zs->avail_in;
+        if(ret == Z_STREAM_END)
+        {
+            /* There might be more members (cat a.gz b.gz) */
+            inflateReset(zs);
+            src->gz_member = 0;
+            continue;
+        }
+        if(ret != Z_OK && ret != Z_BUF_ERROR)
+        {
+            fprintf(stderr, "ftab: gzip error: %s\n",
+                    zs->msg ? zs->msg : "unknown");
+            return -1;
+        }
     }
-    ftab_sort_pair * P = calloc(T->nrow, sizeof(ftab_sort_pair));
-    assert(P != NULL);
-    /* Extract values from col %d and sort */
+    return n - zs->avail_out;
+}
+#endif
 
-    for(size_t kk = 0; kk < T->nrow; kk++)
+#ifdef FTAB_ZSTD
+static i64 src_read_zstd(ftab_src_t * src, char * buf, size_t n)
+{
+    ZSTD_outBuffer out = {buf, n, 0};
+    while(out.pos < out.size)
     {
-        P[kk].idx = kk;
-        P[kk].value = T->T[kk*T->ncol + col];
-    }
-    //printf("First: %f, Last: %f\n", P[0].value, P[T->nrow-1].value);
-    //printf("Sorting dots %zu dots\n", T->nrow);
-    qsort(P, T->nrow,
-          sizeof(ftab_sort_pair),
-          ftab_sort_pair_cmp);
-    float * T2 = calloc(T->ncol*T->nrow_alloc, sizeof(float));
-    assert(T2 != NULL);
-    for(size_t kk = 0; kk< T->nrow; kk++)
-    {
-        size_t newpos = P[kk].idx*T->ncol;
-        size_t oldpos = kk*T->ncol;
-        memcpy(T2+oldpos,
-               T->T + newpos,
-               sizeof(float)*T->ncol);
+        i64 avail = src_fill(src);
+        if(avail < 0)
+        {
+            return -1;
+        }
+        if(avail == 0 && !src->zstd_frame)
+        {
+            break;
+        }
+        /* At the end of the input, flush what the decoder still holds */
+        size_t pos = out.pos;
+        ZSTD_inBuffer in = {src->in, src->in_len, src->in_pos};
+        size_t ret = ZSTD_decompressStream(src->zds, &out, &in);
+        src->in_pos = in.pos;
+        if(ZSTD_isError(ret))
+        {
+            fprintf(stderr, "ftab: zstd error: %s\n",
+                    ZSTD_getErrorName(ret));
+            return -1;
+        }
+        src->zstd_frame = ret != 0;
+        if(avail == 0 && src->zstd_frame && out.pos == pos)
+        {
+            fprintf(stderr, "ftab: zstd error: truncated input\n");
+            return -1;
+        }
     }
-    free(P);
-    free(T->T);
-    T->T = T2;
-    return;
+    return out.pos;
 }
+#endif
 
-void ftab_insert(ftab_t * T, float * row)
+/* Read decompressed data. Returns the number of bytes, 0 at end of
+ * input and -1 on error */
+static i64 src_read(ftab_src_t * src, char * buf, size_t n)
 {
-    assert(T != NULL);
-    assert(row != NULL);
-    if(T->nrow == T->nrow_alloc)
+#ifdef FTAB_ZLIB
+    if(src->codec == FTAB_CODEC_GZIP)
     {
-        T->nrow_alloc += T->nrow_alloc*0.69;
-        T->T = realloc(T->T, T->nrow_alloc*T->ncol*sizeof(float));
+        return src_read_gzip(src, buf, n);
     }
-    memcpy(T->T+T->ncol*T->nrow,
-           row, T->ncol*sizeof(float));
-    T->nrow++;
+#endif
+#ifdef FTAB_ZSTD
+    if(src->codec == FTAB_CODEC_ZSTD)
+    {
+        return src_read_zstd(src, buf, n);
+    }
+#endif
+    /* Uncompressed, start with what is left in the input buffer */
+    if(src->in_pos < src->in_len)
+    {
+        size_t nc = src->in_len - src->in_pos;
+        nc = nc < n ? nc : n;
+        memcpy(buf, src->in + src->in_pos, nc);
+        src->in_pos += nc;
+        return nc;
+    }
+    if(src->raw_eof)
+    {
+        return 0;
+    }
+    return src->raw_read(src, buf, n);
 }
 
+/*                        ASYNCHRONOUS FILE I/O
+ *                        =====================
+ *
+ * Regular files are read and written in requests of request_size
+ * bytes, aligned to FTAB_IO_ALIGN, with up to queue_depth requests in
+ * flight so that the device is kept busy while the rows are parsed or
+ * formatted. Requests go to io_uring when the kernel allows it, set up
+ * with the raw system calls, or else to a few threads that do
+ * pread/pwrite. Both are behind the same two calls, io_submit and
+ * io_wait, where each request is identified by a buffer slot.
+ *
+ * The reader keeps all slots in flight at increasing offsets and
+ * hands out the data in order. The writer copies the formatted text
+ * into the current slot and submits it when it is full, which is where
+ * text that is formatted in parallel meets the ordered output. With
+ * O_DIRECT the last request is padded to FTAB_IO_ALIGN and the file is
+ * truncated to its real size afterwards.
+ */
+
+#define FTAB_IO_ALIGN 4096
 
+#ifndef WINDOWS
 
+static pthread_mutex_t io_mutex = PTHREAD_MUTEX_INITIALIZER;
+static ftab_io_opts_t io_opts = {FTAB_IO_AUTO, 8, (size_t) 1 << 20, 0};
 
-void ftab_set_colname(ftab_t * T, int col, const char * name)
+static void io_get_opts(ftab_io_opts_t * O)
 {
-    assert(name != NULL);
-    // TODO check that only valid chars are used
-    if(col < 0 || col >= (int) T->ncol)
-    { return; }
+    pthread_mutex_lock(&io_mutex);
+    *O = io_opts;
+    pthread_mutex_unlock(&io_mutex);
+}
 
-    if(name == NULL)
-    { return; }
+typedef struct {
+    int write;
+    char * buf;
+    size_t len;
+    u64 offset;
+} ftab_io_req_t;
 
-    if(T->colnames == NULL)
+typedef struct {
+    int slot;
+    i64 res; /* Bytes transferred or -errno */
+} ftab_io_done_t;
+
+typedef struct {
+    int fd;
+    int qd;
+    ftab_io_backend_t backend; /* FTAB_IO_URING or FTAB_IO_THREADS */
+    ftab_io_req_t * slots; /* The request of each slot */
+#ifdef FTAB_URING
+    int ring;
+    unsigned * sq_tail;
+    unsigned * sq_mask;
+    unsigned * sq_array;
+    struct io_uring_sqe * sqes;
+    unsigned * cq_head;
+    unsigned * cq_tail;
+    unsigned * cq_mask;
+    struct io_uring_cqe * cqes;
+    void * sq_map;
+    size_t sq_map_size;
+    void * cq_map;
+    size_t cq_map_size;
+    size_t sqes_size;
+    struct iovec * iov; /* Per slot */
+#endif
+    /* FTAB_IO_THREADS, queues of slots */
+    pthread_t * threads;
+    int nthreads;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond_req;
+    pthread_cond_t cond_done;
+    int * req; /* qd */
+    u64 req_head;
+    u64 req_tail;
+    ftab_io_done_t * done; /* qd */
+    u64 done_head;
+    u64 done_tail;
+    int stop;
+} ftab_io_t;
+
+/* pread/pwrite until len bytes, starting at done, have been
+ * transferred or a read reaches the end of the file. Returns the
+ * number of bytes or -errno */
+static i64 io_full(int fd, const ftab_io_req_t * R, size_t done)
+{
+    while(done < R->len)
     {
-        T->colnames = calloc(T->ncol, sizeof(char*));
-        assert(T->colnames != NULL);
+        i64 n = R->write
+            ? pwrite(fd, R->buf + done, R->len - done, R->offset + done)
+            : pread(fd, R->buf + done, R->len - done, R->offset + done);
+        if(n < 0)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            return -errno;
+        }
+        if(n == 0)
+        {
+            break;
+        }
+        done += n;
     }
+    return done;
+}
 
-    free(T->colnames[col]);
-    T->colnames[col] = strdup(name);
-    return;
+#ifdef FTAB_URING
+static int uring_setup(unsigned entries, struct io_uring_params * p)
+{
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int uring_enter(int ring, unsigned to_submit, unsigned min_complete,
+                       unsigned flags)
+{
+    return syscall(__NR_io_uring_enter, ring, to_submit, min_complete,
+                   flags, NULL, 0);
 }
 
+static pthread_once_t uring_once = PTHREAD_ONCE_INIT;
+static int uring_ok = 0;
 
-int ftab_set_coldata(ftab_t * T, int col, const float * data)
+static void uring_probe(void)
 {
-    if(T == NULL)
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    int ring = uring_setup(1, &p);
+    if(ring >= 0)
     {
-        return EXIT_FAILURE;
+        uring_ok = 1;
+        close(ring);
     }
-    if(col < 0 || (size_t) col >= T->ncol)
+}
+
+static int uring_available(void)
+{
+    pthread_once(&uring_once, uring_probe);
+    return uring_ok;
+}
+
+static int uring_init(ftab_io_t * io)
+{
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    io->ring = uring_setup(io->qd, &p);
+    if(io->ring < 0)
     {
         return EXIT_FAILURE;
     }
-
-    float * C = T->T + col;
-    for(size_t kk = 0; kk<T->nrow; kk++)
+    io->sq_map_size = p.sq_off.array + p.sq_entries*sizeof(unsigned);
+    io->cq_map_size = p.cq_off.cqes + p.cq_entries*sizeof(struct io_uring_cqe);
+    int single = p.features & IORING_FEAT_SINGLE_MMAP;
+    if(single)
     {
-        C[kk*T->ncol] = data[kk];
+        size_t size = io->sq_map_size > io->cq_map_size
+            ? io->sq_map_size : io->cq_map_size;
+        io->sq_map_size = size;
+        io->cq_map_size = size;
     }
-
+    io->sq_map = mmap(NULL, io->sq_map_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, io->ring, IORING_OFF_SQ_RING);
+    io->cq_map = io->sq_map;
+    if(io->sq_map != MAP_FAILED && !single)
+    {
+        io->cq_map = mmap(NULL, io->cq_map_size, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, io->ring,
+                          IORING_OFF_CQ_RING);
+    }
+    io->sqes_size = p.sq_entries*sizeof(struct io_uring_sqe);
+    io->sqes = MAP_FAILED;
+    if(io->cq_map != MAP_FAILED)
+    {
+        io->sqes = mmap(NULL, io->sqes_size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, io->ring, IORING_OFF_SQES);
+    }
+    if(io->sqes == MAP_FAILED)
+    {
+        if(io->cq_map != MAP_FAILED && io->cq_map != io->sq_map)
+        {
+            munmap(io->cq_map, io->cq_map_size);
+        }
+        if(io->sq_map != MAP_FAILED)
+        {
+            munmap(io->sq_map, io->sq_map_size);
+        }
+        close(io->ring);
+        return EXIT_FAILURE;
+    }
+    u8 * sq = io->sq_map;
+    u8 * cq = io->cq_map;
+    io->sq_tail = (unsigned *) (sq + p.sq_off.tail);
+    io->sq_mask = (unsigned *) (sq + p.sq_off.ring_mask);
+    io->sq_array = (unsigned *) (sq + p.sq_off.array);
+    io->cq_head = (unsigned *) (cq + p.cq_off.head);
+    io->cq_tail = (unsigned *) (cq + p.cq_off.tail);
+    io->cq_mask = (unsigned *) (cq + p.cq_off.ring_mask);
+    io->cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+    io->iov = calloc(io->qd, sizeof(struct iovec));
+    assert(io->iov != NULL);
     return EXIT_SUCCESS;
 }
 
-
-ftab_t * ftab_copy(const ftab_t * T)
+static void uring_free(ftab_io_t * io)
 {
-    ftab_t * C = calloc(1, sizeof(ftab_t));
-    assert(C != NULL);
-    C->nrow = T->nrow;
-    C->ncol = T->ncol;
-    C->nrow_alloc = C->nrow;
-    C->T = calloc(C->nrow*C->ncol, sizeof(float));
-    if(C->T == NULL)
+    munmap(io->sqes, io->sqes_size);
+    if(io->cq_map != io->sq_map)
     {
-        goto teardown;
+        munmap(io->cq_map, io->cq_map_size);
     }
+    munmap(io->sq_map, io->sq_map_size);
+    close(io->ring);
+    free(io->iov);
+}
 
-    memcpy(C->T, T->T, C->nrow*C->ncol*sizeof(float));
-
-    if(T->colnames != NULL)
+static int uring_submit(ftab_io_t * io, int slot)
+{
+    const ftab_io_req_t * R = io->slots + slot;
+    /* Only this thread writes the tail */
+    unsigned tail = *io->sq_tail;
+    unsigned idx = tail & *io->sq_mask;
+    struct io_uring_sqe * sqe = io->sqes + idx;
+    memset(sqe, 0, sizeof(*sqe));
+    /* READV/WRITEV are the oldest opcodes, available since 5.1 */
+    sqe->opcode = R->write ? IORING_OP_WRITEV : IORING_OP_READV;
+    sqe->fd = io->fd;
+    io->iov[slot].iov_base = R->buf;
+    io->iov[slot].iov_len = R->len;
+    sqe->addr = (u64) (uintptr_t) (io->iov + slot);
+    sqe->len = 1;
+    sqe->off = R->offset;
+    sqe->user_data = slot;
+    io->sq_array[idx] = idx;
+    __atomic_store_n(io->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    while(1)
     {
-        C->colnames = calloc(C->ncol, sizeof(char*));
-        assert(C->colnames != NULL);
-        for(u64 kk = 0; kk < C->ncol; kk++)
+        int ret = uring_enter(io->ring, 1, 0, 0);
+        if(ret >= 0 || errno != EINTR)
         {
-            if(T->colnames[kk] != NULL)
-            {
-                C->colnames[kk] = strdup(T->colnames[kk]);
-                if(C->colnames[kk] == NULL)
-                {
-                    goto teardown;
-                }
-            }
+            return ret == 1 ? EXIT_SUCCESS : EXIT_FAILURE;
         }
     }
-    return C;
-
- teardown:
-    ftab_free(C);
-    return NULL;
 }
 
-ftab_t * ftab_concatenate_columns(const ftab_t * L , const ftab_t * R)
+static int uring_wait(ftab_io_t * io, ftab_io_done_t * D)
 {
-    if(L->nrow != R->nrow)
+    while(1)
     {
-        fprintf(stderr, "frab_concatenate_columns: "
-                "ERROR: tables have different number of rows\n");
-        return NULL;
+        unsigned head = *io->cq_head;
+        unsigned tail = __atomic_load_n(io->cq_tail, __ATOMIC_ACQUIRE);
+        if(head != tail)
+        {
+            const struct io_uring_cqe * cqe = io->cqes + (head & *io->cq_mask);
+            D->slot = (int) cqe->user_data;
+            D->res = cqe->res;
+            __atomic_store_n(io->cq_head, head + 1, __ATOMIC_RELEASE);
+            return EXIT_SUCCESS;
+        }
+        if(uring_enter(io->ring, 0, 1, IORING_ENTER_GETEVENTS) < 0
+           && errno != EINTR)
+        {
+            return EXIT_FAILURE;
+        }
     }
-    size_t nrow = L->nrow;
-    size_t ncol = L->ncol + R->ncol;
+}
+#endif
 
-    ftab_t * T = ftab_new(ncol);
-    assert(T != NULL);
+static void * io_thread(void * _io)
+{
+    ftab_io_t * io = _io;
+    pthread_mutex_lock(&io->mutex);
+    while(1)
+    {
+        while(io->req_head == io->req_tail && !io->stop)
+        {
+            pthread_cond_wait(&io->cond_req, &io->mutex);
+        }
+        if(io->req_head == io->req_tail)
+        {
+            break;
+        }
+        int slot = io->req[io->req_head++ % io->qd];
+        pthread_mutex_unlock(&io->mutex);
+        i64 res = io_full(io->fd, io->slots + slot, 0);
+        pthread_mutex_lock(&io->mutex);
+        ftab_io_done_t D = {slot, res};
+        io->done[io->done_tail++ % io->qd] = D;
+        pthread_cond_signal(&io->cond_done);
+    }
+    pthread_mutex_unlock(&io->mutex);
+    return NULL;
+}
 
-    for(size_t kk = 0; kk < L->ncol; kk++)
+static void io_close(ftab_io_t * io)
+{
+    if(io == NULL)
     {
-        ftab_set_colname(T, kk, L->colnames[kk]);
+        return;
     }
-    for(size_t kk = 0; kk < R->ncol; kk++)
+#ifdef FTAB_URING
+    if(io->backend == FTAB_IO_URING)
     {
-        ftab_set_colname(T, kk+L->ncol, R->colnames[kk]);
+        uring_free(io);
     }
-    free(T->T);
-    T->T = calloc(nrow*ncol, sizeof(float));
-    assert(T->T != NULL);
-    T->ncol = ncol;
-    T->nrow = nrow;
-    T->nrow_alloc = nrow;
-
-    /* Insert data from L */
-    for(size_t kk = 0; kk < L->nrow; kk++)
+#endif
+    if(io->backend == FTAB_IO_THREADS)
     {
-        for(size_t ll = 0; ll < L->ncol; ll++)
+        pthread_mutex_lock(&io->mutex);
+        io->stop = 1;
+        pthread_cond_broadcast(&io->cond_req);
+        pthread_mutex_unlock(&io->mutex);
+        for(int kk = 0; kk < io->nthreads; kk++)
         {
-            T->T[kk*ncol + ll] = L->T[kk*L->ncol + ll];
+            pthread_join(io->threads[kk], NULL);
         }
+        pthread_mutex_destroy(&io->mutex);
+        pthread_cond_destroy(&io->cond_req);
+        pthread_cond_destroy(&io->cond_done);
+        free(io->threads);
+        free(io->req);
+        free(io->done);
     }
+    free(io->slots);
+    free(io);
+}
 
-    /* Insert data from R */
-    for(size_t kk = 0; kk < R->nrow; kk++)
+/* Requests on fd with qd slots. Returns NULL if the backend can not be
+ * used */
+static ftab_io_t * io_open(int fd, int qd, ftab_io_backend_t backend)
+{
+    ftab_io_t * io = calloc(1, sizeof(ftab_io_t));
+    assert(io != NULL);
+    io->fd = fd;
+    io->qd = qd;
+    io->slots = calloc(qd, sizeof(ftab_io_req_t));
+    assert(io->slots != NULL);
+#ifdef FTAB_URING
+    if(backend == FTAB_IO_AUTO || backend == FTAB_IO_URING)
     {
-        for(size_t ll = 0; ll < R->ncol; ll++)
+        if(uring_init(io) == EXIT_SUCCESS)
         {
-            T->T[kk*ncol + ll + L->ncol] = R->T[kk*R->ncol + ll];
+            io->backend = FTAB_IO_URING;
+            return io;
         }
     }
-
-    return T;
+#endif
+    if(backend == FTAB_IO_URING)
+    {
+        free(io->slots);
+        free(io);
+        return NULL;
+    }
+    io->backend = FTAB_IO_THREADS;
+    io->req = calloc(qd, sizeof(int));
+    io->done = calloc(qd, sizeof(ftab_io_done_t));
+    io->nthreads = qd < 8 ? qd : 8;
+    io->threads = calloc(io->nthreads, sizeof(pthread_t));
+    assert(io->req != NULL && io->done != NULL && io->threads != NULL);
+    pthread_mutex_init(&io->mutex, NULL);
+    pthread_cond_init(&io->cond_req, NULL);
+    pthread_cond_init(&io->cond_done, NULL);
+    for(int kk = 0; kk < io->nthreads; kk++)
+    {
+        if(pthread_create(io->threads + kk, NULL, io_thread, io) != 0)
+        {
+            io->nthreads = kk;
+            io_close(io);
+            return NULL;
+        }
+    }
+    return io;
 }
 
-ftab_t *
-ftab_concatenate_rows(const ftab_t * Top, const ftab_t * Down)
+/* Start the request of a slot, which must not be in flight */
+static int io_submit(ftab_io_t * io, int slot, int write, char * buf,
+                     size_t len, u64 offset)
+{
+    ftab_io_req_t R = {write, buf, len, offset};
+    io->slots[slot] = R;
+#ifdef FTAB_URING
+    if(io->backend == FTAB_IO_URING)
+    {
+        return uring_submit(io, slot);
+    }
+#endif
+    pthread_mutex_lock(&io->mutex);
+    io->req[io->req_tail++ % io->qd] = slot;
+    pthread_cond_signal(&io->cond_req);
+    pthread_mutex_unlock(&io->mutex);
+    return EXIT_SUCCESS;
+}
+
+/* Wait for any request to finish. Short transfers are completed
+ * synchronously, so D->res is the full length unless a read reached
+ * the end of the file or there was an error */
+static int io_wait(ftab_io_t * io, ftab_io_done_t * D)
 {
+#ifdef FTAB_URING
+    if(io->backend == FTAB_IO_URING)
+    {
+        if(uring_wait(io, D))
+        {
+            return EXIT_FAILURE;
+        }
+        const ftab_io_req_t * R = io->slots + D->slot;
+        if(D->res == -EINVAL || D->res == -EOPNOTSUPP)
+        {
+            /* Not supported for this file, e.g., by an old kernel */
+            D->res = io_full(io->fd, R, 0);
+        } else if(D->res >= 0 && (size_t) D->res < R->len)
+        {
+            D->res = io_full(io->fd, R, D->res);
+        }
+        return EXIT_SUCCESS;
+    }
+#endif
+    pthread_mutex_lock(&io->mutex);
+    while(io->done_head == io->done_tail)
+    {
+        pthread_cond_wait(&io->cond_done, &io->mutex);
+    }
+    *D = io->done[io->done_head++ % io->qd];
+    pthread_mutex_unlock(&io->mutex);
+    return EXIT_SUCCESS;
+}
 
-    if(Top == NULL && Down == NULL)
+static char * io_buffer(size_t size)
+{
+    void * buf = NULL;
+    if(posix_memalign(&buf, FTAB_IO_ALIGN, size) != 0)
     {
         return NULL;
     }
-    if(Top == NULL)
+    return buf;
+}
+
+/* Reader, for ftab_src_t */
+
+#define AREAD_BUSY -1
+#define AREAD_IDLE -2
+
+struct ftab_aread {
+    ftab_io_t * io;
+    u64 size; /* Of the file when it was opened */
+    u64 next; /* Offset of the next request */
+    size_t bsize;
+    char ** buf; /* qd */
+    i64 * len; /* Bytes in each slot, or AREAD_BUSY/IDLE */
+    int head; /* The slot to read from */
+    size_t pos;
+    int error;
+};
+
+static void aread_request(ftab_aread_t * R, int slot)
+{
+    if(R->next >= R->size)
     {
-        return ftab_copy(Down);
+        R->len[slot] = AREAD_IDLE;
+        return;
     }
-    if(Down == NULL)
+    size_t len = R->size - R->next < R->bsize ? R->size - R->next : R->bsize;
+    R->len[slot] = AREAD_BUSY;
+    if(io_submit(R->io, slot, 0, R->buf[slot], len, R->next))
     {
-        return ftab_copy(Top);
+        R->len[slot] = AREAD_IDLE;
+        R->error = 1;
+        return;
     }
+    R->next += len;
+}
 
-    if(Top->ncol != Down->ncol)
+static void aread_close(ftab_aread_t * R)
+{
+    if(R == NULL)
+    {
+        return;
+    }
+    /* Requests in flight still write to the buffers */
+    for(int kk = 0; kk < R->io->qd; kk++)
+    {
+        while(R->len[kk] == AREAD_BUSY)
+        {
+            ftab_io_done_t D;
+            if(io_wait(R->io, &D))
+            {
+                break;
+            }
+            R->len[D.slot] = D.res;
+        }
+    }
+    int qd = R->io->qd;
+    io_close(R->io);
+    for(int kk = 0; kk < qd; kk++)
+    {
+        /* A request that could not be waited for might still be
+         * running in the kernel, its buffer is leaked instead */
+        if(R->len[kk] != AREAD_BUSY)
+        {
+            free(R->buf[kk]);
+        }
+    }
+    free(R->buf);
+    free(R->len);
+    free(R);
+}
+
+static ftab_aread_t * aread_open(int fd, u64 size, const ftab_io_opts_t * O)
+{
+    ftab_io_t * io = io_open(fd, O->queue_depth, O->backend);
+    if(io == NULL)
     {
-        fprintf(stderr,
-                "ftab concatenate_rows: error: Tables does "
-                "not have the same number of columns\n");
         return NULL;
     }
-    // TODO: Check column names
+    ftab_aread_t * R = calloc(1, sizeof(ftab_aread_t));
+    assert(R != NULL);
+    R->io = io;
+    R->size = size;
+    R->bsize = O->request_size;
+    R->buf = calloc(io->qd, sizeof(char*));
+    R->len = calloc(io->qd, sizeof(i64));
+    assert(R->buf != NULL && R->len != NULL);
+    for(int kk = 0; kk < io->qd; kk++)
+    {
+        R->buf[kk] = io_buffer(R->bsize);
+        assert(R->buf[kk] != NULL);
+        R->len[kk] = AREAD_IDLE;
+    }
+    for(int kk = 0; kk < io->qd; kk++)
+    {
+        aread_request(R, kk);
+    }
+    return R;
+}
 
-    ftab_t * concat = calloc(1, sizeof(ftab_t));
-    assert(concat != NULL);
-    concat->ncol = Top->ncol;
-    concat->nrow = Top->nrow + Down->nrow;
-    concat->nrow_alloc = concat->nrow;
-    concat->T = calloc(concat->nrow*concat->ncol, sizeof(float));
-    if(concat->T == NULL)
+static i64 src_raw_read_async(ftab_src_t * src, char * buf, size_t n)
+{
+    ftab_aread_t * R = src->ar;
+    while(R->len[R->head] == AREAD_BUSY)
+    {
+        ftab_io_done_t D;
+        if(io_wait(R->io, &D))
+        {
+            return -1;
+        }
+        R->len[D.slot] = D.res;
+    }
+    i64 len = R->len[R->head];
+    if(R->error || (len < 0 && len != AREAD_IDLE))
+    {
+        if(len < 0 && len != AREAD_IDLE)
+        {
+            fprintf(stderr, "ftab: read error: %s\n", strerror(-len));
+        }
+        return -1;
+    }
+    if(len == AREAD_IDLE || len == 0)
+    {
+        return 0;
+    }
+    size_t nc = (size_t) len - R->pos;
+    nc = nc < n ? nc : n;
+    memcpy(buf, R->buf[R->head] + R->pos, nc);
+    R->pos += nc;
+    if(R->pos == (size_t) len)
+    {
+        R->pos = 0;
+        aread_request(R, R->head);
+        R->head = (R->head + 1) % R->io->qd;
+    }
+    return nc;
+}
+
+/* Writer */
+
+typedef struct {
+    ftab_io_t * io;
+    int fd;
+    int direct;
+    size_t bsize;
+    char ** buf; /* qd */
+    int * busy;
+    int cur; /* The slot being filled */
+    size_t fill;
+    u64 offset;
+    int error;
+} ftab_awrite_t;
+
+static void awrite_wait_slot(ftab_awrite_t * W, int slot)
+{
+    while(W->busy[slot])
+    {
+        ftab_io_done_t D;
+        if(io_wait(W->io, &D))
+        {
+            /* The slots stay busy, see awrite_close */
+            W->error = 1;
+            return;
+        }
+        W->busy[D.slot] = 0;
+        if(D.res < 0 || (size_t) D.res != W->io->slots[D.slot].len)
+        {
+            if(!W->error)
+            {
+                fprintf(stderr, "ftab: write error: %s\n",
+                        D.res < 0 ? strerror(-D.res) : "short write");
+            }
+            W->error = 1;
+        }
+    }
+}
+
+/* Submit the current slot and make the next one ready */
+static void awrite_flush(ftab_awrite_t * W)
+{
+    if(W->fill == 0)
+    {
+        return;
+    }
+    size_t len = W->fill;
+    if(W->direct && len % FTAB_IO_ALIGN != 0)
+    {
+        /* Only the last request, the file is truncated afterwards */
+        size_t padded = (len / FTAB_IO_ALIGN + 1)*FTAB_IO_ALIGN;
+        memset(W->buf[W->cur] + len, 0, padded - len);
+        len = padded;
+    }
+    W->busy[W->cur] = 1;
+    if(io_submit(W->io, W->cur, 1, W->buf[W->cur], len, W->offset))
+    {
+        W->busy[W->cur] = 0;
+        W->error = 1;
+    }
+    W->offset += W->fill;
+    W->cur = (W->cur + 1) % W->io->qd;
+    W->fill = 0;
+    awrite_wait_slot(W, W->cur);
+}
+
+static void awrite(ftab_awrite_t * W, const char * data, size_t n)
+{
+    while(n > 0 && !W->error)
+    {
+        size_t nc = W->bsize - W->fill < n ? W->bsize - W->fill : n;
+        memcpy(W->buf[W->cur] + W->fill, data, nc);
+        W->fill += nc;
+        data += nc;
+        n -= nc;
+        if(W->fill == W->bsize)
+        {
+            awrite_flush(W);
+        }
+    }
+}
+
+static ftab_awrite_t * awrite_open(int fd, int direct, const ftab_io_opts_t * O)
+{
+    ftab_io_t * io = io_open(fd, O->queue_depth, O->backend);
+    if(io == NULL)
     {
-        free(concat);
         return NULL;
     }
-    memcpy(concat->T,
-           Top->T,
-           Top->nrow*Top->ncol*sizeof(float));
-    memcpy(concat->T+Top->nrow*Top->ncol,
-           Down->T,
-           Down->nrow*Down->ncol*sizeof(float));
+    ftab_awrite_t * W = calloc(1, sizeof(ftab_awrite_t));
+    assert(W != NULL);
+    W->io = io;
+    W->fd = fd;
+    W->direct = direct;
+    W->bsize = O->request_size;
+    W->buf = calloc(io->qd, sizeof(char*));
+    W->busy = calloc(io->qd, sizeof(int));
+    assert(W->buf != NULL && W->busy != NULL);
+    for(int kk = 0; kk < io->qd; kk++)
+    {
+        W->buf[kk] = io_buffer(W->bsize);
+        assert(W->buf[kk] != NULL);
+    }
+    return W;
+}
 
-    // TODO: Set column names
-    return concat;
+/* Write what is left and wait for all requests. Does not close fd. */
+static int awrite_close(ftab_awrite_t * W)
+{
+    if(!W->error)
+    {
+        awrite_flush(W);
+    }
+    for(int kk = 0; kk < W->io->qd; kk++)
+    {
+        awrite_wait_slot(W, kk);
+    }
+    if(W->direct && !W->error && ftruncate(W->fd, W->offset) != 0)
+    {
+        W->error = 1;
+    }
+    int status = W->error ? EXIT_FAILURE : EXIT_SUCCESS;
+    int qd = W->io->qd;
+    io_close(W->io);
+    for(int kk = 0; kk < qd; kk++)
+    {
+        /* Still busy if io_wait failed, then the kernel might still
+         * read the buffer and it is leaked instead */
+        if(!W->busy[kk])
+        {
+            free(W->buf[kk]);
+        }
+    }
+    free(W->buf);
+    free(W->busy);
+    free(W);
+    return status;
+}
+
+typedef struct {
+    const ftab_t * T;
+    const char * sep;
+    size_t first; /* Rows [first, last) of this batch */
+    size_t last;
+    ftab_strbuf_t * sb; /* Per task */
+    int * failed;
+} ftab_format_job_t;
+
+static void format_worker(void * _J, int thread, int nthreads)
+{
+    ftab_format_job_t * J = _J;
+    size_t first, last;
+    thread_range(J->last - J->first, thread, nthreads, &first, &last);
+    J->sb[thread].len = 0;
+    if(first < last
+       && format_rows(J->sb + thread, J->T, J->sep,
+                      J->first + first, J->first + last))
+    {
+        J->failed[thread] = 1;
+    }
+}
+
+/* Format batches of rows in parallel, the requests of one batch are
+ * written while the next is formatted */
+static int write_dlm_async(const ftab_t * T, ftab_awrite_t * W,
+                           const char * sep)
+{
+    ftab_strbuf_t header = {0};
+    if(format_header(&header, T, sep))
+    {
+        W->error = 1;
+    }
+    awrite(W, header.s, header.len);
+    free(header.s);
+
+    int ntasks = nthreads_for(T->nrow*T->ncol, 1 << 16);
+    size_t chunk = 1 + (1 << 16) / (T->ncol + 1);
+    ftab_format_job_t J = {0};
+    J.T = T;
+    J.sep = sep;
+    J.sb = calloc(ntasks, sizeof(ftab_strbuf_t));
+    J.failed = calloc(ntasks, sizeof(int));
+    assert(J.sb != NULL && J.failed != NULL);
+    for(size_t b0 = 0; b0 < T->nrow && !W->error; b0 += chunk*ntasks)
+    {
+        J.first = b0;
+        J.last = b0 + chunk*ntasks < T->nrow ? b0 + chunk*ntasks : T->nrow;
+        run_parallel(ntasks, format_worker, &J);
+        for(int tt = 0; tt < ntasks; tt++)
+        {
+            if(J.failed[tt])
+            {
+                W->error = 1;
+            }
+            awrite(W, J.sb[tt].s, J.sb[tt].len);
+        }
+    }
+    for(int tt = 0; tt < ntasks; tt++)
+    {
+        free(J.sb[tt].s);
+    }
+    free(J.sb);
+    free(J.failed);
+    return awrite_close(W);
+}
+
+#ifndef FTAB_URING
+static int uring_available(void)
+{
+    return 0;
+}
+#endif
+
+int ftab_io_configure(const ftab_io_opts_t * opts)
+{
+    ftab_io_opts_t O = {FTAB_IO_AUTO, 8, (size_t) 1 << 20, 0};
+    if(opts != NULL)
+    {
+        O = *opts;
+    }
+    if(O.queue_depth == 0)
+    {
+        O.queue_depth = 8;
+    }
+    if(O.request_size == 0)
+    {
+        O.request_size = (size_t) 1 << 20;
+    }
+    if(O.queue_depth < 1 || O.queue_depth > 256
+       || O.request_size > ((size_t) 1 << 30))
+    {
+        fprintf(stderr, "ftab_io_configure: queue_depth must be in [1, 256] "
+                "and request_size at most 1 GiB\n");
+        return EXIT_FAILURE;
+    }
+    O.request_size = (O.request_size + FTAB_IO_ALIGN - 1)
+        / FTAB_IO_ALIGN * FTAB_IO_ALIGN;
+    if(O.backend == FTAB_IO_URING && !uring_available())
+    {
+        fprintf(stderr, "ftab_io_configure: io_uring is not available\n");
+        return EXIT_FAILURE;
+    }
+    pthread_mutex_lock(&io_mutex);
+    io_opts = O;
+    pthread_mutex_unlock(&io_mutex);
+    return EXIT_SUCCESS;
+}
+
+ftab_io_backend_t ftab_io_backend(void)
+{
+    ftab_io_opts_t O;
+    io_get_opts(&O);
+    if(O.backend == FTAB_IO_AUTO)
+    {
+        return uring_available() ? FTAB_IO_URING : FTAB_IO_THREADS;
+    }
+    return O.backend;
+}
+
+static int write_dlm(const ftab_t * T, const char * fname, const char * sep)
+{
+    ftab_io_opts_t O;
+    io_get_opts(&O);
+    if(O.backend != FTAB_IO_SYNC && T != NULL
+       && T->nrow*T->ncol*sizeof(float) >= O.request_size)
+    {
+        int flags = O_WRONLY | O_CREAT | O_TRUNC;
+        int direct = 0;
+        int fd = -1;
+#ifdef O_DIRECT
+        if(O.direct)
+        {
+            /* Not all file systems support O_DIRECT, e.g., tmpfs */
+            fd = open(fname, flags | O_DIRECT, 0666);
+            direct = fd >= 0;
+        }
+#endif
+        if(fd < 0)
+        {
+            fd = open(fname, flags, 0666);
+        }
+        if(fd < 0)
+        {
+            return EXIT_FAILURE;
+        }
+        ftab_awrite_t * W = awrite_open(fd, direct, &O);
+        if(W != NULL)
+        {
+            int status = write_dlm_async(T, W, sep);
+            if(close(fd) != 0)
+            {
+                status = EXIT_FAILURE;
+            }
+            return status;
+        }
+        close(fd);
+    }
+    FILE * fid = fopen(fname, "w");
+    if(fid == NULL)
+    {
+        return EXIT_FAILURE;
+    }
+    int ret = ftab_print(fid, T, sep);
+    if(fclose(fid) != 0)
+    {
+        ret = EXIT_FAILURE;
+    }
+    return ret;
+}
+
+#else
+
+int ftab_io_configure(const ftab_io_opts_t * opts)
+{
+    if(opts != NULL && opts->backend != FTAB_IO_SYNC)
+    {
+        fprintf(stderr, "ftab_io_configure: only FTAB_IO_SYNC is supported "
+                "on this platform\n");
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+ftab_io_backend_t ftab_io_backend(void)
+{
+    return FTAB_IO_SYNC;
+}
+
+static int write_dlm(const ftab_t * T, const char * fname, const char * sep)
+{
+    FILE * fid = fopen(fname, "w");
+    if(fid == NULL)
+    {
+        return EXIT_FAILURE;
+    }
+    int ret = ftab_print(fid, T, sep);
+    fclose(fid);
+    return ret;
+}
+
+#endif
+
+/* Parse a single field. Empty or blank fields becomes empty and
+ * non-numeric fields 0 */
+static float parse_field(const char * p, const char * fend, float empty)
+{
+    if(p == fend)
+    {
+        return empty;
+    }
+    char * e = NULL;
+    float value = strtof(p, &e);
+    if(e > fend)
+    {
+        /* strtof skipped whitespace into the next field */
+        return empty;
+    }
+    if(e == p)
+    {
+        /* Nothing parsed, blank fields are also empty */
+        while(p < fend && (*p == ' ' || *p == '\t'))
+        {
+            p++;
+        }
+        return p == fend ? empty : 0;
+    }
+    return value;
+}
+
+/* The value of empty fields, FTAB_MISSING_BITS if missing values are
+ * tracked */
+static float parse_empty_value(int missing)
+{
+    u32 bits = FTAB_MISSING_BITS;
+    float empty = 0;
+    if(missing)
+    {
+        memcpy(&empty, &bits, sizeof(float));
+    }
+    return empty;
+}
+
+/* Parse one line, [line, end), into row. Returns 1 if at least ncol
+ * values were found and 0 otherwise */
+static int
+parse_line(const char * line, const char * end,
+           float * row, size_t ncol, char dlm, float empty)
+{
+    const char * p = line;
+    for(size_t kk = 0; kk < ncol; kk++)
+    {
+        if(p > end)
+        {
+            return 0;
+        }
+        const char * fend = memchr(p, dlm, end - p);
+        if(fend == NULL)
+        {
+            fend = end;
+        }
+        row[kk] = parse_field(p, fend, empty);
+        p = fend + 1;
+    }
+    return 1;
+}
+
+static u64 hash_mix(u64 h);
+
+/* Sampling of lines while loading, see ftab_opts_t */
+typedef struct {
+    u64 seed;
+    u64 threshold; /* Keep a line if its hash is below */
+} ftab_line_sample_t;
+
+/* Only depends on the seed and the line number */
+static int line_keep(const ftab_line_sample_t * S, u64 line)
+{
+    return hash_mix(S->seed + line) < S->threshold;
+}
+
+/* Parse all lines in a NUL-terminated block. The rows are
+ * returned in a newly allocated array. With S, only the sampled
+ * lines are parsed, first_line is the number of the first line of the
+ * block. */
+static float *
+parse_block(const char * data, size_t len,
+            size_t ncol, char dlm, float empty,
+            const ftab_line_sample_t * S, u64 first_line, size_t * _nrow)
+{
+    size_t nlines = 1;
+    const char * p = data;
+    const char * end = data + len;
+    if(S != NULL)
+    {
+        nlines = line_keep(S, first_line);
+    }
+    u64 line = first_line;
+    while( (p = memchr(p, '\n', end - p)) != NULL)
+    {
+        line++;
+        nlines += S == NULL || line_keep(S, line);
+        p++;
+    }
+
+    float * rows = malloc(nlines*ncol*sizeof(float) + 1);
+    if(rows == NULL)
+    {
+        return NULL;
+    }
+
+    size_t nrow = 0;
+    p = data;
+    line = first_line;
+    while(p < end)
+    {
+        const char * lend = memchr(p, '\n', end - p);
+        const char * next = lend == NULL ? end : lend + 1;
+        if(S != NULL && !line_keep(S, line++))
+        {
+            p = next;
+            continue;
+        }
+        if(lend == NULL)
+        {
+            lend = end;
+        }
+        if(lend > p && lend[-1] == '\r')
+        {
+            lend--;
+        }
+        if(lend > p)
+        {
+            nrow += parse_line(p, lend, rows + nrow*ncol, ncol, dlm, empty);
+        }
+        p = next;
+    }
+    *_nrow = nrow;
+    return rows;
+}
+
+/* Append parsed rows to the table, with missing values if
+ * missing is set */
+static int
+append_rows(ftab_t * T, const float * rows, size_t nrow, int missing)
+{
+    if(T->nrow + nrow > T->nrow_alloc)
+    {
+        size_t nalloc = T->nrow_alloc;
+        while(T->nrow + nrow > nalloc)
+        {
+            nalloc += nalloc*0.69 + 1;
+        }
+        float * TT = realloc(T->T, nalloc*T->ncol*sizeof(float));
+        if(TT == NULL)
+        {
+            return EXIT_FAILURE;
+        }
+        T->T = TT;
+        T->nrow_alloc = nalloc;
+    }
+    memcpy(T->T + T->nrow*T->ncol, rows, nrow*T->ncol*sizeof(float));
+    T->nrow += nrow;
+    valid_append(T, T->nrow - nrow, nrow);
+    if(missing)
+    {
+        valid_record(T, T->nrow - nrow);
+    }
+    return EXIT_SUCCESS;
+}
+
+typedef struct {
+    char * data;
+    size_t len;
+    size_t cap;
+    float * rows;
+    size_t nrow;
+    u64 first_line; /* Only counted when sampling */
+    int state;
+} ftab_block_t;
+
+enum {
+    BLOCK_EMPTY,
+    BLOCK_FILLED,
+    BLOCK_PARSED
+};
+
+/* Read the next block of complete lines from src. The data that
+ * follows the last line break is saved in carry for the next
+ * block. Returns the number of bytes in the block, 0 when there is
+ * nothing more to read, or -1 on error.  */
+static i64
+read_block(ftab_src_t * src, ftab_block_t * B,
+           char ** carry, size_t * carry_len, size_t * carry_cap)
+{
+    if(B->data == NULL || B->cap < *carry_len + FTAB_BLOCK_SIZE)
+    {
+        size_t cap = *carry_len + FTAB_BLOCK_SIZE;
+        char * data = realloc(B->data, cap + 1);
+        if(data == NULL)
+        {
+            return -1;
+        }
+        B->data = data;
+        B->cap = cap;
+    }
+    memcpy(B->data, *carry, *carry_len);
+    B->len = *carry_len;
+    *carry_len = 0;
+
+    size_t scanned = 0;
+    while(1)
+    {
+        int eof = 0;
+        while(B->len < B->cap)
+        {
+            i64 nread = src_read(src, B->data + B->len, B->cap - B->len);
+            if(nread < 0)
+            {
+                return -1;
+            }
+            if(nread == 0)
+            {
+                eof = 1;
+                break;
+            }
+            B->len += nread;
+        }
+        if(eof)
+        {
+            break;
+        }
+
+        /* Find the last line break */
+        size_t last = B->len;
+        while(last > scanned && B->data[last-1] != '\n')
+        {
+            last--;
+        }
+        if(last > scanned)
+        {
+            size_t rest = B->len - last;
+            if(rest > *carry_cap)
+            {
+                char * c = realloc(*carry, rest);
+                if(c == NULL)
+                {
+                    return -1;
+                }
+                *carry = c;
+                *carry_cap = rest;
+            }
+            memcpy(*carry, B->data + last, rest);
+            *carry_len = rest;
+            B->len = last;
+            break;
+        }
+        /* A very long line, make room for more */
+        scanned = B->len;
+        char * data = realloc(B->data, 2*B->cap + 1);
+        if(data == NULL)
+        {
+            return -1;
+        }
+        B->data = data;
+        B->cap *= 2;
+    }
+    B->data[B->len] = '\0';
+    return B->len;
+}
+
+typedef struct {
+    ftab_src_t * src;
+    ftab_t * T;
+    char dlm;
+    int missing;
+    float empty; /* Value of empty fields */
+    const ftab_line_sample_t * sample; /* NULL for all lines */
+    u64 nlines; /* Lines read, when sampling */
+    char * carry;
+    size_t carry_len;
+    size_t carry_cap;
+    int nthreads;
+    ftab_block_t * blocks;
+    size_t nblocks;
+#ifndef WINDOWS
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+#endif
+    u64 n_read; /* Number of blocks read */
+    u64 n_parse; /* Number of blocks claimed by parsers */
+    int done; /* Set when there is nothing more to read */
+    int error;
+} ftab_pipe_t;
+
+/* Number the lines of a block that was just read, for sampling */
+static void pipe_number_lines(ftab_pipe_t * P, ftab_block_t * B)
+{
+    if(P->sample == NULL)
+    {
+        return;
+    }
+    B->first_line = P->nlines;
+    const char * end = B->data + B->len;
+    for(const char * p = B->data; (p = memchr(p, '\n', end - p)) != NULL; p++)
+    {
+        P->nlines++;
+    }
+}
+
+static int
+pipe_run_serial(ftab_pipe_t * P)
+{
+    ftab_block_t B = {0};
+    int status = EXIT_SUCCESS;
+    i64 len = 0;
+    while( (len = read_block(P->src, &B, &P->carry,
+                             &P->carry_len, &P->carry_cap)) > 0)
+    {
+        size_t nrow = 0;
+        pipe_number_lines(P, &B);
+        float * rows = parse_block(B.data, len, P->T->ncol, P->dlm,
+                                   P->empty, P->sample, B.first_line, &nrow);
+        if(rows == NULL || append_rows(P->T, rows, nrow, P->missing))
+        {
+            free(rows);
+            status = EXIT_FAILURE;
+            break;
+        }
+        free(rows);
+    }
+    if(len < 0)
+    {
+        status = EXIT_FAILURE;
+    }
+    free(B.data);
+    return status;
+}
+
+#ifndef WINDOWS
+
+static void pipe_producer(ftab_pipe_t * P)
+{
+    while(1)
+    {
+        pthread_mutex_lock(&P->mutex);
+        ftab_block_t * B = P->blocks + P->n_read % P->nblocks;
+        while(B->state != BLOCK_EMPTY && !P->error)
+        {
+            pthread_cond_wait(&P->cond, &P->mutex);
+        }
+        int error = P->error;
+        pthread_mutex_unlock(&P->mutex);
+        if(error)
+        {
+            break;
+        }
+
+        /* The block is owned by the producer until it is marked as filled */
+        i64 len = read_block(P->src, B, &P->carry,
+                             &P->carry_len, &P->carry_cap);
+        if(len > 0)
+        {
+            pipe_number_lines(P, B);
+        }
+
+        pthread_mutex_lock(&P->mutex);
+        if(len > 0)
+        {
+            B->state = BLOCK_FILLED;
+            P->n_read++;
+        } else {
+            P->done = 1;
+            if(len < 0)
+            {
+                P->error = 1;
+            }
+        }
+        pthread_cond_broadcast(&P->cond);
+        pthread_mutex_unlock(&P->mutex);
+        if(len <= 0)
+        {
+            break;
+        }
+    }
+}
+
+static void pipe_parser(ftab_pipe_t * P)
+{
+    while(1)
+    {
+        pthread_mutex_lock(&P->mutex);
+        while(P->n_parse == P->n_read && !P->done && !P->error)
+        {
+            pthread_cond_wait(&P->cond, &P->mutex);
+        }
+        if(P->error || P->n_parse == P->n_read)
+        {
+            pthread_mutex_unlock(&P->mutex);
+            break;
+        }
+        ftab_block_t * B = P->blocks + P->n_parse % P->nblocks;
+        P->n_parse++;
+        pthread_mutex_unlock(&P->mutex);
+
+        B->rows = parse_block(B->data, B->len, P->T->ncol, P->dlm,
+                              P->empty, P->sample, B->first_line, &B->nrow);
+
+        pthread_mutex_lock(&P->mutex);
+        if(B->rows == NULL)
+        {
+            P->error = 1;
+        }
+        B->state = BLOCK_PARSED;
+        pthread_cond_broadcast(&P->cond);
+        pthread_mutex_unlock(&P->mutex);
+    }
+}
+
+/* Task 0 reads and the others parse */
+static void pipe_task(void * P, int task, int ntasks)
+{
+    (void) ntasks;
+    if(task == 0)
+    {
+        pipe_producer(P);
+    } else {
+        pipe_parser(P);
+    }
+}
+
+/* Read and parse on the workers of ctx while the calling thread
+ * collects the rows. Falls back to pipe_run_serial if the workers
+ * are not available. */
+static int
+pipe_run_threaded(ftab_pipe_t * P, ftab_ctx_t * ctx)
+{
+    P->nblocks = 2*P->nthreads + 2;
+    P->blocks = calloc(P->nblocks, sizeof(ftab_block_t));
+    if(P->blocks == NULL)
+    {
+        return EXIT_FAILURE;
+    }
+    pthread_mutex_init(&P->mutex, NULL);
+    pthread_cond_init(&P->cond, NULL);
+    if(ctx_start(ctx, 1 + P->nthreads, pipe_task, P))
+    {
+        free(P->blocks);
+        P->blocks = NULL;
+        pthread_mutex_destroy(&P->mutex);
+        pthread_cond_destroy(&P->cond);
+        return pipe_run_serial(P);
+    }
+
+    /* Collect the parsed blocks in order */
+    u64 n_collect = 0;
+    while(1)
+    {
+        pthread_mutex_lock(&P->mutex);
+        ftab_block_t * B = P->blocks + n_collect % P->nblocks;
+        while(!P->error
+              && !(P->done && n_collect == P->n_read)
+              && !(n_collect < P->n_read && B->state == BLOCK_PARSED))
+        {
+            pthread_cond_wait(&P->cond, &P->mutex);
+        }
+        if(P->error || n_collect == P->n_read)
+        {
+            pthread_mutex_unlock(&P->mutex);
+            break;
+        }
+        pthread_mutex_unlock(&P->mutex);
+
+        int failed = append_rows(P->T, B->rows, B->nrow, P->missing);
+        free(B->rows);
+        B->rows = NULL;
+
+        pthread_mutex_lock(&P->mutex);
+        if(failed)
+        {
+            P->error = 1;
+        }
+        B->state = BLOCK_EMPTY;
+        n_collect++;
+        pthread_cond_broadcast(&P->cond);
+        pthread_mutex_unlock(&P->mutex);
+    }
+
+    ctx_wait(ctx, 0);
+
+    for(size_t kk = 0; kk < P->nblocks; kk++)
+    {
+        free(P->blocks[kk].data);
+        free(P->blocks[kk].rows);
+    }
+    free(P->blocks);
+    pthread_mutex_destroy(&P->mutex);
+    pthread_cond_destroy(&P->cond);
+    return P->error ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+#endif
+
+/* Read the header line. Anything read after it is returned in
+ * carry. */
+static char *
+read_header(ftab_src_t * src, char ** carry, size_t * carry_len, size_t * carry_cap)
+{
+    size_t cap = 4096;
+    size_t len = 0;
+    char * buf = malloc(cap + 1);
+    assert(buf != NULL);
+    char * nl = NULL;
+    while(nl == NULL)
+    {
+        if(len == cap)
+        {
+            cap *= 2;
+            buf = realloc(buf, cap + 1);
+            assert(buf != NULL);
+        }
+        i64 nread = src_read(src, buf + len, cap - len);
+        if(nread < 0)
+        {
+            free(buf);
+            return NULL;
+        }
+        if(nread == 0)
+        {
+            break;
+        }
+        nl = memchr(buf + len, '\n', nread);
+        len += nread;
+    }
+    if(len == 0)
+    {
+        free(buf);
+        return NULL;
+    }
+    size_t hlen = nl == NULL ? len : (size_t) (nl - buf);
+    size_t rest = nl == NULL ? 0 : len - hlen - 1;
+    *carry = malloc(rest + 1);
+    assert(*carry != NULL);
+    memcpy(*carry, buf + len - rest, rest);
+    *carry_len = rest;
+    *carry_cap = rest;
+    buf[hlen] = '\0';
+    return buf;
+}
+
+static ftab_t *
+ftab_from_src(ftab_src_t * src, const ftab_opts_t * opts)
+{
+    const char * dlm = opts->dlm == NULL ? "," : opts->dlm;
+    if(src_init(src))
+    {
+        src_close(src);
+        return NULL;
+    }
+
+    ftab_pipe_t P = {0};
+    P.src = src;
+    P.dlm = dlm[0];
+    P.missing = opts->missing;
+    P.empty = parse_empty_value(opts->missing);
+    ftab_line_sample_t sample = {0};
+    if(opts->sample > 0 && opts->sample < 1)
+    {
+        sample.seed = hash_mix(opts->sample_seed ^ 0x9E3779B97F4A7C15ULL);
+        /* 2^64 * sample */
+        sample.threshold = (u64) ldexp(opts->sample, 64);
+        P.sample = &sample;
+    }
+    char * header = read_header(src, &P.carry, &P.carry_len, &P.carry_cap);
+    if(header == NULL)
+    {
+        fprintf(stderr, "Empty header line\n");
+        src_close(src);
+        return NULL;
+    }
+
+    ftab_t * T = calloc(1, sizeof(ftab_t));
+    assert(T != NULL);
+    if(parse_col_names(T, header, dlm) < 1)
+    {
+        fprintf(stderr, "Empty header line\n");
+        free(header);
+        free(P.carry);
+        free(T);
+        src_close(src);
+        return NULL;
+    }
+    free(header);
+    T->nrow_alloc = 1024;
+    T->T = calloc(T->nrow_alloc*T->ncol, sizeof(float));
+    assert(T->T != NULL);
+    P.T = T;
+
+    ftab_ctx_t * ctx = opts->ctx != NULL ? opts->ctx : ctx_get();
+    int nthreads = ctx->nthreads;
+    if(opts->nthreads > 0 && opts->nthreads < nthreads)
+    {
+        nthreads = opts->nthreads;
+    }
+    /* One thread collects, one reads and the rest parse */
+    P.nthreads = nthreads - 2;
+    int status = EXIT_SUCCESS;
+#ifndef WINDOWS
+    if(P.nthreads > 0)
+    {
+        status = pipe_run_threaded(&P, ctx);
+    } else {
+        status = pipe_run_serial(&P);
+    }
+#else
+    status = pipe_run_serial(&P);
+#endif
+    free(P.carry);
+    src_close(src);
+    if(status != EXIT_SUCCESS)
+    {
+        fprintf(stderr, "ftab: failed to read table\n");
+        ftab_free(T);
+        return NULL;
+    }
+    return T;
+}
+
+ftab_t * ftab_from_FILE(FILE * fid, const char * dlm)
+{
+    if(fid == NULL || dlm == NULL)
+    {
+        return NULL;
+    }
+    ftab_src_t src = {0};
+    src.fid = fid;
+    src.raw_read = src_raw_read_FILE;
+    ftab_opts_t opts = {0};
+    opts.dlm = dlm;
+    return ftab_from_src(&src, &opts);
+}
+
+ftab_t * ftab_from_fd(int fd, const char * dlm)
+{
+    if(fd < 0 || dlm == NULL)
+    {
+        return NULL;
+    }
+    ftab_src_t src = {0};
+    src.fd = fd;
+    src.raw_read = src_raw_read_fd;
+    ftab_opts_t opts = {0};
+    opts.dlm = dlm;
+    return ftab_from_src(&src, &opts);
+}
+
+/* Read a file, with asynchronous reads unless it is small or not a
+ * regular file */
+static ftab_t * ftab_from_path(const char * fname, const ftab_opts_t * opts)
+{
+#ifndef WINDOWS
+    ftab_io_opts_t O;
+    io_get_opts(&O);
+    if(O.backend != FTAB_IO_SYNC)
+    {
+        int fd = open(fname, O_RDONLY);
+        if(fd < 0)
+        {
+            fprintf(stderr, "Can not open %s\n", fname);
+            return NULL;
+        }
+        struct stat st;
+        ftab_aread_t * R = NULL;
+        if(fstat(fd, &st) == 0 && S_ISREG(st.st_mode)
+           && (u64) st.st_size > O.request_size)
+        {
+            R = aread_open(fd, st.st_size, &O);
+        }
+        /* Pipes can only be opened once, so keep reading from fd */
+        ftab_src_t src = {0};
+        src.fd = fd;
+        src.ar = R;
+        src.raw_read = R != NULL ? src_raw_read_async : src_raw_read_fd;
+        ftab_t * T = ftab_from_src(&src, opts);
+        aread_close(R);
+        close(fd);
+        return T;
+    }
+#endif
+    FILE * fid = fopen(fname, "rb");
+    if(fid == NULL)
+    {
+        fprintf(stderr, "Can not open %s\n", fname);
+        return NULL;
+    }
+    ftab_src_t src = {0};
+    src.fid = fid;
+    src.raw_read = src_raw_read_FILE;
+    ftab_t * T = ftab_from_src(&src, opts);
+    fclose(fid);
+    return T;
+}
+
+ftab_t * ftab_from_file(const char * fname, const ftab_opts_t * opts)
+{
+    if(fname == NULL)
+    {
+        return NULL;
+    }
+    ftab_opts_t defaults = {0};
+    if(opts == NULL)
+    {
+        opts = &defaults;
+    }
+    return ftab_from_path(fname, opts);
+}
+
+ftab_t * ftab_from_buffer(const char * buf, size_t len, const ftab_opts_t * opts)
+{
+    if(buf == NULL)
+    {
+        return NULL;
+    }
+    ftab_opts_t defaults = {0};
+    if(opts == NULL)
+    {
+        opts = &defaults;
+    }
+    ftab_src_t src = {0};
+    src.mem = buf;
+    src.mem_len = len;
+    src.raw_read = src_raw_read_mem;
+    return ftab_from_src(&src, opts);
+}
+
+/*                          PARSE CACHE
+ *                          ===========
+ *
+ * Opt-in with ftab_cache_enable. A parsed csv/tsv file is saved as a
+ * binary snapshot, DIR/ftab-<hash of path and dlm>.snap, that later
+ * loads memory map instead of parsing the file again. The snapshot
+ * records the size, the mtime and a hash of samples of the source
+ * file and is only used if they all still match. Snapshots are
+ * written to a temporary file and renamed into place, so concurrent
+ * readers and writers never see a partial file. When the directory
+ * grows beyond the limit the least recently used snapshots are
+ * removed.
+ *
+ * Layout: "FTABSNP1", u64 src_size, src_mtime_ns, src_hash, nrow,
+ * ncol, names_len, the NUL-terminated column names zero-padded to a
+ * multiple of 64 bytes, and then the float data.
+ */
+
+#define FTAB_SNAP_MAGIC "FTABSNP1"
+#define FTAB_SNAP_HEADER 56
+#define FTAB_SNAP_SAMPLE 4096
+
+#ifndef WINDOWS
+
+static u64 hash_bytes(const u8 * data, size_t len, u64 seed);
+
+static pthread_mutex_t cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+static char * cache_dir = NULL;
+static u64 cache_max_bytes = 0;
+
+typedef struct {
+    u64 size;
+    u64 mtime_ns;
+    u64 hash;
+} ftab_src_key_t;
+
+/* Identify the current version of a file from its size, mtime and
+ * samples of the content: the first and last 64 KiB and a few blocks
+ * in between. */
+static int cache_src_key(const char * fname, ftab_src_key_t * K)
+{
+    struct stat st;
+    /* Pipes and devices can not be sampled, nor read twice */
+    if(stat(fname, &st) != 0 || !S_ISREG(st.st_mode))
+    {
+        return EXIT_FAILURE;
+    }
+    K->size = st.st_size;
+#ifdef __linux__
+    K->mtime_ns = (u64) st.st_mtim.tv_sec*1000000000ULL + st.st_mtim.tv_nsec;
+#else
+    K->mtime_ns = (u64) st.st_mtime*1000000000ULL;
+#endif
+    FILE * fid = fopen(fname, "rb");
+    if(fid == NULL)
+    {
+        return EXIT_FAILURE;
+    }
+    u8 * buf = malloc(16*FTAB_SNAP_SAMPLE);
+    assert(buf != NULL);
+    u64 h = K->size;
+    for(int ss = 0; ss < 18; ss++)
+    {
+        /* 0: head, 1: tail, 2-17: evenly spaced */
+        size_t len = ss < 2 ? 16*FTAB_SNAP_SAMPLE : FTAB_SNAP_SAMPLE;
+        len = len < K->size ? len : K->size;
+        u64 pos = 0;
+        if(ss == 1)
+        {
+            pos = K->size - len;
+        }
+        if(ss >= 2)
+        {
+            pos = (K->size - len) / 17 * (ss - 1);
+        }
+        if(fseek(fid, pos, SEEK_SET) != 0 || fread(buf, 1, len, fid) != len)
+        {
+            free(buf);
+            fclose(fid);
+            return EXIT_FAILURE;
+        }
+        h = hash_bytes(buf, len, h);
+    }
+    free(buf);
+    fclose(fid);
+    K->hash = h;
+    return EXIT_SUCCESS;
+}
+
+static char * cache_path(const char * dir, const char * fname, const char * dlm)
+{
+    char * path = realpath(fname, NULL);
+    const char * key = path == NULL ? fname : path;
+    u64 h = hash_bytes((const u8 *) key, strlen(key), (u8) dlm[0]);
+    free(path);
+    size_t len = strlen(dir) + 64;
+    char * snap = malloc(len);
+    assert(snap != NULL);
+    snprintf(snap, len, "%s/ftab-%016llx.snap", dir, (unsigned long long) h);
+    return snap;
+}
+
+static ftab_t * cache_load(const char * snap, const ftab_src_key_t * K)
+{
+    int fd = open(snap, O_RDONLY);
+    if(fd < 0)
+    {
+        return NULL;
+    }
+    struct stat st;
+    if(fstat(fd, &st) != 0 || st.st_size < FTAB_SNAP_HEADER)
+    {
+        close(fd);
+        return NULL;
+    }
+    size_t size = st.st_size;
+    u8 * map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(map == MAP_FAILED)
+    {
+        return NULL;
+    }
+    u64 H[6];
+    memcpy(H, map + 8, sizeof(H));
+    u64 nrow = H[3];
+    u64 ncol = H[4];
+    u64 names_len = H[5];
+    u64 offset = (FTAB_SNAP_HEADER + names_len + 63) / 64 * 64;
+    if(memcmp(map, FTAB_SNAP_MAGIC, 8) != 0
+       || H[0] != K->size || H[1] != K->mtime_ns || H[2] != K->hash
+       || ncol == 0 || names_len > size || offset > size
+       || (size - offset) / sizeof(float) / ncol != nrow
+       || (size - offset) % (ncol*sizeof(float)) != 0
+       || map[FTAB_SNAP_HEADER + names_len - 1] != '\0')
+    {
+        munmap(map, size);
+        return NULL;
+    }
+
+    ftab_t * T = calloc(1, sizeof(ftab_t));
+    assert(T != NULL);
+    T->nrow = nrow;
+    T->ncol = ncol;
+    T->nrow_alloc = nrow;
+    T->map = map;
+    T->map_size = size;
+    T->T = (float *) (map + offset);
+    T->colnames = calloc(ncol, sizeof(char*));
+    assert(T->colnames != NULL);
+    const char * name = (const char *) map + FTAB_SNAP_HEADER;
+    const char * end = name + names_len;
+    for(size_t cc = 0; cc < ncol && name < end; cc++)
+    {
+        T->colnames[cc] = strdup(name);
+        assert(T->colnames[cc] != NULL);
+        name += strlen(name) + 1;
+    }
+    /* Most recently used */
+    utimensat(AT_FDCWD, snap, NULL, 0);
+    return T;
+}
+
+typedef struct {
+    char * name;
+    u64 size;
+    struct timespec mtime;
+} ftab_snap_entry_t;
+
+static int snap_entry_cmp(const void * _A, const void * _B)
+{
+    const ftab_snap_entry_t * A = _A;
+    const ftab_snap_entry_t * B = _B;
+    if(A->mtime.tv_sec != B->mtime.tv_sec)
+    {
+        return A->mtime.tv_sec < B->mtime.tv_sec ? -1 : 1;
+    }
+    if(A->mtime.tv_nsec != B->mtime.tv_nsec)
+    {
+        return A->mtime.tv_nsec < B->mtime.tv_nsec ? -1 : 1;
+    }
+    return 0;
+}
+
+/* Remove the least recently used snapshots until the total size is
+ * at most max_bytes */
+static void cache_evict(const char * dir, u64 max_bytes)
+{
+    DIR * D = opendir(dir);
+    if(D == NULL)
+    {
+        return;
+    }
+    size_t n = 0;
+    size_t cap = 64;
+    ftab_snap_entry_t * E = malloc(cap*sizeof(ftab_snap_entry_t));
+    assert(E != NULL);
+    u64 total = 0;
+    struct dirent * ent;
+    while( (ent = readdir(D)) != NULL)
+    {
+        size_t len = strlen(ent->d_name);
+        if(strncmp(ent->d_name, "ftab-", 5) != 0 || len < 10
+           || strcmp(ent->d_name + len - 5, ".snap") != 0)
+        {
+            continue;
+        }
+        size_t plen = strlen(dir) + len + 2;
+        char * path = malloc(plen);
+        assert(path != NULL);
+        snprintf(path, plen, "%s/%s", dir, ent->d_name);
+        struct stat st;
+        if(stat(path, &st) != 0)
+        {
+            free(path);
+            continue;
+        }
+        if(n == cap)
+        {
+            cap *= 2;
+            E = realloc(E, cap*sizeof(ftab_snap_entry_t));
+            assert(E != NULL);
+        }
+        E[n].name = path;
+        E[n].size = st.st_size;
+#ifdef __linux__
+        E[n].mtime = st.st_mtim;
+#else
+        E[n].mtime.tv_sec = st.st_mtime;
+        E[n].mtime.tv_nsec = 0;
+#endif
+        total += st.st_size;
+        n++;
+    }
+    closedir(D);
+
+    qsort(E, n, sizeof(ftab_snap_entry_t), snap_entry_cmp);
+    for(size_t kk = 0; kk < n; kk++)
+    {
+        /* Files in use stay valid after unlink */
+        if(total > max_bytes && unlink(E[kk].name) == 0)
+        {
+            total -= E[kk].size;
+        }
+        free(E[kk].name);
+    }
+    free(E);
+}
+
+static void cache_store(const char * snap, const char * dir, u64 max_bytes,
+                        const ftab_t * T, const ftab_src_key_t * K)
+{
+    size_t tlen = strlen(dir) + 32;
+    char * tmp = malloc(tlen);
+    assert(tmp != NULL);
+    snprintf(tmp, tlen, "%s/.ftab-XXXXXX", dir);
+    int fd = mkstemp(tmp);
+    if(fd < 0)
+    {
+        free(tmp);
+        return;
+    }
+    FILE * fid = fdopen(fd, "wb");
+    if(fid == NULL)
+    {
+        close(fd);
+        unlink(tmp);
+        free(tmp);
+        return;
+    }
+
+    u64 names_len = 0;
+    for(size_t cc = 0; cc < T->ncol; cc++)
+    {
+        const char * name = T->colnames == NULL || T->colnames[cc] == NULL
+            ? "" : T->colnames[cc];
+        names_len += strlen(name) + 1;
+    }
+    u64 H[6] = {K->size, K->mtime_ns, K->hash, T->nrow, T->ncol, names_len};
+    int error = 0;
+    error |= fwrite(FTAB_SNAP_MAGIC, 1, 8, fid) != 8;
+    error |= fwrite(H, sizeof(H), 1, fid) != 1;
+    for(size_t cc = 0; cc < T->ncol; cc++)
+    {
+        const char * name = T->colnames == NULL || T->colnames[cc] == NULL
+            ? "" : T->colnames[cc];
+        error |= fwrite(name, 1, strlen(name) + 1, fid) != strlen(name) + 1;
+    }
+    u8 pad[64] = {0};
+    size_t npad = (64 - (FTAB_SNAP_HEADER + names_len) % 64) % 64;
+    error |= fwrite(pad, 1, npad, fid) != npad;
+    error |= fwrite(T->T, sizeof(float), T->nrow*T->ncol, fid) != T->nrow*T->ncol;
+    if(fclose(fid) != 0)
+    {
+        error = 1;
+    }
+    /* rename is atomic, the last writer wins */
+    if(error || rename(tmp, snap) != 0)
+    {
+        unlink(tmp);
+    }
+    free(tmp);
+    cache_evict(dir, max_bytes);
+}
+
+int ftab_cache_enable(const char * dir, uint64_t max_bytes)
+{
+    if(dir == NULL)
+    {
+        return EXIT_FAILURE;
+    }
+    if(mkdir(dir, 0755) != 0 && errno != EEXIST)
+    {
+        fprintf(stderr, "ftab: can not create %s\n", dir);
+        return EXIT_FAILURE;
+    }
+    struct stat st;
+    if(stat(dir, &st) != 0 || !S_ISDIR(st.st_mode))
+    {
+        fprintf(stderr, "ftab: %s is not a directory\n", dir);
+        return EXIT_FAILURE;
+    }
+    pthread_mutex_lock(&cache_mutex);
+    free(cache_dir);
+    cache_dir = strdup(dir);
+    assert(cache_dir != NULL);
+    cache_max_bytes = max_bytes;
+    pthread_mutex_unlock(&cache_mutex);
+    cache_evict(dir, max_bytes);
+    return EXIT_SUCCESS;
+}
+
+void ftab_cache_disable(void)
+{
+    pthread_mutex_lock(&cache_mutex);
+    free(cache_dir);
+    cache_dir = NULL;
+    pthread_mutex_unlock(&cache_mutex);
+}
+
+static ftab_t *
+ftab_from_dlm_cached(const char * fname, const char * dlm,
+                     const char * dir, u64 max_bytes)
+{
+    ftab_opts_t opts = {0};
+    opts.dlm = dlm;
+    ftab_src_key_t K0 = {0};
+    if(cache_src_key(fname, &K0))
+    {
+        /* Not a regular file, or it could not be sampled. Parse it
+         * without the cache. */
+        return ftab_from_path(fname, &opts);
+    }
+    char * snap = cache_path(dir, fname, dlm);
+    ftab_t * T = cache_load(snap, &K0);
+    if(T != NULL)
+    {
+        free(snap);
+        return T;
+    }
+
+    T = ftab_from_path(fname, &opts);
+    if(T == NULL)
+    {
+        free(snap);
+        return NULL;
+    }
+
+    /* Only store if the file did not change while it was read */
+    ftab_src_key_t K1 = {0};
+    if(T != NULL && T->nrow > 0 && cache_src_key(fname, &K1) == EXIT_SUCCESS
+       && memcmp(&K0, &K1, sizeof(K0)) == 0)
+    {
+        cache_store(snap, dir, max_bytes, T, &K0);
+    }
+    free(snap);
+    return T;
+}
+
+#else
+
+int ftab_cache_enable(const char * dir, uint64_t max_bytes)
+{
+    (void) dir;
+    (void) max_bytes;
+    fprintf(stderr, "ftab: the parse cache is not supported on this platform\n");
+    return EXIT_FAILURE;
+}
+
+void ftab_cache_disable(void)
+{
+}
+
+#endif
+
+static ftab_t *
+ftab_from_dlm(const char * fname,
+              const char * dlm)
+{
+#ifndef WINDOWS
+    char * dir = NULL;
+    u64 max_bytes = 0;
+    pthread_mutex_lock(&cache_mutex);
+    if(cache_dir != NULL)
+    {
+        dir = strdup(cache_dir);
+        max_bytes = cache_max_bytes;
+    }
+    pthread_mutex_unlock(&cache_mutex);
+    if(dir != NULL)
+    {
+        ftab_t * T = ftab_from_dlm_cached(fname, dlm, dir, max_bytes);
+        free(dir);
+        return T;
+    }
+#endif
+    ftab_opts_t opts = {0};
+    opts.dlm = dlm;
+    return ftab_from_path(fname, &opts);
+}
+
+
+ftab_t * ftab_from_csv(const char * fname)
+{
+    return ftab_from_dlm(fname, ",");
+}
+
+ftab_t * ftab_from_tsv(const char * fname)
+{
+    return ftab_from_dlm(fname, "\t");
+}
+
+/*                          LAZY READER
+ *                          ===========
+ *
+ * ftab_lazy_open maps the file and records where each row starts,
+ * nothing is parsed. A column is parsed the first time that it is
+ * asked for and is then kept until ftab_lazy_close. Rows are the same
+ * as for ftab_from_dlm, i.e., lines with too few fields are skipped.
+ */
+
+struct ftab_lazy {
+    const char * data;
+    size_t size;
+    void * map; /* NULL if data was read into memory */
+    char dlm;
+    size_t nrow;
+    size_t ncol;
+    char ** colnames;
+    u64 * line; /* Offset to the start of each row */
+    float ** cols; /* Parsed columns, NULL until used */
+};
+
+typedef struct {
+    const ftab_lazy_t * L;
+    size_t begin; /* First byte after the header */
+    u64 ** lines; /* Per thread */
+    size_t * nlines;
+} ftab_lazy_scan_t;
+
+/* Index the lines that start in this thread's part of the file */
+static void lazy_scan_worker(void * _S, int thread, int nthreads)
+{
+    ftab_lazy_scan_t * S = _S;
+    const ftab_lazy_t * L = S->L;
+    const char * end = L->data + L->size;
+    size_t first, last;
+    thread_range(L->size - S->begin, thread, nthreads, &first, &last);
+    const char * p = L->data + S->begin + first;
+    const char * stop = L->data + S->begin + last;
+    if(thread > 0)
+    {
+        /* A line belongs to the thread where it starts */
+        const char * nl = memchr(p - 1, '\n', end - p + 1);
+        p = nl == NULL ? end : nl + 1;
+    }
+
+    size_t n = 0;
+    size_t cap = 1024;
+    u64 * lines = malloc(cap*sizeof(u64));
+    assert(lines != NULL);
+    while(p < stop)
+    {
+        const char * lend = memchr(p, '\n', end - p);
+        const char * next = lend == NULL ? end : lend + 1;
+        if(lend == NULL)
+        {
+            lend = end;
+        }
+        if(lend > p && lend[-1] == '\r')
+        {
+            lend--;
+        }
+        /* ncol fields means ncol-1 delimiters */
+        const char * q = p;
+        size_t ndlm = 0;
+        while(ndlm + 1 < L->ncol
+              && (q = memchr(q, L->dlm, lend - q)) != NULL)
+        {
+            ndlm++;
+            q++;
+        }
+        if(lend > p && ndlm + 1 == L->ncol)
+        {
+            if(n == cap)
+            {
+                cap += cap*0.69 + 1;
+                lines = realloc(lines, cap*sizeof(u64));
+                assert(lines != NULL);
+            }
+            lines[n++] = p - L->data;
+        }
+        p = next;
+    }
+    S->lines[thread] = lines;
+    S->nlines[thread] = n;
+}
+
+ftab_lazy_t * ftab_lazy_open(const char * fname, const char * dlm)
+{
+    if(fname == NULL || dlm == NULL)
+    {
+        return NULL;
+    }
+    FILE * fid = fopen(fname, "rb");
+    if(fid == NULL)
+    {
+        fprintf(stderr, "Can not open %s\n", fname);
+        return NULL;
+    }
+    fseek(fid, 0, SEEK_END);
+    long fsize = ftell(fid);
+    fseek(fid, 0, SEEK_SET);
+    if(fsize <= 0)
+    {
+        fprintf(stderr, "Empty header line\n");
+        fclose(fid);
+        return NULL;
+    }
+
+    ftab_lazy_t * L = calloc(1, sizeof(ftab_lazy_t));
+    assert(L != NULL);
+    L->size = fsize;
+    L->dlm = dlm[0];
+#ifndef WINDOWS
+    L->map = mmap(NULL, L->size, PROT_READ, MAP_PRIVATE, fileno(fid), 0);
+    if(L->map == MAP_FAILED)
+    {
+        L->map = NULL;
+    }
+    L->data = L->map;
+#endif
+    if(L->data == NULL)
+    {
+        char * data = malloc(L->size + 1);
+        assert(data != NULL);
+        if(fread(data, 1, L->size, fid) != L->size)
+        {
+            fprintf(stderr, "Failed to read %s\n", fname);
+            free(data);
+            fclose(fid);
+            free(L);
+            return NULL;
+        }
+        data[L->size] = '\0';
+        L->data = data;
+    }
+    fclose(fid);
+
+    const u8 * magic = (const u8 *) L->data;
+    if(L->size >= 4 && ((magic[0] == 0x1f && magic[1] == 0x8b)
+                        || (magic[0] == 0x28 && magic[1] == 0xb5
+                            && magic[2] == 0x2f && magic[3] == 0xfd)))
+    {
+        fprintf(stderr, "ftab: %s is compressed, use ftab_from_FILE\n", fname);
+        ftab_lazy_close(L);
+        return NULL;
+    }
+
+    /* Header */
+    const char * nl = memchr(L->data, '\n', L->size);
+    size_t hlen = nl == NULL ? L->size : (size_t) (nl - L->data);
+    char * header = malloc(hlen + 1);
+    assert(header != NULL);
+    memcpy(header, L->data, hlen);
+    header[hlen] = '\0';
+    ftab_t H = {0};
+    if(parse_col_names(&H, header, dlm) < 1)
+    {
+        fprintf(stderr, "Empty header line\n");
+        free(header);
+        ftab_lazy_close(L);
+        return NULL;
+    }
+    free(header);
+    L->ncol = H.ncol;
+    L->colnames = H.colnames;
+    L->cols = calloc(L->ncol, sizeof(float*));
+    assert(L->cols != NULL);
+
+    /* Row index */
+    ftab_lazy_scan_t S = {0};
+    S.L = L;
+    S.begin = nl == NULL ? L->size : hlen + 1;
+    int nthreads = nthreads_for(L->size - S.begin, 1 << 22);
+    S.lines = calloc(nthreads, sizeof(u64*));
+    S.nlines = calloc(nthreads, sizeof(size_t));
+    assert(S.lines != NULL && S.nlines != NULL);
+    run_parallel(nthreads, lazy_scan_worker, &S);
+    for(int kk = 0; kk < nthreads; kk++)
+    {
+        L->nrow += S.nlines[kk];
+    }
+    L->line = malloc((L->nrow + 1)*sizeof(u64));
+    assert(L->line != NULL);
+    size_t pos = 0;
+    for(int kk = 0; kk < nthreads; kk++)
+    {
+        memcpy(L->line + pos, S.lines[kk], S.nlines[kk]*sizeof(u64));
+        pos += S.nlines[kk];
+        free(S.lines[kk]);
+    }
+    free(S.lines);
+    free(S.nlines);
+    return L;
+}
+
+void ftab_lazy_close(ftab_lazy_t * L)
+{
+    if(L == NULL)
+    {
+        return;
+    }
+#ifndef WINDOWS
+    if(L->map != NULL)
+    {
+        munmap(L->map, L->size);
+    } else {
+        free((void *) L->data);
+    }
+#else
+    free((void *) L->data);
+#endif
+    if(L->colnames != NULL)
+    {
+        for(size_t kk = 0; kk < L->ncol; kk++)
+        {
+            free(L->colnames[kk]);
+        }
+    }
+    if(L->cols != NULL)
+    {
+        for(size_t kk = 0; kk < L->ncol; kk++)
+        {
+            free(L->cols[kk]);
+        }
+    }
+    free(L->colnames);
+    free(L->cols);
+    free(L->line);
+    free(L);
+}
+
+size_t ftab_lazy_nrow(const ftab_lazy_t * L)
+{
+    return L == NULL ? 0 : L->nrow;
+}
+
+size_t ftab_lazy_ncol(const ftab_lazy_t * L)
+{
+    return L == NULL ? 0 : L->ncol;
+}
+
+const char * ftab_lazy_colname(const ftab_lazy_t * L, size_t col)
+{
+    if(L == NULL || col >= L->ncol)
+    {
+        return NULL;
+    }
+    return L->colnames[col];
+}
+
+int ftab_lazy_get_col(const ftab_lazy_t * L, const char * name)
+{
+    if(L == NULL || name == NULL)
+    {
+        return -1;
+    }
+    ftab_t H = {0};
+    H.ncol = L->ncol;
+    H.colnames = L->colnames;
+    return ftab_get_col(&H, name);
+}
+
+typedef struct {
+    const ftab_lazy_t * L;
+    size_t col;
+    float * out;
+} ftab_lazy_parse_t;
+
+static void lazy_parse_worker(void * _P, int thread, int nthreads)
+{
+    ftab_lazy_parse_t * P = _P;
+    const ftab_lazy_t * L = P->L;
+    const char * end = L->data + L->size;
+    size_t first, last;
+    thread_range(L->nrow, thread, nthreads, &first, &last);
+    for(size_t rr = first; rr < last; rr++)
+    {
+        const char * p = L->data + L->line[rr];
+        const char * lend = memchr(p, '\n', end - p);
+        if(lend == NULL)
+        {
+            lend = end;
+        }
+        if(lend > p && lend[-1] == '\r')
+        {
+            lend--;
+        }
+        for(size_t kk = 0; kk < P->col; kk++)
+        {
+            p = (const char *) memchr(p, L->dlm, lend - p) + 1;
+        }
+        const char * fend = memchr(p, L->dlm, lend - p);
+        if(fend == NULL)
+        {
+            fend = lend;
+        }
+        if(fend == end && L->map != NULL)
+        {
+            /* Last field of a mapped file without newline: strtof
+             * needs a terminated string */
+            char buf[128] = {0};
+            size_t len = fend - p < 127 ? fend - p : 127;
+            memcpy(buf, p, len);
+            P->out[rr] = parse_field(buf, buf + len, 0);
+        } else {
+            P->out[rr] = parse_field(p, fend, 0);
+        }
+    }
+}
+
+const float * ftab_lazy_column(ftab_lazy_t * L, size_t col)
+{
+    if(L == NULL || col >= L->ncol)
+    {
+        return NULL;
+    }
+    if(L->cols[col] == NULL)
+    {
+        ftab_lazy_parse_t P = {0};
+        P.L = L;
+        P.col = col;
+        P.out = malloc((L->nrow + 1)*sizeof(float));
+        assert(P.out != NULL);
+        run_parallel(nthreads_for(L->nrow, 1 << 16), lazy_parse_worker, &P);
+        L->cols[col] = P.out;
+    }
+    return L->cols[col];
+}
+
+ftab_t * ftab_lazy_select(ftab_lazy_t * L, const int * cols, size_t ncols)
+{
+    if(L == NULL || cols == NULL || ncols == 0)
+    {
+        return NULL;
+    }
+    for(size_t cc = 0; cc < ncols; cc++)
+    {
+        if(cols[cc] < 0 || ftab_lazy_column(L, cols[cc]) == NULL)
+        {
+            return NULL;
+        }
+    }
+    ftab_t * T = calloc(1, sizeof(ftab_t));
+    assert(T != NULL);
+    T->ncol = ncols;
+    T->nrow = L->nrow;
+    T->nrow_alloc = L->nrow > 0 ? L->nrow : 1;
+    T->T = malloc(T->nrow_alloc*T->ncol*sizeof(float));
+    T->colnames = calloc(ncols, sizeof(char*));
+    assert(T->T != NULL && T->colnames != NULL);
+    for(size_t cc = 0; cc < ncols; cc++)
+    {
+        T->colnames[cc] = strdup(L->colnames[cols[cc]]);
+        assert(T->colnames[cc] != NULL);
+        const float * V = L->cols[cols[cc]];
+        for(size_t rr = 0; rr < T->nrow; rr++)
+        {
+            T->T[rr*ncols + cc] = V[rr];
+        }
+    }
+    return T;
+}
+
+/*                        APPEND AND TAIL
+ *                        ===============
+ *
+ * For tables that grow while they are being used: ftab_append_tsv and
+ * ftab_append_csv only write new rows, and ftab_tail_read returns the
+ * rows that were completed since the last call.
+ */
+
+/* Read the first line of fid, without the newline. *complete is set
+ * to 0 if the file ended before a newline was found. */
+static char * read_first_line(FILE * fid, size_t * len, int * complete)
+{
+    size_t cap = 4096;
+    size_t n = 0;
+    char * line = malloc(cap + 1);
+    assert(line != NULL);
+    *complete = 0;
+    int c;
+    while( (c = fgetc(fid)) != EOF)
+    {
+        if(c == '\n')
+        {
+            *complete = 1;
+            break;
+        }
+        if(n == cap)
+        {
+            cap *= 2;
+            line = realloc(line, cap + 1);
+            assert(line != NULL);
+        }
+        line[n++] = c;
+    }
+    line[n] = '\0';
+    *len = n + *complete;
+    return line;
+}
+
+/* Check that the header line matches the column names of T, as they
+ * would be written by ftab_print */
+static int header_matches(const ftab_t * T, const char * header, const char * sep)
+{
+    ftab_strbuf_t sb = {0};
+    if(format_header(&sb, T, sep))
+    {
+        free(sb.s);
+        return 0;
+    }
+    sb.s[sb.len - 1] = '\0'; /* newline */
+    ftab_t A = {0};
+    ftab_t B = {0};
+    int match = parse_col_names(&A, sb.s, sep) == parse_col_names(&B, header, sep);
+    for(size_t kk = 0; kk < A.ncol; kk++)
+    {
+        if(match && strcmp(A.colnames[kk], B.colnames[kk]))
+        {
+            match = 0;
+        }
+    }
+    for(size_t kk = 0; kk < A.ncol; kk++)
+    {
+        free(A.colnames[kk]);
+    }
+    for(size_t kk = 0; kk < B.ncol; kk++)
+    {
+        free(B.colnames[kk]);
+    }
+    free(A.colnames);
+    free(B.colnames);
+    free(sb.s);
+    return match;
+}
+
+/* Offset just after the last newline of fid, 0 if there is none and
+ * -1 on error */
+static long end_of_last_line(FILE * fid)
+{
+    if(fseek(fid, 0, SEEK_END) != 0)
+    {
+        return -1;
+    }
+    long pos = ftell(fid);
+    char buf[4096];
+    while(pos > 0)
+    {
+        long n = pos < (long) sizeof(buf) ? pos : (long) sizeof(buf);
+        pos -= n;
+        if(fseek(fid, pos, SEEK_SET) != 0
+           || fread(buf, 1, n, fid) != (size_t) n)
+        {
+            return -1;
+        }
+        for(long kk = n; kk > 0; kk--)
+        {
+            if(buf[kk - 1] == '\n')
+            {
+                return pos + kk;
+            }
+        }
+    }
+    return pos;
+}
+
+static int
+ftab_append_dlm(const ftab_t * T, const char * fname, size_t first_row,
+                const char * sep)
+{
+    if(T == NULL || fname == NULL)
+    {
+        return EXIT_FAILURE;
+    }
+    /* One open file for the check and the append, all writes go to
+     * the end of the file (O_APPEND) and the file is created if
+     * needed */
+    FILE * fid = fopen(fname, "a+b");
+    if(fid == NULL)
+    {
+        return EXIT_FAILURE;
+    }
+#ifndef WINDOWS
+    /* Other appenders wait until the rows are written */
+    if(flock(fileno(fid), LOCK_EX) != 0)
+    {
+        fclose(fid);
+        return EXIT_FAILURE;
+    }
+#endif
+
+    rewind(fid);
+    size_t hlen = 0;
+    int complete = 0;
+    char * header = read_first_line(fid, &hlen, &complete);
+    int empty = hlen == 0;
+    int match = empty || header_matches(T, header, sep);
+    free(header);
+    if(!match)
+    {
+        fprintf(stderr, "ftab: the columns of %s do not match the table\n", fname);
+        fclose(fid);
+        return EXIT_FAILURE;
+    }
+
+    int ret = EXIT_SUCCESS;
+    if(!empty)
+    {
+        /* A row, or the header, that was not completed, e.g., by an
+         * interrupted writer. It is cut off so that the new rows do
+         * not continue it. */
+        long end = end_of_last_line(fid);
+        long size = fseek(fid, 0, SEEK_END) == 0 ? ftell(fid) : -1;
+        if(end < 0 || size < 0)
+        {
+            ret = EXIT_FAILURE;
+        } else if(end < size) {
+#ifdef WINDOWS
+            fprintf(stderr, "ftab: %s ends with an incomplete row\n", fname);
+            ret = EXIT_FAILURE;
+#else
+            if(ftruncate(fileno(fid), end) != 0)
+            {
+                ret = EXIT_FAILURE;
+            }
+#endif
+            empty = end == 0;
+        }
+    }
+
+    /* Switching from reading to writing requires a seek */
+    if(ret == EXIT_SUCCESS && fseek(fid, 0, SEEK_END) != 0)
+    {
+        ret = EXIT_FAILURE;
+    }
+    if(ret == EXIT_SUCCESS)
+    {
+        ret = print_rows(fid, T, sep, first_row, empty);
+    }
+    /* Closing also releases the lock, after the data is flushed */
+    if(fclose(fid) != 0)
+    {
+        ret = EXIT_FAILURE;
+    }
+    return ret;
+}
+
+int ftab_append_tsv(const ftab_t * T, const char * fname, size_t first_row)
+{
+    return ftab_append_dlm(T, fname, first_row, "\t");
+}
+
+int ftab_append_csv(const ftab_t * T, const char * fname, size_t first_row)
+{
+    return ftab_append_dlm(T, fname, first_row, ",");
+}
+
+struct ftab_tail {
+    FILE * fid;
+    char dlm[2];
+    size_t ncol;
+    char ** colnames;
+    u64 offset; /* Everything before has been returned */
+};
+
+ftab_tail_t * ftab_tail_open(const char * fname, const char * dlm)
+{
+    if(fname == NULL || dlm == NULL)
+    {
+        return NULL;
+    }
+    FILE * fid = fopen(fname, "rb");
+    if(fid == NULL)
+    {
+        fprintf(stderr, "Can not open %s\n", fname);
+        return NULL;
+    }
+    size_t hlen = 0;
+    int complete = 0;
+    char * header = read_first_line(fid, &hlen, &complete);
+    ftab_t H = {0};
+    if(!complete || parse_col_names(&H, header, dlm) < 1)
+    {
+        fprintf(stderr, "Empty header line\n");
+        free(header);
+        fclose(fid);
+        return NULL;
+    }
+    free(header);
+    ftab_tail_t * R = calloc(1, sizeof(ftab_tail_t));
+    assert(R != NULL);
+    R->fid = fid;
+    R->dlm[0] = dlm[0];
+    R->ncol = H.ncol;
+    R->colnames = H.colnames;
+    R->offset = hlen;
+    return R;
+}
+
+void ftab_tail_close(ftab_tail_t * R)
+{
+    if(R == NULL)
+    {
+        return;
+    }
+    fclose(R->fid);
+    for(size_t kk = 0; kk < R->ncol; kk++)
+    {
+        free(R->colnames[kk]);
+    }
+    free(R->colnames);
+    free(R);
+}
+
+uint64_t ftab_tail_offset(const ftab_tail_t * R)
+{
+    return R == NULL ? 0 : R->offset;
+}
+
+typedef struct {
+    const char * data;
+    size_t len;
+    size_t ncol;
+    char dlm;
+    float ** rows; /* Per thread */
+    size_t * nrow;
+} ftab_tail_parse_t;
+
+static void tail_parse_worker(void * _P, int thread, int nthreads)
+{
+    ftab_tail_parse_t * P = _P;
+    size_t first, last;
+    thread_range(P->len, thread, nthreads, &first, &last);
+    /* Move both ends to the start of a line */
+    const char * end = P->data + P->len;
+    const char * a = P->data;
+    if(first > 0)
+    {
+        a = memchr(P->data + first - 1, '\n', P->len - first + 1);
+        a = a == NULL ? end : a + 1;
+    }
+    const char * b = end;
+    if(last < P->len)
+    {
+        b = memchr(P->data + last - 1, '\n', P->len - last + 1);
+        b = b == NULL ? end : b + 1;
+    }
+    if(b < a)
+    {
+        b = a;
+    }
+    /* parse_block needs a terminated string */
+    char * block = malloc(b - a + 1);
+    assert(block != NULL);
+    memcpy(block, a, b - a);
+    block[b - a] = '\0';
+    P->rows[thread] = parse_block(block, b - a, P->ncol, P->dlm, 0,
+                                  NULL, 0, P->nrow + thread);
+    free(block);
+}
+
+ftab_t * ftab_tail_read(ftab_tail_t * R)
+{
+    if(R == NULL)
+    {
+        return NULL;
+    }
+    if(fseek(R->fid, 0, SEEK_END) != 0)
+    {
+        return NULL;
+    }
+    long size = ftell(R->fid);
+    if(size < 0 || (u64) size < R->offset)
+    {
+        fprintf(stderr, "ftab: the file was truncated\n");
+        return NULL;
+    }
+    size_t len = size - R->offset;
+    char * buf = malloc(len + 1);
+    assert(buf != NULL);
+    if(fseek(R->fid, R->offset, SEEK_SET) != 0)
+    {
+        free(buf);
+        return NULL;
+    }
+    len = fread(buf, 1, len, R->fid);
+    clearerr(R->fid);
+
+    /* Only complete lines */
+    while(len > 0 && buf[len-1] != '\n')
+    {
+        len--;
+    }
+    buf[len] = '\0';
+
+    ftab_tail_parse_t P = {0};
+    P.data = buf;
+    P.len = len;
+    P.ncol = R->ncol;
+    P.dlm = R->dlm[0];
+    int nthreads = nthreads_for(len, 1 << 22);
+    P.rows = calloc(nthreads, sizeof(float*));
+    P.nrow = calloc(nthreads, sizeof(size_t));
+    assert(P.rows != NULL && P.nrow != NULL);
+    run_parallel(nthreads, tail_parse_worker, &P);
+    free(buf);
+
+    ftab_t * T = calloc(1, sizeof(ftab_t));
+    assert(T != NULL);
+    T->ncol = R->ncol;
+    int error = 0;
+    for(int kk = 0; kk < nthreads; kk++)
+    {
+        T->nrow += P.nrow[kk];
+        error |= P.rows[kk] == NULL;
+    }
+    T->nrow_alloc = T->nrow > 0 ? T->nrow : 1;
+    T->T = malloc(T->nrow_alloc*T->ncol*sizeof(float));
+    assert(T->T != NULL);
+    size_t pos = 0;
+    for(int kk = 0; kk < nthreads; kk++)
+    {
+        if(P.rows[kk] != NULL)
+        {
+            memcpy(T->T + pos*T->ncol, P.rows[kk], P.nrow[kk]*T->ncol*sizeof(float));
+        }
+        pos += P.nrow[kk];
+        free(P.rows[kk]);
+    }
+    free(P.rows);
+    free(P.nrow);
+    T->colnames = calloc(T->ncol, sizeof(char*));
+    assert(T->colnames != NULL);
+    for(size_t kk = 0; kk < T->ncol; kk++)
+    {
+        T->colnames[kk] = strdup(R->colnames[kk]);
+        assert(T->colnames[kk] != NULL);
+    }
+    if(error)
+    {
+        ftab_free(T);
+        return NULL;
+    }
+    R->offset += len;
+    return T;
+}
+
+/*                             NUMPY
+ *                             =====
+ *
+ * Only 2D (or 1D) C-order arrays of little endian float32 ('<f4') are
+ * supported. The column names are stored in a sidecar text file,
+ * fname.colnames, with one name per line.
+ */
+
+static int is_little_endian(void)
+{
+    const u32 one = 1;
+    return ((const u8 *) &one)[0] == 1;
+}
+
+static char * npy_colnames_file(const char * fname)
+{
+    char * cname = malloc(strlen(fname) + strlen(".colnames") + 1);
+    assert(cname != NULL);
+    sprintf(cname, "%s.colnames", fname);
+    return cname;
+}
+
+int ftab_write_npy(const ftab_t * T, const char * fname)
+{
+    if(T == NULL || fname == NULL || !is_little_endian())
+    {
+        return EXIT_FAILURE;
+    }
+    char header[256];
+    int hlen = snprintf(header, sizeof(header),
+                        "{'descr': '<f4', 'fortran_order': False, "
+                        "'shape': (%zu, %zu), }", T->nrow, T->ncol);
+    /* Pad with spaces so that the data starts at a multiple of 64
+     * bytes, 10 bytes for magic, version and header length */
+    size_t total = 10 + hlen + 1;
+    size_t padded = (total + 63) / 64 * 64;
+    memset(header + hlen, ' ', padded - total);
+    hlen += padded - total;
+    header[hlen++] = '\n';
+
+    FILE * fid = fopen(fname, "wb");
+    if(fid == NULL)
+    {
+        return EXIT_FAILURE;
+    }
+    u8 preamble[10] = {0x93, 'N', 'U', 'M', 'P', 'Y', 1, 0,
+                       hlen & 0xff, hlen >> 8};
+    size_t nel = T->nrow*T->ncol;
+    int status = EXIT_SUCCESS;
+    if(fwrite(preamble, 1, 10, fid) != 10
+       || fwrite(header, 1, hlen, fid) != (size_t) hlen
+       || fwrite(T->T, sizeof(float), nel, fid) != nel)
+    {
+        status = EXIT_FAILURE;
+    }
+    if(fclose(fid) != 0)
+    {
+        status = EXIT_FAILURE;
+    }
+    char * cname = npy_colnames_file(fname);
+    if(status != EXIT_SUCCESS || T->colnames == NULL)
+    {
+        /* A sidecar from an earlier table would be picked up when
+         * reading */
+        remove(cname);
+        free(cname);
+        return status;
+    }
+
+    fid = fopen(cname, "wb");
+    free(cname);
+    if(fid == NULL)
+    {
+        return EXIT_FAILURE;
+    }
+    for(size_t kk = 0; kk < T->ncol; kk++)
+    {
+        if(T->colnames[kk] != NULL)
+        {
+            fprintf(fid, "%s", T->colnames[kk]);
+        }
+        fprintf(fid, "\n");
+    }
+    if(fclose(fid) != 0)
+    {
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+/* Parse the header dictionary. Returns the data offset or 0 on
+ * failure */
+static size_t
+npy_parse_header(const u8 * buf, size_t len, size_t * nrow, size_t * ncol)
+{
+    if(len < 10 || memcmp(buf, "\x93NUMPY", 6) != 0)
+    {
+        fprintf(stderr, "ftab_from_npy: not a npy file\n");
+        return 0;
+    }
+    size_t hlen = 0;
+    size_t hstart = 0;
+    if(buf[6] == 1)
+    {
+        hlen = buf[8] | (buf[9] << 8);
+        hstart = 10;
+    } else {
+        if(len < 12)
+        {
+            return 0;
+        }
+        hlen = buf[8] | (buf[9] << 8) | (buf[10] << 16) | ((size_t) buf[11] << 24);
+        hstart = 12;
+    }
+    if(hstart + hlen > len)
+    {
+        fprintf(stderr, "ftab_from_npy: truncated header\n");
+        return 0;
+    }
+    char * header = malloc(hlen + 1);
+    assert(header != NULL);
+    memcpy(header, buf + hstart, hlen);
+    header[hlen] = '\0';
+
+    size_t offset = hstart + hlen;
+    const char * descr = strstr(header, "'descr'");
+    const char * order = strstr(header, "'fortran_order'");
+    const char * shape = strstr(header, "'shape'");
+    const char * colon = order != NULL ? strchr(order, ':') : NULL;
+    if(descr == NULL || colon == NULL || shape == NULL
+       || strstr(descr, "'<f4'") == NULL
+       || strncmp(colon, ": False", 7) != 0)
+    {
+        fprintf(stderr, "ftab_from_npy: only C-order '<f4' arrays are supported\n");
+        offset = 0;
+    }
+    if(offset > 0)
+    {
+        /* Parse the shape tuple, (n,) or (n, m) */
+        size_t dims[3] = {0, 1, 0};
+        int ndim = 0;
+        const char * p = strchr(shape, '(');
+        while(p != NULL)
+        {
+            p++;
+            while(*p == ' ') { p++; }
+            if(*p == ')')
+            {
+                break;
+            }
+            char * e = NULL;
+            unsigned long long value = strtoull(p, &e, 10);
+            if(e == p || ndim == 3)
+            {
+                ndim = 0;
+                break;
+            }
+            dims[ndim++] = value;
+            p = e;
+            while(*p == ' ') { p++; }
+            if(*p != ',')
+            {
+                if(*p != ')')
+                {
+                    ndim = 0;
+                }
+                break;
+            }
+        }
+        if(ndim < 1 || ndim > 2)
+        {
+            fprintf(stderr, "ftab_from_npy: only 1D and 2D arrays are supported\n");
+            offset = 0;
+        }
+        *nrow = dims[0];
+        *ncol = dims[1];
+    }
+    free(header);
+    return offset;
+}
+
+static void npy_read_colnames(ftab_t * T, const char * fname)
+{
+    char * cname = npy_colnames_file(fname);
+    FILE * fid = fopen(cname, "rb");
+    free(cname);
+    if(fid == NULL)
+    {
+        return;
+    }
+    char * line = NULL;
+    size_t len = 0;
+    for(size_t kk = 0; kk < T->ncol; kk++)
+    {
+        if(getline(&line, &len, fid) < 0)
+        {
+            break;
+        }
+        trim_whitespace(line);
+        ftab_set_colname(T, kk, line);
+    }
+    free(line);
+    fclose(fid);
+}
+
+ftab_t * ftab_from_npy(const char * fname)
+{
+    if(fname == NULL || !is_little_endian())
+    {
+        return NULL;
+    }
+    FILE * fid = fopen(fname, "rb");
+    if(fid == NULL)
+    {
+        fprintf(stderr, "Can not open %s\n", fname);
+        return NULL;
+    }
+    u8 buf[4096];
+    size_t len = fread(buf, 1, sizeof(buf), fid);
+    size_t nrow = 0;
+    size_t ncol = 0;
+    size_t offset = npy_parse_header(buf, len, &nrow, &ncol);
+    if(offset == 0 || ncol == 0)
+    {
+        fclose(fid);
+        return NULL;
+    }
+    fseek(fid, 0, SEEK_END);
+    long fsize = ftell(fid);
+    if(nrow > SIZE_MAX / sizeof(float) / ncol)
+    {
+        fprintf(stderr, "ftab_from_npy: invalid shape in %s\n", fname);
+        fclose(fid);
+        return NULL;
+    }
+    size_t nbytes = nrow*ncol*sizeof(float);
+    if(fsize < 0 || (size_t) fsize < offset || (size_t) fsize - offset < nbytes)
+    {
+        fprintf(stderr, "ftab_from_npy: %s is truncated\n", fname);
+        fclose(fid);
+        return NULL;
+    }
+
+    ftab_t * T = calloc(1, sizeof(ftab_t));
+    assert(T != NULL);
+    T->nrow = nrow;
+    T->ncol = ncol;
+    T->nrow_alloc = nrow;
+
+#ifndef WINDOWS
+    /* Use the data in place. The mapping is private, so the table
+     * can be modified without changing the file. */
+    if(offset % sizeof(float) == 0 && nbytes > 0)
+    {
+        void * map = mmap(NULL, offset + nbytes, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE, fileno(fid), 0);
+        if(map != MAP_FAILED)
+        {
+            T->map = map;
+            T->map_size = offset + nbytes;
+            T->T = (float *) ((u8 *) map + offset);
+        }
+    }
+#endif
+
+    if(T->T == NULL)
+    {
+        T->nrow_alloc = nrow > 0 ? nrow : 1;
+        T->T = malloc(T->nrow_alloc*ncol*sizeof(float));
+        assert(T->T != NULL);
+        fseek(fid, offset, SEEK_SET);
+        if(fread(T->T, 1, nbytes, fid) != nbytes)
+        {
+            fclose(fid);
+            ftab_free(T);
+            return NULL;
+        }
+    }
+    fclose(fid);
+    npy_read_colnames(T, fname);
+    return T;
+}
+
+/*                          ARROW IPC FILES
+ *                          ===============
+ *
+ * Reader and writer for the Arrow IPC file format (Feather v2),
+ * limited to float32 columns. The metadata is encoded as
+ * flatbuffers, see Schema.fbs, Message.fbs and File.fbs in the Arrow
+ * repository. Only the few tables and fields that are needed are
+ * handled here.
+ *
+ * The flatbuffers are built front to back, a child object is always
+ * placed after the offset that refers to it (offsets are unsigned).
+ */
+
+#define ARROW_MAGIC "ARROW1"
+#define ARROW_V5 4
+#define ARROW_HEADER_SCHEMA 1
+#define ARROW_HEADER_RECORDBATCH 3
+#define ARROW_TYPE_FLOATINGPOINT 3
+#define ARROW_PRECISION_SINGLE 1
+#define ARROW_ALIGN 64
+
+typedef struct {
+    u8 * buf;
+    size_t len;
+    size_t cap;
+} fb_builder_t;
+
+/* Reserve n zeroed bytes aligned to align. Returns the position */
+static size_t fb_alloc(fb_builder_t * B, size_t n, size_t align)
+{
+    size_t pos = (B->len + align - 1) / align * align;
+    if(pos + n > B->cap)
+    {
+        size_t cap = B->cap < 1024 ? 1024 : B->cap;
+        while(pos + n > cap)
+        {
+            cap *= 2;
+        }
+        B->buf = realloc(B->buf, cap);
+        assert(B->buf != NULL);
+        B->cap = cap;
+    }
+    memset(B->buf + B->len, 0, pos + n - B->len);
+    B->len = pos + n;
+    return pos;
+}
+
+static void fb_put(fb_builder_t * B, size_t pos, const void * value, size_t n)
+{
+    memcpy(B->buf + pos, value, n);
+}
+
+/* Set the offset at pos to point at target */
+static void fb_link(fb_builder_t * B, size_t pos, size_t target)
+{
+    assert(target > pos);
+    u32 off = target - pos;
+    fb_put(B, pos, &off, 4);
+}
+
+typedef struct {
+    int id; /* Field number in the schema */
+    int size; /* 1, 2, 4 or 8 bytes, offsets are 4 */
+    u64 value;
+} fb_field_t;
+
+/* Write a table. The positions of the fields are written to pos so
+ * that offsets can be linked later. Returns the position of the
+ * table. */
+static size_t
+fb_table(fb_builder_t * B, const fb_field_t * F, int nf, size_t * pos)
+{
+    int nslots = 0;
+    for(int kk = 0; kk < nf; kk++)
+    {
+        nslots = F[kk].id + 1 > nslots ? F[kk].id + 1 : nslots;
+    }
+    u16 vtable[64] = {0};
+    assert(nslots + 2 <= 64);
+
+    /* Layout, 4 byte soffset then fields ordered for alignment */
+    u16 inline_pos[16] = {0};
+    size_t cursor = 4;
+    const int order[4] = {4, 8, 2, 1};
+    for(int oo = 0; oo < 4; oo++)
+    {
+        if(order[oo] == 8)
+        {
+            cursor = (cursor + 7) / 8 * 8;
+        }
+        for(int kk = 0; kk < nf; kk++)
+        {
+            if(F[kk].size == order[oo])
+            {
+                inline_pos[kk] = cursor;
+                cursor += F[kk].size;
+            }
+        }
+    }
+
+    vtable[0] = 4 + 2*nslots;
+    vtable[1] = cursor;
+    for(int kk = 0; kk < nf; kk++)
+    {
+        vtable[2 + F[kk].id] = inline_pos[kk];
+    }
+    size_t vt_pos = fb_alloc(B, vtable[0], 2);
+    fb_put(B, vt_pos, vtable, vtable[0]);
+
+    size_t table = fb_alloc(B, cursor, 8);
+    i32 soffset = table - vt_pos;
+    fb_put(B, table, &soffset, 4);
+    for(int kk = 0; kk < nf; kk++)
+    {
+        /* Little endian, the low bytes of value */
+        fb_put(B, table + inline_pos[kk], &F[kk].value, F[kk].size);
+        if(pos != NULL)
+        {
+            pos[kk] = table + inline_pos[kk];
+        }
+    }
+    return table;
+}
+
+/* Write a vector of n elements. The elements are aligned to
+ * align. Returns the position of the vector (its length field) */
+static size_t
+fb_vector(fb_builder_t * B, size_t n, size_t elem_size, size_t align,
+          const void * data)
+{
+    /* The length goes directly before the first element */
+    size_t start = B->len;
+    size_t first = (start + 4 + align - 1) / align * align;
+    size_t pos = first - 4;
+    fb_alloc(B, first + n*elem_size - start, 1);
+    u32 len = n;
+    fb_put(B, pos, &len, 4);
+    if(data != NULL && n > 0)
+    {
+        fb_put(B, first, data, n*elem_size);
+    }
+    return pos;
+}
+
+static size_t fb_string(fb_builder_t * B, const char * str)
+{
+    size_t n = strlen(str);
+    size_t pos = fb_vector(B, n + 1, 1, 4, str);
+    u32 len = n;
+    fb_put(B, pos, &len, 4);
+    return pos;
+}
+
+/* Schema table with one float32 Field per column */
+static size_t arrow_write_schema(fb_builder_t * B, const ftab_t * T)
+{
+    fb_field_t F[2] = {{0, 2, 0}, /* endianness: Little */
+                       {1, 4, 0}}; /* fields */
+    size_t pos[2];
+    size_t schema = fb_table(B, F, 2, pos);
+    size_t fields = fb_vector(B, T->ncol, 4, 4, NULL);
+    fb_link(B, pos[1], fields);
+    for(size_t cc = 0; cc < T->ncol; cc++)
+    {
+        int nullable = T->valid != NULL && T->valid->bits[cc] != NULL;
+        fb_field_t FF[5] = {{0, 4, 0}, /* name */
+                            {1, 1, nullable}, /* nullable */
+                            {2, 1, ARROW_TYPE_FLOATINGPOINT}, /* type_type */
+                            {3, 4, 0}, /* type */
+                            {5, 4, 0}}; /* children */
+        size_t fpos[5];
+        size_t field = fb_table(B, FF, 5, fpos);
+        fb_link(B, fields + 4 + 4*cc, field);
+
+        char name[32];
+        const char * cname = NULL;
+        if(T->colnames != NULL)
+        {
+            cname = T->colnames[cc];
+        }
+        if(cname == NULL)
+        {
+            snprintf(name, sizeof(name), "col_%zu", cc+1);
+            cname = name;
+        }
+        fb_link(B, fpos[0], fb_string(B, cname));
+
+        fb_field_t FP[1] = {{0, 2, ARROW_PRECISION_SINGLE}};
+        fb_link(B, fpos[3], fb_table(B, FP, 1, NULL));
+        fb_link(B, fpos[4], fb_vector(B, 0, 4, 4, NULL));
+    }
+    return schema;
+}
+
+/* Start a flatbuffer with a Message table. Returns the position of
+ * the header offset */
+static size_t
+arrow_write_message(fb_builder_t * B, int header_type, i64 body_length)
+{
+    size_t root = fb_alloc(B, 4, 4);
+    fb_field_t F[4] = {{0, 2, ARROW_V5}, /* version */
+                       {1, 1, header_type},
+                       {2, 4, 0}, /* header */
+                       {3, 8, body_length}};
+    size_t pos[4];
+    fb_link(B, root, fb_table(B, F, 4, pos));
+    return pos[2];
+}
+
+/* Write an encapsulated message: continuation marker, length,
+ * flatbuffer padded to 8 bytes. Returns the number of bytes */
+static size_t
+arrow_write_encapsulated(FILE * fid, const fb_builder_t * B, int * error)
+{
+    u32 len = (B->len + 7) / 8 * 8;
+    u32 cont = 0xFFFFFFFF;
+    u8 pad[8] = {0};
+    if(fwrite(&cont, 4, 1, fid) != 1
+       || fwrite(&len, 4, 1, fid) != 1
+       || fwrite(B->buf, 1, B->len, fid) != B->len
+       || fwrite(pad, 1, len - B->len, fid) != len - B->len)
+    {
+        *error = 1;
+    }
+    return 8 + len;
+}
+
+int ftab_write_arrow(const ftab_t * T, const char * fname)
+{
+    if(T == NULL || fname == NULL || !is_little_endian())
+    {
+        return EXIT_FAILURE;
+    }
+    FILE * fid = fopen(fname, "wb");
+    if(fid == NULL)
+    {
+        return EXIT_FAILURE;
+    }
+    int error = 0;
+    u8 pad[ARROW_ALIGN] = {0};
+    fwrite(ARROW_MAGIC "\0\0", 1, 8, fid);
+    size_t fpos = 8;
+
+    /* Schema message */
+    fb_builder_t B = {0};
+    size_t header = arrow_write_message(&B, ARROW_HEADER_SCHEMA, 0);
+    fb_link(&B, header, arrow_write_schema(&B, T));
+    fpos += arrow_write_encapsulated(fid, &B, &error);
+
+    /* A single record batch, each column padded to 64 bytes. The
+     * columns with missing values have validity bitmaps after the
+     * data. */
+    size_t col_bytes = T->nrow*sizeof(float);
+    size_t col_padded = (col_bytes + ARROW_ALIGN - 1) / ARROW_ALIGN * ARROW_ALIGN;
+    size_t valid_bytes = (T->nrow + 7) / 8;
+    size_t valid_padded = (valid_bytes + ARROW_ALIGN - 1) / ARROW_ALIGN * ARROW_ALIGN;
+    size_t nvalid = 0;
+    for(size_t cc = 0; T->valid != NULL && cc < T->ncol; cc++)
+    {
+        nvalid += T->valid->bits[cc] != NULL;
+    }
+    i64 body_length = col_padded*T->ncol + valid_padded*nvalid;
+    B.len = 0;
+    header = arrow_write_message(&B, ARROW_HEADER_RECORDBATCH, body_length);
+    fb_field_t F[3] = {{0, 8, T->nrow}, /* length */
+                       {1, 4, 0}, /* nodes */
+                       {2, 4, 0}}; /* buffers */
+    size_t pos[3];
+    fb_link(&B, header, fb_table(&B, F, 3, pos));
+    i64 * nodes = calloc(2*T->ncol + 1, sizeof(i64));
+    i64 * buffers = calloc(4*T->ncol + 1, sizeof(i64));
+    assert(nodes != NULL);
+    assert(buffers != NULL);
+    size_t voffset = col_padded*T->ncol;
+    for(size_t cc = 0; cc < T->ncol; cc++)
+    {
+        nodes[2*cc] = T->nrow; /* length */
+        nodes[2*cc + 1] = ftab_count_missing(T, cc); /* null_count */
+        /* The validity buffer, if any, then the data */
+        buffers[4*cc] = cc*col_padded;
+        buffers[4*cc + 1] = 0;
+        if(T->valid != NULL && T->valid->bits[cc] != NULL)
+        {
+            buffers[4*cc] = voffset;
+            buffers[4*cc + 1] = valid_bytes;
+            voffset += valid_padded;
+        }
+        buffers[4*cc + 2] = cc*col_padded;
+        buffers[4*cc + 3] = col_bytes;
+    }
+    fb_link(&B, pos[1], fb_vector(&B, T->ncol, 16, 8, nodes));
+    fb_link(&B, pos[2], fb_vector(&B, 2*T->ncol, 16, 8, buffers));
+    free(nodes);
+    free(buffers);
+    i64 batch_offset = fpos;
+    i32 batch_meta = arrow_write_encapsulated(fid, &B, &error);
+    fpos += batch_meta;
+
+    /* Body, transposed a block of rows at a time */
+    const size_t block = 4096;
+    float * col = malloc(block*sizeof(float));
+    assert(col != NULL);
+    for(size_t cc = 0; cc < T->ncol && !error; cc++)
+    {
+        for(size_t r0 = 0; r0 < T->nrow; r0 += block)
+        {
+            size_t n = T->nrow - r0 < block ? T->nrow - r0 : block;
+            for(size_t kk = 0; kk < n; kk++)
+            {
+                col[kk] = T->T[(r0 + kk)*T->ncol + cc];
+            }
+            if(fwrite(col, sizeof(float), n, fid) != n)
+            {
+                error = 1;
+            }
+        }
+        fwrite(pad, 1, col_padded - col_bytes, fid);
+    }
+    free(col);
+    u8 * bits = malloc(valid_bytes + 1);
+    assert(bits != NULL);
+    for(size_t cc = 0; nvalid > 0 && cc < T->ncol && !error; cc++)
+    {
+        if(T->valid->bits[cc] == NULL)
+        {
+            continue;
+        }
+        memcpy(bits, T->valid->bits[cc], valid_bytes);
+        if(T->nrow % 8 != 0)
+        {
+            /* The bits after the last row are undefined */
+            bits[valid_bytes - 1] &= (u8) ((1u << (T->nrow % 8)) - 1);
+        }
+        if(fwrite(bits, 1, valid_bytes, fid) != valid_bytes)
+        {
+            error = 1;
+        }
+        fwrite(pad, 1, valid_padded - valid_bytes, fid);
+    }
+    free(bits);
+    fpos += body_length;
+
+    /* End of stream marker */
+    u32 eos[2] = {0xFFFFFFFF, 0};
+    fwrite(eos, 4, 2, fid);
+    fpos += 8;
+
+    /* Footer */
+    B.len = 0;
+    size_t root = fb_alloc(&B, 4, 4);
+    fb_field_t FF[4] = {{0, 2, ARROW_V5}, /* version */
+                        {1, 4, 0}, /* schema */
+                        {2, 4, 0}, /* dictionaries */
+                        {3, 4, 0}}; /* recordBatches */
+    size_t fpos_[4];
+    fb_link(&B, root, fb_table(&B, FF, 4, fpos_));
+    fb_link(&B, fpos_[1], arrow_write_schema(&B, T));
+    fb_link(&B, fpos_[2], fb_vector(&B, 0, 24, 8, NULL));
+    /* Block: offset, metaDataLength (padded to 8), bodyLength */
+    u8 blk[24] = {0};
+    memcpy(blk, &batch_offset, 8);
+    memcpy(blk + 8, &batch_meta, 4);
+    memcpy(blk + 16, &body_length, 8);
+    fb_link(&B, fpos_[3], fb_vector(&B, 1, 24, 8, blk));
+    i32 footer_len = B.len;
+    if(fwrite(B.buf, 1, B.len, fid) != B.len
+       || fwrite(&footer_len, 4, 1, fid) != 1
+       || fwrite(ARROW_MAGIC, 1, 6, fid) != 6)
+    {
+        error = 1;
+    }
+    free(B.buf);
+    if(fclose(fid) != 0)
+    {
+        error = 1;
+    }
+    return error ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/* Bounds checked flatbuffer access. Any access outside of the
+ * buffer sets error and returns NULL */
+typedef struct {
+    const u8 * base;
+    size_t len;
+    int error;
+} fb_reader_t;
+
+static u16 rd_u16(const u8 * p) { u16 v; memcpy(&v, p, 2); return v; }
+static u32 rd_u32(const u8 * p) { u32 v; memcpy(&v, p, 4); return v; }
+static i64 rd_i64(const u8 * p) { i64 v; memcpy(&v, p, 8); return v; }
+
+static const u8 * fbr_check(fb_reader_t * R, const u8 * p, size_t n)
+{
+    if(p == NULL || p < R->base || n > R->len
+       || (size_t) (p - R->base) > R->len - n)
+    {
+        R->error = 1;
+        return NULL;
+    }
+    return p;
+}
+
+/* Follow the offset at p */
+static const u8 * fbr_deref(fb_reader_t * R, const u8 * p)
+{
+    if(fbr_check(R, p, 4) == NULL)
+    {
+        return NULL;
+    }
+    return fbr_check(R, p + rd_u32(p), 4);
+}
+
+/* The address of field id of a table, NULL if not present */
+static const u8 * fbr_field(fb_reader_t * R, const u8 * table, int id)
+{
+    if(fbr_check(R, table, 4) == NULL)
+    {
+        return NULL;
+    }
+    const u8 * vt = table - (i32) rd_u32(table);
+    if(fbr_check(R, vt, 4) == NULL)
+    {
+        return NULL;
+    }
+    size_t vsize = rd_u16(vt);
+    if(fbr_check(R, vt, vsize) == NULL || 4 + 2*(size_t) id + 2 > vsize)
+    {
+        return NULL;
+    }
+    u16 off = rd_u16(vt + 4 + 2*id);
+    if(off == 0)
+    {
+        return NULL;
+    }
+    return fbr_check(R, table + off, 1);
+}
+
+static i64 fbr_scalar(fb_reader_t * R, const u8 * table, int id,
+                      int size, i64 def)
+{
+    const u8 * p = fbr_field(R, table, id);
+    if(p == NULL || fbr_check(R, p, size) == NULL)
+    {
+        return def;
+    }
+    switch(size)
+    {
+    case 1:
+        return p[0];
+    case 2:
+        return (int16_t) rd_u16(p);
+    case 4:
+        return (i32) rd_u32(p);
+    }
+    return rd_i64(p);
+}
+
+static const u8 * fbr_table(fb_reader_t * R, const u8 * table, int id)
+{
+    const u8 * p = fbr_field(R, table, id);
+    return p == NULL ? NULL : fbr_deref(R, p);
+}
+
+/* The first element of a vector, NULL if not present */
+static const u8 *
+fbr_vector(fb_reader_t * R, const u8 * table, int id, size_t elem_size, size_t * n)
+{
+    *n = 0;
+    const u8 * v = fbr_table(R, table, id);
+    if(v == NULL)
+    {
+        return NULL;
+    }
+    size_t len = rd_u32(v);
+    if(fbr_check(R, v + 4, len*elem_size) == NULL)
+    {
+        return NULL;
+    }
+    *n = len;
+    return v + 4;
+}
+
+struct ftab_arrow {
+    const u8 * data;
+    size_t size;
+    void * map;
+    size_t ncol;
+    char ** colnames;
+    size_t nbatch;
+    size_t nrow;
+    size_t * batch_nrow;
+    /* nbatch x ncol, pointers into data */
+    const float ** columns;
+    const u8 ** validity;
+    size_t * null_count;
+};
+
+void ftab_arrow_close(ftab_arrow_t * A)
+{
+    if(A == NULL)
+    {
+        return;
+    }
+#ifndef WINDOWS
+    if(A->map != NULL)
+    {
+        munmap(A->map, A->size);
+    } else {
+        free((void *) A->data);
+    }
+#else
+    free((void *) A->data);
+#endif
+    if(A->colnames != NULL)
+    {
+        for(size_t kk = 0; kk < A->ncol; kk++)
+        {
+            free(A->colnames[kk]);
+        }
+        free(A->colnames);
+    }
+    free(A->batch_nrow);
+    free(A->columns);
+    free(A->validity);
+    free(A->null_count);
+    free(A);
+}
+
+static int arrow_parse_schema(ftab_arrow_t * A, fb_reader_t * R, const u8 * schema)
+{
+    if(schema == NULL || fbr_scalar(R, schema, 0, 2, 0) != 0)
+    {
+        fprintf(stderr, "ftab_arrow: missing schema or big endian data\n");
+        return EXIT_FAILURE;
+    }
+    size_t nfields = 0;
+    const u8 * fields = fbr_vector(R, schema, 1, 4, &nfields);
+    if(fields == NULL || nfields == 0)
+    {
+        return EXIT_FAILURE;
+    }
+    A->ncol = nfields;
+    A->colnames = calloc(nfields, sizeof(char*));
+    assert(A->colnames != NULL);
+    for(size_t cc = 0; cc < nfields; cc++)
+    {
+        const u8 * field = fbr_deref(R, fields + 4*cc);
+        const u8 * type = fbr_table(R, field, 3);
+        if(fbr_scalar(R, field, 2, 1, 0) != ARROW_TYPE_FLOATINGPOINT
+           || type == NULL
+           || fbr_scalar(R, type, 0, 2, 0) != ARROW_PRECISION_SINGLE)
+        {
+            fprintf(stderr, "ftab_arrow: column %zu is not float32\n", cc+1);
+            return EXIT_FAILURE;
+        }
+        size_t len = 0;
+        const u8 * name = fbr_vector(R, field, 0, 1, &len);
+        if(name != NULL)
+        {
+            A->colnames[cc] = calloc(len + 1, 1);
+            assert(A->colnames[cc] != NULL);
+            memcpy(A->colnames[cc], name, len);
+        }
+    }
+    return R->error ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/* Parse the record batch message at offset */
+static int
+arrow_parse_batch(ftab_arrow_t * A, size_t batch, i64 offset, i32 meta_len)
+{
+    if(offset < 0 || meta_len < 8 || (u64) offset > A->size
+       || (u64) meta_len > A->size - (u64) offset)
+    {
+        return EXIT_FAILURE;
+    }
+    const u8 * msg = A->data + offset;
+    size_t prefix = 8;
+    size_t fb_len = rd_u32(msg + 4);
+    if(rd_u32(msg) != 0xFFFFFFFF)
+    {
+        /* Pre 0.15 format without continuation marker */
+        prefix = 4;
+        fb_len = rd_u32(msg);
+    }
+    if(prefix + fb_len > (size_t) meta_len)
+    {
+        return EXIT_FAILURE;
+    }
+    fb_reader_t R = {msg + prefix, fb_len, 0};
+    const u8 * message = fbr_deref(&R, R.base);
+    if(fbr_scalar(&R, message, 1, 1, 0) != ARROW_HEADER_RECORDBATCH)
+    {
+        return EXIT_FAILURE;
+    }
+    const u8 * rb = fbr_table(&R, message, 2);
+    i64 body_len = fbr_scalar(&R, message, 3, 8, 0);
+    const u8 * body = A->data + offset + meta_len;
+    if(body_len < 0 || (u64) body_len > A->size - (u64) (offset + meta_len))
+    {
+        return EXIT_FAILURE;
+    }
+    if(fbr_field(&R, rb, 3) != NULL)
+    {
+        fprintf(stderr, "ftab_arrow: compressed record batches are not supported\n");
+        return EXIT_FAILURE;
+    }
+    i64 length = fbr_scalar(&R, rb, 0, 8, 0);
+    size_t nnodes = 0;
+    size_t nbuffers = 0;
+    const u8 * nodes = fbr_vector(&R, rb, 1, 16, &nnodes);
+    const u8 * buffers = fbr_vector(&R, rb, 2, 16, &nbuffers);
+    if(R.error || length < 0 || nnodes != A->ncol || nbuffers != 2*A->ncol)
+    {
+        return EXIT_FAILURE;
+    }
+    A->batch_nrow[batch] = length;
+    A->nrow += length;
+    /* All offsets and lengths are unsigned here, so negative values
+     * from the file become too large and fail the checks */
+    u64 n = length;
+    u64 blen = body_len;
+    for(size_t cc = 0; cc < A->ncol; cc++)
+    {
+        size_t idx = batch*A->ncol + cc;
+        A->null_count[idx] = rd_i64(nodes + 16*cc + 8);
+        u64 voff = rd_i64(buffers + 32*cc);
+        u64 vlen = rd_i64(buffers + 32*cc + 8);
+        u64 doff = rd_i64(buffers + 32*cc + 16);
+        u64 dlen = rd_i64(buffers + 32*cc + 24);
+        if(doff > blen || dlen > blen - doff || n > dlen / sizeof(float)
+           || (size_t) (body + doff - A->data) % sizeof(float) != 0)
+        {
+            return EXIT_FAILURE;
+        }
+        A->columns[idx] = (const float *) (body + doff);
+        if(vlen > 0)
+        {
+            if(voff > blen || vlen > blen - voff || n / 8 + (n % 8 != 0) > vlen)
+            {
+                return EXIT_FAILURE;
+            }
+            A->validity[idx] = body + voff;
+        }
+    }
+    return EXIT_SUCCESS;
+}
+
+ftab_arrow_t * ftab_arrow_open(const char * fname)
+{
+    if(fname == NULL || !is_little_endian())
+    {
+        return NULL;
+    }
+    FILE * fid = fopen(fname, "rb");
+    if(fid == NULL)
+    {
+        fprintf(stderr, "Can not open %s\n", fname);
+        return NULL;
+    }
+    fseek(fid, 0, SEEK_END);
+    long fsize = ftell(fid);
+    fseek(fid, 0, SEEK_SET);
+    if(fsize < 8 + 6 + 4)
+    {
+        fclose(fid);
+        return NULL;
+    }
+
+    ftab_arrow_t * A = calloc(1, sizeof(ftab_arrow_t));
+    assert(A != NULL);
+    A->size = fsize;
+#ifndef WINDOWS
+    void * map = mmap(NULL, A->size, PROT_READ, MAP_PRIVATE, fileno(fid), 0);
+    if(map != MAP_FAILED)
+    {
+        A->map = map;
+        A->data = map;
+    }
+#endif
+    if(A->data == NULL)
+    {
+        u8 * data = malloc(A->size);
+        assert(data != NULL);
+        A->data = data;
+        if(fread(data, 1, A->size, fid) != A->size)
+        {
+            fclose(fid);
+            ftab_arrow_close(A);
+            return NULL;
+        }
+    }
+    fclose(fid);
+
+    const u8 * end = A->data + A->size;
+    if(memcmp(A->data, ARROW_MAGIC, 6) != 0
+       || memcmp(end - 6, ARROW_MAGIC, 6) != 0)
+    {
+        fprintf(stderr, "ftab_arrow: %s is not an Arrow IPC file\n", fname);
+        ftab_arrow_close(A);
+        return NULL;
+    }
+    i32 footer_len = rd_u32(end - 10);
+    if(footer_len <= 0 || (size_t) footer_len > A->size - 18)
+    {
+        ftab_arrow_close(A);
+        return NULL;
+    }
+    fb_reader_t R = {end - 10 - footer_len, footer_len, 0};
+    const u8 * footer = fbr_deref(&R, R.base);
+    if(arrow_parse_schema(A, &R, fbr_table(&R, footer, 1)))
+    {
+        ftab_arrow_close(A);
+        return NULL;
+    }
+
+    const u8 * blocks = fbr_vector(&R, footer, 3, 24, &A->nbatch);
+    A->batch_nrow = calloc(A->nbatch + 1, sizeof(size_t));
+    A->columns = calloc(A->nbatch*A->ncol + 1, sizeof(float*));
+    A->validity = calloc(A->nbatch*A->ncol + 1, sizeof(u8*));
+    A->null_count = calloc(A->nbatch*A->ncol + 1, sizeof(size_t));
+    assert(A->batch_nrow != NULL && A->columns != NULL);
+    assert(A->validity != NULL && A->null_count != NULL);
+    for(size_t bb = 0; bb < A->nbatch; bb++)
+    {
+        const u8 * blk = blocks + 24*bb;
+        if(arrow_parse_batch(A, bb, rd_i64(blk), (i32) rd_u32(blk + 8)))
+        {
+            fprintf(stderr, "ftab_arrow: invalid record batch %zu\n", bb);
+            ftab_arrow_close(A);
+            return NULL;
+        }
+    }
+    return A;
+}
+
+size_t ftab_arrow_nrow(const ftab_arrow_t * A)
+{
+    return A->nrow;
+}
+
+size_t ftab_arrow_ncol(const ftab_arrow_t * A)
+{
+    return A->ncol;
+}
+
+size_t ftab_arrow_nbatch(const ftab_arrow_t * A)
+{
+    return A->nbatch;
+}
+
+const char * ftab_arrow_colname(const ftab_arrow_t * A, size_t col)
+{
+    return col < A->ncol ? A->colnames[col] : NULL;
+}
+
+const float *
+ftab_arrow_column(const ftab_arrow_t * A, size_t batch, size_t col, size_t * nrow)
+{
+    if(batch >= A->nbatch || col >= A->ncol)
+    {
+        return NULL;
+    }
+    size_t idx = batch*A->ncol + col;
+    if(A->validity[idx] != NULL && A->null_count[idx] > 0)
+    {
+        return NULL;
+    }
+    if(nrow != NULL)
+    {
+        *nrow = A->batch_nrow[batch];
+    }
+    return A->columns[idx];
+}
+
+ftab_t * ftab_from_arrow(const char * fname)
+{
+    ftab_arrow_t * A = ftab_arrow_open(fname);
+    if(A == NULL)
+    {
+        return NULL;
+    }
+    ftab_t * T = calloc(1, sizeof(ftab_t));
+    assert(T != NULL);
+    T->ncol = A->ncol;
+    T->nrow = A->nrow;
+    T->nrow_alloc = A->nrow > 0 ? A->nrow : 1;
+    T->T = malloc(T->nrow_alloc*T->ncol*sizeof(float));
+    assert(T->T != NULL);
+    size_t r0 = 0;
+    for(size_t bb = 0; bb < A->nbatch; bb++)
+    {
+        size_t n = A->batch_nrow[bb];
+        for(size_t cc = 0; cc < A->ncol; cc++)
+        {
+            const float * C = A->columns[bb*A->ncol + cc];
+            const u8 * V = A->validity[bb*A->ncol + cc];
+            float * dst = T->T + r0*T->ncol + cc;
+            for(size_t kk = 0; kk < n; kk++)
+            {
+                dst[kk*T->ncol] = C[kk];
+            }
+            if(V != NULL && A->null_count[bb*A->ncol + cc] > 0)
+            {
+                /* Both use 1 for valid */
+                u8 * valid = valid_col(T, cc);
+                for(size_t kk = 0; kk < n; kk++)
+                {
+                    if(!bit_get(V, kk))
+                    {
+                        dst[kk*T->ncol] = NAN;
+                        bit_clear(valid, r0 + kk);
+                    }
+                }
+            }
+        }
+        r0 += n;
+    }
+    for(size_t cc = 0; cc < A->ncol; cc++)
+    {
+        if(A->colnames[cc] != NULL)
+        {
+            ftab_set_colname(T, cc, A->colnames[cc]);
+        }
+    }
+    ftab_arrow_close(A);
+    return T;
+}
+
+typedef struct{
+    float value;
+    size_t idx;
+} ftab_sort_pair;
+
+int ftab_sort_pair_cmp(const void * _A, const void * _B)
+{
+    ftab_sort_pair * A = (ftab_sort_pair*) _A;
+    ftab_sort_pair * B = (ftab_sort_pair*) _B;
+
+    //printf("idx: %zu, value: %f\n", A->idx, A->value);
+    //printf("idx: %zu, value: %f\n", B->idx, B->value);
+    //exit(1);
+    float fa = A->value;
+    float fb = B->value;
+    /* Descending with NAN last, a total order also with NAN */
+    int na = isnan(fa) != 0;
+    int nb = isnan(fb) != 0;
+    if(na || nb)
+    {
+        return na - nb;
+    }
+    if(fa == fb)
+    {
+        return 0;
+    }
+    if(fa < fb)
+    {
+        return 1;
+    }
+    return -1;
+}
+
+typedef struct {
+    const ftab_t * T;
+    int col;
+    ftab_sort_pair * P;
+    ftab_sort_pair * tmp;
+    size_t * run; /* Boundaries of the sorted runs */
+    size_t nrun;
+    float * T2;
+} ftab_sort_job_t;
+
+/* Extract and sort one run */
+static void sort_run_worker(void * _J, int thread, int nthreads)
+{
+    ftab_sort_job_t * J = _J;
+    const ftab_t * T = J->T;
+    size_t first, last;
+    thread_range(T->nrow, thread, nthreads, &first, &last);
+    for(size_t kk = first; kk < last; kk++)
+    {
+        J->P[kk].idx = kk;
+        J->P[kk].value = T->T[kk*T->ncol + J->col];
+    }
+    qsort(J->P + first, last - first,
+          sizeof(ftab_sort_pair),
+          ftab_sort_pair_cmp);
+}
+
+/* Merge runs 2*pair and 2*pair+1 into tmp */
+static void sort_merge_worker(void * _J, int pair, int npairs)
+{
+    (void) npairs;
+    ftab_sort_job_t * J = _J;
+    size_t a = J->run[2*pair];
+    size_t am = J->run[2*pair + 1];
+    size_t b = am;
+    size_t bm = (size_t) 2*pair + 2 <= J->nrun ? J->run[2*pair + 2] : am;
+    size_t out = a;
+    while(a < am && b < bm)
+    {
+        if(ftab_sort_pair_cmp(J->P + b, J->P + a) < 0)
+        {
+            J->tmp[out++] = J->P[b++];
+        } else {
+            J->tmp[out++] = J->P[a++];
+        }
+    }
+    memcpy(J->tmp + out, J->P + a, (am - a)*sizeof(ftab_sort_pair));
+    out += am - a;
+    memcpy(J->tmp + out, J->P + b, (bm - b)*sizeof(ftab_sort_pair));
+}
+
+/* Move the rows to their sorted positions */
+static void sort_gather_worker(void * _J, int thread, int nthreads)
+{
+    ftab_sort_job_t * J = _J;
+    const ftab_t * T = J->T;
+    size_t first, last;
+    thread_range(T->nrow, thread, nthreads, &first, &last);
+    for(size_t kk = first; kk < last; kk++)
+    {
+        memcpy(J->T2 + kk*T->ncol,
+               T->T + J->P[kk].idx*T->ncol,
+               sizeof(float)*T->ncol);
+    }
+}
+
+/* Reorder the rows, row kk of the result is row idx[kk] */
+static void valid_gather(ftab_t * T, const ftab_sort_pair * idx)
+{
+    if(T->valid == NULL)
+    {
+        return;
+    }
+    for(size_t cc = 0; cc < T->ncol; cc++)
+    {
+        u8 * B = T->valid->bits[cc];
+        if(B == NULL)
+        {
+            continue;
+        }
+        u8 * B2 = calloc(T->valid->cap/8 + 1, 1);
+        assert(B2 != NULL);
+        for(size_t kk = 0; kk < T->nrow; kk++)
+        {
+            if(bit_get(B, idx[kk].idx))
+            {
+                bit_set(B2, kk);
+            }
+        }
+        free(B);
+        T->valid->bits[cc] = B2;
+    }
+}
+
+void ftab_sort(ftab_t * T, int col)
+{
+    if(col == -1)
+    {
+        fprintf(stderr, "ftab_sort: Can't use column %d for sorting\n", col);
+        exit(EXIT_FAILURE);
+    }
+    ftab_sort_job_t J = {0};
+    J.T = T;
+    J.col = col;
+    J.P = calloc(T->nrow + 1, sizeof(ftab_sort_pair));
+    assert(J.P != NULL);
+
+    /* Sort runs in parallel, then merge them pairwise */
+    int nthreads = nthreads_for(T->nrow, 1 << 16);
+    run_parallel(nthreads, sort_run_worker, &J);
+    if(nthreads > 1)
+    {
+        J.tmp = calloc(T->nrow + 1, sizeof(ftab_sort_pair));
+        J.run = calloc(nthreads + 1, sizeof(size_t));
+        assert(J.tmp != NULL && J.run != NULL);
+        J.nrun = nthreads;
+        for(int kk = 0; kk <= nthreads; kk++)
+        {
+            size_t last;
+            thread_range(T->nrow, kk, nthreads, J.run + kk, &last);
+        }
+        while(J.nrun > 1)
+        {
+            int npairs = (J.nrun + 1) / 2;
+            run_parallel(npairs, sort_merge_worker, &J);
+            ftab_sort_pair * swap = J.P;
+            J.P = J.tmp;
+            J.tmp = swap;
+            for(int kk = 0; kk < npairs; kk++)
+            {
+                J.run[kk] = J.run[2*kk];
+            }
+            J.run[npairs] = T->nrow;
+            J.nrun = npairs;
+        }
+        free(J.tmp);
+        free(J.run);
+    }
+
+    J.T2 = calloc(T->ncol*T->nrow_alloc, sizeof(float));
+    assert(J.T2 != NULL);
+    run_parallel(nthreads_for(T->nrow*T->ncol, 1 << 18), sort_gather_worker, &J);
+    valid_gather(T, J.P);
+    free(J.P);
+    free_data(T);
+    T->T = J.T2;
+    return;
+}
+
+/*                             TOP-K
+ *                             =====
+ *
+ * Each thread keeps a heap with the k best rows seen so far, the
+ * worst of them at the root. The heaps are merged in the end.
+ */
+
+typedef struct {
+    size_t k;
+    int descending;
+} ftab_topk_order_t;
+
+/* Returns 1 if A should come before B. NAN are placed last and ties
+ * are resolved by row index so that the result is deterministic. */
+static int topk_before(const ftab_topk_order_t * O,
+                       const ftab_sort_pair * A,
+                       const ftab_sort_pair * B)
+{
+    int nan_a = isnan(A->value);
+    int nan_b = isnan(B->value);
+    if(nan_a || nan_b)
+    {
+        if(nan_a && nan_b)
+        {
+            return A->idx < B->idx;
+        }
+        return nan_b;
+    }
+    if(A->value == B->value)
+    {
+        return A->idx < B->idx;
+    }
+    if(O->descending)
+    {
+        return A->value > B->value;
+    }
+    return A->value < B->value;
+}
+
+/* Restore the heap property from position pos and down */
+static void topk_sift_down(const ftab_topk_order_t * O,
+                           ftab_sort_pair * H, size_t n, size_t pos)
+{
+    while(1)
+    {
+        size_t worst = pos;
+        size_t left = 2*pos + 1;
+        size_t right = left + 1;
+        if(left < n && topk_before(O, H + worst, H + left))
+        {
+            worst = left;
+        }
+        if(right < n && topk_before(O, H + worst, H + right))
+        {
+            worst = right;
+        }
+        if(worst == pos)
+        {
+            return;
+        }
+        ftab_sort_pair tmp = H[pos];
+        H[pos] = H[worst];
+        H[worst] = tmp;
+        pos = worst;
+    }
+}
+
+/* Offer P to the heap H of size *n and capacity O->k */
+static void topk_push(const ftab_topk_order_t * O,
+                      ftab_sort_pair * H, size_t * n,
+                      const ftab_sort_pair * P)
+{
+    if(*n < O->k)
+    {
+        /* Sift up */
+        size_t pos = (*n)++;
+        H[pos] = *P;
+        while(pos > 0)
+        {
+            size_t parent = (pos-1)/2;
+            if(!topk_before(O, H + parent, H + pos))
+            {
+                break;
+            }
+            ftab_sort_pair tmp = H[pos];
+            H[pos] = H[parent];
+            H[parent] = tmp;
+            pos = parent;
+        }
+        return;
+    }
+    if(topk_before(O, P, H))
+    {
+        H[0] = *P;
+        topk_sift_down(O, H, *n, 0);
+    }
+}
+
+typedef struct {
+    const ftab_t * T;
+    int col;
+    ftab_topk_order_t order;
+    ftab_sort_pair * heaps;
+    size_t * start; /* The heap of task tt starts at heaps[start[tt]] */
+    size_t * heap_size;
+} ftab_topk_job_t;
+
+static void topk_worker(void * _J, int thread, int nthreads)
+{
+    ftab_topk_job_t * J = _J;
+    const ftab_t * T = J->T;
+    size_t first = 0;
+    size_t last = 0;
+    thread_range(T->nrow, thread, nthreads, &first, &last);
+    ftab_sort_pair * H = J->heaps + J->start[thread];
+    size_t n = 0;
+    const float * V = T->T + J->col;
+    for(size_t kk = first; kk < last; kk++)
+    {
+        ftab_sort_pair P = {V[kk*T->ncol], kk};
+        topk_push(&J->order, H, &n, &P);
+    }
+    J->heap_size[thread] = n;
+}
+
+ftab_t * ftab_topk(const ftab_t * T, int col, size_t k, int descending)
+{
+    if(T == NULL || col < 0 || (size_t) col >= T->ncol)
+    {
+        fprintf(stderr, "ftab_topk: Can't use column %d\n", col);
+        return NULL;
+    }
+    if(k > T->nrow)
+    {
+        k = T->nrow;
+    }
+
+    ftab_topk_job_t J = {0};
+    J.T = T;
+    J.col = col;
+    J.order.k = k;
+    J.order.descending = descending;
+    int nthreads = nthreads_for(T->nrow, 1 << 16);
+    /* A heap never holds more than the rows of its task, so all of
+     * them together at most T->nrow. The merged heap has k more. */
+    J.start = malloc((nthreads + 1)*sizeof(size_t));
+    J.heap_size = calloc(nthreads, sizeof(size_t));
+    assert(J.start != NULL);
+    assert(J.heap_size != NULL);
+    J.start[0] = 0;
+    for(int tt = 0; tt < nthreads; tt++)
+    {
+        size_t first, last;
+        thread_range(T->nrow, tt, nthreads, &first, &last);
+        J.start[tt+1] = J.start[tt] + (k < last - first ? k : last - first);
+    }
+    size_t total = J.start[nthreads] + (nthreads > 1 ? k : 0);
+    J.heaps = malloc((total + 1)*sizeof(ftab_sort_pair));
+    if(J.heaps == NULL)
+    {
+        fprintf(stderr, "ftab_topk: out of memory\n");
+        free(J.start);
+        free(J.heap_size);
+        return NULL;
+    }
+    if(k > 0)
+    {
+        run_parallel(nthreads, topk_worker, &J);
+    }
+
+    /* Merge into a heap after the others */
+    ftab_sort_pair * H = J.heaps;
+    size_t n = J.heap_size[0];
+    if(nthreads > 1)
+    {
+        H = J.heaps + J.start[nthreads];
+        n = 0;
+        for(int tt = 0; tt < nthreads; tt++)
+        {
+            for(size_t kk = 0; kk < J.heap_size[tt]; kk++)
+            {
+                topk_push(&J.order, H, &n, J.heaps + J.start[tt] + kk);
+            }
+        }
+    }
+
+    /* Heap sort, the worst element is moved to the end first */
+    for(size_t kk = n; kk > 1; kk--)
+    {
+        ftab_sort_pair tmp = H[0];
+        H[0] = H[kk-1];
+        H[kk-1] = tmp;
+        topk_sift_down(&J.order, H, kk-1, 0);
+    }
+
+    ftab_t * R = calloc(1, sizeof(ftab_t));
+    assert(R != NULL);
+    R->ncol = T->ncol;
+    R->nrow = n;
+    R->nrow_alloc = n > 0 ? n : 1;
+    R->T = calloc(R->nrow_alloc*R->ncol, sizeof(float));
+    assert(R->T != NULL);
+    for(size_t kk = 0; kk < n; kk++)
+    {
+        memcpy(R->T + kk*R->ncol,
+               T->T + H[kk].idx*T->ncol,
+               T->ncol*sizeof(float));
+    }
+    if(T->colnames != NULL)
+    {
+        for(size_t kk = 0; kk < T->ncol; kk++)
+        {
+            if(T->colnames[kk] != NULL)
+            {
+                ftab_set_colname(R, kk, T->colnames[kk]);
+            }
+        }
+    }
+    free(J.heaps);
+    free(J.start);
+    free(J.heap_size);
+    return R;
+}
+
+/*                        MERGE OF SORTED TABLES
+ *                        ======================
+ *
+ * k-way merge with a loser tree: the root holds the run with the next
+ * row and each internal node the loser of the match played there, so
+ * advancing the winner costs one comparison per level, log2(k). For
+ * large outputs the key range is split into partitions by sampled
+ * splitter values, each run is cut at the splitters by binary search
+ * and the partitions are merged in parallel straight into their part
+ * of the output.
+ */
+
+typedef struct {
+    const ftab_t ** tables;
+    size_t n;
+    int col;
+    int descending;
+    size_t * cut; /* (npart+1)*n, where each run is cut */
+    ftab_t * R;
+} ftab_merge_job_t;
+
+/* Returns 1 if a comes strictly before b. NAN are placed last. */
+static inline int merge_before(float a, float b, int descending)
+{
+    if(isnan(a))
+    {
+        return 0;
+    }
+    if(isnan(b))
+    {
+        return 1;
+    }
+    return descending ? a > b : a < b;
+}
+
+static inline float merge_key(const ftab_t * T, size_t row, int col)
+{
+    return T->T[row*T->ncol + col];
+}
+
+/* First row of T that does not come before value */
+static size_t merge_lower_bound(const ftab_t * T, int col, float value,
+                                int descending)
+{
+    size_t lo = 0;
+    size_t hi = T->nrow;
+    while(lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        if(merge_before(merge_key(T, mid, col), value, descending))
+        {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+static int merge_descending_cmp(const void * _A, const void * _B)
+{
+    float a = *(const float *) _A;
+    float b = *(const float *) _B;
+    return merge_before(a, b, 1) ? -1 : merge_before(b, a, 1);
+}
+
+static int merge_ascending_cmp(const void * _A, const void * _B)
+{
+    float a = *(const float *) _A;
+    float b = *(const float *) _B;
+    return merge_before(a, b, 0) ? -1 : merge_before(b, a, 0);
+}
+
+typedef struct {
+    const ftab_merge_job_t * J;
+    const size_t * end;
+    size_t * pos;
+    float * key; /* Key of the head of each run */
+} ftab_loser_tree_t;
+
+/* Returns 1 if the head of run a comes before the head of run b.
+ * Exhausted runs lose and ties go to the lower run index, so the
+ * merge is stable. */
+static inline int lt_before(const ftab_loser_tree_t * L, size_t a, size_t b)
+{
+    if(L->pos[a] == L->end[a])
+    {
+        return 0;
+    }
+    if(L->pos[b] == L->end[b])
+    {
+        return 1;
+    }
+    float va = L->key[a];
+    float vb = L->key[b];
+    int descending = L->J->descending;
+    if(merge_before(va, vb, descending))
+    {
+        return 1;
+    }
+    if(merge_before(vb, va, descending))
+    {
+        return 0;
+    }
+    return a < b;
+}
+
+static void merge_worker(void * _J, int part, int npart)
+{
+    (void) npart;
+    ftab_merge_job_t * J = _J;
+    size_t k = J->n;
+    const size_t * first = J->cut + part*k;
+    size_t out = 0;
+    for(size_t ii = 0; ii < k; ii++)
+    {
+        out += first[ii];
+    }
+
+    ftab_loser_tree_t L;
+    L.J = J;
+    L.end = J->cut + (part + 1)*k;
+    L.pos = malloc(k*sizeof(size_t));
+    L.key = malloc(k*sizeof(float));
+    size_t * tree = malloc(k*sizeof(size_t)); /* Losers, winner at 0 */
+    size_t * win = malloc(2*k*sizeof(size_t));
+    assert(L.pos != NULL && L.key != NULL && tree != NULL && win != NULL);
+    memcpy(L.pos, first, k*sizeof(size_t));
+    for(size_t ii = 0; ii < k; ii++)
+    {
+        L.key[ii] = L.pos[ii] < L.end[ii]
+            ? merge_key(J->tables[ii], L.pos[ii], J->col) : 0;
+    }
+
+    /* Leaf ii is node k+ii, node nn has the children 2nn and 2nn+1 */
+    for(size_t ii = 0; ii < k; ii++)
+    {
+        win[k + ii] = ii;
+    }
+    for(size_t nn = k - 1; nn >= 1; nn--)
+    {
+        size_t a = win[2*nn];
+        size_t b = win[2*nn + 1];
+        int a_wins = lt_before(&L, a, b);
+        win[nn] = a_wins ? a : b;
+        tree[nn] = a_wins ? b : a;
+    }
+    tree[0] = k > 1 ? win[1] : 0;
+    free(win);
+
+    const size_t ncol = J->R->ncol;
+    float * R = J->R->T;
+    while(1)
+    {
+        size_t w = tree[0];
+        if(L.pos[w] == L.end[w])
+        {
+            break; /* All runs exhausted */
+        }
+        memcpy(R + out*ncol,
+               J->tables[w]->T + L.pos[w]*ncol,
+               ncol*sizeof(float));
+        out++;
+        L.pos[w]++;
+        if(L.pos[w] < L.end[w])
+        {
+            L.key[w] = merge_key(J->tables[w], L.pos[w], J->col);
+        }
+        for(size_t nn = (k + w) / 2; nn >= 1; nn /= 2)
+        {
+            if(lt_before(&L, tree[nn], w))
+            {
+                size_t tmp = tree[nn];
+                tree[nn] = w;
+                w = tmp;
+            }
+        }
+        tree[0] = w;
+    }
+    free(tree);
+    free(L.key);
+    free(L.pos);
+}
+
+/* Split all runs at npart-1 sampled key values */
+static void merge_cut(ftab_merge_job_t * J, size_t nrow, int npart)
+{
+    size_t k = J->n;
+    for(size_t ii = 0; ii < k; ii++)
+    {
+        J->cut[ii] = 0;
+        J->cut[npart*k + ii] = J->tables[ii]->nrow;
+    }
+    if(npart == 1)
+    {
+        return;
+    }
+
+    size_t step = nrow / (64*(size_t) npart);
+    step = step < 1 ? 1 : step;
+    size_t nsample = 0;
+    for(size_t ii = 0; ii < k; ii++)
+    {
+        nsample += (J->tables[ii]->nrow + step - 1) / step;
+    }
+    float * S = malloc((nsample + 1)*sizeof(float));
+    assert(S != NULL);
+    size_t ns = 0;
+    for(size_t ii = 0; ii < k; ii++)
+    {
+        for(size_t rr = 0; rr < J->tables[ii]->nrow; rr += step)
+        {
+            S[ns++] = merge_key(J->tables[ii], rr, J->col);
+        }
+    }
+    qsort(S, ns, sizeof(float),
+          J->descending ? merge_descending_cmp : merge_ascending_cmp);
+
+    for(int pp = 1; pp < npart; pp++)
+    {
+        float split = S[ns*pp/npart];
+        for(size_t ii = 0; ii < k; ii++)
+        {
+            size_t c = merge_lower_bound(J->tables[ii], J->col, split,
+                                         J->descending);
+            /* Only decreasing if the input was not sorted */
+            size_t prev = J->cut[(pp-1)*k + ii];
+            J->cut[pp*k + ii] = c < prev ? prev : c;
+        }
+    }
+    free(S);
+}
+
+ftab_t * ftab_merge_sorted(const ftab_t ** tables, size_t n, int col,
+                           int descending)
+{
+    if(tables == NULL || n == 0)
+    {
+        return NULL;
+    }
+    size_t nrow = 0;
+    for(size_t ii = 0; ii < n; ii++)
+    {
+        if(tables[ii] == NULL || tables[ii]->ncol != tables[0]->ncol)
+        {
+            fprintf(stderr, "ftab_merge_sorted: the tables don't have the same columns\n");
+            return NULL;
+        }
+        nrow += tables[ii]->nrow;
+    }
+    if(col < 0 || (size_t) col >= tables[0]->ncol)
+    {
+        fprintf(stderr, "ftab_merge_sorted: invalid column %d\n", col);
+        return NULL;
+    }
+
+    ftab_t * R = calloc(1, sizeof(ftab_t));
+    assert(R != NULL);
+    R->ncol = tables[0]->ncol;
+    R->nrow = nrow;
+    R->nrow_alloc = nrow > 0 ? nrow : 1;
+    R->T = malloc(R->nrow_alloc*R->ncol*sizeof(float));
+    if(R->T == NULL)
+    {
+        free(R);
+        return NULL;
+    }
+    for(size_t ii = 0; ii < n && R->colnames == NULL; ii++)
+    {
+        for(size_t cc = 0; tables[ii]->colnames != NULL && cc < R->ncol; cc++)
+        {
+            if(tables[ii]->colnames[cc] != NULL)
+            {
+                ftab_set_colname(R, cc, tables[ii]->colnames[cc]);
+            }
+        }
+    }
+
+    ftab_merge_job_t J = {0};
+    J.tables = tables;
+    J.n = n;
+    J.col = col;
+    J.descending = descending;
+    J.R = R;
+    int npart = nthreads_for(nrow, 1 << 16);
+    J.cut = malloc((npart + 1)*n*sizeof(size_t));
+    assert(J.cut != NULL);
+    merge_cut(&J, nrow, npart);
+    run_parallel(npart, merge_worker, &J);
+    free(J.cut);
+    return R;
+}
+
+/*                          PARTITIONING
+ *                          ============
+ *
+ * A hash table maps the distinct keys to partitions, in ascending key
+ * order, which gives the size of each partition. The rows are then
+ * scattered in parallel: each task counts its rows per partition,
+ * which gives it an exclusive output range in every partition, and
+ * copies them in order. The partitions are contiguous ranges of one
+ * table, so the sub-tables are just views.
+ */
+
+struct ftab_partition {
+    ftab_t * T; /* All rows, grouped by key */
+    size_t nkeys;
+    float * keys;
+    size_t * offsets; /* nkeys + 1 */
+    ftab_t * views; /* nkeys, pointing into T */
+};
+
+typedef struct {
+    const ftab_t * T;
+    ftab_t * R;
+    const u32 * id; /* Partition of each row */
+    size_t nkeys;
+    size_t * pos; /* nkeys per task, first output row */
+    size_t * dest; /* Output row of each input row, if needed */
+} ftab_partition_job_t;
+
+static u32 part_key_bits(float key)
+{
+    if(isnan(key))
+    {
+        key = NAN; /* All NAN in one partition */
+    }
+    if(key == 0)
+    {
+        key = 0; /* and -0 with 0 */
+    }
+    u32 bits;
+    memcpy(&bits, &key, sizeof(u32));
+    return bits;
+}
+
+static int part_key_cmp(const void * _A, const void * _B)
+{
+    float a = *(const float *) _A;
+    float b = *(const float *) _B;
+    if(isnan(a) || isnan(b))
+    {
+        return isnan(a) - isnan(b);
+    }
+    return (a > b) - (a < b);
+}
+
+static void part_count_worker(void * _J, int thread, int nthreads)
+{
+    ftab_partition_job_t * J = _J;
+    size_t first, last;
+    thread_range(J->T->nrow, thread, nthreads, &first, &last);
+    size_t * pos = J->pos + thread*J->nkeys;
+    for(size_t kk = first; kk < last; kk++)
+    {
+        pos[J->id[kk]]++;
+    }
+}
+
+static void part_scatter_worker(void * _J, int thread, int nthreads)
+{
+    ftab_partition_job_t * J = _J;
+    const size_t ncol = J->T->ncol;
+    size_t first, last;
+    thread_range(J->T->nrow, thread, nthreads, &first, &last);
+    size_t * pos = J->pos + thread*J->nkeys;
+    for(size_t kk = first; kk < last; kk++)
+    {
+        size_t out = pos[J->id[kk]]++;
+        memcpy(J->R->T + out*ncol, J->T->T + kk*ncol, ncol*sizeof(float));
+        if(J->dest != NULL)
+        {
+            J->dest[kk] = out;
+        }
+    }
+}
+
+/* Assign a partition, in ascending key order, to each row. Returns
+ * the number of partitions */
+static size_t part_ids(const ftab_t * T, int col, u32 * id, float ** _keys)
+{
+    size_t cap = 64;
+    u32 * hkey = malloc(cap*sizeof(u32));
+    u32 * hval = malloc(cap*sizeof(u32));
+    float * keys = malloc(cap/2*sizeof(float));
+    assert(hkey != NULL && hval != NULL && keys != NULL);
+    memset(hval, 0xff, cap*sizeof(u32));
+    size_t nkeys = 0;
+    for(size_t kk = 0; kk < T->nrow; kk++)
+    {
+        float key = T->T[kk*T->ncol + col];
+        u32 bits = part_key_bits(key);
+        size_t h = hash_mix(bits) & (cap - 1);
+        while(hval[h] != UINT32_MAX && hkey[h] != bits)
+        {
+            h = (h + 1) & (cap - 1);
+        }
+        if(hval[h] == UINT32_MAX)
+        {
+            hkey[h] = bits;
+            hval[h] = nkeys;
+            memcpy(keys + nkeys, &bits, sizeof(float));
+            nkeys++;
+            if(2*nkeys == cap)
+            {
+                /* Keep the load below 1/2 */
+                size_t cap2 = 2*cap;
+                u32 * hkey2 = malloc(cap2*sizeof(u32));
+                u32 * hval2 = malloc(cap2*sizeof(u32));
+                keys = realloc(keys, cap2/2*sizeof(float));
+                assert(hkey2 != NULL && hval2 != NULL && keys != NULL);
+                memset(hval2, 0xff, cap2*sizeof(u32));
+                for(size_t ii = 0; ii < cap; ii++)
+                {
+                    if(hval[ii] == UINT32_MAX)
+                    {
+                        continue;
+                    }
+                    size_t h2 = hash_mix(hkey[ii]) & (cap2 - 1);
+                    while(hval2[h2] != UINT32_MAX)
+                    {
+                        h2 = (h2 + 1) & (cap2 - 1);
+                    }
+                    hkey2[h2] = hkey[ii];
+                    hval2[h2] = hval[ii];
+                }
+                free(hkey);
+                free(hval);
+                hkey = hkey2;
+                hval = hval2;
+                cap = cap2;
+            }
+            id[kk] = nkeys - 1;
+        } else {
+            id[kk] = hval[h];
+        }
+    }
+    free(hkey);
+    free(hval);
+
+    /* Renumber in key order */
+    float * sorted = malloc((nkeys + 1)*sizeof(float));
+    u32 * rank = malloc((nkeys + 1)*sizeof(u32));
+    assert(sorted != NULL && rank != NULL);
+    memcpy(sorted, keys, nkeys*sizeof(float));
+    qsort(sorted, nkeys, sizeof(float), part_key_cmp);
+    for(size_t kk = 0; kk < nkeys; kk++)
+    {
+        float * found = bsearch(keys + kk, sorted, nkeys, sizeof(float), part_key_cmp);
+        assert(found != NULL);
+        rank[kk] = found - sorted;
+    }
+    for(size_t kk = 0; kk < T->nrow; kk++)
+    {
+        id[kk] = rank[id[kk]];
+    }
+    free(rank);
+    free(keys);
+    *_keys = sorted;
+    return nkeys;
+}
+
+ftab_partition_t * ftab_partition(const ftab_t * T, int col)
+{
+    if(!ftab_has_data(T) || col < 0 || (size_t) col >= T->ncol)
+    {
+        fprintf(stderr, "ftab_partition: invalid table or column\n");
+        return NULL;
+    }
+    if(T->nrow >= UINT32_MAX)
+    {
+        fprintf(stderr, "ftab_partition: too many rows\n");
+        return NULL;
+    }
+
+    ftab_partition_t * P = calloc(1, sizeof(ftab_partition_t));
+    assert(P != NULL);
+    u32 * id = malloc((T->nrow + 1)*sizeof(u32));
+    assert(id != NULL);
+    P->nkeys = part_ids(T, col, id, &P->keys);
+
+    ftab_t * R = calloc(1, sizeof(ftab_t));
+    assert(R != NULL);
+    R->ncol = T->ncol;
+    R->nrow = T->nrow;
+    R->nrow_alloc = T->nrow > 0 ? T->nrow : 1;
+    R->T = malloc(R->nrow_alloc*R->ncol*sizeof(float));
+    assert(R->T != NULL);
+    for(size_t cc = 0; T->colnames != NULL && cc < T->ncol; cc++)
+    {
+        if(T->colnames[cc] != NULL)
+        {
+            ftab_set_colname(R, cc, T->colnames[cc]);
+        }
+    }
+    P->T = R;
+
+    /* Per task histograms, then the output position of each (key,
+     * task) in key major order */
+    int nthreads = nthreads_for(T->nrow*T->ncol, 1 << 18);
+    ftab_partition_job_t J = {0};
+    J.T = T;
+    J.R = R;
+    J.id = id;
+    J.nkeys = P->nkeys;
+    J.pos = calloc(nthreads*P->nkeys + 1, sizeof(size_t));
+    assert(J.pos != NULL);
+    if(T->valid != NULL)
+    {
+        J.dest = malloc(T->nrow*sizeof(size_t));
+        assert(J.dest != NULL);
+    }
+    run_parallel(nthreads, part_count_worker, &J);
+    P->offsets = malloc((P->nkeys + 1)*sizeof(size_t));
+    assert(P->offsets != NULL);
+    size_t sum = 0;
+    for(size_t kk = 0; kk < P->nkeys; kk++)
+    {
+        P->offsets[kk] = sum;
+        for(int tt = 0; tt < nthreads; tt++)
+        {
+            size_t n = J.pos[tt*P->nkeys + kk];
+            J.pos[tt*P->nkeys + kk] = sum;
+            sum += n;
+        }
+    }
+    P->offsets[P->nkeys] = sum;
+    run_parallel(nthreads, part_scatter_worker, &J);
+    free(J.pos);
+    free(id);
+
+    /* Missing values */
+    for(size_t cc = 0; J.dest != NULL && cc < T->ncol; cc++)
+    {
+        if(T->valid->bits[cc] == NULL)
+        {
+            continue;
+        }
+        u8 * B = valid_col(R, cc);
+        for(size_t rr = 0; rr < T->nrow; rr++)
+        {
+            if(!bit_get(T->valid->bits[cc], rr))
+            {
+                bit_clear(B, J.dest[rr]);
+            }
+        }
+    }
+    free(J.dest);
+
+    /* The views share the data and the column names of R */
+    P->views = calloc(P->nkeys + 1, sizeof(ftab_t));
+    assert(P->views != NULL);
+    for(size_t kk = 0; kk < P->nkeys; kk++)
+    {
+        ftab_t * V = P->views + kk;
+        V->ncol = R->ncol;
+        V->nrow = P->offsets[kk+1] - P->offsets[kk];
+        V->nrow_alloc = V->nrow;
+        V->T = R->T + P->offsets[kk]*R->ncol;
+        V->colnames = R->colnames;
+        for(size_t cc = 0; cc < R->ncol; cc++)
+        {
+            valid_copy(V, 0, cc, R, P->offsets[kk], cc, V->nrow);
+        }
+    }
+    return P;
+}
+
+void ftab_partition_free(ftab_partition_t * P)
+{
+    if(P == NULL)
+    {
+        return;
+    }
+    for(size_t kk = 0; kk < P->nkeys; kk++)
+    {
+        valid_free(P->views + kk);
+    }
+    free(P->views);
+    ftab_free(P->T);
+    free(P->keys);
+    free(P->offsets);
+    free(P);
+}
+
+size_t ftab_partition_count(const ftab_partition_t * P)
+{
+    return P->nkeys;
+}
+
+float ftab_partition_key(const ftab_partition_t * P, size_t k)
+{
+    return P->keys[k];
+}
+
+const ftab_t * ftab_partition_table(const ftab_partition_t * P, size_t k)
+{
+    return P->views + k;
+}
+
+const ftab_t * ftab_partition_grouped(const ftab_partition_t * P)
+{
+    return P->T;
+}
+
+const size_t * ftab_partition_offsets(const ftab_partition_t * P)
+{
+    return P->offsets;
+}
+
+/* Check that pattern has exactly one floating point conversion, e.g.,
+ * "cell_%.0f.tsv" */
+static int part_check_pattern(const char * pattern)
+{
+    int nconv = 0;
+    for(const char * p = pattern; *p != '\0'; p++)
+    {
+        if(*p != '%')
+        {
+            continue;
+        }
+        p++;
+        if(*p == '%')
+        {
+            continue;
+        }
+        p += strspn(p, "-+ #0");
+        p += strspn(p, "0123456789");
+        if(*p == '.')
+        {
+            p++;
+            p += strspn(p, "0123456789");
+        }
+        if(*p == '\0' || strchr("fFeEgGaA", *p) == NULL)
+        {
+            return EXIT_FAILURE;
+        }
+        nconv++;
+    }
+    return nconv == 1 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+typedef struct {
+    const ftab_partition_t * P;
+    char ** fnames; /* Per key */
+    int * failed; /* Per task */
+} ftab_partition_write_job_t;
+
+static int part_fname_cmp(const void * _A, const void * _B)
+{
+    return strcmp(*(char * const *) _A, *(char * const *) _B);
+}
+
+static void part_write_worker(void * _J, int thread, int nthreads)
+{
+    ftab_partition_write_job_t * J = _J;
+    size_t first, last;
+    thread_range(J->P->nkeys, thread, nthreads, &first, &last);
+    for(size_t kk = first; kk < last; kk++)
+    {
+        const char * fname = J->fnames[kk];
+        size_t len = strlen(fname);
+        int csv = len >= 4 && strcmp(fname + len - 4, ".csv") == 0;
+        const ftab_t * V = J->P->views + kk;
+        if(csv ? ftab_write_csv(V, fname) : ftab_write_tsv(V, fname))
+        {
+            fprintf(stderr, "ftab_write_partitioned: could not write %s\n", fname);
+            J->failed[thread] = 1;
+        }
+    }
+}
+
+int ftab_write_partitioned(const ftab_t * T, int col, const char * pattern)
+{
+    if(pattern == NULL || part_check_pattern(pattern))
+    {
+        fprintf(stderr, "ftab_write_partitioned: the pattern needs one "
+                "conversion for the key, like %%.0f\n");
+        return EXIT_FAILURE;
+    }
+    ftab_partition_t * P = ftab_partition(T, col);
+    if(P == NULL)
+    {
+        return EXIT_FAILURE;
+    }
+    /* Distinct keys can format to the same name, and the files would
+     * then be written concurrently */
+    ftab_partition_write_job_t J = {P, NULL, NULL};
+    J.fnames = calloc(P->nkeys + 1, sizeof(char*));
+    char ** sorted = calloc(P->nkeys + 1, sizeof(char*));
+    assert(J.fnames != NULL && sorted != NULL);
+    for(size_t kk = 0; kk < P->nkeys; kk++)
+    {
+        int n = snprintf(NULL, 0, pattern, (double) P->keys[kk]);
+        J.fnames[kk] = malloc(n + 1);
+        assert(J.fnames[kk] != NULL);
+        snprintf(J.fnames[kk], n + 1, pattern, (double) P->keys[kk]);
+        sorted[kk] = J.fnames[kk];
+    }
+    qsort(sorted, P->nkeys, sizeof(char*), part_fname_cmp);
+    int status = EXIT_SUCCESS;
+    for(size_t kk = 1; kk < P->nkeys; kk++)
+    {
+        if(strcmp(sorted[kk-1], sorted[kk]) == 0)
+        {
+            fprintf(stderr, "ftab_write_partitioned: several keys give the "
+                    "file name %s, use a pattern with more precision\n",
+                    sorted[kk]);
+            status = EXIT_FAILURE;
+            break;
+        }
+    }
+    free(sorted);
+
+    if(status == EXIT_SUCCESS)
+    {
+        ftab_ctx_t * ctx = ctx_get();
+        int nthreads = P->nkeys < (size_t) ctx->nthreads ? (int) P->nkeys : ctx->nthreads;
+        nthreads = nthreads < 1 ? 1 : nthreads;
+        J.failed = calloc(nthreads, sizeof(int));
+        assert(J.failed != NULL);
+        run_parallel(nthreads, part_write_worker, &J);
+        for(int tt = 0; tt < nthreads; tt++)
+        {
+            if(J.failed[tt])
+            {
+                status = EXIT_FAILURE;
+            }
+        }
+        free(J.failed);
+    }
+    for(size_t kk = 0; kk < P->nkeys; kk++)
+    {
+        free(J.fnames[kk]);
+    }
+    free(J.fnames);
+    ftab_partition_free(P);
+    return status;
+}
+
+/*                          DISTINCT ROWS
+ *                          =============
+ *
+ * All rows are inserted, in parallel, into one open addressing set.
+ * A slot holds 32 bits of the hash, to skip most row comparisons, and
+ * the row index + 1. When two rows are equal the slot ends up with
+ * the smaller index, so the first occurrence is kept no matter how
+ * the tasks interleave. A row that loses its slot to an earlier
+ * duplicate is unmarked by the task that replaced it.
+ */
+
+typedef struct {
+    const ftab_t * T;
+    const int * cols;
+    size_t ncols;
+    int canonical;
+    u64 * slots;
+    size_t mask;
+    u8 * keep;
+} ftab_distinct_job_t;
+
+static u32 distinct_bits(float v, int canonical)
+{
+    if(canonical)
+    {
+        if(isnan(v))
+        {
+            v = NAN;
+        }
+        if(v == 0)
+        {
+            v = 0;
+        }
+    }
+    u32 bits;
+    memcpy(&bits, &v, sizeof(u32));
+    return bits;
+}
+
+static u64 distinct_hash(const ftab_distinct_job_t * J, size_t row)
+{
+    const float * R = J->T->T + row*J->T->ncol;
+    u64 h = 0x9E3779B97F4A7C15ULL;
+    for(size_t cc = 0; cc < J->ncols; cc++)
+    {
+        h = hash_mix(h ^ distinct_bits(R[J->cols[cc]], J->canonical));
+    }
+    return h;
+}
+
+static int distinct_equal(const ftab_distinct_job_t * J, size_t a, size_t b)
+{
+    const float * A = J->T->T + a*J->T->ncol;
+    const float * B = J->T->T + b*J->T->ncol;
+    for(size_t cc = 0; cc < J->ncols; cc++)
+    {
+        int col = J->cols[cc];
+        if(distinct_bits(A[col], J->canonical)
+           != distinct_bits(B[col], J->canonical))
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+#define DISTINCT_BATCH 16
+
+/* Insert row kk. Marks it as kept if it is the first of its key, and
+ * unmarks the row it replaces. */
+static void distinct_insert(ftab_distinct_job_t * J, size_t kk, u64 h)
+{
+    u64 tag = h >> 32;
+    u64 slot = tag << 32 | (kk + 1);
+    size_t pos = h & J->mask;
+    u64 cur = __atomic_load_n(J->slots + pos, __ATOMIC_ACQUIRE);
+    /* Published by the release of the slot update, so it is ordered
+     * before the store of a task that replaces kk later */
+    __atomic_store_n(J->keep + kk, 1, __ATOMIC_RELAXED);
+    while(1)
+    {
+        if(cur == 0)
+        {
+            if(__atomic_compare_exchange_n(J->slots + pos, &cur, slot, 0,
+                                           __ATOMIC_ACQ_REL,
+                                           __ATOMIC_ACQUIRE))
+            {
+                return;
+            }
+            continue; /* cur was updated */
+        }
+        size_t other = (cur & 0xffffffffu) - 1;
+        if(cur >> 32 == tag && distinct_equal(J, kk, other))
+        {
+            if(kk > other)
+            {
+                __atomic_store_n(J->keep + kk, 0, __ATOMIC_RELAXED);
+                return;
+            }
+            /* Replace a later duplicate */
+            if(__atomic_compare_exchange_n(J->slots + pos, &cur, slot, 0,
+                                           __ATOMIC_ACQ_REL,
+                                           __ATOMIC_ACQUIRE))
+            {
+                __atomic_store_n(J->keep + other, 0, __ATOMIC_RELAXED);
+                return;
+            }
+            continue;
+        }
+        pos = (pos + 1) & J->mask;
+        cur = __atomic_load_n(J->slots + pos, __ATOMIC_ACQUIRE);
+    }
+}
+
+static void distinct_worker(void * _J, int thread, int nthreads)
+{
+    ftab_distinct_job_t * J = _J;
+    size_t first, last;
+    thread_range(J->T->nrow, thread, nthreads, &first, &last);
+    /* Hash a batch of rows and prefetch their slots before inserting */
+    u64 h[DISTINCT_BATCH];
+    for(size_t b0 = first; b0 < last; b0 += DISTINCT_BATCH)
+    {
+        size_t nb = last - b0 < DISTINCT_BATCH ? last - b0 : DISTINCT_BATCH;
+        for(size_t kk = 0; kk < nb; kk++)
+        {
+            h[kk] = distinct_hash(J, b0 + kk);
+            __builtin_prefetch(J->slots + (h[kk] & J->mask));
+        }
+        for(size_t kk = 0; kk < nb; kk++)
+        {
+            distinct_insert(J, b0 + kk, h[kk]);
+        }
+    }
+}
+
+int ftab_distinct(ftab_t * T, const int * cols, size_t n, int canonical)
+{
+    if(!ftab_has_data(T))
+    {
+        return EXIT_FAILURE;
+    }
+    if(T->nrow >= UINT32_MAX)
+    {
+        fprintf(stderr, "ftab_distinct: too many rows\n");
+        return EXIT_FAILURE;
+    }
+    int * all = NULL;
+    if(cols == NULL)
+    {
+        n = T->ncol;
+        all = malloc(n*sizeof(int));
+        assert(all != NULL);
+        for(size_t cc = 0; cc < n; cc++)
+        {
+            all[cc] = cc;
+        }
+        cols = all;
+    }
+    for(size_t cc = 0; cc < n; cc++)
+    {
+        if(cols[cc] < 0 || (size_t) cols[cc] >= T->ncol)
+        {
+            fprintf(stderr, "ftab_distinct: invalid column %d\n", cols[cc]);
+            free(all);
+            return EXIT_FAILURE;
+        }
+    }
+    if(T->nrow < 2)
+    {
+        free(all);
+        return EXIT_SUCCESS;
+    }
+
+    /* Load factor at most 3/4 */
+    size_t cap = 64;
+    while(cap < T->nrow + T->nrow/3 + 1)
+    {
+        cap *= 2;
+    }
+    ftab_distinct_job_t J = {0};
+    J.T = T;
+    J.cols = cols;
+    J.ncols = n;
+    J.canonical = canonical;
+    J.slots = calloc(cap, sizeof(u64));
+    J.mask = cap - 1;
+    J.keep = malloc(T->nrow);
+    assert(J.slots != NULL && J.keep != NULL);
+    int nthreads = nthreads_for(T->nrow, 1 << 16);
+    run_parallel(nthreads, distinct_worker, &J);
+    free(J.slots);
+    ftab_subselect_rows(T, J.keep);
+    free(J.keep);
+    free(all);
+    return EXIT_SUCCESS;
+}
+
+/*                            SKETCHES
+ *                            ========
+ *
+ * ftab_quantile copies the non-NAN values of a column and finds the
+ * order statistics with introselect: quickselect with a three way
+ * partition, since label columns have many equal values, that falls
+ * back to sorting if the recursion gets too deep. Several quantiles
+ * are found in increasing order, each within the part of the array
+ * that is left after the previous one.
+ *
+ * The quantile sketch is KLL (Karnin, Lang, Liberty, 2016). Level h
+ * holds items of weight 2^h. When a level is full it is sorted and
+ * every other item, from a random offset, is promoted to the next
+ * level. Capacities decrease by 2/3 per level from the top, so the
+ * size is O(k) and the rank error about 1.7/k. Merging is
+ * concatenating levels and compacting again.
+ *
+ * The distinct count sketch is HyperLogLog with 2^p registers, each
+ * holding the largest number of leading zeros seen, plus one, of the
+ * hashes that go to it. Merging is the elementwise max.
+ */
+
+static int cmp_float_asc(const void * _A, const void * _B)
+{
+    float a = *(const float *) _A;
+    float b = *(const float *) _B;
+    return (a > b) - (a < b);
+}
+
+/* Introselect in a[first, last), places the k-th smallest at a[k] with
+ * smaller or equal values before it and larger or equal after it. */
+static void introselect(float * a, size_t first, size_t last, size_t k)
+{
+    int depth = 0;
+    for(size_t n = last - first; n > 1; n /= 2)
+    {
+        depth += 2;
+    }
+    while(last - first > 16)
+    {
+        if(depth-- == 0)
+        {
+            qsort(a + first, last - first, sizeof(float), cmp_float_asc);
+            return;
+        }
+        /* Median of three */
+        float x = a[first];
+        float y = a[first + (last - first)/2];
+        float z = a[last - 1];
+        float pivot = x < y ? (y < z ? y : (x < z ? z : x))
+            : (x < z ? x : (y < z ? z : y));
+        /* a[first, lt) < pivot, a[lt, ii) == pivot, a[gt, last) > pivot */
+        size_t lt = first;
+        size_t ii = first;
+        size_t gt = last;
+        while(ii < gt)
+        {
+            float v = a[ii];
+            if(v < pivot)
+            {
+                a[ii++] = a[lt];
+                a[lt++] = v;
+            } else if(v > pivot)
+            {
+                a[ii] = a[--gt];
+                a[gt] = v;
+            } else {
+                ii++;
+            }
+        }
+        if(k < lt)
+        {
+            last = lt;
+        } else if(k >= gt)
+        {
+            first = gt;
+        } else {
+            return;
+        }
+    }
+    /* Insertion sort for short ranges */
+    for(size_t ii = first + 1; ii < last; ii++)
+    {
+        float v = a[ii];
+        size_t jj = ii;
+        while(jj > first && a[jj-1] > v)
+        {
+            a[jj] = a[jj-1];
+            jj--;
+        }
+        a[jj] = v;
+    }
+}
+
+typedef struct {
+    double q;
+    size_t idx;
+} ftab_quantile_pair;
+
+static int quantile_pair_cmp(const void * _A, const void * _B)
+{
+    const ftab_quantile_pair * A = _A;
+    const ftab_quantile_pair * B = _B;
+    return (A->q > B->q) - (A->q < B->q);
+}
+
+int ftab_quantile(const ftab_t * T, int col, const double * q, size_t nq,
+                  double * out)
+{
+    if(!ftab_has_data(T) || col < 0 || (size_t) col >= T->ncol
+       || (nq > 0 && (q == NULL || out == NULL)))
+    {
+        return EXIT_FAILURE;
+    }
+    for(size_t kk = 0; kk < nq; kk++)
+    {
+        if(!(q[kk] >= 0 && q[kk] <= 1))
+        {
+            fprintf(stderr, "ftab_quantile: q=%f is not in [0, 1]\n", q[kk]);
+            return EXIT_FAILURE;
+        }
+    }
+    float * a = malloc((T->nrow + 1)*sizeof(float));
+    assert(a != NULL);
+    size_t n = 0;
+    for(size_t kk = 0; kk < T->nrow; kk++)
+    {
+        float v = T->T[kk*T->ncol + col];
+        a[n] = v;
+        n += !isnan(v);
+    }
+
+    /* Increasing order of q */
+    ftab_quantile_pair * order = malloc((nq + 1)*sizeof(ftab_quantile_pair));
+    assert(order != NULL);
+    for(size_t kk = 0; kk < nq; kk++)
+    {
+        order[kk].q = q[kk];
+        order[kk].idx = kk;
+    }
+    qsort(order, nq, sizeof(ftab_quantile_pair), quantile_pair_cmp);
+
+    size_t first = 0;
+    for(size_t kk = 0; kk < nq; kk++)
+    {
+        if(n == 0)
+        {
+            out[order[kk].idx] = NAN;
+            continue;
+        }
+        /* Linear interpolation between the closest ranks */
+        double h = (n - 1)*order[kk].q;
+        size_t lo = (size_t) h;
+        lo = lo > n - 1 ? n - 1 : lo;
+        introselect(a, first, n, lo);
+        first = lo;
+        double v = a[lo];
+        if(h > lo && lo + 1 < n)
+        {
+            float next = a[lo + 1];
+            for(size_t ii = lo + 2; ii < n; ii++)
+            {
+                next = a[ii] < next ? a[ii] : next;
+            }
+            v += (h - lo)*((double) next - v);
+        }
+        out[order[kk].idx] = v;
+    }
+    free(order);
+    free(a);
+    return EXIT_SUCCESS;
+}
+
+#define QS_MIN_CAPACITY 8
+
+struct ftab_qsketch {
+    int k;
+    int nlevels;
+    u64 n;
+    float min;
+    float max;
+    u64 rng;
+    u32 * size; /* nlevels */
+    u32 * alloc;
+    u32 * cap; /* Capacity of each level */
+    u64 total_cap;
+    float ** items;
+};
+
+/* Capacities shrink by 2/3 per level below the top, but not below
+ * QS_MIN_CAPACITY, which keeps the bottom levels from compacting on
+ * almost every insertion */
+static void qs_set_capacities(ftab_qsketch_t * S)
+{
+    S->total_cap = 0;
+    for(int h = 0; h < S->nlevels; h++)
+    {
+        double c = ceil(S->k * pow(2.0/3.0, S->nlevels - 1 - h));
+        S->cap[h] = c < QS_MIN_CAPACITY ? QS_MIN_CAPACITY : (u32) c;
+        S->total_cap += S->cap[h];
+    }
+}
+
+static void qs_add_level(ftab_qsketch_t * S)
+{
+    S->nlevels++;
+    S->size = realloc(S->size, S->nlevels*sizeof(u32));
+    S->alloc = realloc(S->alloc, S->nlevels*sizeof(u32));
+    S->cap = realloc(S->cap, S->nlevels*sizeof(u32));
+    S->items = realloc(S->items, S->nlevels*sizeof(float*));
+    assert(S->size != NULL && S->alloc != NULL && S->cap != NULL
+           && S->items != NULL);
+    qs_set_capacities(S);
+    int h = S->nlevels - 1;
+    S->size[h] = 0;
+    S->alloc[h] = S->cap[h] + 1;
+    S->items[h] = malloc(S->alloc[h]*sizeof(float));
+    assert(S->items[h] != NULL);
+}
+
+static void qs_reserve(ftab_qsketch_t * S, int level, u32 n)
+{
+    if(n > S->alloc[level])
+    {
+        S->alloc[level] = n + n/2;
+        S->items[level] = realloc(S->items[level], S->alloc[level]*sizeof(float));
+        assert(S->items[level] != NULL);
+    }
+}
+
+ftab_qsketch_t * ftab_qsketch_new(int k)
+{
+    k = k == 0 ? 200 : k;
+    if(k < 8 || k > 65536)
+    {
+        fprintf(stderr, "ftab_qsketch_new: k=%d is not in [8, 65536]\n", k);
+        return NULL;
+    }
+    ftab_qsketch_t * S = calloc(1, sizeof(ftab_qsketch_t));
+    assert(S != NULL);
+    S->k = k;
+    S->min = NAN;
+    S->max = NAN;
+    S->rng = 0x853C49E6748FEA9BULL;
+    qs_add_level(S);
+    return S;
+}
+
+void ftab_qsketch_free(ftab_qsketch_t * S)
+{
+    if(S == NULL)
+    {
+        return;
+    }
+    for(int h = 0; h < S->nlevels; h++)
+    {
+        free(S->items[h]);
+    }
+    free(S->items);
+    free(S->size);
+    free(S->alloc);
+    free(S->cap);
+    free(S);
+}
+
+/* Compact the lowest full level until the sketch is within capacity */
+static void qs_compress(ftab_qsketch_t * S)
+{
+    while(1)
+    {
+        u64 size = 0;
+        for(int h = 0; h < S->nlevels; h++)
+        {
+            size += S->size[h];
+        }
+        if(size < S->total_cap)
+        {
+            return;
+        }
+        int h = 0;
+        while(S->size[h] < S->cap[h])
+        {
+            h++;
+        }
+        if(h + 1 == S->nlevels)
+        {
+            qs_add_level(S);
+        }
+        float * L = S->items[h];
+        u32 n = S->size[h];
+        qsort(L, n, sizeof(float), cmp_float_asc);
+        /* xorshift64 */
+        S->rng ^= S->rng << 13;
+        S->rng ^= S->rng >> 7;
+        S->rng ^= S->rng << 17;
+        u32 offset = S->rng & 1;
+        /* With an odd number of items the first one stays */
+        u32 keep = n & 1;
+        u32 npromote = n / 2;
+        qs_reserve(S, h + 1, S->size[h+1] + npromote);
+        float * U = S->items[h+1] + S->size[h+1];
+        for(u32 ii = 0; ii < npromote; ii++)
+        {
+            U[ii] = L[keep + 2*ii + offset];
+        }
+        S->size[h+1] += npromote;
+        S->size[h] = keep;
+    }
+}
+
+void ftab_qsketch_add(ftab_qsketch_t * S, float value)
+{
+    if(isnan(value))
+    {
+        return;
+    }
+    if(S->n == 0 || value < S->min)
+    {
+        S->min = value;
+    }
+    if(S->n == 0 || value > S->max)
+    {
+        S->max = value;
+    }
+    S->n++;
+    qs_reserve(S, 0, S->size[0] + 1);
+    S->items[0][S->size[0]++] = value;
+    if(S->size[0] >= S->cap[0])
+    {
+        qs_compress(S);
+    }
+}
+
+int ftab_qsketch_merge(ftab_qsketch_t * S, const ftab_qsketch_t * O)
+{
+    if(S == NULL || O == NULL || S->k != O->k)
+    {
+        fprintf(stderr, "ftab_qsketch_merge: the sketches need the same k\n");
+        return EXIT_FAILURE;
+    }
+    if(O->n == 0)
+    {
+        return EXIT_SUCCESS;
+    }
+    while(S->nlevels < O->nlevels)
+    {
+        qs_add_level(S);
+    }
+    for(int h = 0; h < O->nlevels; h++)
+    {
+        qs_reserve(S, h, S->size[h] + O->size[h]);
+        memcpy(S->items[h] + S->size[h], O->items[h], O->size[h]*sizeof(float));
+        S->size[h] += O->size[h];
+    }
+    if(S->n == 0 || O->min < S->min)
+    {
+        S->min = O->min;
+    }
+    if(S->n == 0 || O->max > S->max)
+    {
+        S->max = O->max;
+    }
+    S->n += O->n;
+    S->rng ^= O->rng;
+    S->rng += S->rng == 0;
+    qs_compress(S);
+    return EXIT_SUCCESS;
+}
+
+typedef struct {
+    const ftab_t * T;
+    int col;
+    ftab_qsketch_t ** S; /* Per task */
+} ftab_qsketch_job_t;
+
+static void qsketch_worker(void * _J, int thread, int nthreads)
+{
+    ftab_qsketch_job_t * J = _J;
+    size_t first, last;
+    thread_range(J->T->nrow, thread, nthreads, &first, &last);
+    ftab_qsketch_t * S = J->S[thread];
+    for(size_t kk = first; kk < last; kk++)
+    {
+        ftab_qsketch_add(S, J->T->T[kk*J->T->ncol + J->col]);
+    }
+}
+
+int ftab_qsketch_add_column(ftab_qsketch_t * S, const ftab_t * T, int col)
+{
+    if(S == NULL || !ftab_has_data(T) || col < 0 || (size_t) col >= T->ncol)
+    {
+        return EXIT_FAILURE;
+    }
+    int nthreads = nthreads_for(T->nrow, 1 << 16);
+    ftab_qsketch_job_t J = {T, col, NULL};
+    J.S = malloc(nthreads*sizeof(ftab_qsketch_t*));
+    assert(J.S != NULL);
+    J.S[0] = S;
+    for(int tt = 1; tt < nthreads; tt++)
+    {
+        J.S[tt] = ftab_qsketch_new(S->k);
+        J.S[tt]->rng = hash_mix(S->rng + tt);
+    }
+    run_parallel(nthreads, qsketch_worker, &J);
+    for(int tt = 1; tt < nthreads; tt++)
+    {
+        ftab_qsketch_merge(S, J.S[tt]);
+        ftab_qsketch_free(J.S[tt]);
+    }
+    free(J.S);
+    return EXIT_SUCCESS;
+}
+
+uint64_t ftab_qsketch_count(const ftab_qsketch_t * S)
+{
+    return S->n;
+}
+
+static int cmp_sort_pair_value(const void * _A, const void * _B)
+{
+    const ftab_sort_pair * A = _A;
+    const ftab_sort_pair * B = _B;
+    return (A->value > B->value) - (A->value < B->value);
+}
+
+double ftab_qsketch_quantile(const ftab_qsketch_t * S, double q)
+{
+    if(S->n == 0 || !(q >= 0 && q <= 1))
+    {
+        return NAN;
+    }
+    if(q == 0)
+    {
+        return S->min;
+    }
+    if(q == 1)
+    {
+        return S->max;
+    }
+    size_t n = 0;
+    for(int h = 0; h < S->nlevels; h++)
+    {
+        n += S->size[h];
+    }
+    /* The weight 2^h is kept in idx */
+    ftab_sort_pair * P = malloc(n*sizeof(ftab_sort_pair));
+    assert(P != NULL);
+    size_t pos = 0;
+    for(int h = 0; h < S->nlevels; h++)
+    {
+        for(u32 ii = 0; ii < S->size[h]; ii++)
+        {
+            P[pos].value = S->items[h][ii];
+            P[pos].idx = (size_t) 1 << h;
+            pos++;
+        }
+    }
+    qsort(P, n, sizeof(ftab_sort_pair), cmp_sort_pair_value);
+    double target = q*S->n;
+    double v = S->max;
+    u64 cum = 0;
+    for(size_t kk = 0; kk < n; kk++)
+    {
+        cum += P[kk].idx;
+        if(cum >= target)
+        {
+            v = P[kk].value;
+            break;
+        }
+    }
+    free(P);
+    return v;
+}
+
+#define FTAB_QSKETCH_MAGIC "FTABKLL1"
+
+char * ftab_qsketch_serialize(const ftab_qsketch_t * S, size_t * len)
+{
+    size_t n = 8 + 2*sizeof(u32) + 2*sizeof(u64) + 2*sizeof(float);
+    for(int h = 0; h < S->nlevels; h++)
+    {
+        n += sizeof(u32) + S->size[h]*sizeof(float);
+    }
+    char * buf = malloc(n);
+    assert(buf != NULL);
+    char * p = buf;
+    u32 k = S->k;
+    u32 nlevels = S->nlevels;
+    memcpy(p, FTAB_QSKETCH_MAGIC, 8); p += 8;
+    memcpy(p, &k, sizeof(u32)); p += sizeof(u32);
+    memcpy(p, &nlevels, sizeof(u32)); p += sizeof(u32);
+    memcpy(p, &S->n, sizeof(u64)); p += sizeof(u64);
+    memcpy(p, &S->rng, sizeof(u64)); p += sizeof(u64);
+    memcpy(p, &S->min, sizeof(float)); p += sizeof(float);
+    memcpy(p, &S->max, sizeof(float)); p += sizeof(float);
+    for(int h = 0; h < S->nlevels; h++)
+    {
+        memcpy(p, S->size + h, sizeof(u32)); p += sizeof(u32);
+        memcpy(p, S->items[h], S->size[h]*sizeof(float));
+        p += S->size[h]*sizeof(float);
+    }
+    *len = n;
+    return buf;
+}
+
+ftab_qsketch_t * ftab_qsketch_deserialize(const char * buf, size_t len)
+{
+    size_t head = 8 + 2*sizeof(u32) + 2*sizeof(u64) + 2*sizeof(float);
+    if(buf == NULL || len < head || memcmp(buf, FTAB_QSKETCH_MAGIC, 8) != 0)
+    {
+        fprintf(stderr, "ftab_qsketch_deserialize: not a quantile sketch\n");
+        return NULL;
+    }
+    const char * p = buf + 8;
+    u32 k, nlevels;
+    memcpy(&k, p, sizeof(u32)); p += sizeof(u32);
+    memcpy(&nlevels, p, sizeof(u32)); p += sizeof(u32);
+    ftab_qsketch_t * S = ftab_qsketch_new(k);
+    if(S == NULL || nlevels < 1 || nlevels > 64)
+    {
+        ftab_qsketch_free(S);
+        return NULL;
+    }
+    memcpy(&S->n, p, sizeof(u64)); p += sizeof(u64);
+    memcpy(&S->rng, p, sizeof(u64)); p += sizeof(u64);
+    memcpy(&S->min, p, sizeof(float)); p += sizeof(float);
+    memcpy(&S->max, p, sizeof(float)); p += sizeof(float);
+    while((u32) S->nlevels < nlevels)
+    {
+        qs_add_level(S);
+    }
+    const char * end = buf + len;
+    for(u32 h = 0; h < nlevels; h++)
+    {
+        u32 size;
+        if((size_t) (end - p) < sizeof(u32))
+        {
+            break;
+        }
+        memcpy(&size, p, sizeof(u32)); p += sizeof(u32);
+        if((size_t) (end - p) / sizeof(float) < size)
+        {
+            break;
+        }
+        qs_reserve(S, h, size);
+        memcpy(S->items[h], p, size*sizeof(float));
+        p += size*sizeof(float);
+        S->size[h] = size;
+    }
+    if(p != end)
+    {
+        fprintf(stderr, "ftab_qsketch_deserialize: truncated sketch\n");
+        ftab_qsketch_free(S);
+        return NULL;
+    }
+    return S;
+}
+
+struct ftab_hll {
+    int p;
+    u8 * reg; /* 2^p */
+};
+
+ftab_hll_t * ftab_hll_new(int p)
+{
+    p = p == 0 ? 14 : p;
+    if(p < 4 || p > 18)
+    {
+        fprintf(stderr, "ftab_hll_new: p=%d is not in [4, 18]\n", p);
+        return NULL;
+    }
+    ftab_hll_t * H = calloc(1, sizeof(ftab_hll_t));
+    assert(H != NULL);
+    H->p = p;
+    H->reg = calloc((size_t) 1 << p, 1);
+    assert(H->reg != NULL);
+    return H;
+}
+
+void ftab_hll_free(ftab_hll_t * H)
+{
+    if(H == NULL)
+    {
+        return;
+    }
+    free(H->reg);
+    free(H);
+}
+
+static void hll_add(u8 * reg, int p, float value)
+{
+    if(isnan(value))
+    {
+        return;
+    }
+    value = value == 0 ? 0 : value; /* -0 */
+    u32 bits;
+    memcpy(&bits, &value, sizeof(u32));
+    u64 h = hash_mix(bits + 0x9E3779B97F4A7C15ULL);
+    size_t idx = h >> (64 - p);
+    /* The guard bit limits the rank to 64 - p + 1 */
+    u64 w = (h << p) | ((u64) 1 << (p - 1));
+    u8 rank = __builtin_clzll(w) + 1;
+    reg[idx] = rank > reg[idx] ? rank : reg[idx];
+}
+
+void ftab_hll_add(ftab_hll_t * H, float value)
+{
+    hll_add(H->reg, H->p, value);
+}
+
+typedef struct {
+    const ftab_t * T;
+    int col;
+    int p;
+    u8 * reg; /* 2^p per task */
+} ftab_hll_job_t;
+
+static void hll_worker(void * _J, int thread, int nthreads)
+{
+    ftab_hll_job_t * J = _J;
+    size_t first, last;
+    thread_range(J->T->nrow, thread, nthreads, &first, &last);
+    u8 * reg = J->reg + ((size_t) thread << J->p);
+    for(size_t kk = first; kk < last; kk++)
+    {
+        hll_add(reg, J->p, J->T->T[kk*J->T->ncol + J->col]);
+    }
+}
+
+int ftab_hll_add_column(ftab_hll_t * H, const ftab_t * T, int col)
+{
+    if(H == NULL || !ftab_has_data(T) || col < 0 || (size_t) col >= T->ncol)
+    {
+        return EXIT_FAILURE;
+    }
+    size_t m = (size_t) 1 << H->p;
+    int nthreads = nthreads_for(T->nrow, 1 << 16);
+    ftab_hll_job_t J = {T, col, H->p, NULL};
+    J.reg = malloc(nthreads*m);
+    assert(J.reg != NULL);
+    memcpy(J.reg, H->reg, m);
+    memset(J.reg + m, 0, (nthreads - 1)*m);
+    run_parallel(nthreads, hll_worker, &J);
+    for(int tt = 1; tt < nthreads; tt++)
+    {
+        const u8 * R = J.reg + tt*m;
+        for(size_t ii = 0; ii < m; ii++)
+        {
+            J.reg[ii] = R[ii] > J.reg[ii] ? R[ii] : J.reg[ii];
+        }
+    }
+    memcpy(H->reg, J.reg, m);
+    free(J.reg);
+    return EXIT_SUCCESS;
+}
+
+int ftab_hll_merge(ftab_hll_t * H, const ftab_hll_t * O)
+{
+    if(H == NULL || O == NULL || H->p != O->p)
+    {
+        fprintf(stderr, "ftab_hll_merge: the sketches need the same p\n");
+        return EXIT_FAILURE;
+    }
+    size_t m = (size_t) 1 << H->p;
+    for(size_t ii = 0; ii < m; ii++)
+    {
+        H->reg[ii] = O->reg[ii] > H->reg[ii] ? O->reg[ii] : H->reg[ii];
+    }
+    return EXIT_SUCCESS;
+}
+
+double ftab_hll_estimate(const ftab_hll_t * H)
+{
+    size_t m = (size_t) 1 << H->p;
+    double alpha = m == 16 ? 0.673 : m == 32 ? 0.697 : m == 64 ? 0.709
+        : 0.7213/(1 + 1.079/m);
+    double sum = 0;
+    size_t zeros = 0;
+    for(size_t ii = 0; ii < m; ii++)
+    {
+        sum += ldexp(1.0, -H->reg[ii]);
+        zeros += H->reg[ii] == 0;
+    }
+    double E = alpha*m*m/sum;
+    /* Linear counting for small cardinalities */
+    if(E <= 2.5*m && zeros > 0)
+    {
+        E = m*log((double) m / zeros);
+    }
+    return E;
+}
+
+#define FTAB_HLL_MAGIC "FTABHLL1"
+
+char * ftab_hll_serialize(const ftab_hll_t * H, size_t * len)
+{
+    size_t m = (size_t) 1 << H->p;
+    char * buf = malloc(8 + sizeof(u32) + m);
+    assert(buf != NULL);
+    u32 p = H->p;
+    memcpy(buf, FTAB_HLL_MAGIC, 8);
+    memcpy(buf + 8, &p, sizeof(u32));
+    memcpy(buf + 8 + sizeof(u32), H->reg, m);
+    *len = 8 + sizeof(u32) + m;
+    return buf;
+}
+
+ftab_hll_t * ftab_hll_deserialize(const char * buf, size_t len)
+{
+    if(buf == NULL || len < 8 + sizeof(u32)
+       || memcmp(buf, FTAB_HLL_MAGIC, 8) != 0)
+    {
+        fprintf(stderr, "ftab_hll_deserialize: not a distinct count sketch\n");
+        return NULL;
+    }
+    u32 p;
+    memcpy(&p, buf + 8, sizeof(u32));
+    if(p < 4 || p > 18 || len != 8 + sizeof(u32) + ((size_t) 1 << p))
+    {
+        fprintf(stderr, "ftab_hll_deserialize: invalid sketch\n");
+        return NULL;
+    }
+    ftab_hll_t * H = ftab_hll_new(p);
+    memcpy(H->reg, buf + 8 + sizeof(u32), (size_t) 1 << p);
+    return H;
+}
+
+/*                            SAMPLING
+ *                            ========
+ *
+ * Each row gets a pseudo random tag from the seed and its index, and
+ * the sample is the n rows with the smallest tags, i.e., a uniform
+ * sample without replacement. Like a reservoir, each task only keeps
+ * the n smallest tags of its rows, in a heap, and the heaps are merged
+ * at the end. The tags do not depend on how the rows are split, so
+ * neither does the sample.
+ */
+
+typedef struct {
+    u64 tag;
+    size_t idx;
+} ftab_sample_pair;
+
+static int sample_less(const ftab_sample_pair * a, const ftab_sample_pair * b)
+{
+    return a->tag < b->tag || (a->tag == b->tag && a->idx < b->idx);
+}
+
+/* Max-heap with the n smallest pairs seen */
+static void sample_push(ftab_sample_pair * H, size_t * size, size_t n,
+                        ftab_sample_pair p)
+{
+    size_t pos;
+    if(*size < n)
+    {
+        /* Sift up */
+        pos = (*size)++;
+        while(pos > 0 && sample_less(H + (pos - 1)/2, &p))
+        {
+            H[pos] = H[(pos - 1)/2];
+            pos = (pos - 1)/2;
+        }
+        H[pos] = p;
+        return;
+    }
+    if(n == 0 || !sample_less(&p, H))
+    {
+        return;
+    }
+    /* Replace the largest and sift down */
+    pos = 0;
+    while(2*pos + 1 < n)
+    {
+        size_t child = 2*pos + 1;
+        if(child + 1 < n && sample_less(H + child, H + child + 1))
+        {
+            child++;
+        }
+        if(!sample_less(&p, H + child))
+        {
+            break;
+        }
+        H[pos] = H[child];
+        pos = child;
+    }
+    H[pos] = p;
+}
+
+/* The n rows in [first, last) with the smallest tags */
+static size_t sample_range(u64 seed, size_t first, size_t last, size_t n,
+                           ftab_sample_pair * H)
+{
+    size_t size = 0;
+    for(size_t kk = first; kk < last; kk++)
+    {
+        ftab_sample_pair p = {hash_mix(seed + kk), kk};
+        sample_push(H, &size, n, p);
+    }
+    return size;
+}
+
+static int sample_idx_cmp(const void * _A, const void * _B)
+{
+    const ftab_sample_pair * A = _A;
+    const ftab_sample_pair * B = _B;
+    return (A->idx > B->idx) - (A->idx < B->idx);
+}
+
+/* A new table with the rows P[kk].idx of T */
+static ftab_t * sample_gather(const ftab_t * T, const ftab_sample_pair * P,
+                              size_t n)
+{
+    ftab_t * R = calloc(1, sizeof(ftab_t));
+    assert(R != NULL);
+    R->ncol = T->ncol;
+    R->nrow = n;
+    R->nrow_alloc = n > 0 ? n : 1;
+    R->T = malloc(R->nrow_alloc*R->ncol*sizeof(float));
+    assert(R->T != NULL);
+    for(size_t kk = 0; kk < n; kk++)
+    {
+        memcpy(R->T + kk*R->ncol, T->T + P[kk].idx*T->ncol,
+               T->ncol*sizeof(float));
+    }
+    for(size_t cc = 0; T->colnames != NULL && cc < T->ncol; cc++)
+    {
+        if(T->colnames[cc] != NULL)
+        {
+            ftab_set_colname(R, cc, T->colnames[cc]);
+        }
+    }
+    for(size_t cc = 0; T->valid != NULL && cc < T->ncol; cc++)
+    {
+        for(size_t kk = 0; T->valid->bits[cc] != NULL && kk < n; kk++)
+        {
+            valid_copy(R, kk, cc, T, P[kk].idx, cc, 1);
+        }
+    }
+    return R;
+}
+
+typedef struct {
+    u64 seed;
+    size_t nrow;
+    size_t n;
+    ftab_sample_pair * heaps;
+    size_t * start; /* The heap of task tt starts at heaps[start[tt]] */
+    size_t * heap_size;
+} ftab_sample_job_t;
+
+static void sample_worker(void * _J, int thread, int nthreads)
+{
+    ftab_sample_job_t * J = _J;
+    size_t first, last;
+    thread_range(J->nrow, thread, nthreads, &first, &last);
+    J->heap_size[thread] = sample_range(J->seed, first, last, J->n,
+                                        J->heaps + J->start[thread]);
+}
+
+ftab_t * ftab_sample(const ftab_t * T, size_t n, uint64_t seed)
+{
+    if(!ftab_has_data(T))
+    {
+        return NULL;
+    }
+    n = n > T->nrow ? T->nrow : n;
+    ftab_sample_job_t J = {0};
+    J.seed = hash_mix(seed ^ 0x9E3779B97F4A7C15ULL);
+    J.nrow = T->nrow;
+    J.n = n;
+    int nthreads = nthreads_for(T->nrow, 1 << 16);
+    /* Each heap holds at most the rows of its task, so all of them
+     * together at most T->nrow. The merged heap has n more. */
+    J.start = malloc((nthreads + 1)*sizeof(size_t));
+    J.heap_size = calloc(nthreads, sizeof(size_t));
+    assert(J.start != NULL && J.heap_size != NULL);
+    J.start[0] = 0;
+    for(int tt = 0; tt < nthreads; tt++)
+    {
+        size_t first, last;
+        thread_range(T->nrow, tt, nthreads, &first, &last);
+        J.start[tt+1] = J.start[tt] + (n < last - first ? n : last - first);
+    }
+    size_t total = J.start[nthreads] + (nthreads > 1 ? n : 0);
+    J.heaps = malloc((total + 1)*sizeof(ftab_sample_pair));
+    if(J.heaps == NULL)
+    {
+        fprintf(stderr, "ftab_sample: out of memory\n");
+        free(J.start);
+        free(J.heap_size);
+        return NULL;
+    }
+    run_parallel(nthreads, sample_worker, &J);
+
+    /* Merge into a heap after the others */
+    ftab_sample_pair * H = J.heaps;
+    size_t size = J.heap_size[0];
+    if(nthreads > 1)
+    {
+        H = J.heaps + J.start[nthreads];
+        size = 0;
+        for(int tt = 0; tt < nthreads; tt++)
+        {
+            for(size_t kk = 0; kk < J.heap_size[tt]; kk++)
+            {
+                sample_push(H, &size, n, J.heaps[J.start[tt] + kk]);
+            }
+        }
+    }
+    qsort(H, size, sizeof(ftab_sample_pair), sample_idx_cmp);
+    ftab_t * R = sample_gather(T, H, size);
+    free(J.heaps);
+    free(J.start);
+    free(J.heap_size);
+    return R;
+}
+
+typedef struct {
+    const ftab_partition_t * P;
+    u64 seed;
+    size_t n;
+    ftab_sample_pair * out;
+    size_t * start; /* The sample of key kk is out[start[kk]:start[kk+1]] */
+} ftab_stratified_job_t;
+
+static void stratified_worker(void * _J, int thread, int nthreads)
+{
+    ftab_stratified_job_t * J = _J;
+    size_t first, last;
+    thread_range(J->P->nkeys, thread, nthreads, &first, &last);
+    for(size_t kk = first; kk < last; kk++)
+    {
+        ftab_sample_pair * H = J->out + J->start[kk];
+        /* A seed per key, so that the sample of a key does not depend
+         * on the other keys */
+        u64 seed = hash_mix(J->seed ^ part_key_bits(J->P->keys[kk]));
+        size_t offset = J->P->offsets[kk];
+        size_t count = sample_range(seed, 0, J->P->offsets[kk+1] - offset,
+                                    J->n, H);
+        qsort(H, count, sizeof(ftab_sample_pair), sample_idx_cmp);
+        for(size_t ii = 0; ii < count; ii++)
+        {
+            H[ii].idx += offset;
+        }
+    }
+}
+
+ftab_t * ftab_sample_stratified(const ftab_t * T, int col, size_t n,
+                                uint64_t seed)
+{
+    ftab_partition_t * P = ftab_partition(T, col);
+    if(P == NULL)
+    {
+        return NULL;
+    }
+    ftab_stratified_job_t J = {0};
+    J.P = P;
+    J.seed = hash_mix(seed ^ 0x9E3779B97F4A7C15ULL);
+    J.n = n;
+    /* At most the whole stratum, so the total is at most T->nrow */
+    J.start = malloc((P->nkeys + 1)*sizeof(size_t));
+    assert(J.start != NULL);
+    J.start[0] = 0;
+    for(size_t kk = 0; kk < P->nkeys; kk++)
+    {
+        size_t size = P->offsets[kk+1] - P->offsets[kk];
+        J.start[kk+1] = J.start[kk] + (n < size ? n : size);
+    }
+    size_t total = J.start[P->nkeys];
+    J.out = malloc((total + 1)*sizeof(ftab_sample_pair));
+    if(J.out == NULL)
+    {
+        fprintf(stderr, "ftab_sample_stratified: out of memory\n");
+        free(J.start);
+        ftab_partition_free(P);
+        return NULL;
+    }
+    run_parallel(nthreads_for(T->nrow, 1 << 16), stratified_worker, &J);
+
+    ftab_t * R = sample_gather(P->T, J.out, total);
+    free(J.out);
+    free(J.start);
+    ftab_partition_free(P);
+    return R;
+}
+
+/*                             K-D TREE
+ *                             ========
+ *
+ * Implicit layout: The points are stored in tree order. The node of
+ * the range [lo, hi) is the point at mid = lo + (hi-lo)/2 and the
+ * children are the ranges [lo, mid) and [mid+1, hi). Small ranges are
+ * leaves that are scanned linearly. Only the split dimension is
+ * stored per node.
+ */
+
+#define FTAB_KD_LEAF 8
+#define FTAB_KD_MAXDIM 32
+#define FTAB_KD_STACK 256
+
+struct ftab_kdtree {
+    size_t n;
+    int ndim;
+    /* n x ndim coordinates, in tree order */
+    float * P;
+    /* The row in the table of each point */
+    int64_t * idx;
+    /* The split dimension of each node */
+    u8 * split;
+};
+
+typedef struct {
+    size_t lo;
+    size_t hi;
+    float bmin[FTAB_KD_MAXDIM];
+    float bmax[FTAB_KD_MAXDIM];
+} kd_range_t;
+
+static void kd_swap(ftab_kdtree_t * K, size_t a, size_t b)
+{
+    float * A = K->P + a*K->ndim;
+    float * B = K->P + b*K->ndim;
+    for(int dd = 0; dd < K->ndim; dd++)
+    {
+        float tmp = A[dd];
+        A[dd] = B[dd];
+        B[dd] = tmp;
+    }
+    int64_t tmp = K->idx[a];
+    K->idx[a] = K->idx[b];
+    K->idx[b] = tmp;
+}
+
+/* Partial sort [left, right] so that the point at nth is in its
+ * sorted position along dimension d. Floyd-Rivest selection, the
+ * pivot is chosen from a sample so that most of the range is
+ * partitioned only once or twice. */
+static void kd_select(ftab_kdtree_t * K, i64 left, i64 right, i64 nth, int d)
+{
+    const int nd = K->ndim;
+    const float * P = K->P;
+    while(right > left)
+    {
+        if(right - left > 600)
+        {
+            double n = right - left + 1;
+            double i = nth - left + 1;
+            double z = log(n);
+            double s = 0.5*exp(2.0*z/3.0);
+            double sd = 0.5*sqrt(z*s*(n-s)/n) * (i < n/2 ? -1 : 1);
+            i64 new_left = nth - i*s/n + sd;
+            i64 new_right = nth + (n-i)*s/n + sd;
+            kd_select(K,
+                      new_left > left ? new_left : left,
+                      new_right < right ? new_right : right,
+                      nth, d);
+        }
+        float pv = P[nth*nd + d];
+        i64 ii = left;
+        i64 jj = right;
+        kd_swap(K, left, nth);
+        if(P[right*nd + d] > pv)
+        {
+            kd_swap(K, right, left);
+        }
+        while(ii < jj)
+        {
+            kd_swap(K, ii, jj);
+            ii++;
+            jj--;
+            while(P[ii*nd + d] < pv) { ii++; }
+            while(P[jj*nd + d] > pv) { jj--; }
+        }
+        if(P[left*nd + d] == pv)
+        {
+            kd_swap(K, left, jj);
+        } else {
+            jj++;
+            kd_swap(K, jj, right);
+        }
+        if(jj <= nth)
+        {
+            left = jj + 1;
+        }
+        if(nth <= jj)
+        {
+            right = jj - 1;
+        }
+    }
+}
+
+/* Split the range R at its node. Returns the number of children
+ * written to C (0 for a leaf) */
+static int kd_split(ftab_kdtree_t * K, const kd_range_t * R, kd_range_t * C)
+{
+    if(R->hi - R->lo <= FTAB_KD_LEAF)
+    {
+        return 0;
+    }
+    int d = 0;
+    float widest = -1;
+    for(int dd = 0; dd < K->ndim; dd++)
+    {
+        float w = R->bmax[dd] - R->bmin[dd];
+        if(w > widest)
+        {
+            widest = w;
+            d = dd;
+        }
+    }
+    size_t mid = R->lo + (R->hi - R->lo)/2;
+    kd_select(K, R->lo, R->hi - 1, mid, d);
+    K->split[mid] = d;
+    float value = K->P[mid*K->ndim + d];
+    C[0] = *R;
+    C[0].hi = mid;
+    C[0].bmax[d] = value;
+    C[1] = *R;
+    C[1].lo = mid + 1;
+    C[1].bmin[d] = value;
+    return 2;
+}
+
+static void kd_build_range(ftab_kdtree_t * K, const kd_range_t * R)
+{
+    kd_range_t C[2];
+    if(kd_split(K, R, C))
+    {
+        kd_build_range(K, C);
+        kd_build_range(K, C+1);
+    }
+}
+
+typedef struct {
+    ftab_kdtree_t * K;
+    kd_range_t * tasks;
+    size_t ntasks;
+    /* Output for kd_split_worker, two per task */
+    kd_range_t * next;
+    int * nnext;
+} kd_build_job_t;
+
+/* Split each task once */
+static void kd_split_worker(void * _J, int thread, int nthreads)
+{
+    kd_build_job_t * J = _J;
+    for(size_t kk = thread; kk < J->ntasks; kk += nthreads)
+    {
+        J->nnext[kk] = kd_split(J->K, J->tasks + kk, J->next + 2*kk);
+    }
+}
+
+static void kd_build_worker(void * _J, int thread, int nthreads)
+{
+    kd_build_job_t * J = _J;
+    for(size_t kk = thread; kk < J->ntasks; kk += nthreads)
+    {
+        kd_build_range(J->K, J->tasks + kk);
+    }
+}
+
+void ftab_kdtree_free(ftab_kdtree_t * K)
+{
+    if(K == NULL)
+    {
+        return;
+    }
+    free(K->P);
+    free(K->idx);
+    free(K->split);
+    free(K);
+}
+
+ftab_kdtree_t *
+ftab_kdtree_build(const ftab_t * T, const int * cols, int ndim)
+{
+    if(T == NULL || cols == NULL || ndim < 1 || ndim > FTAB_KD_MAXDIM)
+    {
+        fprintf(stderr, "ftab_kdtree_build: invalid arguments\n");
+        return NULL;
+    }
+    for(int dd = 0; dd < ndim; dd++)
+    {
+        if(cols[dd] < 0 || (size_t) cols[dd] >= T->ncol)
+        {
+            fprintf(stderr, "ftab_kdtree_build: invalid column %d\n", cols[dd]);
+            return NULL;
+        }
+    }
+
+    ftab_kdtree_t * K = calloc(1, sizeof(ftab_kdtree_t));
+    assert(K != NULL);
+    K->ndim = ndim;
+    K->P = malloc((T->nrow*ndim + 1)*sizeof(float));
+    K->idx = malloc((T->nrow + 1)*sizeof(int64_t));
+    K->split = calloc(T->nrow + 1, 1);
+    if(K->P == NULL || K->idx == NULL || K->split == NULL)
+    {
+        ftab_kdtree_free(K);
+        return NULL;
+    }
+
+    /* Copy the coordinates, rows with NAN are left out */
+    kd_range_t R = {0};
+    for(int dd = 0; dd < ndim; dd++)
+    {
+        R.bmin[dd] = INFINITY;
+        R.bmax[dd] = -INFINITY;
+    }
+    size_t n = 0;
+    for(size_t kk = 0; kk < T->nrow; kk++)
+    {
+        float * p = K->P + n*ndim;
+        int valid = 1;
+        for(int dd = 0; dd < ndim; dd++)
+        {
+            p[dd] = T->T[kk*T->ncol + cols[dd]];
+            valid = valid && !isnan(p[dd]);
+        }
+        if(!valid)
+        {
+            continue;
+        }
+        for(int dd = 0; dd < ndim; dd++)
+        {
+            R.bmin[dd] = p[dd] < R.bmin[dd] ? p[dd] : R.bmin[dd];
+            R.bmax[dd] = p[dd] > R.bmax[dd] ? p[dd] : R.bmax[dd];
+        }
+        K->idx[n++] = kk;
+    }
+    K->n = n;
+    R.lo = 0;
+    R.hi = n;
+
+    /* Split the top levels one level at a time until there is
+     * enough work for all threads */
+    int nthreads = nthreads_for(n, 1 << 16);
+    size_t max_tasks = 16*nthreads;
+    kd_build_job_t J = {0};
+    J.K = K;
+    J.tasks = malloc(3*max_tasks*sizeof(kd_range_t));
+    J.nnext = malloc(max_tasks*sizeof(int));
+    assert(J.tasks != NULL);
+    assert(J.nnext != NULL);
+    J.next = J.tasks + max_tasks;
+    J.tasks[0] = R;
+    J.ntasks = 1;
+    while(nthreads > 1 && J.ntasks > 0 && J.ntasks < max_tasks)
+    {
+        run_parallel(J.ntasks < (size_t) nthreads ? (int) J.ntasks : nthreads,
+                     kd_split_worker, &J);
+        size_t ntasks = 0;
+        for(size_t kk = 0; kk < J.ntasks; kk++)
+        {
+            for(int cc = 0; cc < J.nnext[kk]; cc++)
+            {
+                J.tasks[ntasks++] = J.next[2*kk + cc];
+            }
+        }
+        J.ntasks = ntasks;
+    }
+    run_parallel(nthreads, kd_build_worker, &J);
+    free(J.nnext);
+    kd_range_t * tasks = J.tasks;
+    free(tasks);
+    return K;
+}
+
+size_t ftab_kdtree_size(const ftab_kdtree_t * K)
+{
+    return K == NULL ? 0 : K->n;
+}
+
+static float kd_dist2(const float * A, const float * B, int ndim)
+{
+    float d2 = 0;
+    for(int dd = 0; dd < ndim; dd++)
+    {
+        float d = A[dd] - B[dd];
+        d2 += d*d;
+    }
+    return d2;
+}
+
+typedef struct {
+    float d2;
+    int64_t idx;
+} kd_hit_t;
+
+/* Max-heap on distance */
+static void kd_heap_push(kd_hit_t * H, size_t * n, size_t k, kd_hit_t hit)
+{
+    size_t pos = 0;
+    if(*n < k)
+    {
+        pos = (*n)++;
+        H[pos] = hit;
+        while(pos > 0 && H[(pos-1)/2].d2 < H[pos].d2)
+        {
+            kd_hit_t tmp = H[pos];
+            H[pos] = H[(pos-1)/2];
+            H[(pos-1)/2] = tmp;
+            pos = (pos-1)/2;
+        }
+        return;
+    }
+    if(hit.d2 >= H[0].d2)
+    {
+        return;
+    }
+    H[0] = hit;
+    while(1)
+    {
+        size_t largest = pos;
+        size_t left = 2*pos + 1;
+        size_t right = left + 1;
+        if(left < *n && H[left].d2 > H[largest].d2)
+        {
+            largest = left;
+        }
+        if(right < *n && H[right].d2 > H[largest].d2)
+        {
+            largest = right;
+        }
+        if(largest == pos)
+        {
+            break;
+        }
+        kd_hit_t tmp = H[pos];
+        H[pos] = H[largest];
+        H[largest] = tmp;
+        pos = largest;
+    }
+}
+
+typedef struct {
+    size_t lo;
+    size_t hi;
+    float bound; /* Lower bound on the squared distance to the range */
+} kd_stack_t;
+
+/* Called for each point within the search radius. Can lower *max_d2 */
+typedef void (*kd_visit_fn)(void * ctx, size_t point, float d2, float * max_d2);
+
+/* Visit all points within sqrt(*max_d2) of q */
+static void kd_search(const ftab_kdtree_t * K, const float * q,
+                      float max_d2, kd_visit_fn visit, void * ctx)
+{
+    kd_stack_t stack[FTAB_KD_STACK];
+    int top = 0;
+    stack[top++] = (kd_stack_t) {0, K->n, 0};
+    while(top > 0)
+    {
+        kd_stack_t S = stack[--top];
+        if(S.bound > max_d2)
+        {
+            continue;
+        }
+        if(S.hi - S.lo <= FTAB_KD_LEAF)
+        {
+            for(size_t pp = S.lo; pp < S.hi; pp++)
+            {
+                float d2 = kd_dist2(K->P + pp*K->ndim, q, K->ndim);
+                if(d2 <= max_d2)
+                {
+                    visit(ctx, pp, d2, &max_d2);
+                }
+            }
+            continue;
+        }
+        size_t pp = S.lo + (S.hi - S.lo)/2;
+        float d2 = kd_dist2(K->P + pp*K->ndim, q, K->ndim);
+        if(d2 <= max_d2)
+        {
+            visit(ctx, pp, d2, &max_d2);
+        }
+        int d = K->split[pp];
+        float diff = q[d] - K->P[pp*K->ndim + d];
+        float bound = diff*diff > S.bound ? diff*diff : S.bound;
+        /* Push the far side first so that the near side is searched
+         * first */
+        if(diff < 0)
+        {
+            stack[top++] = (kd_stack_t) {pp+1, S.hi, bound};
+            stack[top++] = (kd_stack_t) {S.lo, pp, S.bound};
+        } else {
+            stack[top++] = (kd_stack_t) {S.lo, pp, bound};
+            stack[top++] = (kd_stack_t) {pp+1, S.hi, S.bound};
+        }
+    }
+}
+
+typedef struct {
+    const ftab_kdtree_t * K;
+    kd_hit_t * H;
+    size_t n;
+    size_t k;
+    /* Radius search */
+    int64_t * I;
+    size_t cap;
+} kd_visit_t;
+
+static void kd_visit_knn(void * _V, size_t point, float d2, float * max_d2)
+{
+    kd_visit_t * V = _V;
+    kd_hit_t hit = {d2, V->K->idx[point]};
+    kd_heap_push(V->H, &V->n, V->k, hit);
+    if(V->n == V->k)
+    {
+        *max_d2 = V->H[0].d2;
+    }
+}
+
+static void kd_visit_radius(void * _V, size_t point, float d2, float * max_d2)
+{
+    (void) d2;
+    (void) max_d2;
+    kd_visit_t * V = _V;
+    if(V->n == V->cap)
+    {
+        V->cap *= 2;
+        V->I = realloc(V->I, V->cap*sizeof(int64_t));
+        assert(V->I != NULL);
+    }
+    V->I[V->n++] = V->K->idx[point];
+}
+
+static int kd_hit_cmp(const void * _A, const void * _B)
+{
+    const kd_hit_t * A = _A;
+    const kd_hit_t * B = _B;
+    if(A->d2 != B->d2)
+    {
+        return A->d2 < B->d2 ? -1 : 1;
+    }
+    return A->idx < B->idx ? -1 : (A->idx > B->idx);
+}
+
+typedef struct {
+    const ftab_kdtree_t * K;
+    const float * Q;
+    size_t nq;
+    size_t k;
+    float radius2;
+    int64_t * idx;
+    float * dist2;
+    /* Radius search, per thread results */
+    size_t * count;
+    int64_t ** thread_idx;
+} kd_query_job_t;
+
+static void kd_knn_worker(void * _J, int thread, int nthreads)
+{
+    kd_query_job_t * J = _J;
+    const ftab_kdtree_t * K = J->K;
+    size_t first = 0;
+    size_t last = 0;
+    thread_range(J->nq, thread, nthreads, &first, &last);
+    kd_visit_t V = {0};
+    V.K = K;
+    V.k = J->k;
+    V.H = malloc(J->k*sizeof(kd_hit_t));
+    assert(V.H != NULL);
+    for(size_t qq = first; qq < last; qq++)
+    {
+        V.n = 0;
+        kd_search(K, J->Q + qq*K->ndim, INFINITY, kd_visit_knn, &V);
+        qsort(V.H, V.n, sizeof(kd_hit_t), kd_hit_cmp);
+        for(size_t kk = 0; kk < J->k; kk++)
+        {
+            J->idx[qq*J->k + kk] = kk < V.n ? V.H[kk].idx : -1;
+            if(J->dist2 != NULL)
+            {
+                J->dist2[qq*J->k + kk] = kk < V.n ? V.H[kk].d2 : INFINITY;
+            }
+        }
+    }
+    free(V.H);
+}
+
+int ftab_kdtree_knn(const ftab_kdtree_t * K,
+                    const float * Q, size_t nq, size_t k,
+                    int64_t * idx, float * dist2)
+{
+    if(K == NULL || Q == NULL || idx == NULL)
+    {
+        return EXIT_FAILURE;
+    }
+    if(k == 0 || nq == 0)
+    {
+        return EXIT_SUCCESS;
+    }
+    kd_query_job_t J = {0};
+    J.K = K;
+    J.Q = Q;
+    J.nq = nq;
+    J.k = k;
+    J.idx = idx;
+    J.dist2 = dist2;
+    run_parallel(nthreads_for(nq, 256), kd_knn_worker, &J);
+    return EXIT_SUCCESS;
+}
+
+static void kd_radius_worker(void * _J, int thread, int nthreads)
+{
+    kd_query_job_t * J = _J;
+    const ftab_kdtree_t * K = J->K;
+    size_t first = 0;
+    size_t last = 0;
+    thread_range(J->nq, thread, nthreads, &first, &last);
+    kd_visit_t V = {0};
+    V.K = K;
+    V.cap = 1024;
+    V.I = malloc(V.cap*sizeof(int64_t));
+    assert(V.I != NULL);
+    for(size_t qq = first; qq < last; qq++)
+    {
+        size_t n0 = V.n;
+        kd_search(K, J->Q + qq*K->ndim, J->radius2, kd_visit_radius, &V);
+        J->count[qq] = V.n - n0;
+    }
+    J->thread_idx[thread] = V.I;
+}
+
+int ftab_kdtree_radius(const ftab_kdtree_t * K,
+                       const float * Q, size_t nq, float radius,
+                       size_t ** offsets, int64_t ** idx)
+{
+    if(K == NULL || Q == NULL || offsets == NULL || idx == NULL)
+    {
+        return EXIT_FAILURE;
+    }
+    kd_query_job_t J = {0};
+    J.K = K;
+    J.Q = Q;
+    J.nq = nq;
+    J.radius2 = radius*radius;
+    int nthreads = nthreads_for(nq, 256);
+    J.count = calloc(nq + 1, sizeof(size_t));
+    J.thread_idx = calloc(nthreads, sizeof(int64_t*));
+    size_t * O = calloc(nq + 1, sizeof(size_t));
+    assert(J.count != NULL);
+    assert(J.thread_idx != NULL);
+    assert(O != NULL);
+    run_parallel(nthreads, kd_radius_worker, &J);
+
+    for(size_t qq = 0; qq < nq; qq++)
+    {
+        O[qq+1] = O[qq] + J.count[qq];
+    }
+    int64_t * I = malloc((O[nq] + 1)*sizeof(int64_t));
+    assert(I != NULL);
+    /* The threads processed consecutive ranges of queries */
+    for(int tt = 0; tt < nthreads; tt++)
+    {
+        size_t first = 0;
+        size_t last = 0;
+        thread_range(nq, tt, nthreads, &first, &last);
+        memcpy(I + O[first], J.thread_idx[tt],
+               (O[last] - O[first])*sizeof(int64_t));
+        free(J.thread_idx[tt]);
+    }
+    free(J.thread_idx);
+    free(J.count);
+    *offsets = O;
+    *idx = I;
+    return EXIT_SUCCESS;
+}
+
+/*                           HISTOGRAMS
+ *                           ==========
+ *
+ * The rows are processed in blocks. For each block the column values
+ * are gathered into a contiguous buffer so that the bin indices can
+ * be computed by vectorized (branch free) loops. Each thread counts
+ * into a private histogram with an extra slot for values outside the
+ * range. The histograms are summed in the end.
+ */
+
+#define FTAB_HIST_BLOCK 1024
+
+typedef struct {
+    const ftab_t * T;
+    const int * cols;
+    int ndim;
+    const size_t * nbins;
+    const float * lo;
+    const float * hi;
+    u32 nbin_total;
+    u64 * counts; /* (nbin_total + 1) per thread */
+} ftab_hist_job_t;
+
+/* Add the bin index along one dimension to B. Out of range values
+ * and NAN sets B to the overflow bin. */
+static void
+hist_bin_index(const float * restrict V, u32 * restrict B, size_t n,
+               float lo, float scale, u32 nbins, u32 stride, u32 overflow)
+{
+    const float fbins = nbins;
+    for(size_t kk = 0; kk < n; kk++)
+    {
+        float x = (V[kk] - lo) * scale;
+        /* False for NAN */
+        int valid = (x >= 0) & (x <= fbins) & (B[kk] != overflow);
+        x = valid ? x : 0;
+        u32 b = (u32) x;
+        b = b < nbins ? b : nbins - 1; /* x == hi goes to the last bin */
+        B[kk] = valid ? B[kk] + b*stride : overflow;
+    }
+}
+
+static void hist_worker(void * _J, int thread, int nthreads)
+{
+    ftab_hist_job_t * J = _J;
+    const ftab_t * T = J->T;
+    size_t first = 0;
+    size_t last = 0;
+    thread_range(T->nrow, thread, nthreads, &first, &last);
+    u64 * C = J->counts + (size_t) thread*(J->nbin_total + 1);
+    float V[FTAB_HIST_BLOCK];
+    u32 B[FTAB_HIST_BLOCK];
+
+    for(size_t b0 = first; b0 < last; b0 += FTAB_HIST_BLOCK)
+    {
+        size_t n = last - b0 < FTAB_HIST_BLOCK ? last - b0 : FTAB_HIST_BLOCK;
+        memset(B, 0, n*sizeof(u32));
+        u32 stride = 1;
+        for(int dd = J->ndim - 1; dd >= 0; dd--)
+        {
+            const float * src = T->T + b0*T->ncol + J->cols[dd];
+            for(size_t kk = 0; kk < n; kk++)
+            {
+                V[kk] = src[kk*T->ncol];
+            }
+            float scale = J->nbins[dd] / (J->hi[dd] - J->lo[dd]);
+            hist_bin_index(V, B, n, J->lo[dd], scale, J->nbins[dd],
+                           stride, J->nbin_total);
+            stride *= J->nbins[dd];
+        }
+        for(size_t kk = 0; kk < n; kk++)
+        {
+            C[B[kk]]++;
+        }
+    }
+}
+
+ftab_t *
+ftab_histogram_nd(const ftab_t * T, const int * cols, int ndim,
+                  const size_t * nbins, const float * lo, const float * hi)
+{
+    if(T == NULL || cols == NULL || nbins == NULL
+       || lo == NULL || hi == NULL || ndim < 1)
+    {
+        return NULL;
+    }
+    u64 nbin_total = 1;
+    for(int dd = 0; dd < ndim; dd++)
+    {
+        if(cols[dd] < 0 || (size_t) cols[dd] >= T->ncol)
+        {
+            fprintf(stderr, "ftab_histogram: invalid column %d\n", cols[dd]);
+            return NULL;
+        }
+        if(nbins[dd] < 1 || !(hi[dd] > lo[dd]))
+        {
+            fprintf(stderr, "ftab_histogram: invalid bins for column %d\n",
+                    cols[dd]);
+            return NULL;
+        }
+        nbin_total *= nbins[dd];
+        if(nbin_total >= UINT32_MAX)
+        {
+            fprintf(stderr, "ftab_histogram: too many bins\n");
+            return NULL;
+        }
+    }
+
+    ftab_hist_job_t J = {0};
+    J.T = T;
+    J.cols = cols;
+    J.ndim = ndim;
+    J.nbins = nbins;
+    J.lo = lo;
+    J.hi = hi;
+    J.nbin_total = nbin_total;
+    int nthreads = nthreads_for(T->nrow, 1 << 16);
+    J.counts = calloc((nbin_total + 1)*nthreads, sizeof(u64));
+    if(J.counts == NULL)
+    {
+        return NULL;
+    }
+    run_parallel(nthreads, hist_worker, &J);
+    for(int tt = 1; tt < nthreads; tt++)
+    {
+        const u64 * C = J.counts + tt*(nbin_total + 1);
+        for(u64 kk = 0; kk < nbin_total; kk++)
+        {
+            J.counts[kk] += C[kk];
+        }
+    }
+
+    /* One row per bin with the bin centers and the count */
+    ftab_t * H = calloc(1, sizeof(ftab_t));
+    assert(H != NULL);
+    H->ncol = ndim + 1;
+    H->nrow = nbin_total;
+    H->nrow_alloc = nbin_total;
+    H->T = calloc(H->nrow*H->ncol, sizeof(float));
+    if(H->T == NULL)
+    {
+        free(H);
+        free(J.counts);
+        return NULL;
+    }
+    for(u64 kk = 0; kk < nbin_total; kk++)
+    {
+        float * row = H->T + kk*H->ncol;
+        u64 rest = kk;
+        for(int dd = ndim - 1; dd >= 0; dd--)
+        {
+            u64 b = rest % nbins[dd];
+            rest /= nbins[dd];
+            float width = (hi[dd] - lo[dd]) / nbins[dd];
+            row[dd] = lo[dd] + (b + 0.5)*width;
+        }
+        row[ndim] = J.counts[kk];
+    }
+    for(int dd = 0; dd < ndim; dd++)
+    {
+        char name[32];
+        const char * cname = NULL;
+        if(T->colnames != NULL)
+        {
+            cname = T->colnames[cols[dd]];
+        }
+        if(cname == NULL)
+        {
+            snprintf(name, sizeof(name), "col_%d", cols[dd]+1);
+            cname = name;
+        }
+        ftab_set_colname(H, dd, cname);
+    }
+    ftab_set_colname(H, ndim, "count");
+    free(J.counts);
+    return H;
+}
+
+ftab_t *
+ftab_histogram(const ftab_t * T, int col, size_t nbins, float lo, float hi)
+{
+    return ftab_histogram_nd(T, &col, 1, &nbins, &lo, &hi);
+}
+
+/*                        PACKED COLUMNS
+ *                        ==============
+ *
+ * Compressed, column-wise, in-memory copy of a table. Each column is
+ * stored with the smallest of:
+ *
+ * - FTAB_ENC_FOR: Frame of reference. Integer valued columns are
+ *   stored as value - min, bit-packed with as few bits as needed.
+ * - FTAB_ENC_DICT: Dictionary of the distinct values (bit patterns)
+ *   and bit-packed codes.
+ * - FTAB_ENC_F16: Half precision floats. Only used when it is exact
+ *   or if lossy compression was asked for.
+ * - FTAB_ENC_RAW: Plain float32.
+ */
+
+#define FTAB_DICT_MAX (1 << 16)
+
+typedef struct {
+    ftab_encoding_t enc;
+    int bits; /* Bit width of the packed codes */
+    float base; /* FOR: value = base + code */
+    size_t ndict;
+    float * dict;
+    u64 * packed; /* Bit-packed codes, FOR or DICT */
+    u16 * f16;
+    float * raw;
+} ftab_packed_col_t;
+
+struct ftab_packed {
+    size_t nrow;
+    size_t ncol;
+    char ** colnames;
+    ftab_packed_col_t * cols;
+};
+
+static u16 f32_to_f16(float value)
+{
+    u32 x;
+    memcpy(&x, &value, 4);
+    u32 sign = (x >> 16) & 0x8000;
+    i32 exp = ((x >> 23) & 0xff) - 127 + 15;
+    u32 mant = x & 0x7fffff;
+    if(((x >> 23) & 0xff) == 0xff)
+    {
+        /* Inf or NAN, keep NAN a NAN */
+        return sign | 0x7c00 | (mant ? 0x200 | (mant >> 13) : 0);
+    }
+    if(exp >= 31)
+    {
+        return sign | 0x7c00;
+    }
+    if(exp <= 0)
+    {
+        if(exp < -10)
+        {
+            return sign;
+        }
+        /* Subnormal, round to nearest even */
+        mant |= 0x800000;
+        u32 shift = 14 - exp;
+        u32 half = mant >> shift;
+        u32 rest = mant & ((1u << shift) - 1);
+        u32 mid = 1u << (shift - 1);
+        if(rest > mid || (rest == mid && (half & 1)))
+        {
+            half++;
+        }
+        return sign | half;
+    }
+    u32 half = sign | (exp << 10) | (mant >> 13);
+    u32 rest = mant & 0x1fff;
+    if(rest > 0x1000 || (rest == 0x1000 && (half & 1)))
+    {
+        half++; /* Might carry into the exponent, which is correct */
+    }
+    return half;
+}
+
+static float f16_to_f32(u16 h)
+{
+    u32 sign = (u32) (h & 0x8000) << 16;
+    u32 exp = (h >> 10) & 0x1f;
+    u32 mant = h & 0x3ff;
+    u32 x = 0;
+    if(exp == 0x1f)
+    {
+        x = sign | 0x7f800000 | (mant << 13);
+    } else if(exp == 0)
+    {
+        if(mant == 0)
+        {
+            x = sign;
+        } else {
+            /* Subnormal, normalize */
+            exp = 127 - 15 + 1;
+            while(!(mant & 0x400))
+            {
+                mant <<= 1;
+                exp--;
+            }
+            x = sign | (exp << 23) | ((mant & 0x3ff) << 13);
+        }
+    } else {
+        x = sign | ((exp - 15 + 127) << 23) | (mant << 13);
+    }
+    float value;
+    memcpy(&value, &x, 4);
+    return value;
+}
+
+/* Number of bits needed for values up to max */
+static int bits_for(u64 max)
+{
+    int bits = 0;
+    while(bits < 64 && (max >> bits) != 0)
+    {
+        bits++;
+    }
+    return bits;
+}
+
+static u64 * bitpack_alloc(size_t n, int bits)
+{
+    return calloc((n*bits + 63)/64 + 1, sizeof(u64));
+}
+
+static void bitpack_set(u64 * W, size_t idx, int bits, u64 code)
+{
+    if(bits == 0)
+    {
+        return;
+    }
+    size_t pos = idx*bits;
+    size_t word = pos >> 6;
+    int off = pos & 63;
+    W[word] |= code << off;
+    if(off + bits > 64)
+    {
+        W[word+1] |= code >> (64 - off);
+    }
+}
+
+static u32 bitpack_get(const u64 * W, size_t idx, int bits)
+{
+    if(bits == 0)
+    {
+        return 0;
+    }
+    size_t pos = idx*bits;
+    size_t word = pos >> 6;
+    int off = pos & 63;
+    u64 v = W[word] >> off;
+    if(off + bits > 64)
+    {
+        v |= W[word+1] << (64 - off);
+    }
+    return v & ((1ull << bits) - 1);
+}
+
+/* Unpack codes [first, first+n) */
+static void bitpack_get_range(const u64 * W, size_t first, size_t n,
+                              int bits, u32 * out)
+{
+    for(size_t kk = 0; kk < n; kk++)
+    {
+        out[kk] = bitpack_get(W, first + kk, bits);
+    }
+}
+
+static int u32_cmp(const void * _A, const void * _B)
+{
+    u32 a = *(const u32 *) _A;
+    u32 b = *(const u32 *) _B;
+    return a < b ? -1 : a > b;
+}
+
+/* Find the dictionary of a column, returns NULL if there are too many
+ * distinct values */
+static u32 * dict_build(const float * C, size_t n, size_t * ndict)
+{
+    /* Open addressing set of bit patterns */
+    size_t cap = 2*FTAB_DICT_MAX;
+    u32 * set = malloc(cap*sizeof(u32));
+    u8 * used = calloc(cap, 1);
+    assert(set != NULL && used != NULL);
+    size_t nd = 0;
+    for(size_t kk = 0; kk < n && nd <= FTAB_DICT_MAX; kk++)
+    {
+        u32 x;
+        memcpy(&x, C + kk, 4);
+        size_t h = (x * 2654435761u) & (cap - 1);
+        while(used[h] && set[h] != x)
+        {
+            h = (h + 1) & (cap - 1);
+        }
+        if(!used[h])
+        {
+            used[h] = 1;
+            set[h] = x;
+            nd++;
+        }
+    }
+    if(nd > FTAB_DICT_MAX)
+    {
+        free(set);
+        free(used);
+        return NULL;
+    }
+    u32 * D = malloc((nd + 1)*sizeof(u32));
+    assert(D != NULL);
+    size_t pos = 0;
+    for(size_t kk = 0; kk < cap; kk++)
+    {
+        if(used[kk])
+        {
+            D[pos++] = set[kk];
+        }
+    }
+    free(set);
+    free(used);
+    qsort(D, nd, sizeof(u32), u32_cmp);
+    *ndict = nd;
+    return D;
+}
+
+static size_t dict_lookup(const u32 * D, size_t nd, u32 x)
+{
+    size_t lo = 0;
+    size_t hi = nd;
+    while(hi - lo > 1)
+    {
+        size_t mid = (lo + hi)/2;
+        if(D[mid] <= x)
+        {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+static void packed_col_free(ftab_packed_col_t * PC)
+{
+    free(PC->dict);
+    free(PC->packed);
+    free(PC->f16);
+    free(PC->raw);
+}
+
+/* Encode a contiguous column */
+static void pack_column(ftab_packed_col_t * PC, const float * C, size_t n, int flags)
+{
+    /* Frame of reference, integers only */
+    int integer = n > 0;
+    float fmin = INFINITY;
+    float fmax = -INFINITY;
+    int f16_exact = 1;
+    for(size_t kk = 0; kk < n; kk++)
+    {
+        float v = C[kk];
+        integer = integer && v == rintf(v) && fabsf(v) <= 16777216.0f
+            && !(v == 0 && signbit(v));
+        fmin = v < fmin ? v : fmin;
+        fmax = v > fmax ? v : fmax;
+        if(f16_exact)
+        {
+            float r = f16_to_f32(f32_to_f16(v));
+            f16_exact = memcmp(&r, &v, 4) == 0 || (isnan(r) && isnan(v));
+        }
+    }
+    size_t best = 4*n;
+    PC->enc = FTAB_ENC_RAW;
+
+    int for_bits = integer ? bits_for((u64) ((double) fmax - fmin)) : 64;
+    size_t for_bytes = (n*for_bits + 7)/8;
+    if(integer && for_bytes < best)
+    {
+        best = for_bytes;
+        PC->enc = FTAB_ENC_FOR;
+    }
+
+    size_t ndict = 0;
+    u32 * D = NULL;
+    if(PC->enc != FTAB_ENC_FOR || for_bits > 1)
+    {
+        D = dict_build(C, n, &ndict);
+    }
+    int dict_bits = D == NULL ? 64 : bits_for(ndict > 0 ? ndict - 1 : 0);
+    size_t dict_bytes = (n*dict_bits + 7)/8 + 4*ndict;
+    if(D != NULL && dict_bytes < best)
+    {
+        best = dict_bytes;
+        PC->enc = FTAB_ENC_DICT;
+    }
+
+    if((f16_exact || (flags & FTAB_PACK_LOSSY_F16)) && 2*n < best)
+    {
+        best = 2*n;
+        PC->enc = FTAB_ENC_F16;
+    }
+
+    switch(PC->enc)
+    {
+    case FTAB_ENC_FOR:
+        PC->bits = for_bits;
+        PC->base = fmin;
+        PC->packed = bitpack_alloc(n, for_bits);
+        assert(PC->packed != NULL);
+        for(size_t kk = 0; kk < n; kk++)
+        {
+            bitpack_set(PC->packed, kk, for_bits, (u64) ((double) C[kk] - fmin));
+        }
+        break;
+    case FTAB_ENC_DICT:
+        PC->bits = dict_bits;
+        PC->ndict = ndict;
+        PC->dict = malloc((ndict + 1)*sizeof(float));
+        PC->packed = bitpack_alloc(n, dict_bits);
+        assert(PC->dict != NULL && PC->packed != NULL);
+        memcpy(PC->dict, D, ndict*sizeof(float));
+        for(size_t kk = 0; kk < n; kk++)
+        {
+            u32 x;
+            memcpy(&x, C + kk, 4);
+            bitpack_set(PC->packed, kk, dict_bits, dict_lookup(D, ndict, x));
+        }
+        break;
+    case FTAB_ENC_F16:
+        PC->f16 = malloc((n + 1)*sizeof(u16));
+        assert(PC->f16 != NULL);
+        for(size_t kk = 0; kk < n; kk++)
+        {
+            PC->f16[kk] = f32_to_f16(C[kk]);
+        }
+        break;
+    case FTAB_ENC_RAW:
+        PC->raw = malloc((n + 1)*sizeof(float));
+        assert(PC->raw != NULL);
+        memcpy(PC->raw, C, n*sizeof(float));
+        break;
+    }
+    free(D);
+}
+
+typedef struct {
+    const ftab_t * T;
+    ftab_packed_t * P;
+    int flags;
+} ftab_pack_job_t;
+
+static void pack_worker(void * _J, int thread, int nthreads)
+{
+    ftab_pack_job_t * J = _J;
+    const ftab_t * T = J->T;
+    float * C = malloc((T->nrow + 1)*sizeof(float));
+    assert(C != NULL);
+    for(size_t cc = thread; cc < T->ncol; cc += nthreads)
+    {
+        for(size_t kk = 0; kk < T->nrow; kk++)
+        {
+            C[kk] = T->T[kk*T->ncol + cc];
+        }
+        pack_column(J->P->cols + cc, C, T->nrow, J->flags);
+    }
+    free(C);
+}
+
+ftab_packed_t * ftab_pack(const ftab_t * T, int flags)
+{
+    if(T == NULL)
+    {
+        return NULL;
+    }
+    ftab_packed_t * P = calloc(1, sizeof(ftab_packed_t));
+    assert(P != NULL);
+    P->nrow = T->nrow;
+    P->ncol = T->ncol;
+    P->cols = calloc(T->ncol, sizeof(ftab_packed_col_t));
+    assert(P->cols != NULL);
+    if(T->colnames != NULL)
+    {
+        P->colnames = calloc(T->ncol, sizeof(char*));
+        assert(P->colnames != NULL);
+        for(size_t cc = 0; cc < T->ncol; cc++)
+        {
+            if(T->colnames[cc] != NULL)
+            {
+                P->colnames[cc] = strdup(T->colnames[cc]);
+            }
+        }
+    }
+    ftab_pack_job_t J = {T, P, flags};
+    int nthreads = nthreads_for(T->nrow*T->ncol, 1 << 18);
+    nthreads = (size_t) nthreads > T->ncol ? (int) T->ncol : nthreads;
+    run_parallel(nthreads, pack_worker, &J);
+    return P;
+}
+
+void ftab_packed_free(ftab_packed_t * P)
+{
+    if(P == NULL)
+    {
+        return;
+    }
+    for(size_t cc = 0; cc < P->ncol; cc++)
+    {
+        packed_col_free(P->cols + cc);
+        if(P->colnames != NULL)
+        {
+            free(P->colnames[cc]);
+        }
+    }
+    free(P->colnames);
+    free(P->cols);
+    free(P);
+}
+
+size_t ftab_packed_nrow(const ftab_packed_t * P)
+{
+    return P->nrow;
+}
+
+size_t ftab_packed_ncol(const ftab_packed_t * P)
+{
+    return P->ncol;
+}
+
+ftab_encoding_t ftab_packed_encoding(const ftab_packed_t * P, int col)
+{
+    assert(col >= 0 && (size_t) col < P->ncol);
+    return P->cols[col].enc;
+}
+
+size_t ftab_packed_bytes(const ftab_packed_t * P)
+{
+    size_t bytes = sizeof(ftab_packed_t) + P->ncol*sizeof(ftab_packed_col_t);
+    for(size_t cc = 0; cc < P->ncol; cc++)
+    {
+        const ftab_packed_col_t * PC = P->cols + cc;
+        switch(PC->enc)
+        {
+        case FTAB_ENC_FOR:
+            bytes += (P->nrow*PC->bits + 63)/64*8;
+            break;
+        case FTAB_ENC_DICT:
+            bytes += (P->nrow*PC->bits + 63)/64*8 + PC->ndict*sizeof(float);
+            break;
+        case FTAB_ENC_F16:
+            bytes += P->nrow*sizeof(u16);
+            break;
+        case FTAB_ENC_RAW:
+            bytes += P->nrow*sizeof(float);
+            break;
+        }
+    }
+    return bytes;
+}
+
+/* Decode rows [first, first+n) of a column */
+static void
+packed_decode_range(const ftab_packed_col_t * PC, size_t first, size_t n, float * out)
+{
+    switch(PC->enc)
+    {
+    case FTAB_ENC_FOR:
+        for(size_t kk = 0; kk < n; kk++)
+        {
+            out[kk] = (double) PC->base + bitpack_get(PC->packed, first + kk, PC->bits);
+        }
+        break;
+    case FTAB_ENC_DICT:
+        for(size_t kk = 0; kk < n; kk++)
+        {
+            out[kk] = PC->dict[bitpack_get(PC->packed, first + kk, PC->bits)];
+        }
+        break;
+    case FTAB_ENC_F16:
+        for(size_t kk = 0; kk < n; kk++)
+        {
+            out[kk] = f16_to_f32(PC->f16[first + kk]);
+        }
+        break;
+    case FTAB_ENC_RAW:
+        memcpy(out, PC->raw + first, n*sizeof(float));
+        break;
+    }
+}
+
+int ftab_packed_decode(const ftab_packed_t * P, int col, float * out)
+{
+    if(P == NULL || out == NULL || col < 0 || (size_t) col >= P->ncol)
+    {
+        return EXIT_FAILURE;
+    }
+    packed_decode_range(P->cols + col, 0, P->nrow, out);
+    return EXIT_SUCCESS;
+}
+
+ftab_t * ftab_unpack(const ftab_packed_t * P)
+{
+    if(P == NULL)
+    {
+        return NULL;
+    }
+    ftab_t * T = calloc(1, sizeof(ftab_t));
+    assert(T != NULL);
+    T->nrow = P->nrow;
+    T->ncol = P->ncol;
+    T->nrow_alloc = P->nrow > 0 ? P->nrow : 1;
+    T->T = malloc(T->nrow_alloc*T->ncol*sizeof(float));
+    float * C = malloc((P->nrow + 1)*sizeof(float));
+    assert(T->T != NULL && C != NULL);
+    for(size_t cc = 0; cc < P->ncol; cc++)
+    {
+        packed_decode_range(P->cols + cc, 0, P->nrow, C);
+        for(size_t kk = 0; kk < P->nrow; kk++)
+        {
+            T->T[kk*T->ncol + cc] = C[kk];
+        }
+        if(P->colnames != NULL && P->colnames[cc] != NULL)
+        {
+            ftab_set_colname(T, cc, P->colnames[cc]);
+        }
+    }
+    free(C);
+    return T;
+}
+
+#define FTAB_PACKED_BLOCK 1024
+
+int ftab_packed_stats(const ftab_packed_t * P, int col, ftab_colstats_t * S)
+{
+    if(P == NULL || S == NULL || col < 0 || (size_t) col >= P->ncol)
+    {
+        return EXIT_FAILURE;
+    }
+    const ftab_packed_col_t * PC = P->cols + col;
+    memset(S, 0, sizeof(ftab_colstats_t));
+    S->min = NAN;
+    S->max = NAN;
+    u32 codes[FTAB_PACKED_BLOCK];
+
+    if(PC->enc == FTAB_ENC_FOR)
+    {
+        /* Integer arithmetic on the codes */
+        u64 sum = 0;
+        u32 cmin = UINT32_MAX;
+        u32 cmax = 0;
+        for(size_t b0 = 0; b0 < P->nrow; b0 += FTAB_PACKED_BLOCK)
+        {
+            size_t n = P->nrow - b0 < FTAB_PACKED_BLOCK ? P->nrow - b0 : FTAB_PACKED_BLOCK;
+            bitpack_get_range(PC->packed, b0, n, PC->bits, codes);
+            for(size_t kk = 0; kk < n; kk++)
+            {
+                sum += codes[kk];
+                cmin = codes[kk] < cmin ? codes[kk] : cmin;
+                cmax = codes[kk] > cmax ? codes[kk] : cmax;
+            }
+        }
+        S->n = P->nrow;
+        if(P->nrow > 0)
+        {
+            S->sum = (double) sum + (double) PC->base * P->nrow;
+            S->min = (double) PC->base + cmin;
+            S->max = (double) PC->base + cmax;
+        }
+        return EXIT_SUCCESS;
+    }
+
+    if(PC->enc == FTAB_ENC_DICT)
+    {
+        /* Count the codes, then aggregate over the dictionary */
+        u64 * count = calloc(PC->ndict + 1, sizeof(u64));
+        assert(count != NULL);
+        for(size_t b0 = 0; b0 < P->nrow; b0 += FTAB_PACKED_BLOCK)
+        {
+            size_t n = P->nrow - b0 < FTAB_PACKED_BLOCK ? P->nrow - b0 : FTAB_PACKED_BLOCK;
+            bitpack_get_range(PC->packed, b0, n, PC->bits, codes);
+            for(size_t kk = 0; kk < n; kk++)
+            {
+                count[codes[kk]]++;
+            }
+        }
+        for(size_t dd = 0; dd < PC->ndict; dd++)
+        {
+            float v = PC->dict[dd];
+            if(count[dd] == 0 || isnan(v))
+            {
+                continue;
+            }
+            S->n += count[dd];
+            S->sum += (double) v * count[dd];
+            S->min = !(S->min <= v) ? v : S->min;
+            S->max = !(S->max >= v) ? v : S->max;
+        }
+        free(count);
+        return EXIT_SUCCESS;
+    }
+
+    float V[FTAB_PACKED_BLOCK];
+    for(size_t b0 = 0; b0 < P->nrow; b0 += FTAB_PACKED_BLOCK)
+    {
+        size_t n = P->nrow - b0 < FTAB_PACKED_BLOCK ? P->nrow - b0 : FTAB_PACKED_BLOCK;
+        packed_decode_range(PC, b0, n, V);
+        for(size_t kk = 0; kk < n; kk++)
+        {
+            float v = V[kk];
+            if(isnan(v))
+            {
+                continue;
+            }
+            S->n++;
+            S->sum += v;
+            S->min = !(S->min <= v) ? v : S->min;
+            S->max = !(S->max >= v) ? v : S->max;
+        }
+    }
+    return EXIT_SUCCESS;
+}
+
+int ftab_packed_select_range(const ftab_packed_t * P, int col,
+                             float lo, float hi, u8 * selection)
+{
+    if(P == NULL || selection == NULL || col < 0 || (size_t) col >= P->ncol)
+    {
+        return EXIT_FAILURE;
+    }
+    const ftab_packed_col_t * PC = P->cols + col;
+    u32 codes[FTAB_PACKED_BLOCK];
+
+    if(PC->enc == FTAB_ENC_FOR)
+    {
+        /* Compare the codes against the range in the code domain */
+        double clo = ceil((double) lo - PC->base);
+        double chi = floor((double) hi - PC->base);
+        clo = clo < 0 ? 0 : clo;
+        if(!(chi >= clo) || chi < 0)
+        {
+            memset(selection, 0, P->nrow);
+            return EXIT_SUCCESS;
+        }
+        u32 ulo = clo;
+        u32 uhi = chi > UINT32_MAX ? UINT32_MAX : (u32) chi;
+        for(size_t b0 = 0; b0 < P->nrow; b0 += FTAB_PACKED_BLOCK)
+        {
+            size_t n = P->nrow - b0 < FTAB_PACKED_BLOCK ? P->nrow - b0 : FTAB_PACKED_BLOCK;
+            bitpack_get_range(PC->packed, b0, n, PC->bits, codes);
+            for(size_t kk = 0; kk < n; kk++)
+            {
+                selection[b0 + kk] = codes[kk] >= ulo && codes[kk] <= uhi;
+            }
+        }
+        return EXIT_SUCCESS;
+    }
+
+    if(PC->enc == FTAB_ENC_DICT)
+    {
+        /* Evaluate the predicate once per dictionary entry */
+        u8 * lut = malloc(PC->ndict + 1);
+        assert(lut != NULL);
+        for(size_t dd = 0; dd < PC->ndict; dd++)
+        {
+            lut[dd] = PC->dict[dd] >= lo && PC->dict[dd] <= hi;
+        }
+        for(size_t b0 = 0; b0 < P->nrow; b0 += FTAB_PACKED_BLOCK)
+        {
+            size_t n = P->nrow - b0 < FTAB_PACKED_BLOCK ? P->nrow - b0 : FTAB_PACKED_BLOCK;
+            bitpack_get_range(PC->packed, b0, n, PC->bits, codes);
+            for(size_t kk = 0; kk < n; kk++)
+            {
+                selection[b0 + kk] = lut[codes[kk]];
+            }
+        }
+        free(lut);
+        return EXIT_SUCCESS;
+    }
+
+    float V[FTAB_PACKED_BLOCK];
+    for(size_t b0 = 0; b0 < P->nrow; b0 += FTAB_PACKED_BLOCK)
+    {
+        size_t n = P->nrow - b0 < FTAB_PACKED_BLOCK ? P->nrow - b0 : FTAB_PACKED_BLOCK;
+        packed_decode_range(PC, b0, n, V);
+        for(size_t kk = 0; kk < n; kk++)
+        {
+            selection[b0 + kk] = V[kk] >= lo && V[kk] <= hi;
+        }
+    }
+    return EXIT_SUCCESS;
+}
+
+/*                      COMPRESSED COLUMN FILES
+ *                      =======================
+ *
+ * Layout (little endian):
+ *
+ *   "FTABCMP1" nrow:u64 ncol:u32 chunk_rows:u32
+ *   ncol x (len:u32 name)
+ *   chunks ...
+ *   directory: nchunk x ncol x (offset:u64 size:u64 filter:u8
+ *                               backend:u8 min:f32 max:f32)
+ *   directory offset:u64 "FTABCMP1"
+ *
+ * Each chunk holds chunk_rows values of one column. The floats are
+ * first transformed by a filter, byte shuffle or XOR with the
+ * previous value followed by byte shuffle, and then compressed by
+ * zstd or zlib when available. min/max of each chunk (NAN ignored)
+ * lets ftab_from_compressed_range skip chunks.
+ */
+
+#define FTAB_CMP_MAGIC "FTABCMP1"
+#define FTAB_CMP_CHUNK (1 << 16)
+#define FTAB_CMP_DIRENT 26
+
+enum {
+    FTAB_FILTER_SHUFFLE = 1,
+    FTAB_FILTER_XOR = 2
+};
+
+enum {
+    FTAB_BACKEND_NONE = 0,
+    FTAB_BACKEND_ZLIB = 1,
+    FTAB_BACKEND_ZSTD = 2
+};
+
+typedef struct {
+    u64 offset;
+    u64 size;
+    u8 filter;
+    u8 backend;
+    float min;
+    float max;
+} ftab_cmp_chunk_t;
+
+/* Byte shuffle: all first bytes, then all second bytes, ... */
+static void shuffle4(const u8 * src, u8 * dst, size_t n)
+{
+    for(size_t kk = 0; kk < n; kk++)
+    {
+        dst[kk] = src[4*kk];
+        dst[n + kk] = src[4*kk + 1];
+        dst[2*n + kk] = src[4*kk + 2];
+        dst[3*n + kk] = src[4*kk + 3];
+    }
+}
+
+static void unshuffle4(const u8 * src, u8 * dst, size_t n)
+{
+    for(size_t kk = 0; kk < n; kk++)
+    {
+        dst[4*kk] = src[kk];
+        dst[4*kk + 1] = src[n + kk];
+        dst[4*kk + 2] = src[2*n + kk];
+        dst[4*kk + 3] = src[3*n + kk];
+    }
+}
+
+static void filter_apply(int filter, const float * V, u8 * dst, u32 * tmp, size_t n)
+{
+    const u8 * src = (const u8 *) V;
+    if(filter == FTAB_FILTER_XOR)
+    {
+        u32 prev = 0;
+        for(size_t kk = 0; kk < n; kk++)
+        {
+            u32 x;
+            memcpy(&x, V + kk, 4);
+            tmp[kk] = x ^ prev;
+            prev = x;
+        }
+        src = (const u8 *) tmp;
+    }
+    shuffle4(src, dst, n);
+}
+
+static void filter_undo(int filter, const u8 * src, float * V, size_t n)
+{
+    unshuffle4(src, (u8 *) V, n);
+    if(filter == FTAB_FILTER_XOR)
+    {
+        u32 prev = 0;
+        for(size_t kk = 0; kk < n; kk++)
+        {
+            u32 x;
+            memcpy(&x, V + kk, 4);
+            prev ^= x;
+            memcpy(V + kk, &prev, 4);
+        }
+    }
+}
+
+static int cmp_default_backend(void)
+{
+#if defined(FTAB_ZSTD)
+    return FTAB_BACKEND_ZSTD;
+#elif defined(FTAB_ZLIB)
+    return FTAB_BACKEND_ZLIB;
+#else
+    return FTAB_BACKEND_NONE;
+#endif
+}
+
+/* Upper bound of the compressed size */
+static size_t cmp_bound(size_t n)
+{
+    size_t bound = n;
+#ifdef FTAB_ZLIB
+    bound = compressBound(n) > bound ? compressBound(n) : bound;
+#endif
+#ifdef FTAB_ZSTD
+    bound = ZSTD_compressBound(n) > bound ? ZSTD_compressBound(n) : bound;
+#endif
+    return bound;
+}
+
+/* Returns the compressed size or 0 on failure */
+static size_t cmp_compress(int backend, const u8 * src, size_t n, u8 * dst, size_t cap)
+{
+    switch(backend)
+    {
+#ifdef FTAB_ZSTD
+    case FTAB_BACKEND_ZSTD:
+    {
+        size_t ret = ZSTD_compress(dst, cap, src, n, 3);
+        return ZSTD_isError(ret) ? 0 : ret;
+    }
+#endif
+#ifdef FTAB_ZLIB
+    case FTAB_BACKEND_ZLIB:
+    {
+        uLongf len = cap;
+        return compress2(dst, &len, src, n, 1) == Z_OK ? len : 0;
+    }
+#endif
+    case FTAB_BACKEND_NONE:
+        if(n > cap)
+        {
+            return 0;
+        }
+        memcpy(dst, src, n);
+        return n;
+    }
+    return 0;
+}
+
+static int cmp_decompress(int backend, const u8 * src, size_t n, u8 * dst, size_t raw)
+{
+    switch(backend)
+    {
+#ifdef FTAB_ZSTD
+    case FTAB_BACKEND_ZSTD:
+        return ZSTD_decompress(dst, raw, src, n) == raw ? EXIT_SUCCESS : EXIT_FAILURE;
+#endif
+#ifdef FTAB_ZLIB
+    case FTAB_BACKEND_ZLIB:
+    {
+        uLongf len = raw;
+        return (uncompress(dst, &len, src, n) == Z_OK && len == raw)
+            ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+#endif
+    case FTAB_BACKEND_NONE:
+        if(n != raw)
+        {
+            return EXIT_FAILURE;
+        }
+        memcpy(dst, src, n);
+        return EXIT_SUCCESS;
+    }
+    fprintf(stderr, "ftab: unsupported compression backend %d\n", backend);
+    return EXIT_FAILURE;
+}
+
+typedef struct {
+    const ftab_t * T;
+    size_t chunk_rows;
+    size_t first_chunk;
+    size_t nchunk; /* Chunks in this batch */
+    ftab_cmp_chunk_t * dir; /* For the batch */
+    u8 ** out; /* Compressed data per task */
+} ftab_cmp_write_job_t;
+
+static void cmp_write_worker(void * _J, int thread, int nthreads)
+{
+    ftab_cmp_write_job_t * J = _J;
+    const ftab_t * T = J->T;
+    size_t n_max = J->chunk_rows;
+    float * V = malloc(n_max*sizeof(float));
+    u32 * tmp = malloc(n_max*sizeof(u32));
+    u8 * filtered = malloc(4*n_max);
+    size_t cap = cmp_bound(4*n_max);
+    u8 * best = malloc(cap);
+    u8 * candidate = malloc(cap);
+    assert(V != NULL && tmp != NULL && filtered != NULL);
+    assert(best != NULL && candidate != NULL);
+
+    size_t ntasks = J->nchunk*T->ncol;
+    for(size_t tt = thread; tt < ntasks; tt += nthreads)
+    {
+        size_t chunk = J->first_chunk + tt / T->ncol;
+        size_t col = tt % T->ncol;
+        size_t r0 = chunk*J->chunk_rows;
+        size_t n = T->nrow - r0 < J->chunk_rows ? T->nrow - r0 : J->chunk_rows;
+        ftab_cmp_chunk_t * D = J->dir + tt;
+        D->min = NAN;
+        D->max = NAN;
+        for(size_t kk = 0; kk < n; kk++)
+        {
+            float v = T->T[(r0 + kk)*T->ncol + col];
+            V[kk] = v;
+            D->min = !(D->min <= v) && !isnan(v) ? v : D->min;
+            D->max = !(D->max >= v) && !isnan(v) ? v : D->max;
+        }
+
+        /* Try both filters, keep the smallest */
+        size_t best_size = 0;
+        const int filters[2] = {FTAB_FILTER_SHUFFLE, FTAB_FILTER_XOR};
+        for(int ff = 0; ff < 2; ff++)
+        {
+            filter_apply(filters[ff], V, filtered, tmp, n);
+            int backend = cmp_default_backend();
+            size_t size = cmp_compress(backend, filtered, 4*n, candidate, cap);
+            if(size == 0 || size >= 4*n)
+            {
+                backend = FTAB_BACKEND_NONE;
+                size = cmp_compress(backend, filtered, 4*n, candidate, cap);
+            }
+            if(best_size == 0 || size < best_size)
+            {
+                u8 * swap = best;
+                best = candidate;
+                candidate = swap;
+                best_size = size;
+                D->filter = filters[ff];
+                D->backend = backend;
+            }
+        }
+        D->size = best_size;
+        J->out[tt] = malloc(best_size + 1);
+        assert(J->out[tt] != NULL);
+        memcpy(J->out[tt], best, best_size);
+    }
+    free(V);
+    free(tmp);
+    free(filtered);
+    free(best);
+    free(candidate);
+}
+
+static void put_u32(u8 * p, u32 v) { memcpy(p, &v, 4); }
+static void put_u64(u8 * p, u64 v) { memcpy(p, &v, 8); }
+
+int ftab_write_compressed(const ftab_t * T, const char * fname)
+{
+    if(T == NULL || fname == NULL || !is_little_endian())
+    {
+        return EXIT_FAILURE;
+    }
+    FILE * fid = fopen(fname, "wb");
+    if(fid == NULL)
+    {
+        return EXIT_FAILURE;
+    }
+    int error = 0;
+    u8 header[24];
+    memcpy(header, FTAB_CMP_MAGIC, 8);
+    put_u64(header + 8, T->nrow);
+    put_u32(header + 16, T->ncol);
+    put_u32(header + 20, FTAB_CMP_CHUNK);
+    error |= fwrite(header, 1, 24, fid) != 24;
+    u64 pos = 24;
+    for(size_t cc = 0; cc < T->ncol; cc++)
+    {
+        /* Missing names are stored as empty strings */
+        const char * cname = "";
+        if(T->colnames != NULL && T->colnames[cc] != NULL)
+        {
+            cname = T->colnames[cc];
+        }
+        u8 len[4];
+        put_u32(len, strlen(cname));
+        error |= fwrite(len, 1, 4, fid) != 4;
+        error |= fwrite(cname, 1, strlen(cname), fid) != strlen(cname);
+        pos += 4 + strlen(cname);
+    }
+
+    size_t nchunk = (T->nrow + FTAB_CMP_CHUNK - 1) / FTAB_CMP_CHUNK;
+    ftab_cmp_chunk_t * dir = calloc(nchunk*T->ncol + 1, sizeof(ftab_cmp_chunk_t));
+    assert(dir != NULL);
+
+    /* Compress a batch of chunks in parallel, then write them */
+    int nthreads = nthreads_for(T->nrow*T->ncol, FTAB_CMP_CHUNK);
+    size_t batch = 4*nthreads;
+    u8 ** out = calloc(batch*T->ncol, sizeof(u8*));
+    assert(out != NULL);
+    for(size_t c0 = 0; c0 < nchunk && !error; c0 += batch)
+    {
+        ftab_cmp_write_job_t J = {0};
+        J.T = T;
+        J.chunk_rows = FTAB_CMP_CHUNK;
+        J.first_chunk = c0;
+        J.nchunk = nchunk - c0 < batch ? nchunk - c0 : batch;
+        J.dir = dir + c0*T->ncol;
+        J.out = out;
+        run_parallel(nthreads, cmp_write_worker, &J);
+        for(size_t tt = 0; tt < J.nchunk*T->ncol; tt++)
+        {
+            J.dir[tt].offset = pos;
+            error |= fwrite(out[tt], 1, J.dir[tt].size, fid) != J.dir[tt].size;
+            pos += J.dir[tt].size;
+            free(out[tt]);
+            out[tt] = NULL;
+        }
+    }
+    free(out);
+
+    /* Directory and trailer */
+    u64 dir_offset = pos;
+    for(size_t kk = 0; kk < nchunk*T->ncol && !error; kk++)
+    {
+        u8 ent[FTAB_CMP_DIRENT];
+        put_u64(ent, dir[kk].offset);
+        put_u64(ent + 8, dir[kk].size);
+        ent[16] = dir[kk].filter;
+        ent[17] = dir[kk].backend;
+        memcpy(ent + 18, &dir[kk].min, 4);
+        memcpy(ent + 22, &dir[kk].max, 4);
+        error |= fwrite(ent, 1, FTAB_CMP_DIRENT, fid) != FTAB_CMP_DIRENT;
+    }
+    u8 trailer[16];
+    put_u64(trailer, dir_offset);
+    memcpy(trailer + 8, FTAB_CMP_MAGIC, 8);
+    error |= fwrite(trailer, 1, 16, fid) != 16;
+    free(dir);
+    if(fclose(fid) != 0)
+    {
+        error = 1;
+    }
+    return error ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+typedef struct {
+    const u8 * data;
+    size_t size;
+    size_t nrow;
+    size_t ncol;
+    size_t chunk_rows;
+    size_t nchunk;
+    ftab_cmp_chunk_t * dir;
+    u8 * use_chunk; /* Chunks to decode */
+    size_t * row_offset; /* First output row per chunk */
+    ftab_t * T;
+    int error;
+} ftab_cmp_read_job_t;
+
+static void cmp_read_worker(void * _J, int thread, int nthreads)
+{
+    ftab_cmp_read_job_t * J = _J;
+    u8 * raw = malloc(4*J->chunk_rows);
+    float * V = malloc(J->chunk_rows*sizeof(float));
+    assert(raw != NULL && V != NULL);
+    size_t ntasks = J->nchunk*J->ncol;
+    for(size_t tt = thread; tt < ntasks; tt += nthreads)
+    {
+        size_t chunk = tt / J->ncol;
+        size_t col = tt % J->ncol;
+        if(!J->use_chunk[chunk])
+        {
+            continue;
+        }
+        size_t r0 = chunk*J->chunk_rows;
+        size_t n = J->nrow - r0 < J->chunk_rows ? J->nrow - r0 : J->chunk_rows;
+        const ftab_cmp_chunk_t * D = J->dir + tt;
+        if(D->offset > J->size || D->size > J->size - D->offset
+           || cmp_decompress(D->backend, J->data + D->offset, D->size, raw, 4*n))
+        {
+            J->error = 1;
+            continue;
+        }
+        filter_undo(D->filter, raw, V, n);
+        float * dst = J->T->T + J->row_offset[chunk]*J->ncol + col;
+        for(size_t kk = 0; kk < n; kk++)
+        {
+            dst[kk*J->ncol] = V[kk];
+        }
+    }
+    free(raw);
+    free(V);
+}
+
+static ftab_t *
+cmp_read(const char * fname, int col, float lo, float hi)
+{
+    if(fname == NULL || !is_little_endian())
+    {
+        return NULL;
+    }
+    FILE * fid = fopen(fname, "rb");
+    if(fid == NULL)
+    {
+        fprintf(stderr, "Can not open %s\n", fname);
+        return NULL;
+    }
+    fseek(fid, 0, SEEK_END);
+    long fsize = ftell(fid);
+    fseek(fid, 0, SEEK_SET);
+    if(fsize < 40)
+    {
+        fprintf(stderr, "ftab: %s is not a compressed ftab file\n", fname);
+        fclose(fid);
+        return NULL;
+    }
+    ftab_cmp_read_job_t J = {0};
+    J.size = fsize;
+    void * map = NULL;
+#ifndef WINDOWS
+    /* Chunks that are skipped are never read from disk */
+    map = mmap(NULL, J.size, PROT_READ, MAP_PRIVATE, fileno(fid), 0);
+    if(map == MAP_FAILED)
+    {
+        map = NULL;
+    }
+    J.data = map;
+#endif
+    if(J.data == NULL)
+    {
+        u8 * data = malloc(J.size);
+        assert(data != NULL);
+        if(fread(data, 1, J.size, fid) != J.size)
+        {
+            J.error = 1;
+        }
+        J.data = data;
+    }
+    fclose(fid);
+
+    ftab_t * T = NULL;
+    const u8 * d = J.data;
+    if(J.error || memcmp(d, FTAB_CMP_MAGIC, 8) != 0
+       || memcmp(d + J.size - 8, FTAB_CMP_MAGIC, 8) != 0)
+    {
+        fprintf(stderr, "ftab: %s is not a compressed ftab file\n", fname);
+        goto done;
+    }
+    J.nrow = rd_i64(d + 8);
+    J.ncol = rd_u32(d + 16);
+    J.chunk_rows = rd_u32(d + 20);
+    if(col >= 0 && (size_t) col >= J.ncol)
+    {
+        goto done;
+    }
+    /* Every chunk of every column has a directory entry, which bounds
+     * the shape by the file size without any overflow */
+    size_t max_entries = (J.size - 40) / FTAB_CMP_DIRENT;
+    if(J.ncol == 0 || J.chunk_rows != FTAB_CMP_CHUNK
+       || J.ncol > max_entries)
+    {
+        fprintf(stderr, "ftab: %s has an invalid header\n", fname);
+        goto done;
+    }
+    J.nchunk = J.nrow / J.chunk_rows + (J.nrow % J.chunk_rows != 0);
+    u64 dir_offset = rd_i64(d + J.size - 16);
+    if(J.nchunk > max_entries / J.ncol || dir_offset < 24
+       || dir_offset > J.size - 16
+       || (J.size - 16 - dir_offset) / FTAB_CMP_DIRENT != J.nchunk*J.ncol)
+    {
+        fprintf(stderr, "ftab: %s is corrupt\n", fname);
+        goto done;
+    }
+
+    T = calloc(1, sizeof(ftab_t));
+    assert(T != NULL);
+    T->ncol = J.ncol;
+    T->colnames = calloc(J.ncol, sizeof(char*));
+    assert(T->colnames != NULL);
+    size_t pos = 24;
+    int has_names = 0;
+    for(size_t cc = 0; cc < J.ncol; cc++)
+    {
+        u32 len = pos + 4 <= dir_offset ? rd_u32(d + pos) : 0;
+        if(pos + 4 + len > dir_offset)
+        {
+            J.error = 1;
+            break;
+        }
+        if(len > 0)
+        {
+            T->colnames[cc] = calloc(len + 1, 1);
+            assert(T->colnames[cc] != NULL);
+            memcpy(T->colnames[cc], d + pos + 4, len);
+            has_names = 1;
+        }
+        pos += 4 + len;
+    }
+    if(!has_names)
+    {
+        free(T->colnames);
+        T->colnames = NULL;
+    }
+
+    J.dir = calloc(J.nchunk*J.ncol + 1, sizeof(ftab_cmp_chunk_t));
+    J.use_chunk = calloc(J.nchunk + 1, 1);
+    J.row_offset = calloc(J.nchunk + 1, sizeof(size_t));
+    assert(J.dir != NULL && J.use_chunk != NULL && J.row_offset != NULL);
+    for(size_t kk = 0; kk < J.nchunk*J.ncol; kk++)
+    {
+        const u8 * ent = d + dir_offset + kk*FTAB_CMP_DIRENT;
+        J.dir[kk].offset = rd_i64(ent);
+        J.dir[kk].size = rd_i64(ent + 8);
+        J.dir[kk].filter = ent[16];
+        J.dir[kk].backend = ent[17];
+        memcpy(&J.dir[kk].min, ent + 18, 4);
+        memcpy(&J.dir[kk].max, ent + 22, 4);
+    }
+
+    /* Decide what chunks to read */
+    size_t nrow = 0;
+    for(size_t kk = 0; kk < J.nchunk; kk++)
+    {
+        J.use_chunk[kk] = 1;
+        if(col >= 0)
+        {
+            const ftab_cmp_chunk_t * D = J.dir + kk*J.ncol + col;
+            J.use_chunk[kk] = D->max >= lo && D->min <= hi;
+        }
+        J.row_offset[kk] = nrow;
+        if(J.use_chunk[kk])
+        {
+            size_t r0 = kk*J.chunk_rows;
+            nrow += J.nrow - r0 < J.chunk_rows ? J.nrow - r0 : J.chunk_rows;
+        }
+    }
+    T->nrow = nrow;
+    T->nrow_alloc = nrow > 0 ? nrow : 1;
+    /* nrow*ncol is at most chunk_rows times the number of entries */
+    T->T = malloc(T->nrow_alloc*T->ncol*sizeof(float));
+    if(T->T == NULL)
+    {
+        fprintf(stderr, "ftab: out of memory reading %s\n", fname);
+        T->nrow = 0;
+        J.error = 1;
+    }
+    J.T = T;
+    if(!J.error)
+    {
+        run_parallel(nthreads_for(J.nrow*J.ncol, J.chunk_rows), cmp_read_worker, &J);
+    }
+    free(J.dir);
+    free(J.use_chunk);
+    free(J.row_offset);
+    if(J.error)
+    {
+        fprintf(stderr, "ftab: failed to decode %s\n", fname);
+        ftab_free(T);
+        T = NULL;
+    }
+
+ done:
+#ifndef WINDOWS
+    if(map != NULL)
+    {
+        munmap(map, J.size);
+    } else {
+        free((void *) J.data);
+    }
+#else
+    free((void *) J.data);
+#endif
+    if(T != NULL && col >= 0)
+    {
+        /* Remove the rows outside the range in the chunks that were read */
+        u8 * sel = malloc(T->nrow + 1);
+        assert(sel != NULL);
+        for(size_t kk = 0; kk < T->nrow; kk++)
+        {
+            float v = T->T[kk*T->ncol + col];
+            sel[kk] = v >= lo && v <= hi;
+        }
+        ftab_subselect_rows(T, sel);
+        free(sel);
+    }
+    return T;
+}
+
+ftab_t * ftab_from_compressed(const char * fname)
+{
+    return cmp_read(fname, -1, 0, 0);
+}
+
+ftab_t * ftab_from_compressed_range(const char * fname, int col, float lo, float hi)
+{
+    if(col < 0)
+    {
+        return NULL;
+    }
+    return cmp_read(fname, col, lo, hi);
+}
+
+void ftab_insert(ftab_t * T, float * row)
+{
+    assert(T != NULL);
+    assert(row != NULL);
+    if(own_data(T))
+    {
+        return;
+    }
+    if(T->nrow == T->nrow_alloc)
+    {
+        T->nrow_alloc += T->nrow_alloc*0.69 + 1;
+        T->T = realloc(T->T, T->nrow_alloc*T->ncol*sizeof(float));
+    }
+    memcpy(T->T+T->ncol*T->nrow,
+           row, T->ncol*sizeof(float));
+    T->nrow++;
+    valid_append(T, T->nrow - 1, 1);
+}
+
+
+
+
+void ftab_set_colname(ftab_t * T, int col, const char * name)
+{
+    assert(name != NULL);
+    // TODO check that only valid chars are used
+    if(col < 0 || col >= (int) T->ncol)
+    { return; }
+
+    if(name == NULL)
+    { return; }
+
+    if(T->colnames == NULL)
+    {
+        T->colnames = calloc(T->ncol, sizeof(char*));
+        assert(T->colnames != NULL);
+    }
+
+    free(T->colnames[col]);
+    T->colnames[col] = strdup(name);
+    return;
+}
+
+
+int ftab_set_coldata(ftab_t * T, int col, const float * data)
+{
+    if(T == NULL)
+    {
+        return EXIT_FAILURE;
+    }
+    if(col < 0 || (size_t) col >= T->ncol)
+    {
+        return EXIT_FAILURE;
+    }
+
+    float * C = T->T + col;
+    for(size_t kk = 0; kk<T->nrow; kk++)
+    {
+        C[kk*T->ncol] = data[kk];
+    }
+    /* All values are valid now */
+    if(T->valid != NULL)
+    {
+        free(T->valid->bits[col]);
+        T->valid->bits[col] = NULL;
+    }
+
+    return EXIT_SUCCESS;
+}
+
+
+ftab_t * ftab_copy(const ftab_t * T)
+{
+    ftab_t * C = calloc(1, sizeof(ftab_t));
+    assert(C != NULL);
+    C->nrow = T->nrow;
+    C->ncol = T->ncol;
+    C->nrow_alloc = C->nrow;
+    C->T = calloc(C->nrow*C->ncol, sizeof(float));
+    if(C->T == NULL)
+    {
+        goto teardown;
+    }
+
+    par_memcpy(C->T, T->T, C->nrow*C->ncol*sizeof(float));
+    for(size_t cc = 0; cc < C->ncol; cc++)
+    {
+        valid_copy(C, 0, cc, T, 0, cc, C->nrow);
+    }
+
+    if(T->colnames != NULL)
+    {
+        C->colnames = calloc(C->ncol, sizeof(char*));
+        assert(C->colnames != NULL);
+        for(u64 kk = 0; kk < C->ncol; kk++)
+        {
+            if(T->colnames[kk] != NULL)
+            {
+                C->colnames[kk] = strdup(T->colnames[kk]);
+                if(C->colnames[kk] == NULL)
+                {
+                    goto teardown;
+                }
+            }
+        }
+    }
+    return C;
+
+ teardown:
+    ftab_free(C);
+    return NULL;
+}
+
+/*                      COLUMN SELECTION AND CONCATENATION
+ *                      ==================================
+ *
+ * Both are copies of row segments, a run of adjacent columns, from
+ * one row major buffer to another. Rows are copied in blocks that fit
+ * in L1, one segment at a time, so that the loops over narrow segments
+ * have a fixed width and compile to plain loads and stores instead of
+ * one memcpy call per row. Tasks take contiguous row ranges.
+ *
+ * ftab_select_columns compacts in place. When columns are dropped a
+ * row moves to an earlier position, so rows [a, b) can be moved in
+ * parallel once rows [0, a) are done and b*n <= a*ncol, i.e., the
+ * destinations only overwrite rows that were already moved. The ranges
+ * grow by ncol/n per round, rounds that would be too small are done
+ * serially, through a buffer. A permutation keeps every row in place.
+ */
+
+#define COPY_BLOCK_FLOATS 4096
+
+/* Rows per block for tables with ncol columns */
+static size_t copy_block_rows(size_t ncol)
+{
+    return COPY_BLOCK_FLOATS / (ncol + 1) + 1;
+}
+
+/* A run of w adjacent columns, from column src to column dst */
+typedef struct {
+    size_t src;
+    size_t dst;
+    size_t w;
+} ftab_segment_t;
+
+/* Copy w floats from each of n rows. D and S do not overlap. */
+static void copy_row_segments(float * restrict D, size_t dstride,
+                              const float * restrict S, size_t sstride,
+                              size_t w, size_t n)
+{
+    if(w == dstride && w == sstride)
+    {
+        memcpy(D, S, n*w*sizeof(float));
+        return;
+    }
+    switch(w)
+    {
+    case 1:
+        for(size_t kk = 0; kk < n; kk++)
+        {
+            D[kk*dstride] = S[kk*sstride];
+        }
+        break;
+    case 2:
+        for(size_t kk = 0; kk < n; kk++)
+        {
+            memcpy(D + kk*dstride, S + kk*sstride, 2*sizeof(float));
+        }
+        break;
+    case 3:
+        for(size_t kk = 0; kk < n; kk++)
+        {
+            memcpy(D + kk*dstride, S + kk*sstride, 3*sizeof(float));
+        }
+        break;
+    case 4:
+        for(size_t kk = 0; kk < n; kk++)
+        {
+            memcpy(D + kk*dstride, S + kk*sstride, 4*sizeof(float));
+        }
+        break;
+    default:
+        for(size_t kk = 0; kk < n; kk++)
+        {
+            memcpy(D + kk*dstride, S + kk*sstride, w*sizeof(float));
+        }
+    }
+}
+
+/* Rows [first, last) of the segments from S, with sncol columns, to D
+ * with dncol columns, block by block */
+static void copy_segments(float * D, size_t dncol, const float * S, size_t sncol,
+                          const ftab_segment_t * seg, size_t nseg,
+                          size_t first, size_t last)
+{
+    size_t block = copy_block_rows(dncol);
+    for(size_t b0 = first; b0 < last; b0 += block)
+    {
+        size_t n = last - b0 < block ? last - b0 : block;
+        for(size_t ss = 0; ss < nseg; ss++)
+        {
+            copy_row_segments(D + b0*dncol + seg[ss].dst, dncol,
+                              S + b0*sncol + seg[ss].src, sncol,
+                              seg[ss].w, n);
+        }
+    }
+}
+
+/* The runs of adjacent columns in idx */
+static size_t make_segments(const int * idx, size_t n, ftab_segment_t * seg)
+{
+    size_t nseg = 0;
+    for(size_t kk = 0; kk < n; kk++)
+    {
+        if(nseg > 0 && seg[nseg-1].src + seg[nseg-1].w == (size_t) idx[kk])
+        {
+            seg[nseg-1].w++;
+            continue;
+        }
+        seg[nseg].src = idx[kk];
+        seg[nseg].dst = kk;
+        seg[nseg].w = 1;
+        nseg++;
+    }
+    return nseg;
+}
+
+typedef struct {
+    float * D;
+    size_t dncol;
+    const float * S;
+    size_t sncol;
+    const ftab_segment_t * seg;
+    size_t nseg;
+    size_t first; /* Rows [first, last) */
+    size_t last;
+    float * tmp; /* dncol per task, for rows that are moved in place */
+} ftab_select_job_t;
+
+static void select_worker(void * _J, int thread, int nthreads)
+{
+    ftab_select_job_t * J = _J;
+    size_t first, last;
+    thread_range(J->last - J->first, thread, nthreads, &first, &last);
+    first += J->first;
+    last += J->first;
+    if(J->tmp == NULL)
+    {
+        copy_segments(J->D, J->dncol, J->S, J->sncol, J->seg, J->nseg,
+                      first, last);
+        return;
+    }
+    /* In place, a block of rows at a time through tmp. The block is
+     * read before it is written and rows only move to earlier
+     * positions, so no rows that are not yet read are overwritten */
+    size_t block = copy_block_rows(J->dncol);
+    float * tmp = J->tmp + thread*block*J->dncol;
+    for(size_t b0 = first; b0 < last; b0 += block)
+    {
+        size_t nb = last - b0 < block ? last - b0 : block;
+        copy_segments(tmp, J->dncol, J->S + b0*J->sncol, J->sncol,
+                      J->seg, J->nseg, 0, nb);
+        memcpy(J->D + b0*J->dncol, tmp, nb*J->dncol*sizeof(float));
+    }
+}
+
+/* Move the column names and bitmaps of T to the new order */
+static void select_column_meta(ftab_t * T, const int * idx, size_t n)
+{
+    u8 * used = calloc(T->ncol, 1);
+    assert(used != NULL);
+    if(T->colnames != NULL)
+    {
+        char ** names = calloc(n, sizeof(char*));
+        assert(names != NULL);
+        for(size_t kk = 0; kk < n; kk++)
+        {
+            char * name = T->colnames[idx[kk]];
+            if(name != NULL && used[idx[kk]])
+            {
+                name = strdup(name);
+                assert(name != NULL);
+            }
+            names[kk] = name;
+            used[idx[kk]] = 1;
+        }
+        for(size_t cc = 0; cc < T->ncol; cc++)
+        {
+            if(!used[cc])
+            {
+                free(T->colnames[cc]);
+            }
+        }
+        free(T->colnames);
+        T->colnames = names;
+    }
+    if(T->valid != NULL)
+    {
+        memset(used, 0, T->ncol);
+        u8 ** bits = calloc(n, sizeof(u8*));
+        assert(bits != NULL);
+        for(size_t kk = 0; kk < n; kk++)
+        {
+            u8 * B = T->valid->bits[idx[kk]];
+            if(B != NULL && used[idx[kk]])
+            {
+                u8 * B2 = malloc(T->valid->cap/8 + 1);
+                assert(B2 != NULL);
+                memcpy(B2, B, T->valid->cap/8 + 1);
+                B = B2;
+            }
+            bits[kk] = B;
+            used[idx[kk]] = 1;
+        }
+        for(size_t cc = 0; cc < T->ncol; cc++)
+        {
+            if(!used[cc])
+            {
+                free(T->valid->bits[cc]);
+            }
+        }
+        free(T->valid->bits);
+        T->valid->bits = bits;
+    }
+    free(used);
+}
+
+int ftab_select_columns(ftab_t * T, const int * idx, size_t n)
+{
+    if(T == NULL || idx == NULL || n == 0 || n > T->ncol)
+    {
+        fprintf(stderr, "ftab_select_columns: need 1 to ncol columns\n");
+        return EXIT_FAILURE;
+    }
+    for(size_t kk = 0; kk < n; kk++)
+    {
+        if(idx[kk] < 0 || (size_t) idx[kk] >= T->ncol)
+        {
+            fprintf(stderr, "ftab_select_columns: invalid column %d\n", idx[kk]);
+            return EXIT_FAILURE;
+        }
+    }
+    ftab_segment_t * seg = malloc(n*sizeof(ftab_segment_t));
+    assert(seg != NULL);
+    size_t nseg = make_segments(idx, n, seg);
+    size_t ncol = T->ncol;
+    size_t nrow = T->nrow;
+    int nthreads = nthreads_for(nrow*n, 1 << 18);
+    ftab_select_job_t J = {0};
+    J.dncol = n;
+    J.sncol = ncol;
+    J.seg = seg;
+    J.nseg = nseg;
+
+    if(T->map != NULL)
+    {
+        /* Into a new buffer instead of writing to the mapping */
+        size_t nalloc = nrow > 0 ? nrow : 1;
+        J.D = malloc(nalloc*n*sizeof(float));
+        assert(J.D != NULL);
+        J.S = T->T;
+        J.last = nrow;
+        run_parallel(nthreads, select_worker, &J);
+        free_data(T);
+        T->T = J.D;
+        T->nrow_alloc = nalloc;
+    } else if(nseg > 1 || seg[0].src != 0 || n != ncol)
+    {
+        J.D = T->T;
+        J.S = T->T;
+        if(n == ncol)
+        {
+            /* A permutation, every row stays where it is */
+            J.tmp = malloc(nthreads*copy_block_rows(n)*n*sizeof(float));
+            assert(J.tmp != NULL);
+            J.last = nrow;
+            run_parallel(nthreads, select_worker, &J);
+        } else {
+            float * tmp = malloc(copy_block_rows(n)*n*sizeof(float));
+            assert(tmp != NULL);
+            size_t done = 0;
+            while(done < nrow)
+            {
+                size_t next = done*ncol/n;
+                next = next > nrow ? nrow : next;
+                J.first = done;
+                if(next - done < 1024)
+                {
+                    /* Too few rows to move in parallel, serially through
+                     * tmp instead */
+                    J.last = done + 1024 < nrow ? done + 1024 : nrow;
+                    J.tmp = tmp;
+                    run_parallel(1, select_worker, &J);
+                } else {
+                    J.last = next;
+                    J.tmp = NULL;
+                    run_parallel(nthreads_for((next - done)*n, 1 << 18),
+                                 select_worker, &J);
+                }
+                done = J.last;
+            }
+            J.tmp = tmp;
+        }
+        free(J.tmp);
+        /* Give back the memory of the dropped columns */
+        size_t nalloc = T->nrow_alloc > 0 ? T->nrow_alloc : 1;
+        float * data = realloc(T->T, nalloc*n*sizeof(float));
+        if(data != NULL)
+        {
+            T->T = data;
+        }
+    }
+    free(seg);
+    select_column_meta(T, idx, n);
+    T->ncol = n;
+    return EXIT_SUCCESS;
+}
+
+typedef struct {
+    ftab_t * T;
+    const ftab_t ** tables;
+    size_t n;
+} ftab_hcat_job_t;
+
+static void hcat_worker(void * _J, int thread, int nthreads)
+{
+    ftab_hcat_job_t * J = _J;
+    size_t first, last;
+    thread_range(J->T->nrow, thread, nthreads, &first, &last);
+    size_t ncol = J->T->ncol;
+    size_t block = copy_block_rows(ncol);
+    for(size_t b0 = first; b0 < last; b0 += block)
+    {
+        size_t nb = last - b0 < block ? last - b0 : block;
+        size_t offset = 0;
+        for(size_t tt = 0; tt < J->n; tt++)
+        {
+            const ftab_t * S = J->tables[tt];
+            copy_row_segments(J->T->T + b0*ncol + offset, ncol,
+                              S->T + b0*S->ncol, S->ncol, S->ncol, nb);
+            offset += S->ncol;
+        }
+    }
+}
+
+ftab_t * ftab_hcat(const ftab_t ** tables, size_t n)
+{
+    if(tables == NULL || n == 0)
+    {
+        return NULL;
+    }
+    size_t ncol = 0;
+    for(size_t tt = 0; tt < n; tt++)
+    {
+        if(tables[tt] == NULL || tables[tt]->nrow != tables[0]->nrow)
+        {
+            fprintf(stderr, "ftab_hcat: "
+                    "ERROR: tables have different number of rows\n");
+            return NULL;
+        }
+        ncol += tables[tt]->ncol;
+    }
+    size_t nrow = tables[0]->nrow;
+
+    ftab_t * T = calloc(1, sizeof(ftab_t));
+    assert(T != NULL);
+    T->ncol = ncol;
+    T->nrow = nrow;
+    T->nrow_alloc = nrow > 0 ? nrow : 1;
+    T->T = malloc(T->nrow_alloc*ncol*sizeof(float));
+    assert(T->T != NULL);
+
+    ftab_hcat_job_t J = {T, tables, n};
+    run_parallel(nthreads_for(nrow*ncol, 1 << 18), hcat_worker, &J);
+
+    size_t offset = 0;
+    for(size_t tt = 0; tt < n; tt++)
+    {
+        const ftab_t * S = tables[tt];
+        for(size_t cc = 0; cc < S->ncol; cc++)
+        {
+            if(S->colnames != NULL && S->colnames[cc] != NULL)
+            {
+                ftab_set_colname(T, offset + cc, S->colnames[cc]);
+            }
+            valid_copy(T, 0, offset + cc, S, 0, cc, nrow);
+        }
+        offset += S->ncol;
+    }
+    return T;
+}
+
+ftab_t * ftab_concatenate_columns(const ftab_t * L , const ftab_t * R)
+{
+    const ftab_t * tables[2] = {L, R};
+    return ftab_hcat(tables, 2);
+}
+
+ftab_t *
+ftab_concatenate_rows(const ftab_t * Top, const ftab_t * Down)
+{
+
+    if(Top == NULL && Down == NULL)
+    {
+        return NULL;
+    }
+    if(Top == NULL)
+    {
+        return ftab_copy(Down);
+    }
+    if(Down == NULL)
+    {
+        return ftab_copy(Top);
+    }
+
+    if(Top->ncol != Down->ncol)
+    {
+        fprintf(stderr,
+                "ftab concatenate_rows: error: Tables does "
+                "not have the same number of columns\n");
+        return NULL;
+    }
+    // TODO: Check column names
+
+    ftab_t * concat = calloc(1, sizeof(ftab_t));
+    assert(concat != NULL);
+    concat->ncol = Top->ncol;
+    concat->nrow = Top->nrow + Down->nrow;
+    concat->nrow_alloc = concat->nrow;
+    concat->T = calloc(concat->nrow*concat->ncol, sizeof(float));
+    if(concat->T == NULL)
+    {
+        free(concat);
+        return NULL;
+    }
+    par_memcpy(concat->T,
+               Top->T,
+               Top->nrow*Top->ncol*sizeof(float));
+    par_memcpy(concat->T+Top->nrow*Top->ncol,
+               Down->T,
+               Down->nrow*Down->ncol*sizeof(float));
+    for(size_t cc = 0; cc < concat->ncol; cc++)
+    {
+        valid_copy(concat, 0, cc, Top, 0, cc, Top->nrow);
+        valid_copy(concat, Top->nrow, cc, Down, 0, cc, Down->nrow);
+    }
+
+    // TODO: Set column names
+    return concat;
+}
+
+ftab_t *
+ftab_new_from_data(int nrow, int ncol, const float * data)
+{
+    ftab_t * T = calloc(1, sizeof(ftab_t));
+    if(T == NULL)
+    {
+        return T;
+    }
+    T->ncol = ncol;
+    T->nrow = nrow;
+    T->nrow_alloc = T->nrow;
+    T->T = calloc(nrow*ncol, sizeof(float));
+    if(T->T == NULL)
+    {
+        free(T);
+        return NULL;
+    }
+    memcpy(T->T, data, nrow*ncol*sizeof(float));
+    return T;
+}
+
+char * tempfilename(void)
+{
+    char * fname = calloc(1024, 1);
+    assert(fname != NULL);
+#ifdef WINDOWS
+    printf("TODO: Windows functionality\n");
+    sprintf(fname, "ftab-random");
+#else
+    sprintf(fname, "/tmp/ftab-XXXXXX");
+    int filedes = mkstemp(fname);
+    close(filedes);
+#endif
+    return fname;
+}
+
+int ftab_compare(const ftab_t * A, const ftab_t * B)
+{
+    if(A == NULL)
+    {
+        return 1;
+    }
+    if(B == NULL)
+    {
+        return 1;
+    }
+    if(A->ncol != B->ncol)
+    {
+        return 1;
+    }
+    if(A->nrow != B->nrow)
+    {
+        return 1;
+    }
+
+    int equal_colnames = 1;
+    if(A->colnames == NULL)
+    {
+        if(B->colnames != NULL)
+        {
+            equal_colnames = 0;
+        }
+
+    }
+    if(B->colnames == NULL)
+    {
+        if(A->colnames != NULL)
+        {
+            equal_colnames = 0;
+        }
+    }
+    if(A->colnames != NULL && B->colnames != NULL)
+    {
+        for(size_t kk = 0; kk<A->ncol; kk++)
+        {
+            const char * a = A->colnames[kk];
+            const char * b = B->colnames[kk];
+            if(a == NULL || b == NULL)
+            {
+                if(a != b)
+                {
+                    equal_colnames = 0;
+                }
+            } else if(strcmp(a, b))
+            {
+                equal_colnames = 0;
+            }
+        }
+    }
+    if(equal_colnames == 0)
+    {
+        return 1;
+    }
+
+    if(A->nrow == 0)
+    {
+        return 0;
+    }
+    // Compare missing values
+    for(size_t cc = 0; (A->valid != NULL || B->valid != NULL) && cc < A->ncol; cc++)
+    {
+        for(size_t rr = 0; rr < A->nrow; rr++)
+        {
+            if(ftab_is_missing(A, rr, cc) != ftab_is_missing(B, rr, cc))
+            {
+                return 1;
+            }
+        }
+    }
+    // Compare data
+    return memcmp(A->T, B->T, A->ncol*A->nrow*sizeof(float)) != 0;
+}
+
+/*                       HASH AND APPROXIMATE COMPARISON
+ *                       ===============================
+ *
+ * The hash is computed over fixed size blocks, each with four
+ * independent 64-bit lanes, and the block hashes are combined in
+ * order. The result does not depend on the number of threads.
+ */
+
+#define FTAB_HASH_BLOCK (1 << 16) /* floats */
+
+static const u64 HASH_P1 = 0x9E3779B185EBCA87ULL;
+static const u64 HASH_P2 = 0xC2B2AE3D27D4EB4FULL;
+static const u64 HASH_P3 = 0x165667B19E3779F9ULL;
+
+static u64 hash_rotl(u64 x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+static u64 hash_mix(u64 h)
+{
+    h ^= h >> 33;
+    h *= HASH_P2;
+    h ^= h >> 29;
+    h *= HASH_P3;
+    h ^= h >> 32;
+    return h;
+}
+
+static u64 hash_bytes(const u8 * data, size_t len, u64 seed)
+{
+    u64 acc[4] = {seed + HASH_P1, seed + HASH_P2, seed, seed - HASH_P1};
+    size_t pos = 0;
+    for( ; pos + 32 <= len; pos += 32)
+    {
+        for(int ll = 0; ll < 4; ll++)
+        {
+            u64 x;
+            memcpy(&x, data + pos + 8*ll, 8);
+            acc[ll] = hash_rotl(acc[ll] + x*HASH_P2, 31)*HASH_P1;
+        }
+    }
+    u64 h = hash_rotl(acc[0], 1) + hash_rotl(acc[1], 7)
+        + hash_rotl(acc[2], 12) + hash_rotl(acc[3], 18);
+    for( ; pos < len; pos++)
+    {
+        h = hash_rotl(h ^ (data[pos]*HASH_P3), 11)*HASH_P1;
+    }
+    return hash_mix(h + len);
+}
+
+typedef struct {
+    const ftab_t * T;
+    size_t nblocks;
+    u64 * block_hash;
+} ftab_hash_job_t;
+
+static void hash_worker(void * _J, int thread, int nthreads)
+{
+    ftab_hash_job_t * J = _J;
+    size_t nel = J->T->nrow*J->T->ncol;
+    for(size_t bb = thread; bb < J->nblocks; bb += nthreads)
+    {
+        size_t first = bb*FTAB_HASH_BLOCK;
+        size_t n = nel - first < FTAB_HASH_BLOCK ? nel - first : FTAB_HASH_BLOCK;
+        J->block_hash[bb] = hash_bytes((const u8 *) (J->T->T + first),
+                                       n*sizeof(float), bb);
+    }
+}
+
+uint64_t ftab_hash(const ftab_t * T)
+{
+    if(T == NULL)
+    {
+        return 0;
+    }
+    u64 h = hash_mix(T->nrow*HASH_P1 + T->ncol);
+    for(size_t cc = 0; cc < T->ncol; cc++)
+    {
+        const char * name = T->colnames == NULL ? NULL : T->colnames[cc];
+        u64 hc = name == NULL ? HASH_P3 : hash_bytes((const u8 *) name, strlen(name), cc);
+        h = hash_mix(h ^ hc) + HASH_P1;
+    }
+    if(T->T == NULL || T->nrow == 0)
+    {
+        return h;
+    }
+
+    ftab_hash_job_t J = {0};
+    J.T = T;
+    J.nblocks = (T->nrow*T->ncol + FTAB_HASH_BLOCK - 1) / FTAB_HASH_BLOCK;
+    J.block_hash = malloc(J.nblocks*sizeof(u64));
+    assert(J.block_hash != NULL);
+    run_parallel(nthreads_for(J.nblocks, 4), hash_worker, &J);
+    for(size_t bb = 0; bb < J.nblocks; bb++)
+    {
+        h = hash_mix(h ^ J.block_hash[bb]) + HASH_P1;
+    }
+    free(J.block_hash);
+    return h;
+}
+
+typedef struct {
+    const ftab_t * A;
+    const ftab_t * B;
+    double abs_tol;
+    double rel_tol;
+    size_t first_bad; /* Element index, shared, nel if none */
+} ftab_approx_job_t;
+
+static int approx_equal(float a, float b, double abs_tol, double rel_tol)
+{
+    if(a == b || (isnan(a) && isnan(b)))
+    {
+        return 1;
+    }
+    double d = fabs((double) a - (double) b);
+    double m = fabs(a) > fabs(b) ? fabs(a) : fabs(b);
+    return d <= abs_tol || d <= rel_tol*m;
+}
+
+static void approx_worker(void * _J, int thread, int nthreads)
+{
+    ftab_approx_job_t * J = _J;
+    size_t nel = J->A->nrow*J->A->ncol;
+    size_t first, last;
+    thread_range(nel, thread, nthreads, &first, &last);
+    const float * a = J->A->T;
+    const float * b = J->B->T;
+    for(size_t b0 = first; b0 < last; b0 += 4096)
+    {
+        /* Stop if a difference was found before this block */
+        if(__atomic_load_n(&J->first_bad, __ATOMIC_RELAXED) < b0)
+        {
+            return;
+        }
+        size_t b1 = b0 + 4096 < last ? b0 + 4096 : last;
+        /* Fast bitwise check first */
+        if(memcmp(a + b0, b + b0, (b1 - b0)*sizeof(float)) == 0)
+        {
+            continue;
+        }
+        for(size_t kk = b0; kk < b1; kk++)
+        {
+            if(!approx_equal(a[kk], b[kk], J->abs_tol, J->rel_tol))
+            {
+                size_t cur = __atomic_load_n(&J->first_bad, __ATOMIC_RELAXED);
+                while(kk < cur
+                      && !__atomic_compare_exchange_n(&J->first_bad, &cur, kk, 0,
+                                                      __ATOMIC_RELAXED,
+                                                      __ATOMIC_RELAXED))
+                {
+                }
+                return;
+            }
+        }
+    }
+}
+
+int ftab_compare_approx(const ftab_t * A, const ftab_t * B,
+                        double abs_tol, double rel_tol,
+                        size_t * row, size_t * col)
+{
+    if(row != NULL)
+    {
+        *row = SIZE_MAX;
+    }
+    if(col != NULL)
+    {
+        *col = SIZE_MAX;
+    }
+    if(A == NULL || B == NULL || A->ncol != B->ncol || A->nrow != B->nrow)
+    {
+        return 1;
+    }
+    size_t nel = A->nrow*A->ncol;
+    if(nel == 0)
+    {
+        return 0;
+    }
+    ftab_approx_job_t J = {0};
+    J.A = A;
+    J.B = B;
+    J.abs_tol = abs_tol;
+    J.rel_tol = rel_tol;
+    J.first_bad = nel;
+    run_parallel(nthreads_for(nel, 1 << 18), approx_worker, &J);
+    if(J.first_bad == nel)
+    {
+        return 0;
+    }
+    if(row != NULL)
+    {
+        *row = J.first_bad / A->ncol;
+    }
+    if(col != NULL)
+    {
+        *col = J.first_bad % A->ncol;
+    }
+    return 1;
+}
+
+/* Read back the tsv file fname that was written from T, through
+ * ftab_from_FILE and gzip compressed */
+static int ut_from_FILE(const ftab_t * T, const char * fname)
+{
+    int status = 0;
+    FILE * fid = fopen(fname, "rb");
+    assert(fid != NULL);
+    ftab_t * T2 = ftab_from_FILE(fid, "\t");
+    fclose(fid);
+    if(ftab_compare(T, T2))
+    {
+        printf("ftab_from_FILE test failed\n");
+        status++;
+    }
+    ftab_free(T2);
+
+#ifdef FTAB_ZLIB
+    char * gzname = tempfilename();
+    gzFile gz = gzopen(gzname, "wb");
+    assert(gz != NULL);
+    fid = fopen(fname, "rb");
+    assert(fid != NULL);
+    char buf[1024];
+    size_t nread = 0;
+    while( (nread = fread(buf, 1, sizeof(buf), fid)) > 0)
+    {
+        gzwrite(gz, buf, nread);
+    }
+    fclose(fid);
+    gzclose(gz);
+    T2 = ftab_from_tsv(gzname);
+    if(ftab_compare(T, T2))
+    {
+        printf("gzip test failed\n");
+        status++;
+    }
+    ftab_free(T2);
+
+    /* A truncated file is an error, not a shorter table */
+    fid = fopen(gzname, "rb");
+    assert(fid != NULL);
+    fseek(fid, 0, SEEK_END);
+    size_t gzlen = ftell(fid);
+    fseek(fid, 0, SEEK_SET);
+    char * gzbuf = malloc(gzlen);
+    assert(gzbuf != NULL);
+    size_t gzread = fread(gzbuf, 1, gzlen, fid);
+    fclose(fid);
+    T2 = ftab_from_buffer(gzbuf, gzread/2, NULL);
+    if(gzread != gzlen || T2 != NULL)
+    {
+        printf("truncated gzip test failed\n");
+        status++;
+    }
+    ftab_free(T2);
+    free(gzbuf);
+#ifndef WINDOWS
+    unlink(gzname);
+#endif
+    free(gzname);
+#endif
+
+#ifdef FTAB_ZSTD
+    /* Same for zstd, the full frame and then half of it. One column,
+     * so that a cut row still parses, and several zstd blocks */
+    ftab_t * Z = ftab_new(1);
+    for(size_t kk = 0; kk < 100000; kk++)
+    {
+        float v = kk;
+        ftab_insert(Z, &v);
+    }
+    size_t zlen = 0;
+    char * zraw = ftab_write_buffer(Z, ",", &zlen);
+    ftab_t * Z2 = ftab_from_buffer(zraw, zlen, NULL);
+    size_t zcap = ZSTD_compressBound(zlen);
+    char * zbuf = malloc(zcap);
+    assert(zraw != NULL && zbuf != NULL);
+    size_t zsize = ZSTD_compress(zbuf, zcap, zraw, zlen, 3);
+    assert(!ZSTD_isError(zsize));
+    T2 = ftab_from_buffer(zbuf, zsize, NULL);
+    ftab_t * T3 = ftab_from_buffer(zbuf, zsize/2, NULL);
+    if(ftab_compare(Z2, T2) || T3 != NULL)
+    {
+        printf("truncated zstd test failed\n");
+        status++;
+    }
+    ftab_free(T3);
+    ftab_free(T2);
+    ftab_free(Z2);
+    ftab_free(Z);
+    free(zbuf);
+    free(zraw);
+#endif
+    return status;
+}
+
+/* Round trip through memory */
+static int ut_buffer(const ftab_t * T)
+{
+    size_t len = 0;
+    char * buf = ftab_write_buffer(T, ",", &len);
+    assert(buf != NULL);
+    assert(strlen(buf) == len);
+    ftab_t * T2 = ftab_from_buffer(buf, len, NULL);
+    int status = ftab_compare(T, T2);
+    if(status)
+    {
+        printf("ftab_from_buffer test failed\n");
+    }
+    ftab_free(T2);
+    free(buf);
+    return status ? 1 : 0;
+}
+
+static int ut_topk(void)
+{
+    int status = 0;
+    size_t n = 1000;
+    ftab_t * T = ftab_new(2);
+    for(size_t kk = 0; kk < n; kk++)
+    {
+        float row[2] = {(float) ((kk*7919) % n), (float) kk};
+        ftab_insert(T, row);
+    }
+    ftab_t * S = ftab_copy(T);
+    ftab_sort(S, 0);
+    ftab_head(S, 10);
+    ftab_t * K = ftab_topk(T, 0, 10, 1);
+    if(ftab_compare(S, K))
+    {
+        printf("ftab_topk descending test failed\n");
+        status++;
+    }
+    ftab_free(K);
+    K = ftab_topk(T, 0, 3, 0);
+    if(K->nrow != 3 || K->T[0] != 0 || K->T[2] != 1 || K->T[4] != 2)
+    {
+        printf("ftab_topk ascending test failed\n");
+        status++;
+    }
+    ftab_free(K);
+    ftab_free(S);
+    ftab_free(T);
+
+    /* Several tasks, k larger than the rows of a task, and NAN */
+    ftab_ctx_t * ctx = ftab_ctx_new(4);
+    ftab_ctx_use(ctx);
+    n = 300000;
+    T = ftab_new(2);
+    for(size_t kk = 0; kk < n; kk++)
+    {
+        float v = (kk*7919) % n;
+        float row[2] = {kk % 5 == 0 ? NAN : v, (float) kk};
+        ftab_insert(T, row);
+    }
+    S = ftab_copy(T);
+    ftab_sort(S, 0);
+    ftab_head(S, n/2);
+    K = ftab_topk(T, 0, n/2, 1);
+    ftab_t * A = ftab_topk(T, 0, n, 0);
+    int ok = K != NULL && ftab_compare(S, K) == 0 && A != NULL
+        && A->nrow == n && A->T[0] == 1 && isnan(A->T[2*(n-1)]);
+    for(size_t kk = 1; ok && kk < n; kk++)
+    {
+        /* Ascending, then the NAN by row */
+        float a = A->T[2*(kk-1)];
+        float b = A->T[2*kk];
+        ok = isnan(b) ? !isnan(a) || A->T[2*kk-1] < A->T[2*kk+1] : a < b;
+    }
+    if(!ok)
+    {
+        printf("ftab_topk parallel test failed\n");
+        status++;
+    }
+    ftab_free(A);
+    ftab_free(K);
+    ftab_free(S);
+    ftab_free(T);
+    ftab_ctx_use(NULL);
+    ftab_ctx_free(ctx);
+    return status;
+}
+
+/* Check the knn and radius results for columns 0-2 of T against
+ * brute force. Returns the number of failed queries. */
+static int ut_kdtree_check(const ftab_t * T, const float * Q, size_t nq,
+                           size_t k, const int64_t * idx,
+                           const float * dist2, const size_t * offsets,
+                           float radius)
+{
+    int nfail = 0;
+    float best[16];
+    assert(k <= 16);
+    for(size_t qq = 0; qq < nq; qq++)
+    {
+        const float * q = Q + 3*qq;
+        const int64_t * I = idx + qq*k;
+        const float * D = dist2 + qq*k;
+        /* The k smallest distances, in order, by insertion */
+        size_t nbest = 0;
+        size_t nwithin = 0;
+        for(size_t kk = 0; kk < T->nrow; kk++)
+        {
+            float d2 = kd_dist2(T->T + kk*T->ncol, q, 3);
+            nwithin += d2 <= radius*radius;
+            if(nbest == k && d2 >= best[k-1])
+            {
+                continue;
+            }
+            size_t pos = nbest < k ? nbest++ : k - 1;
+            while(pos > 0 && best[pos-1] > d2)
+            {
+                best[pos] = best[pos-1];
+                pos--;
+            }
+            best[pos] = d2;
+        }
+        int ok = nwithin == offsets[qq+1] - offsets[qq];
+        for(size_t jj = 0; ok && jj < k; jj++)
+        {
+            /* Sorted, the same distances as brute force and the
+             * distance of the returned row */
+            ok = I[jj] >= 0 && (size_t) I[jj] < T->nrow && D[jj] == best[jj]
+                && kd_dist2(T->T + I[jj]*T->ncol, q, 3) == D[jj]
+                && (jj == 0 || D[jj-1] <= D[jj]);
+            for(size_t ii = 0; ok && ii < jj; ii++)
+            {
+                ok = I[ii] != I[jj];
+            }
+        }
+        nfail += !ok;
+    }
+    return nfail;
+}
+
+/* Compare the k-d tree against brute force */
+static int ut_kdtree(void)
+{
+    int status = 0;
+    ftab_ctx_t * ctx = ftab_ctx_new(4);
+    /* Integer coordinates with many ties, then more points than the
+     * parallel build threshold with queries in parallel as well */
+    size_t npoints[2] = {2000, 150000};
+    size_t nqueries[2] = {2, 600};
+    for(int tt = 0; tt < 2; tt++)
+    {
+        ftab_ctx_use(tt == 0 ? NULL : ctx);
+        ftab_t * T = ftab_new(4);
+        srand(1);
+        for(size_t kk = 0; kk < npoints[tt]; kk++)
+        {
+            float row[4] = {rand() % 100, rand() % 100, rand() % 10, kk};
+            if(tt == 1)
+            {
+                row[0] = (float) rand() / RAND_MAX * 100;
+                row[1] = (float) rand() / RAND_MAX * 100;
+                row[2] = (float) rand() / RAND_MAX * 10;
+            }
+            ftab_insert(T, row);
+        }
+        size_t nq = nqueries[tt];
+        size_t k = 5;
+        float radius = tt == 0 ? 10 : 2;
+        float * Q = malloc(3*nq*sizeof(float));
+        int64_t * idx = malloc(nq*k*sizeof(int64_t));
+        float * dist2 = malloc(nq*k*sizeof(float));
+        assert(Q != NULL && idx != NULL && dist2 != NULL);
+        for(size_t qq = 0; qq < nq; qq++)
+        {
+            Q[3*qq] = rand() % 100;
+            Q[3*qq + 1] = rand() % 100;
+            Q[3*qq + 2] = rand() % 10;
+        }
+        int cols[3] = {0, 1, 2};
+        ftab_kdtree_t * K = ftab_kdtree_build(T, cols, 3);
+        size_t * offsets = NULL;
+        int64_t * ridx = NULL;
+        if(K == NULL || ftab_kdtree_size(K) != T->nrow
+           || ftab_kdtree_knn(K, Q, nq, k, idx, dist2) != EXIT_SUCCESS
+           || ftab_kdtree_radius(K, Q, nq, radius, &offsets, &ridx)
+           != EXIT_SUCCESS
+           || ut_kdtree_check(T, Q, nq, k, idx, dist2, offsets, radius))
+        {
+            printf("ftab_kdtree test %d failed\n", tt);
+            status++;
+        }
+        free(offsets);
+        free(ridx);
+        free(dist2);
+        free(idx);
+        free(Q);
+        ftab_kdtree_free(K);
+        ftab_free(T);
+    }
+    ftab_ctx_use(NULL);
+    ftab_ctx_free(ctx);
+    return status;
+}
+
+static int ut_histogram(void)
+{
+    int status = 0;
+    ftab_t * T = ftab_new(2);
+    ftab_set_colname(T, 0, "x");
+    ftab_set_colname(T, 1, "y");
+    for(int kk = 0; kk < 100; kk++)
+    {
+        float row[2] = {kk, kk % 2};
+        ftab_insert(T, row);
+    }
+    float nan_row[2] = {NAN, 0};
+    ftab_insert(T, nan_row);
+    float hi_row[2] = {100, 0};
+    ftab_insert(T, hi_row);
+
+    /* 10 bins of width 9 with 100 = hi in the last bin */
+    ftab_t * H = ftab_histogram(T, 0, 10, 10, 100);
+    if(H->nrow != 10 || H->T[1] != 9 || H->T[19] != 10
+       || H->T[0] != 14.5 || strcmp(H->colnames[0], "x"))
+    {
+        printf("ftab_histogram test failed\n");
+        status++;
+    }
+    ftab_free(H);
+
+    int cols[2] = {0, 1};
+    size_t nbins[2] = {2, 2};
+    float lo[2] = {0, 0};
+    float hi[2] = {100, 2};
+    H = ftab_histogram_nd(T, cols, 2, nbins, lo, hi);
+    if(H->nrow != 4 || H->ncol != 3 || H->T[2] != 25 || H->T[11] != 25)
+    {
+        printf("ftab_histogram_nd test failed\n");
+        status++;
+    }
+    ftab_free(H);
+    ftab_free(T);
+    return status;
+}
+
+static int ut_npy(const ftab_t * T)
+{
+    int status = 0;
+    char * fname = tempfilename();
+    char * cname = npy_colnames_file(fname);
+    ftab_t * T2 = NULL;
+    if(ftab_write_npy(T, fname) == EXIT_SUCCESS)
+    {
+        T2 = ftab_from_npy(fname);
+    }
+    if(ftab_compare(T, T2))
+    {
+        printf("npy test failed\n");
+        status++;
+    }
+    if(T2 != NULL)
+    {
+        /* Has to be copied from the mapping */
+        float row[4] = {0};
+        ftab_insert(T2, row);
+    }
+    ftab_free(T2);
+
+    /* Without names the old sidecar is removed */
+    ftab_t * U = ftab_copy(T);
+    for(size_t kk = 0; U->colnames != NULL && kk < U->ncol; kk++)
+    {
+        free(U->colnames[kk]);
+    }
+    free(U->colnames);
+    U->colnames = NULL;
+    T2 = NULL;
+    if(ftab_write_npy(U, fname) == EXIT_SUCCESS)
+    {
+        T2 = ftab_from_npy(fname);
+    }
+    if(T2 == NULL || T2->colnames != NULL)
+    {
+        printf("npy test without column names failed\n");
+        status++;
+    }
+    ftab_free(T2);
+    ftab_free(U);
+
+    /* Malformed headers */
+    const char * bad[] = {
+        "{'descr': '<f4', 'fortran_order' False, 'shape': (2, 2), }",
+        "{'descr': '<f4', 'fortran_order': False, "
+        "'shape': (4611686018427387904, 8), }"};
+    for(size_t kk = 0; kk < 2; kk++)
+    {
+        FILE * fid = fopen(fname, "wb");
+        assert(fid != NULL);
+        size_t hlen = strlen(bad[kk]);
+        u8 preamble[10] = {0x93, 'N', 'U', 'M', 'P', 'Y', 1, 0,
+                           hlen & 0xff, hlen >> 8};
+        fwrite(preamble, 1, 10, fid);
+        fwrite(bad[kk], 1, hlen, fid);
+        float data[4] = {1, 2, 3, 4};
+        fwrite(data, sizeof(float), 4, fid);
+        fclose(fid);
+        T2 = ftab_from_npy(fname);
+        if(T2 != NULL)
+        {
+            printf("npy malformed header test %zu failed\n", kk);
+            status++;
+        }
+        ftab_free(T2);
+    }
+#ifndef WINDOWS
+    unlink(fname);
+    unlink(cname);
+#endif
+    free(cname);
+    free(fname);
+    return status;
+}
+
+static int ut_arrow(const ftab_t * T)
+{
+    int status = 0;
+    char * fname = tempfilename();
+    ftab_write_arrow(T, fname);
+    ftab_t * T2 = ftab_from_arrow(fname);
+    if(ftab_compare(T, T2))
+    {
+        printf("Arrow test failed\n");
+        status++;
+    }
+    ftab_free(T2);
+    ftab_arrow_t * A = ftab_arrow_open(fname);
+    size_t nrow = 0;
+    const float * C = A == NULL ? NULL : ftab_arrow_column(A, 0, 1, &nrow);
+    if(C == NULL || nrow != T->nrow || C[0] != T->T[1])
+    {
+        printf("Arrow column test failed\n");
+        status++;
+    }
+    ftab_arrow_close(A);
+
+    /* Missing values are nulls, the column can not be used in place */
+    ftab_t * M = ftab_new(2);
+    ftab_set_colname(M, 0, "a");
+    ftab_set_colname(M, 1, "b");
+    for(int kk = 0; kk < 21; kk++)
+    {
+        float row[2] = {kk, -kk};
+        ftab_insert(M, row);
+    }
+    ftab_set_missing(M, 0, 1);
+    ftab_set_missing(M, M->nrow - 1, 1);
+    ftab_write_arrow(M, fname);
+    T2 = ftab_from_arrow(fname);
+    A = ftab_arrow_open(fname);
+    if(ftab_compare(M, T2) || ftab_count_missing(T2, 1) != 2
+       || !ftab_is_missing(T2, M->nrow - 1, 1) || ftab_count_missing(T2, 0) != 0
+       || A == NULL || ftab_arrow_column(A, 0, 1, NULL) != NULL
+       || ftab_arrow_column(A, 0, 0, NULL) == NULL)
+    {
+        printf("Arrow missing value test failed\n");
+        status++;
+    }
+    ftab_arrow_close(A);
+    ftab_free(T2);
+    ftab_free(M);
+#ifndef WINDOWS
+    unlink(fname);
+#endif
+    free(fname);
+    return status;
+}
+
+static int ut_pack(void)
+{
+    int status = 0;
+    ftab_t * T = ftab_new(5);
+    for(int kk = 0; kk < 3000; kk++)
+    {
+        /* label, offset integers, few distinct, halfs, anything */
+        float row[5] = {kk % 4, 100000 + kk, 0.1f * (kk % 7), (kk % 1024) * 0.5f,
+                        sinf(kk)};
+        ftab_insert(T, row);
+    }
+    ftab_packed_t * P = ftab_pack(T, 0);
+    ftab_t * T2 = ftab_unpack(P);
+    if(ftab_compare(T, T2)
+       || ftab_packed_encoding(P, 0) != FTAB_ENC_FOR
+       || ftab_packed_encoding(P, 1) != FTAB_ENC_FOR
+       || ftab_packed_encoding(P, 2) != FTAB_ENC_DICT
+       || ftab_packed_encoding(P, 3) != FTAB_ENC_F16
+       || ftab_packed_encoding(P, 4) != FTAB_ENC_RAW)
+    {
+        printf("ftab_pack test failed\n");
+        status++;
+    }
+    ftab_colstats_t S;
+    ftab_packed_stats(P, 1, &S);
+    u8 * sel = malloc(T->nrow);
+    ftab_packed_select_range(P, 0, 1, 2, sel);
+    size_t nsel = 0;
+    for(size_t kk = 0; kk < T->nrow; kk++)
+    {
+        nsel += sel[kk];
+    }
+    if(S.min != 100000 || S.max != 102999 || S.n != 3000 || nsel != 1500)
+    {
+        printf("ftab_packed kernel test failed\n");
+        status++;
+    }
+    free(sel);
+    ftab_free(T2);
+    ftab_packed_free(P);
+    ftab_free(T);
+    return status;
+}
+
+static int ut_compressed(void)
+{
+    int status = 0;
+    size_t nrow = 150000;
+    ftab_t * T = ftab_new(3);
+    ftab_set_colname(T, 0, "idx");
+    ftab_set_colname(T, 1, "y");
+    ftab_set_colname(T, 2, "z");
+    for(size_t kk = 0; kk < nrow; kk++)
+    {
+        float row[3] = {kk, sinf(kk*0.01), kk % 7 == 0 ? NAN : kk % 5};
+        ftab_insert(T, row);
+    }
+    char * fname = tempfilename();
+    ftab_t * T2 = NULL;
+    ftab_t * T3 = NULL;
+    if(ftab_write_compressed(T, fname) == EXIT_SUCCESS)
+    {
+        T2 = ftab_from_compressed(fname);
+        T3 = ftab_from_compressed_range(fname, 0, 70000, 70099.5);
+    }
+    if(ftab_compare(T, T2))
+    {
+        printf("ftab_from_compressed test failed\n");
+        status++;
+    }
+    if(T3 == NULL || T3->nrow != 100 || T3->T[0] != 70000
+       || strcmp(T3->colnames[2], "z"))
+    {
+        printf("ftab_from_compressed_range test failed\n");
+        status++;
+    }
+    ftab_free(T3);
+    ftab_free(T2);
+    ftab_free(T);
+
+    /* Headers that do not fit the file */
+    const u64 bad[3][3] = {{(u64) 1 << 40, 1, FTAB_CMP_CHUNK},
+                           {10, 0xffffffff, FTAB_CMP_CHUNK},
+                           {10, 1, 1}};
+    for(int kk = 0; kk < 3; kk++)
+    {
+        u8 buf[500] = {0};
+        memcpy(buf, FTAB_CMP_MAGIC, 8);
+        put_u64(buf + 8, bad[kk][0]);
+        put_u32(buf + 16, bad[kk][1]);
+        put_u32(buf + 20, bad[kk][2]);
+        put_u64(buf + sizeof(buf) - 16, 28);
+        memcpy(buf + sizeof(buf) - 8, FTAB_CMP_MAGIC, 8);
+        FILE * fid = fopen(fname, "wb");
+        assert(fid != NULL);
+        fwrite(buf, 1, sizeof(buf), fid);
+        fclose(fid);
+        T2 = ftab_from_compressed(fname);
+        if(T2 != NULL)
+        {
+            printf("ftab_from_compressed invalid header test %d failed\n", kk);
+            status++;
+        }
+        ftab_free(T2);
+    }
+#ifndef WINDOWS
+    unlink(fname);
+#endif
+    free(fname);
+    return status;
+}
+
+static int ut_lazy(void)
+{
+    int status = 0;
+    char * fname = tempfilename();
+    FILE * fid = fopen(fname, "wb");
+    assert(fid != NULL);
+    fprintf(fid, "a,b,c\r\n1,2,3\r\n\n4,5\n7,,9.5\n10,11,12");
+    fclose(fid);
+    ftab_t * T = ftab_from_csv(fname);
+    ftab_lazy_t * L = ftab_lazy_open(fname, ",");
+    int cols[2] = {2, ftab_lazy_get_col(L, "a")};
+    ftab_t * S = ftab_lazy_select(L, cols, 2);
+    if(T == NULL || S == NULL || ftab_lazy_nrow(L) != T->nrow
+       || strcmp(ftab_lazy_colname(L, 1), "b"))
+    {
+        printf("ftab_lazy test failed\n");
+        status++;
+    } else {
+        const float * B = ftab_lazy_column(L, 1);
+        for(size_t kk = 0; kk < T->nrow; kk++)
+        {
+            if(B[kk] != T->T[kk*3 + 1]
+               || S->T[2*kk] != T->T[kk*3 + 2]
+               || S->T[2*kk + 1] != T->T[kk*3])
+            {
+                printf("ftab_lazy_column test failed\n");
+                status++;
+                break;
+            }
+        }
+    }
+    ftab_free(S);
+    ftab_free(T);
+    ftab_lazy_close(L);
+#ifndef WINDOWS
+    unlink(fname);
+#endif
+    free(fname);
+    return status;
+}
+
+typedef struct {
+    const char * fname;
+    int thread;
+} ut_append_job_t;
+
+static void * ut_append_writer(void * _J)
+{
+    ut_append_job_t * J = _J;
+    ftab_t * T = ftab_new(2);
+    ftab_set_colname(T, 0, "t");
+    ftab_set_colname(T, 1, "v");
+    for(int kk = 0; kk < 1000; kk++)
+    {
+        float row[2] = {J->thread, kk};
+        ftab_insert(T, row);
+    }
+    for(int kk = 0; kk < 10; kk++)
+    {
+        ftab_append_csv(T, J->fname, 0);
+    }
+    ftab_free(T);
+    return NULL;
+}
+
+static int ut_append_tail(void)
+{
+    int status = 0;
+    char * fname = tempfilename();
+    ftab_t * T = ftab_new(2);
+    ftab_set_colname(T, 0, "t");
+    ftab_set_colname(T, 1, "v");
+    float row[2] = {0, 1};
+    ftab_insert(T, row);
+    ftab_append_csv(T, fname, 0);
+    ftab_tail_t * R = ftab_tail_open(fname, ",");
+    ftab_t * N1 = ftab_tail_read(R);
+
+    for(int kk = 1; kk < 5; kk++)
+    {
+        row[0] = kk;
+        ftab_insert(T, row);
+    }
+    ftab_append_csv(T, fname, 1);
+    FILE * fid = fopen(fname, "ab");
+    assert(fid != NULL);
+    fprintf(fid, "5,1"); /* Not complete */
+    fclose(fid);
+    ftab_t * N2 = ftab_tail_read(R);
+    ftab_t * N3 = ftab_tail_read(R);
+
+    /* The next append cuts the incomplete row */
+    row[0] = 6;
+    ftab_insert(T, row);
+    int ret = ftab_append_csv(T, fname, 5);
+    ftab_t * N4 = ftab_tail_read(R);
+    ftab_t * A = ftab_from_csv(fname);
+
+    ftab_t * W = ftab_new(3);
+    if(N1 == NULL || N1->nrow != 1 || N2 == NULL || N2->nrow != 4
+       || N2->T[0] != 1 || N2->T[6] != 4 || N3 == NULL || N3->nrow != 0
+       || ret != EXIT_SUCCESS || N4 == NULL || N4->nrow != 1
+       || N4->T[0] != 6 || A == NULL || A->nrow != 6 || A->T[10] != 6
+       || ftab_append_csv(W, fname, 0) == EXIT_SUCCESS)
+    {
+        printf("ftab_append/ftab_tail test failed\n");
+        status++;
+    }
+    ftab_free(W);
+    ftab_free(A);
+    ftab_free(N4);
+
+    /* A header without newline is written again */
+    fid = fopen(fname, "wb");
+    assert(fid != NULL);
+    fprintf(fid, "t,v");
+    fclose(fid);
+    ret = ftab_append_csv(T, fname, 4);
+    A = ftab_from_csv(fname);
+    if(ret != EXIT_SUCCESS || A == NULL || A->nrow != 2 || A->T[0] != 4
+       || A->T[2] != 6)
+    {
+        printf("ftab_append incomplete header test failed\n");
+        status++;
+    }
+    ftab_free(A);
+    ftab_free(N1);
+    ftab_free(N2);
+    ftab_free(N3);
+    ftab_tail_close(R);
+    ftab_free(T);
+
+#ifndef WINDOWS
+    /* Concurrent appends to a new file, one header and whole rows */
+    unlink(fname);
+    ut_append_job_t J[4];
+    pthread_t threads[4];
+    for(int tt = 0; tt < 4; tt++)
+    {
+        J[tt].fname = fname;
+        J[tt].thread = tt;
+        pthread_create(threads + tt, NULL, ut_append_writer, J + tt);
+    }
+    for(int tt = 0; tt < 4; tt++)
+    {
+        pthread_join(threads[tt], NULL);
+    }
+    T = ftab_from_csv(fname);
+    double sum = 0;
+    int ordered = T != NULL;
+    for(size_t kk = 0; ordered && kk < T->nrow; kk++)
+    {
+        sum += T->T[2*kk];
+        /* Each append is contiguous */
+        ordered = T->T[2*kk + 1] == (float) (kk % 1000);
+    }
+    if(T == NULL || T->nrow != 40000 || sum != 60000 || !ordered)
+    {
+        printf("ftab_append concurrent test failed\n");
+        status++;
+    }
+    ftab_free(T);
+    unlink(fname);
+#endif
+    free(fname);
+    return status;
+}
+
+/* Run the parallel code paths on a pool, also when there is only
+ * one CPU */
+static int ut_ctx(void)
+{
+    int status = 0;
+    ftab_ctx_t * ctx = ftab_ctx_new(4);
+    ftab_ctx_use(ctx);
+
+    size_t nrow = 300000;
+    ftab_t * T = ftab_new(3);
+    for(size_t kk = 0; kk < nrow; kk++)
+    {
+        float v = (kk*7919) % nrow;
+        float row[3] = {v, 2*v, kk % 2};
+        ftab_insert(T, row);
+    }
+    ftab_t * C = ftab_copy(T);
+    ftab_sort(T, 0);
+    int sorted = T->nrow == nrow;
+    for(size_t kk = 0; kk < T->nrow; kk++)
+    {
+        sorted = sorted && T->T[3*kk] == (float) (nrow - 1 - kk)
+            && T->T[3*kk + 1] == 2*T->T[3*kk];
+    }
+    ftab_t * R = ftab_concatenate_rows(T, C);
+    ftab_t * W = ftab_concatenate_columns(T, C);
+    u8 * sel = malloc(nrow);
+    for(size_t kk = 0; kk < nrow; kk++)
+    {
+        sel[kk] = C->T[3*kk + 2] == 1;
+    }
+    ftab_subselect_rows(C, sel);
+
+    size_t len = 0;
+    char * buf = ftab_write_buffer(T, ",", &len);
+    ftab_t * B = ftab_from_buffer(buf, len, NULL);
+
+    if(ftab_ctx_nthreads(ctx) != 4 || !sorted
+       || R->nrow != 2*nrow || R->T[3*nrow] != 0 || R->T[3*nrow + 3] != 7919
+       || W->ncol != 6 || W->T[6*5 + 3 + 1] != 2*W->T[6*5 + 3]
+       || C->nrow != nrow / 2 || C->T[3*10 + 2] != 1
+       || B == NULL || B->nrow != nrow
+       || memcmp(B->T, T->T, 3*nrow*sizeof(float)))
+    {
+        printf("ftab_ctx test failed\n");
+        status++;
+    }
+    free(buf);
+    free(sel);
+    ftab_free(B);
+    ftab_free(W);
+    ftab_free(R);
+    ftab_free(C);
+    ftab_free(T);
+    ftab_ctx_use(NULL);
+    ftab_ctx_free(ctx);
+    return status;
+}
+
+/* ftab_sort with NAN, serial and with the parallel runs/merge */
+static int ut_sort_nan(void)
+{
+    int status = 0;
+    size_t nrow = 300000;
+    int nthreads[2] = {1, 4};
+    for(int tt = 0; tt < 2; tt++)
+    {
+        ftab_ctx_t * ctx = ftab_ctx_new(nthreads[tt]);
+        ftab_ctx_use(ctx);
+        ftab_t * T = ftab_new(2);
+        for(size_t kk = 0; kk < nrow; kk++)
+        {
+            float v = (kk*7919) % nrow;
+            float row[2] = {kk % 3 == 0 ? NAN : v, v};
+            ftab_insert(T, row);
+        }
+        ftab_sort(T, 0);
+        size_t nvalue = nrow - (nrow + 2) / 3;
+        int ok = T->nrow == nrow;
+        for(size_t kk = 0; ok && kk < T->nrow; kk++)
+        {
+            float v = T->T[2*kk];
+            if(kk < nvalue)
+            {
+                ok = !isnan(v) && v == T->T[2*kk + 1]
+                    && (kk == 0 || T->T[2*(kk-1)] > v);
+            } else {
+                ok = isnan(v);
+            }
+        }
+        if(!ok)
+        {
+            printf("ftab_sort NAN order test failed (%d threads)\n",
+                   nthreads[tt]);
+            status++;
+        }
+        ftab_free(T);
+        ftab_ctx_use(NULL);
+        ftab_ctx_free(ctx);
+    }
+    return status;
+}
+
+static int ut_convert(void)
+{
+    int status = 0;
+    const double D[8] = {-1, 0.5, 1, 2.75, NAN, 1e10, 3, 4};
+    ftab_t * T = ftab_new_from_f64(4, 2, D);
+    u32 U[8];
+    double F[8];
+    int cols[2] = {1, 0};
+    int saturating = ftab_to_u32(T, NULL, 0, U, 0);
+    int checked = ftab_to_u32(T, NULL, 0, U, 1);
+    ftab_to_f64(T, cols, 2, F);
+    if(T == NULL || saturating != EXIT_SUCCESS || checked == EXIT_SUCCESS
+       || U[0] != 0 || U[1] != 0 || U[3] != 2 || U[4] != 0
+       || U[5] != UINT32_MAX || U[7] != 4
+       || F[0] != 0.5 || F[1] != -1 || F[6] != 4 || F[7] != 3)
+    {
+        printf("ftab_to_u32/f64 test failed\n");
+        status++;
+    }
+    const i32 I[3] = {-5, 0, 7};
+    ftab_t * TI = ftab_new_from_i32(3, 1, I);
+    u32 * UI = ftab_get_data_u32(TI);
+    if(TI == NULL || TI->T[0] != -5 || UI == NULL || UI[0] != 0 || UI[2] != 7)
+    {
+        printf("ftab_new_from_i32 test failed\n");
+        status++;
+    }
+    free(UI);
+    ftab_free(TI);
+    ftab_free(T);
+    return status;
+}
+
+static int ut_hash_compare(const ftab_t * T)
+{
+    int status = 0;
+    ftab_t * C = ftab_copy(T);
+    u64 h = ftab_hash(T);
+    if(ftab_compare(T, C) || h != ftab_hash(C))
+    {
+        printf("ftab_hash test failed\n");
+        status++;
+    }
+    ftab_set_colname(C, 1, "other");
+    if(ftab_compare(T, C) == 0 || h == ftab_hash(C))
+    {
+        printf("ftab_compare column name test failed\n");
+        status++;
+    }
+
+    /* Text round trip */
+    ftab_t * L = ftab_new(3);
+    for(int kk = 0; kk < 1000; kk++)
+    {
+        float row[3] = {kk/3.0f, 1e6f/(kk+1), kk == 10 ? NAN : -kk};
+        ftab_insert(L, row);
+    }
+    size_t len = 0;
+    char * buf = ftab_write_buffer(L, "\t", &len);
+    ftab_opts_t opts = {0};
+    opts.dlm = "\t";
+    ftab_t * L2 = ftab_from_buffer(buf, len, &opts);
+    size_t row = 0;
+    size_t col = 0;
+    int approx = ftab_compare_approx(L, L2, 1e-6, 1e-6, NULL, NULL);
+    L2->T[3*700 + 1] += 1;
+    L2->T[3*900 + 2] += 1;
+    int diff = ftab_compare_approx(L, L2, 1e-6, 1e-6, &row, &col);
+    if(ftab_compare(L, L2) == 0 || approx != 0 || diff != 1
+       || row != 700 || col != 1)
+    {
+        printf("ftab_compare_approx test failed\n");
+        status++;
+    }
+    free(buf);
+    ftab_free(L2);
+    ftab_free(L);
+    ftab_free(C);
+    return status;
+}
+
+#ifndef WINDOWS
+typedef struct {
+    const char * fname;
+    const ftab_t * T;
+} ut_fifo_job_t;
+
+static void * ut_fifo_writer(void * _J)
+{
+    ut_fifo_job_t * J = _J;
+    FILE * fid = fopen(J->fname, "wb");
+    if(fid != NULL)
+    {
+        ftab_print(fid, J->T, ",");
+        fclose(fid);
+    }
+    return NULL;
+}
+
+static int ut_cache(void)
+{
+    int status = 0;
+    char * dir = tempfilename();
+    unlink(dir);
+    char * fname = tempfilename();
+    ftab_t * T = ftab_new(3);
+    ftab_set_colname(T, 0, "a");
+    ftab_set_colname(T, 1, "b");
+    ftab_set_colname(T, 2, "c");
+    for(int kk = 0; kk < 5000; kk++)
+    {
+        float row[3] = {kk, kk/7.0f, -kk};
+        ftab_insert(T, row);
+    }
+    ftab_write_csv(T, fname);
+    if(ftab_cache_enable(dir, 1ULL << 30))
+    {
+        printf("ftab_cache_enable test failed\n");
+        return 1;
+    }
+    ftab_t * A = ftab_from_csv(fname); /* miss */
+    ftab_t * B = ftab_from_csv(fname); /* hit */
+    if(ftab_compare(A, B) != 0 || B == NULL || B->map == NULL)
+    {
+        printf("ftab_cache hit test failed\n");
+        status++;
+    }
+    /* The data of a snapshot can be modified and grown */
+    float row[3] = {1, 2, 3};
+    ftab_insert(B, row);
+    ftab_free(B);
+
+    /* Same size, different content */
+    FILE * fid = fopen(fname, "r+b");
+    fseek(fid, -9, SEEK_END);
+    fputc('7', fid);
+    fclose(fid);
+    ftab_t * C = ftab_from_csv(fname);
+    if(C == NULL || C->map != NULL || C->nrow != T->nrow
+       || C->T[3*C->nrow - 1] == T->T[3*T->nrow - 1])
+    {
+        printf("ftab_cache invalidation test failed\n");
+        status++;
+    }
+    ftab_free(C);
+
+    /* A limit of 0 keeps nothing */
+    ftab_cache_enable(dir, 0);
+    ftab_t * D = ftab_from_csv(fname);
+    if(D == NULL || D->map != NULL)
+    {
+        printf("ftab_cache eviction test failed\n");
+        status++;
+    }
+    ftab_free(D);
+
+    /* A pipe is parsed without the cache */
+    char * fifo = tempfilename();
+    unlink(fifo);
+    if(mkfifo(fifo, 0600) == 0)
+    {
+        ut_fifo_job_t J = {fifo, T};
+        pthread_t writer;
+        pthread_create(&writer, NULL, ut_fifo_writer, &J);
+        ftab_t * F = ftab_from_csv(fifo);
+        pthread_join(writer, NULL);
+        if(ftab_compare(F, A) != 0)
+        {
+            printf("ftab_cache fifo test failed\n");
+            status++;
+        }
+        ftab_free(F);
+        unlink(fifo);
+    }
+    free(fifo);
+    ftab_cache_disable();
+
+    DIR * dd = opendir(dir);
+    struct dirent * ent;
+    while(dd != NULL && (ent = readdir(dd)) != NULL)
+    {
+        if(ent->d_name[0] != '.')
+        {
+            printf("ftab_cache eviction test failed, %s left\n", ent->d_name);
+            status++;
+        }
+    }
+    if(dd != NULL)
+    {
+        closedir(dd);
+    }
+    rmdir(dir);
+    unlink(fname);
+    free(dir);
+    free(fname);
+    ftab_free(A);
+    ftab_free(T);
+    return status;
+}
+#endif
+
+static int ut_expr(void)
+{
+    int status = 0;
+    size_t nrow = 5000;
+    ftab_t * T = ftab_new(3);
+    ftab_set_colname(T, 0, "x");
+    ftab_set_colname(T, 1, "y");
+    ftab_set_colname(T, 2, "bg 2");
+    for(size_t kk = 0; kk < nrow; kk++)
+    {
+        float row[3] = {kk % 17, (float) kk - 2500, kk == 7 ? NAN : 2};
+        ftab_insert(T, row);
+    }
+
+    float * R = ftab_eval(T, "sqrt(x*x + y*y) - -1 + 2*3/4");
+    float * C = ftab_eval(T, "(x >= 3 && y < 0) || !(x != 5)");
+    float * M = ftab_eval(T, "max(x, `bg 2`) + pow(2, 3) + abs(-y)");
+    if(R == NULL || C == NULL || M == NULL)
+    {
+        printf("ftab_eval test failed\n");
+        status++;
+    }
+    for(size_t kk = 0; status == 0 && kk < nrow; kk++)
+    {
+        float x = T->T[3*kk];
+        float y = T->T[3*kk + 1];
+        float bg = T->T[3*kk + 2];
+        float r = sqrtf(x*x + y*y) + 1 + 1.5f;
+        float c = ((x >= 3 && y < 0) || x == 5);
+        float m = fmaxf(x, bg) + 8 + fabsf(y);
+        if(fabsf(R[kk] - r) > 1e-3f*r || C[kk] != c || M[kk] != m)
+        {
+            printf("ftab_eval test failed for row %zu\n", kk);
+            status++;
+        }
+    }
+    free(R);
+    free(C);
+    free(M);
+
+    /* Errors */
+    const char * bad[] = {"x +", "z", "sqrt(x", "foo(x)", "x y", "min(x)",
+                          "`x", "", "x == == y"};
+    for(size_t kk = 0; kk < sizeof(bad)/sizeof(bad[0]); kk++)
+    {
+        float * B = ftab_eval(T, bad[kk]);
+        if(B != NULL)
+        {
+            printf("ftab_eval did not fail for \"%s\"\n", bad[kk]);
+            status++;
+            free(B);
+        }
+    }
+
+    size_t expected = 0;
+    for(size_t kk = 0; kk < nrow; kk++)
+    {
+        float x = T->T[3*kk];
+        float bg = T->T[3*kk + 2];
+        expected += (x/bg > 3);
+    }
+    if(ftab_filter(T, "x/`bg 2` > 3") != EXIT_SUCCESS
+       || T->nrow != expected || ftab_filter(T, "x >") == EXIT_SUCCESS
+       || T->nrow != expected)
+    {
+        printf("ftab_filter test failed\n");
+        status++;
+    }
+    for(size_t kk = 0; kk < T->nrow; kk++)
+    {
+        if(!(T->T[3*kk] / T->T[3*kk + 2] > 3))
+        {
+            printf("ftab_filter test failed for row %zu\n", kk);
+            status++;
+            break;
+        }
+    }
+    ftab_free(T);
+
+    /* Without column names only the constants are known */
+    T = ftab_new(2);
+    float row[2] = {1, 2};
+    ftab_insert(T, row);
+    float * P = ftab_eval(T, "pi + 1");
+    float * X = ftab_eval(T, "x");
+    if(P == NULL || fabsf(P[0] - 4.14159f) > 1e-5f || X != NULL
+       || ftab_get_col(T, "x") != -1)
+    {
+        printf("ftab_eval test without column names failed\n");
+        status++;
+    }
+    free(P);
+    free(X);
+    ftab_free(T);
+    return status;
+}
+
+static int ut_merge_sorted(void)
+{
+    int status = 0;
+    ftab_ctx_t * ctx = ftab_ctx_new(4);
+    ftab_ctx_use(ctx);
+    for(int descending = 0; descending < 2; descending++)
+    {
+        /* Shards of different sizes, the last one empty */
+        size_t sizes[5] = {200000, 1, 77777, 150000, 0};
+        ftab_t * S[5];
+        double sum = 0;
+        for(int ss = 0; ss < 5; ss++)
+        {
+            S[ss] = ftab_new(2);
+            ftab_set_colname(S[ss], 0, "t");
+            ftab_set_colname(S[ss], 1, "shard");
+            for(size_t kk = 0; kk < sizes[ss]; kk++)
+            {
+                /* Many duplicated keys and a few NAN at the end */
+                float t = (float) (kk*(ss+3) / 5);
+                if(kk + 3 > sizes[ss] && ss == 3)
+                {
+                    t = NAN;
+                }
+                if(descending && !isnan(t))
+                {
+                    t = -t;
+                }
+                float row[2] = {t, ss};
+                ftab_insert(S[ss], row);
+                sum += ss;
+            }
+        }
+        ftab_t * M = ftab_merge_sorted((const ftab_t **) S, 5, 0, descending);
+        int ok = M != NULL && M->nrow == 427778;
+        double msum = 0;
+        for(size_t kk = 0; ok && kk < M->nrow; kk++)
+        {
+            msum += M->T[2*kk + 1];
+            if(kk == 0)
+            {
+                continue;
+            }
+            float a = M->T[2*kk - 2];
+            float b = M->T[2*kk];
+            if(isnan(a))
+            {
+                ok = isnan(b);
+            } else if(!isnan(b))
+            {
+                ok = descending ? a >= b : a <= b;
+                /* Stable, lower shard first */
+                if(a == b && M->T[2*kk - 1] > M->T[2*kk + 1])
+                {
+                    ok = 0;
+                }
+            }
+        }
+        if(!ok || msum != sum || strcmp(M->colnames[1], "shard") != 0)
+        {
+            printf("ftab_merge_sorted test failed (descending=%d)\n", descending);
+            status++;
+        }
+        ftab_free(M);
+        for(int ss = 0; ss < 5; ss++)
+        {
+            ftab_free(S[ss]);
+        }
+    }
+    ftab_ctx_use(NULL);
+    ftab_ctx_free(ctx);
+
+    ftab_t * A = ftab_new(2);
+    ftab_t * B = ftab_new(3);
+    const ftab_t * bad[2] = {A, B};
+    if(ftab_merge_sorted(bad, 2, 0, 0) != NULL
+       || ftab_merge_sorted(bad, 1, 2, 0) != NULL)
+    {
+        printf("ftab_merge_sorted argument test failed\n");
+        status++;
+    }
+    ftab_free(A);
+    ftab_free(B);
+    return status;
+}
+
+static int ut_missing(void)
+{
+    int status = 0;
+    const char * csv = "a,b,c\n1,,3\n,5,6\n7,8,\n9, ,nan\n";
+    ftab_opts_t opts = {0};
+    opts.missing = 1;
+    ftab_t * T = ftab_from_buffer(csv, strlen(csv), &opts);
+    ftab_t * Z = ftab_from_buffer(csv, strlen(csv), NULL);
+    if(T == NULL || Z == NULL || T->nrow != 4
+       || !ftab_is_missing(T, 0, 1) || !ftab_is_missing(T, 1, 0)
+       || !ftab_is_missing(T, 2, 2) || !ftab_is_missing(T, 3, 1)
+       || ftab_is_missing(T, 3, 2) || ftab_is_missing(T, 0, 0)
+       || !isnan(T->T[1]) || !isnan(T->T[11])
+       || ftab_count_missing(T, 0) != 1 || ftab_count_missing(T, 1) != 2
+       || Z->valid != NULL || Z->T[1] != 0)
+    {
+        printf("ftab missing value parsing test failed\n");
+        status++;
+    }
+    /* Empty fields are written back, a nan value is not missing */
+    size_t len = 0;
+    char * buf = ftab_write_buffer(T, ",", &len);
+    ftab_t * T2 = ftab_from_buffer(buf, len, &opts);
+    if(ftab_compare(T, T2) != 0 || strstr(buf, "\n,5") == NULL
+       || ftab_compare(T, Z) == 0)
+    {
+        printf("ftab missing value writer test failed\n");
+        status++;
+    }
+    free(buf);
+
+    /* Operations that keep the bitmaps */
+    float row[3] = {10, 11, 12};
+    ftab_insert(T, row);
+    ftab_sort(T, 0); /* Descending, NAN last */
+    int ok = T->nrow == 5;
+    for(size_t rr = 0; rr < T->nrow; rr++)
+    {
+        for(size_t cc = 0; cc < 3; cc++)
+        {
+            float v = T->T[3*rr + cc];
+            int missing = ftab_is_missing(T, rr, cc);
+            /* The only NAN that is not missing is c in the row with a 9 */
+            if(missing != (isnan(v) && !(cc == 2 && T->T[3*rr] == 9)))
+            {
+                ok = 0;
+            }
+        }
+    }
+    /* Remove the inserted row */
+    u8 sel[5] = {0};
+    for(size_t rr = 0; rr < T->nrow && rr < 5; rr++)
+    {
+        sel[rr] = T->T[3*rr] != 10;
+    }
+    ftab_subselect_rows(T, sel);
+    ftab_t * C = ftab_concatenate_rows(T, T2);
+    ftab_t * D = ftab_concatenate_columns(T2, T2);
+    ftab_t * E = ftab_copy(C);
+    if(!ok || ftab_count_missing(C, 1) != 2 + 2 || ftab_compare(C, E) != 0
+       || !ftab_is_missing(D, 0, 4) || ftab_count_missing(D, 3) != 1
+       || ftab_count_missing(T, 0) + ftab_count_missing(T, 1)
+       + ftab_count_missing(T, 2) != 4 || ftab_compare(T, T2) == 0)
+    {
+        printf("ftab missing value operation test failed\n");
+        status++;
+    }
+    float col[8] = {0};
+    ftab_set_coldata(C, 1, col);
+    if(ftab_count_missing(C, 1) != 0)
+    {
+        printf("ftab_set_coldata missing value test failed\n");
+        status++;
+    }
+    ftab_free(C);
+    ftab_free(D);
+    ftab_free(E);
+    ftab_free(T2);
+    ftab_free(Z);
+    ftab_free(T);
+
+    /* Large input, parsed in parallel */
+    ftab_ctx_t * ctx = ftab_ctx_new(4);
+    ftab_ctx_use(ctx);
+    ftab_strbuf_t sb = {0};
+    sb_append(&sb, "x,y\n", 4);
+    size_t nrow = 300000;
+    for(size_t kk = 0; kk < nrow; kk++)
+    {
+        char line[64];
+        int n = kk % 7 == 0 ? snprintf(line, sizeof(line), "%zu,\n", kk)
+            : snprintf(line, sizeof(line), "%zu,%zu\n", kk, kk);
+        sb_append(&sb, line, n);
+    }
+    T = ftab_from_buffer(sb.s, sb.len, &opts);
+    if(T == NULL || T->nrow != nrow || ftab_count_missing(T, 0) != 0
+       || ftab_count_missing(T, 1) != (nrow + 6) / 7
+       || !ftab_is_missing(T, 7*1000, 1) || ftab_is_missing(T, 7*1000 + 1, 1))
+    {
+        printf("ftab missing value parallel parsing test failed\n");
+        status++;
+    }
+    ftab_free(T);
+    free(sb.s);
+    ftab_ctx_use(NULL);
+    ftab_ctx_free(ctx);
+    return status;
+}
+
+static int ut_partition(void)
+{
+    int status = 0;
+    ftab_ctx_t * ctx = ftab_ctx_new(4);
+    ftab_ctx_use(ctx);
+    size_t nrow = 200000;
+    ftab_t * T = ftab_new(3);
+    ftab_set_colname(T, 0, "x");
+    ftab_set_colname(T, 1, "label");
+    ftab_set_colname(T, 2, "y");
+    for(size_t kk = 0; kk < nrow; kk++)
+    {
+        float label = (float) ((kk*7919) % 37);
+        if(kk % 1001 == 0)
+        {
+            label = NAN;
+        }
+        if(label == 0 && kk % 2 == 1)
+        {
+            label = -0.0f;
+        }
+        float row[3] = {(float) kk, label, (float) (kk % 13)};
+        ftab_insert(T, row);
+    }
+
+    ftab_partition_t * P = ftab_partition(T, 1);
+    const size_t * off = P == NULL ? NULL : ftab_partition_offsets(P);
+    if(P == NULL || ftab_partition_count(P) != 38 || off[0] != 0
+       || off[38] != nrow || !isnan(ftab_partition_key(P, 37))
+       || ftab_partition_key(P, 0) != 0 || ftab_partition_key(P, 36) != 36
+       || ftab_partition_grouped(P)->nrow != nrow)
+    {
+        printf("ftab_partition test failed\n");
+        status++;
+        ftab_partition_free(P);
+        P = NULL;
+    }
+    /* Same as one subselection per key */
+    u8 * sel = malloc(nrow);
+    assert(sel != NULL);
+    for(size_t kk = 0; P != NULL && kk < ftab_partition_count(P); kk++)
+    {
+        float key = ftab_partition_key(P, kk);
+        for(size_t rr = 0; rr < nrow; rr++)
+        {
+            float v = T->T[3*rr + 1];
+            sel[rr] = isnan(key) ? isnan(v) : v == key;
+        }
+        ftab_t * S = ftab_copy(T);
+        ftab_subselect_rows(S, sel);
+        const ftab_t * V = ftab_partition_table(P, kk);
+        if(ftab_compare(S, V) != 0
+           || V->T != ftab_partition_grouped(P)->T + 3*off[kk])
+        {
+            printf("ftab_partition key %zu test failed\n", kk);
+            status++;
+        }
+        ftab_free(S);
+    }
+    free(sel);
+    ftab_partition_free(P);
+
+    /* One file per key */
+    char * base = tempfilename();
+    char * pattern = malloc(strlen(base) + 32);
+    assert(pattern != NULL);
+    sprintf(pattern, "%s_%%02.0f.csv", base);
+    char * fname = malloc(strlen(base) + 32);
+    assert(fname != NULL);
+    if(ftab_write_partitioned(T, 1, pattern) != EXIT_SUCCESS
+       || ftab_write_partitioned(T, 1, "%s.tsv") == EXIT_SUCCESS
+       || ftab_write_partitioned(T, 1, "%f_%f.tsv") == EXIT_SUCCESS
+       || ftab_write_partitioned(T, 3, pattern) == EXIT_SUCCESS)
+    {
+        printf("ftab_write_partitioned test failed\n");
+        status++;
+    }
+    for(int kk = 0; kk < 38; kk++)
+    {
+        if(kk < 37)
+        {
+            sprintf(fname, "%s_%02d.csv", base, kk);
+        } else {
+            sprintf(fname, "%s_nan.csv", base);
+        }
+        ftab_t * F = ftab_from_csv(fname);
+        if(F == NULL || F->nrow < 100 || F->ncol != 3
+           || (kk < 37 && F->T[1] != kk))
+        {
+            printf("ftab_write_partitioned %s test failed\n", fname);
+            status++;
+        }
+        ftab_free(F);
+        unlink(fname);
+    }
+
+    /* Non-integral keys, 0.2 and 0.4 are both 0 with %.0f */
+    ftab_t * K = ftab_new(2);
+    for(int kk = 0; kk < 90; kk++)
+    {
+        float row[2] = {kk, (kk % 3) == 0 ? 0.2f : (kk % 3) == 1 ? 0.4f : 1.5f};
+        ftab_insert(K, row);
+    }
+    sprintf(pattern, "%s_%%.0f.tsv", base);
+    sprintf(fname, "%s_0.tsv", base);
+    FILE * fid = NULL;
+    if(ftab_write_partitioned(K, 1, pattern) == EXIT_SUCCESS
+       || (fid = fopen(fname, "rb")) != NULL)
+    {
+        printf("ftab_write_partitioned file name collision test failed\n");
+        status++;
+    }
+    if(fid != NULL)
+    {
+        fclose(fid);
+    }
+    sprintf(pattern, "%s_%%.1f.tsv", base);
+    if(ftab_write_partitioned(K, 1, pattern) != EXIT_SUCCESS)
+    {
+        printf("ftab_write_partitioned non-integral key test failed\n");
+        status++;
+    }
+    const char * kname[3] = {"0.2", "0.4", "1.5"};
+    for(int kk = 0; kk < 3; kk++)
+    {
+        sprintf(fname, "%s_%s.tsv", base, kname[kk]);
+        ftab_t * F = ftab_from_tsv(fname);
+        if(F == NULL || F->nrow != 30 || F->T[0] != kk)
+        {
+            printf("ftab_write_partitioned %s test failed\n", fname);
+            status++;
+        }
+        ftab_free(F);
+        unlink(fname);
+    }
+    ftab_free(K);
+    unlink(base);
+    free(fname);
+    free(pattern);
+    free(base);
+    ftab_free(T);
+    ftab_ctx_use(NULL);
+    ftab_ctx_free(ctx);
+
+    /* Missing values follow the rows */
+    const char * csv = "k,v\n1,\n2,5\n1,3\n,4\n2,\n";
+    ftab_opts_t opts = {0};
+    opts.missing = 1;
+    T = ftab_from_buffer(csv, strlen(csv), &opts);
+    P = ftab_partition(T, 0);
+    if(P == NULL || ftab_partition_count(P) != 3
+       || !ftab_is_missing(ftab_partition_table(P, 0), 0, 1)
+       || ftab_is_missing(ftab_partition_table(P, 0), 1, 1)
+       || !ftab_is_missing(ftab_partition_table(P, 1), 1, 1)
+       || !ftab_is_missing(ftab_partition_table(P, 2), 0, 0)
+       || ftab_count_missing(ftab_partition_grouped(P), 1) != 2)
+    {
+        printf("ftab_partition missing value test failed\n");
+        status++;
+    }
+    ftab_partition_free(P);
+    ftab_free(T);
+    return status;
+}
+
+static int ut_distinct(void)
+{
+    int status = 0;
+    /* Row 3 repeats row 0, so does row 1 in column 0. Rows 4 and 5
+     * only differ by -0 and the NAN payload */
+    float nan2 = NAN;
+    u32 bits;
+    memcpy(&bits, &nan2, sizeof(u32));
+    bits ^= 1;
+    memcpy(&nan2, &bits, sizeof(u32));
+    float data[] = {1, 2,
+                    1, 3,
+                    4, 2,
+                    1, 2,
+                    0, NAN,
+                    -0.0f, nan2};
+    ftab_t * T = ftab_new(2);
+    for(size_t kk = 0; kk < 6; kk++)
+    {
+        ftab_insert(T, data + 2*kk);
+    }
+    ftab_t * A = ftab_copy(T);
+    ftab_t * C = ftab_copy(T);
+    int col0 = 0;
+    if(ftab_distinct(T, NULL, 0, 0) || T->nrow != 5
+       || ftab_distinct(A, &col0, 1, 0) || A->nrow != 4 || A->T[2] != 4
+       || ftab_distinct(C, NULL, 0, 1) || C->nrow != 4 || C->T[6] != 0
+       || ftab_distinct(C, &col0, 1, 0) || C->nrow != 3)
+    {
+        printf("ftab_distinct test failed\n");
+        status++;
+    }
+    int bad = 2;
+    if(ftab_distinct(T, &bad, 1, 0) == EXIT_SUCCESS)
+    {
+        printf("ftab_distinct invalid column test failed\n");
+        status++;
+    }
+    ftab_free(A);
+    ftab_free(C);
+    ftab_free(T);
+
+    /* In parallel, against a serial reference */
+    ftab_ctx_t * ctx = ftab_ctx_new(4);
+    ftab_ctx_use(ctx);
+    size_t nrow = 300000;
+    T = ftab_new(3);
+    for(size_t kk = 0; kk < nrow; kk++)
+    {
+        float row[3] = {(float) ((kk*7919) % 1000), (float) (kk % 7),
+                        (float) kk};
+        ftab_insert(T, row);
+    }
+    int cols[2] = {1, 0};
+    ftab_distinct(T, cols, 2, 0);
+    /* (kk*7919) % 1000 and kk % 7 repeat with period 7000 */
+    int ok = T->nrow == 7000;
+    for(size_t kk = 0; ok && kk < T->nrow; kk++)
+    {
+        ok = T->T[3*kk + 2] == (float) kk;
+    }
+    if(!ok)
+    {
+        printf("ftab_distinct parallel test failed\n");
+        status++;
+    }
+    ftab_free(T);
+    ftab_ctx_use(NULL);
+    ftab_ctx_free(ctx);
+    return status;
+}
+
+static int ut_sketch(void)
+{
+    int status = 0;
+    float small[] = {3, 1, NAN, 2};
+    ftab_t * T = ftab_new(1);
+    for(size_t kk = 0; kk < 4; kk++)
+    {
+        ftab_insert(T, small + kk);
+    }
+    double q[4] = {0.75, 0, 0.5, 1};
+    double out[4] = {0};
+    double bad = 1.5;
+    if(ftab_quantile(T, 0, q, 4, out) || out[0] != 2.5 || out[1] != 1
+       || out[2] != 2 || out[3] != 3
+       || ftab_quantile(T, 0, &bad, 1, out) == EXIT_SUCCESS)
+    {
+        printf("ftab_quantile test failed\n");
+        status++;
+    }
+    ftab_free(T);
+
+    /* A permutation of 0, ..., n-1 and a label column */
+    ftab_ctx_t * ctx = ftab_ctx_new(4);
+    ftab_ctx_use(ctx);
+    size_t n = 400001;
+    T = ftab_new(2);
+    for(size_t kk = 0; kk < n; kk++)
+    {
+        float row[2] = {(float) ((kk*7919) % n), (float) (kk % 1000)};
+        ftab_insert(T, row);
+    }
+    double q2[5] = {0.99, 0.25, 0.01, 0.5, 0.1234567};
+    double out2[5] = {0};
+    int ok = ftab_quantile(T, 0, q2, 5, out2) == EXIT_SUCCESS;
+    for(size_t kk = 0; kk < 5; kk++)
+    {
+        ok = ok && fabs(out2[kk] - q2[kk]*(n-1)) < 1e-3;
+    }
+    double med = 0;
+    ok = ok && ftab_quantile(T, 1, q2 + 3, 1, &med) == EXIT_SUCCESS
+        && med == 499; /* Label 0 has one row more */
+    if(!ok)
+    {
+        printf("ftab_quantile large test failed\n");
+        status++;
+    }
+
+    /* KLL, in parallel, merged from pieces and serialized */
+    ftab_qsketch_t * S = ftab_qsketch_new(0);
+    ftab_qsketch_t * A = ftab_qsketch_new(0);
+    ftab_qsketch_t * B = ftab_qsketch_new(0);
+    ftab_qsketch_add_column(S, T, 0);
+    for(size_t kk = 0; kk < n; kk++)
+    {
+        ftab_qsketch_add(kk % 2 ? A : B, T->T[2*kk]);
+    }
+    ftab_qsketch_merge(A, B);
+    size_t len = 0;
+    char * buf = ftab_qsketch_serialize(S, &len);
+    ftab_qsketch_t * S2 = ftab_qsketch_deserialize(buf, len);
+    ok = ftab_qsketch_count(S) == n && ftab_qsketch_count(A) == n
+        && S2 != NULL && ftab_qsketch_quantile(S, 0) == 0
+        && ftab_qsketch_quantile(S, 1) == n - 1
+        && ftab_qsketch_deserialize(buf, len - 1) == NULL;
+    for(size_t kk = 0; ok && kk < 5; kk++)
+    {
+        double expected = q2[kk]*n;
+        ok = fabs(ftab_qsketch_quantile(S, q2[kk]) - expected) < 0.02*n
+            && fabs(ftab_qsketch_quantile(A, q2[kk]) - expected) < 0.02*n
+            && ftab_qsketch_quantile(S2, q2[kk]) == ftab_qsketch_quantile(S, q2[kk]);
+    }
+    if(!ok)
+    {
+        printf("ftab_qsketch test failed\n");
+        status++;
+    }
+    free(buf);
+    ftab_qsketch_free(S);
+    ftab_qsketch_free(S2);
+    ftab_qsketch_free(A);
+    ftab_qsketch_free(B);
+
+    /* HyperLogLog */
+    ftab_hll_t * H = ftab_hll_new(0);
+    ftab_hll_t * L = ftab_hll_new(0);
+    ftab_hll_t * H1 = ftab_hll_new(0);
+    ftab_hll_t * H2 = ftab_hll_new(0);
+    ftab_hll_add_column(H, T, 0);
+    ftab_hll_add_column(L, T, 1);
+    ftab_hll_add(L, -0.0f);
+    ftab_hll_add(L, NAN);
+    for(size_t kk = 0; kk < n; kk++)
+    {
+        ftab_hll_add(T->T[2*kk] < n/2 ? H1 : H2, T->T[2*kk]);
+    }
+    ftab_hll_merge(H1, H2);
+    buf = ftab_hll_serialize(H, &len);
+    ftab_hll_t * H3 = ftab_hll_deserialize(buf, len);
+    if(fabs(ftab_hll_estimate(H) - n) > 0.03*n
+       || fabs(ftab_hll_estimate(L) - 1000) > 30
+       || ftab_hll_estimate(H1) != ftab_hll_estimate(H)
+       || H3 == NULL || ftab_hll_estimate(H3) != ftab_hll_estimate(H)
+       || ftab_hll_new(3) != NULL)
+    {
+        printf("ftab_hll test failed\n");
+        status++;
+    }
+    free(buf);
+    ftab_hll_free(H);
+    ftab_hll_free(H1);
+    ftab_hll_free(H2);
+    ftab_hll_free(H3);
+    ftab_hll_free(L);
+    ftab_free(T);
+    ftab_ctx_use(NULL);
+    ftab_ctx_free(ctx);
+    return status;
+}
+
+static int ut_sample(void)
+{
+    int status = 0;
+    ftab_ctx_t * ctx1 = ftab_ctx_new(1);
+    ftab_ctx_t * ctx4 = ftab_ctx_new(4);
+    /* More than one task per context with 4 threads */
+    size_t nrow = 300000;
+    ftab_t * T = ftab_new(2);
+    ftab_set_colname(T, 0, "idx");
+    ftab_set_colname(T, 1, "key");
+    for(size_t kk = 0; kk < nrow; kk++)
+    {
+        float row[2] = {(float) kk, (float) (kk % 10)};
+        ftab_insert(T, row);
+    }
+    float row[2] = {0, 99};
+    for(size_t kk = 0; kk < 3; kk++)
+    {
+        ftab_insert(T, row);
+    }
+
+    ftab_ctx_use(ctx1);
+    ftab_t * S1 = ftab_sample(T, 1000, 42);
+    ftab_t * Z1 = ftab_sample_stratified(T, 1, 50, 42);
+    ftab_t * H1 = ftab_sample(T, nrow/2, 5);
+    ftab_ctx_use(ctx4);
+    ftab_t * S4 = ftab_sample(T, 1000, 42);
+    ftab_t * Z4 = ftab_sample_stratified(T, 1, 50, 42);
+    ftab_t * S5 = ftab_sample(T, 1000, 43);
+    /* n larger than the rows of a task */
+    ftab_t * H4 = ftab_sample(T, nrow/2, 5);
+    ftab_t * All = ftab_sample(T, 2*nrow, 1);
+    double sum = 0;
+    int ok = S1 != NULL && S1->nrow == 1000 && ftab_compare(S1, S4) == 0
+        && ftab_compare(S1, S5) != 0 && ftab_compare(All, T) == 0
+        && H1 != NULL && H1->nrow == nrow/2 && ftab_compare(H1, H4) == 0;
+    for(size_t kk = 0; ok && kk < S1->nrow; kk++)
+    {
+        ok = kk == 0 || S1->T[2*kk] > S1->T[2*kk - 2];
+        sum += S1->T[2*kk];
+    }
+    /* The mean index is within 10 standard deviations */
+    if(!ok || fabs(sum/1000 - nrow/2.0) > 10*nrow/sqrt(12*1000.0))
+    {
+        printf("ftab_sample test failed\n");
+        status++;
+    }
+    /* 50 of each of the keys 0-9, then the 3 rows with key 99 */
+    ok = Z1 != NULL && Z1->nrow == 503 && ftab_compare(Z1, Z4) == 0
+        && Z1->T[2*502 + 1] == 99;
+    for(size_t kk = 0; ok && kk < 500; kk++)
+    {
+        ok = Z1->T[2*kk + 1] == kk / 50
+            && ((int) Z1->T[2*kk]) % 10 == (int) (kk / 50)
+            && (kk % 50 == 0 || Z1->T[2*kk] > Z1->T[2*kk - 2]);
+    }
+    if(!ok)
+    {
+        printf("ftab_sample_stratified test failed\n");
+        status++;
+    }
+    /* n larger than any stratum takes all of them */
+    ftab_t * Zall = ftab_sample_stratified(T, 1, (size_t) 1 << 60, 7);
+    if(Zall == NULL || Zall->nrow != T->nrow)
+    {
+        printf("ftab_sample_stratified large n test failed\n");
+        status++;
+    }
+    ftab_free(Zall);
+    ftab_free(S1);
+    ftab_free(S4);
+    ftab_free(S5);
+    ftab_free(H1);
+    ftab_free(H4);
+    ftab_free(All);
+    ftab_free(Z1);
+    ftab_free(Z4);
+    ftab_free(T);
+
+    /* Sampling while loading, larger than one block */
+    ftab_strbuf_t sb = {0};
+    sb_append(&sb, "idx,key\n", 8);
+    nrow = 1000000;
+    for(size_t kk = 0; kk < nrow; kk++)
+    {
+        char line[64];
+        int n = snprintf(line, sizeof(line), "%zu,%zu\n", kk, kk % 10);
+        sb_append(&sb, line, n);
+    }
+    ftab_opts_t opts = {0};
+    opts.sample = 0.01;
+    opts.sample_seed = 7;
+    opts.ctx = ctx1;
+    ftab_t * L1 = ftab_from_buffer(sb.s, sb.len, &opts);
+    opts.ctx = ctx4;
+    ftab_t * L4 = ftab_from_buffer(sb.s, sb.len, &opts);
+    opts.sample_seed = 8;
+    ftab_t * L5 = ftab_from_buffer(sb.s, sb.len, &opts);
+    ok = L1 != NULL && ftab_compare(L1, L4) == 0 && ftab_compare(L1, L5) != 0
+        && fabs((double) L1->nrow - 0.01*nrow) < 10*sqrt(0.01*nrow);
+    for(size_t kk = 1; ok && kk < L1->nrow; kk++)
+    {
+        ok = L1->T[2*kk] > L1->T[2*kk - 2]
+            && ((int) L1->T[2*kk]) % 10 == L1->T[2*kk + 1];
+    }
+    if(!ok)
+    {
+        printf("ftab_from_buffer sampling test failed\n");
+        status++;
+    }
+    ftab_free(L1);
+    ftab_free(L4);
+    ftab_free(L5);
+    free(sb.s);
+    ftab_ctx_use(NULL);
+    ftab_ctx_free(ctx1);
+    ftab_ctx_free(ctx4);
+    return status;
+}
+
+/* Check that S has the columns idx of the table made by ut_columns */
+static int ut_columns_check(const ftab_t * S, const int * idx, size_t n)
+{
+    if(S == NULL || S->ncol != n || S->nrow != 50000)
+    {
+        return 0;
+    }
+    for(size_t rr = 0; rr < S->nrow; rr++)
+    {
+        for(size_t cc = 0; cc < n; cc++)
+        {
+            float v = S->T[rr*n + cc];
+            if(rr == 3 && idx[cc] == 2)
+            {
+                if(!isnan(v) || !ftab_is_missing(S, rr, cc))
+                {
+                    return 0;
+                }
+            } else if(v != (float) (rr*7 + idx[cc]) || ftab_is_missing(S, rr, cc))
+            {
+                return 0;
+            }
+        }
+    }
+    for(size_t cc = 0; cc < n; cc++)
+    {
+        char name[16];
+        sprintf(name, "c%d", idx[cc]);
+        if(strcmp(S->colnames[cc], name) != 0)
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static int ut_columns(void)
+{
+    int status = 0;
+    ftab_ctx_t * ctx = ftab_ctx_new(4);
+    ftab_ctx_use(ctx);
+    ftab_t * T = ftab_new(7);
+    for(int cc = 0; cc < 7; cc++)
+    {
+        char name[16];
+        sprintf(name, "c%d", cc);
+        ftab_set_colname(T, cc, name);
+    }
+    for(size_t rr = 0; rr < 50000; rr++)
+    {
+        float row[7];
+        for(size_t cc = 0; cc < 7; cc++)
+        {
+            row[cc] = rr*7 + cc;
+        }
+        ftab_insert(T, row);
+    }
+    ftab_set_missing(T, 3, 2);
+
+    const int sel[][7] = {{6, 0, 2},
+                          {0, 1, 2},
+                          {1, 0, 2, 3, 4, 5, 6},
+                          {2, 2},
+                          {0, 1, 2, 3, 4, 5, 6},
+                          {0, 1, 2, 3, 4, 6}};
+    const size_t nsel[] = {3, 3, 7, 2, 7, 6};
+    for(size_t kk = 0; kk < 6; kk++)
+    {
+        ftab_t * S = ftab_copy(T);
+        if(ftab_select_columns(S, sel[kk], nsel[kk])
+           || !ut_columns_check(S, sel[kk], nsel[kk]))
+        {
+            printf("ftab_select_columns test %zu failed\n", kk);
+            status++;
+        }
+        ftab_free(S);
+    }
+    int bad[2] = {0, 7};
+    if(ftab_select_columns(T, bad, 2) == EXIT_SUCCESS)
+    {
+        printf("ftab_select_columns invalid column test failed\n");
+        status++;
+    }
+
+    /* The columns 0-6, 1, 5-6 */
+    ftab_t * A = ftab_copy(T);
+    ftab_t * B = ftab_copy(T);
+    ftab_t * C = ftab_copy(T);
+    int c1 = 1;
+    int c56[2] = {5, 6};
+    ftab_select_columns(B, &c1, 1);
+    ftab_select_columns(C, c56, 2);
+    const ftab_t * tables[3] = {A, B, C};
+    ftab_t * H = ftab_hcat(tables, 3);
+    ftab_t * AB = ftab_concatenate_columns(A, B);
+    ftab_t * ABC = ftab_concatenate_columns(AB, C);
+    const int hidx[10] = {0, 1, 2, 3, 4, 5, 6, 1, 5, 6};
+    ftab_head(C, 10);
+    tables[2] = C;
+    if(!ut_columns_check(H, hidx, 10) || ftab_compare(H, ABC) != 0
+       || ftab_hcat(tables, 3) != NULL)
+    {
+        printf("ftab_hcat test failed\n");
+        status++;
+    }
+    ftab_free(A);
+    ftab_free(B);
+    ftab_free(C);
+    ftab_free(H);
+    ftab_free(AB);
+    ftab_free(ABC);
+    ftab_free(T);
+    ftab_ctx_use(NULL);
+    ftab_ctx_free(ctx);
+    return status;
+}
+
+static int ut_io(void)
+{
+    int status = 0;
+    ftab_ctx_t * ctx = ftab_ctx_new(4);
+    ftab_ctx_use(ctx);
+    ftab_t * T = ftab_new(5);
+    for(int cc = 0; cc < 5; cc++)
+    {
+        char name[16];
+        sprintf(name, "io%d", cc);
+        ftab_set_colname(T, cc, name);
+    }
+    for(size_t rr = 0; rr < 20000; rr++)
+    {
+        float row[5];
+        for(size_t cc = 0; cc < 5; cc++)
+        {
+            row[cc] = (float) (rr*5 + cc) / 4;
+        }
+        ftab_insert(T, row);
+    }
+    ftab_set_missing(T, 0, 0);
+    ftab_set_missing(T, 12345, 3);
+    ftab_set_missing(T, 19999, 4);
+
+    /* Small requests to have many of them in flight */
+    const ftab_io_backend_t backends[] = {FTAB_IO_URING, FTAB_IO_THREADS,
+                                          FTAB_IO_SYNC, FTAB_IO_URING,
+                                          FTAB_IO_THREADS};
+    /* FTAB_IO_AUTO picks io_uring when it is usable, otherwise the
+     * FTAB_IO_URING cases are skipped, e.g., disabled in a container */
+    ftab_io_opts_t auto_opts = {0};
+    auto_opts.backend = FTAB_IO_AUTO;
+    int have_uring = ftab_io_configure(&auto_opts) == EXIT_SUCCESS
+        && ftab_io_backend() == FTAB_IO_URING;
+    char * fname = tempfilename();
+    for(int kk = 0; kk < 5; kk++)
+    {
+        ftab_io_opts_t O = {0};
+        O.backend = backends[kk];
+        O.queue_depth = 4;
+        O.request_size = 4000;
+        O.direct = kk >= 3;
+        if(O.backend == FTAB_IO_URING && !have_uring)
+        {
+            continue;
+        }
+        if(ftab_io_configure(&O) != EXIT_SUCCESS)
+        {
+            printf("ftab_io_configure test %d failed\n", kk);
+            status++;
+            continue;
+        }
+        ftab_opts_t opts = {0};
+        opts.missing = 1;
+        for(int csv = 0; csv < 2; csv++)
+        {
+            opts.dlm = csv ? "," : "\t";
+            int ret = csv ? ftab_write_csv(T, fname) : ftab_write_tsv(T, fname);
+            ftab_t * R = ftab_from_file(fname, &opts);
+            if(ret != EXIT_SUCCESS || ftab_compare(T, R) != 0)
+            {
+                printf("asynchronous I/O test %d/%d failed\n", kk, csv);
+                status++;
+            }
+            ftab_free(R);
+        }
+    }
+    unlink(fname);
+    free(fname);
+
+    ftab_io_opts_t bad = {0};
+    bad.queue_depth = 1000;
+    if(ftab_io_configure(&bad) == EXIT_SUCCESS
+       || ftab_io_configure(NULL) != EXIT_SUCCESS
+       || ftab_io_backend() == FTAB_IO_SYNC)
+    {
+        printf("ftab_io_configure defaults test failed\n");
+        status++;
+    }
+    ftab_free(T);
+    ftab_ctx_use(NULL);
+    ftab_ctx_free(ctx);
+    return status;
+}
+
+int ftab_ut(int argc, char ** argv)
+{
+    printf("ftab version %s\n\n", ftab_version());
+    if(argc == 1)
+    {
+        printf("Running some self tests.\n");
+        printf("To test on a specific file, use:\n");
+        printf("%s file.csv\n", argv[0]);
+        printf("\n");
+    }
+    if(argc > 1)
+    {
+        printf("Reading %s as CSV\n", argv[1]);
+        ftab_t * T = ftab_from_csv(argv[1]);
+        printf("\n");
+        if(T == NULL)
+        {
+            printf("Unable to read the file\n");
+            return EXIT_FAILURE;
+        }
+        printf("Table size: %lu x %lu\n", T->nrow, T->ncol);
+        if(T->colnames != NULL)
+        {
+            printf("Columns names\n");
+            for(int kk = 0; kk < (int) T->ncol; kk++)
+            {
+                printf("%2d '%s'\n", kk+1, T->colnames[kk]);
+            }
+        }
+        if(T->nrow > 0)
+        {
+            printf("First row:\n");
+            for(int kk = 0; kk < (int) T->ncol; kk++)
+            {
+                printf("%f\t", T->T[kk]);
+            }
+            printf("\n");
+        }
+
+        char * fname = tempfilename();
+        printf("Temporary file: %s\n", fname);
+        ftab_write_tsv(T, fname);
+
+
+        ftab_t * T2 = ftab_from_tsv(fname);
+#ifndef WINDOWS
+        unlink(fname);
+#endif
+        free(fname);
+
+        int status = ftab_compare(T, T2);
+        ftab_free(T);
+        ftab_free(T2);
+        if(status == 0)
+        {
+            printf("OK! File can be written and read back\n");
+            return EXIT_SUCCESS;
+        } else {
+            printf("Failed to write and read back this file\n");
+            return EXIT_FAILURE;
+        }
+    }
+
+    ftab_t * T = ftab_new(4);
+    assert(T != NULL);
+    printf("T: %zu x %zu\n", T->nrow, T->ncol);
+    ftab_set_colname(T, 0, "x");
+    ftab_set_colname(T, 1, "y");
+    ftab_set_colname(T, 2, "z");
+    ftab_set_colname(T, 3, "value");
+    ftab_print(stdout, T, "\t");
+
+    float row[4] = {1, 2, 3, 1.23};
+    ftab_insert(T, row);
+    ftab_print(stdout, T, "\t");
+
+    /* Save and read */
+    char * fname = tempfilename();
+
+    printf("Temporary file: %s\n", fname);
+    ftab_write_tsv(T, fname);
+
+
+    ftab_t * T2 = ftab_from_tsv(fname);
+    int status = ftab_compare(T, T2);
+    if( status != 0 )
+    {
+        printf("Test failed\n");
+    }
+
+    status += ut_from_FILE(T, fname);
+    status += ut_buffer(T);
+    status += ut_topk();
+    status += ut_kdtree();
+    status += ut_histogram();
+    status += ut_npy(T);
+    status += ut_arrow(T);
+    status += ut_pack();
+    status += ut_compressed();
+    status += ut_lazy();
+    status += ut_append_tail();
+    status += ut_ctx();
+    status += ut_sort_nan();
+    status += ut_convert();
+    status += ut_hash_compare(T);
+#ifndef WINDOWS
+    status += ut_cache();
+#endif
+    status += ut_expr();
+    status += ut_merge_sorted();
+    status += ut_missing();
+    status += ut_partition();
+    status += ut_distinct();
+    status += ut_sketch();
+    status += ut_sample();
+    status += ut_columns();
+    status += ut_io();
+
+#ifndef WINDOWS
+    unlink(fname);
+#endif
+    free(fname);
+    ftab_print(stdout, T, "\t");
+    ftab_free(T);
+    ftab_free(T2);
+
+    if(status != 0)
+    {
+        printf("%d test(s) failed\n", status);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+typedef struct {
+    const ftab_t * T;
+    const u8 * selection;
+    size_t * offset; /* Output row of each task */
+    float * T2;
+} ftab_subselect_job_t;
+
+static void subselect_count_worker(void * _J, int thread, int nthreads)
+{
+    ftab_subselect_job_t * J = _J;
+    size_t first, last;
+    thread_range(J->T->nrow, thread, nthreads, &first, &last);
+    size_t n = 0;
+    for(size_t kk = first; kk < last; kk++)
+    {
+        n += J->selection[kk] > 0;
+    }
+    J->offset[thread + 1] = n;
+}
+
+static void subselect_copy_worker(void * _J, int thread, int nthreads)
+{
+    ftab_subselect_job_t * J = _J;
+    const ftab_t * T = J->T;
+    size_t first, last;
+    thread_range(T->nrow, thread, nthreads, &first, &last);
+    float * out = J->T2 + J->offset[thread]*T->ncol;
+    for(size_t kk = first; kk < last; kk++)
+    {
+        if(J->selection[kk] > 0)
+        {
+            memcpy(out, T->T + kk*T->ncol, T->ncol*sizeof(float));
+            out += T->ncol;
+        }
+    }
+}
+
+void
+ftab_subselect_rows(ftab_t * tab, const u8 * selection)
+{
+    valid_select(tab, selection, tab->nrow);
+    int nthreads = nthreads_for(tab->nrow*tab->ncol, 1 << 20);
+    if(nthreads > 1)
+    {
+        /* Count per task, then copy to a new buffer */
+        ftab_subselect_job_t J = {0};
+        J.T = tab;
+        J.selection = selection;
+        J.offset = calloc(nthreads + 1, sizeof(size_t));
+        assert(J.offset != NULL);
+        run_parallel(nthreads, subselect_count_worker, &J);
+        for(int kk = 0; kk < nthreads; kk++)
+        {
+            J.offset[kk + 1] += J.offset[kk];
+        }
+        J.T2 = malloc(tab->nrow_alloc*tab->ncol*sizeof(float));
+        if(J.T2 != NULL)
+        {
+            run_parallel(nthreads, subselect_copy_worker, &J);
+            free_data(tab);
+            tab->T = J.T2;
+            tab->nrow = J.offset[nthreads];
+            free(J.offset);
+            return;
+        }
+        free(J.offset);
+    }
+
+    u64 nsel = 0;
+    for(u64 kk = 0; kk < tab->nrow; kk++)
+    {
+        if(selection[kk] > 0)
+        {
+            if(kk != nsel)
+            {
+                memcpy(tab->T + nsel*tab->ncol,
+                       tab->T + kk*tab->ncol,
+                       tab->ncol*sizeof(float));
+            }
+            nsel++;
+        }
+    }
+    tab->nrow = nsel;
+    return;
+}
+
+
+u64 ftab_nel(const ftab_t * T)
+{
+    if(ftab_has_data(T))
+    {
+        return T->nrow*T->ncol;
+    } else {
+        return 0;
+    }
+}
+
+/*                          CONVERSIONS
+ *                          ===========
+ *
+ * The loops are branch free so that they are vectorized by the
+ * compiler, and large tables are converted in parallel.
+ */
+
+enum {
+    CONV_TO_F64,
+    CONV_TO_U32,
+    CONV_FROM_F64,
+    CONV_FROM_U32,
+    CONV_FROM_I32
+};
+
+typedef struct {
+    int kind;
+    const ftab_t * T; /* Source or destination table */
+    const int * cols; /* NULL for all */
+    size_t ncols;
+    const void * in; /* For CONV_FROM_* */
+    void * out; /* For CONV_TO_* */
+    int * bad; /* Per task, number of values out of range */
+} ftab_conv_job_t;
+
+static void conv_f32_to_f64(const float * in, double * out, size_t n)
+{
+    for(size_t kk = 0; kk < n; kk++)
+    {
+        out[kk] = in[kk];
+    }
+}
+
+/* Saturating: NAN and negative values becomes 0, too large values
+ * UINT32_MAX. Returns the number of such values. Written with masks
+ * instead of branches so that it is vectorized. */
+static int conv_f32_to_u32(const float * in, u32 * out, size_t n)
+{
+    u32 bad = 0;
+    for(size_t kk = 0; kk < n; kk++)
+    {
+        float v = in[kk];
+        u32 neg = -(u32) !(v >= 0);
+        u32 over = -(u32) (v >= 4294967296.0f);
+        u32 big = -(u32) (v >= 2147483648.0f);
+        bad += (neg | over) & 1;
+        float c = v > 0 ? v : 0;
+        c = c < 4294967040.0f ? c : 4294967040.0f;
+        /* Values >= 2^31 don't fit in i32 */
+        c -= (float) (big & 1) * 2147483648.0f;
+        out[kk] = ((u32) (i32) c + (big & 0x80000000u)) | over;
+    }
+    return bad;
+}
+
+static void conv_worker(void * _J, int thread, int nthreads)
+{
+    ftab_conv_job_t * J = _J;
+    const ftab_t * T = J->T;
+    size_t first, last;
+    thread_range(T->nrow, thread, nthreads, &first, &last);
+    if(J->cols == NULL)
+    {
+        /* Contiguous */
+        size_t a = first*T->ncol;
+        size_t n = (last - first)*T->ncol;
+        switch(J->kind)
+        {
+        case CONV_TO_F64:
+            conv_f32_to_f64(T->T + a, (double *) J->out + a, n);
+            break;
+        case CONV_TO_U32:
+            J->bad[thread] = conv_f32_to_u32(T->T + a, (u32 *) J->out + a, n);
+            break;
+        case CONV_FROM_F64:
+        {
+            const double * in = (const double *) J->in + a;
+            for(size_t kk = 0; kk < n; kk++)
+            {
+                T->T[a + kk] = in[kk];
+            }
+            break;
+        }
+        case CONV_FROM_U32:
+        {
+            const u32 * in = (const u32 *) J->in + a;
+            for(size_t kk = 0; kk < n; kk++)
+            {
+                T->T[a + kk] = in[kk];
+            }
+            break;
+        }
+        case CONV_FROM_I32:
+        {
+            const i32 * in = (const i32 *) J->in + a;
+            for(size_t kk = 0; kk < n; kk++)
+            {
+                T->T[a + kk] = in[kk];
+            }
+            break;
+        }
+        }
+        return;
+    }
+
+    /* Selected columns, gather one row at a time into a block */
+    float buf[1024];
+    size_t rows_per_block = 1024 / J->ncols;
+    rows_per_block = rows_per_block < 1 ? 1 : rows_per_block;
+    for(size_t r0 = first; r0 < last; r0 += rows_per_block)
+    {
+        size_t r1 = r0 + rows_per_block < last ? r0 + rows_per_block : last;
+        size_t n = 0;
+        for(size_t rr = r0; rr < r1; rr++)
+        {
+            const float * row = T->T + rr*T->ncol;
+            for(size_t cc = 0; cc < J->ncols; cc++)
+            {
+                buf[n++] = row[J->cols[cc]];
+            }
+        }
+        size_t a = r0*J->ncols;
+        if(J->kind == CONV_TO_F64)
+        {
+            conv_f32_to_f64(buf, (double *) J->out + a, n);
+        } else {
+            J->bad[thread] += conv_f32_to_u32(buf, (u32 *) J->out + a, n);
+        }
+    }
+}
+
+/* Wide selections, more than 1024 columns, are rare: convert them
+ * one row at a time */
+static int conv_wide(ftab_conv_job_t * J)
+{
+    const ftab_t * T = J->T;
+    float * row = malloc(J->ncols*sizeof(float));
+    assert(row != NULL);
+    int bad = 0;
+    for(size_t rr = 0; rr < T->nrow; rr++)
+    {
+        for(size_t cc = 0; cc < J->ncols; cc++)
+        {
+            row[cc] = T->T[rr*T->ncol + J->cols[cc]];
+        }
+        if(J->kind == CONV_TO_F64)
+        {
+            conv_f32_to_f64(row, (double *) J->out + rr*J->ncols, J->ncols);
+        } else {
+            bad += conv_f32_to_u32(row, (u32 *) J->out + rr*J->ncols, J->ncols);
+        }
+    }
+    free(row);
+    return bad;
+}
+
+/* Returns the number of values out of range */
+static int conv_run(ftab_conv_job_t * J)
+{
+    if(J->cols != NULL && J->ncols > 1024)
+    {
+        return conv_wide(J);
+    }
+    size_t nel = J->T->nrow*(J->cols == NULL ? J->T->ncol : J->ncols);
+    int nthreads = nthreads_for(nel, 1 << 18);
+    J->bad = calloc(nthreads, sizeof(int));
+    assert(J->bad != NULL);
+    run_parallel(nthreads, conv_worker, J);
+    int nbad = 0;
+    for(int kk = 0; kk < nthreads; kk++)
+    {
+        nbad += J->bad[kk];
+    }
+    free(J->bad);
+    return nbad;
+}
+
+static int conv_check_cols(const ftab_t * T, const int * cols, size_t ncols)
+{
+    if(!ftab_has_data(T))
+    {
+        return EXIT_FAILURE;
+    }
+    for(size_t cc = 0; cols != NULL && cc < ncols; cc++)
+    {
+        if(cols[cc] < 0 || (size_t) cols[cc] >= T->ncol)
+        {
+            fprintf(stderr, "ftab: invalid column %d\n", cols[cc]);
+            return EXIT_FAILURE;
+        }
+    }
+    return EXIT_SUCCESS;
+}
+
+int ftab_to_f64(const ftab_t * T, const int * cols, size_t ncols, double * out)
+{
+    if(out == NULL || conv_check_cols(T, cols, ncols))
+    {
+        return EXIT_FAILURE;
+    }
+    ftab_conv_job_t J = {0};
+    J.kind = CONV_TO_F64;
+    J.T = T;
+    J.cols = cols;
+    J.ncols = ncols;
+    J.out = out;
+    conv_run(&J);
+    return EXIT_SUCCESS;
+}
+
+int ftab_to_u32(const ftab_t * T, const int * cols, size_t ncols,
+                uint32_t * out, int checked)
+{
+    if(out == NULL || conv_check_cols(T, cols, ncols))
+    {
+        return EXIT_FAILURE;
+    }
+    ftab_conv_job_t J = {0};
+    J.kind = CONV_TO_U32;
+    J.T = T;
+    J.cols = cols;
+    J.ncols = ncols;
+    J.out = out;
+    int bad = conv_run(&J);
+    if(checked && bad > 0)
+    {
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+static ftab_t * conv_new(int kind, const void * data, size_t nrow, size_t ncol)
+{
+    if(data == NULL || ncol < 1)
+    {
+        return NULL;
+    }
+    ftab_t * T = calloc(1, sizeof(ftab_t));
+    assert(T != NULL);
+    T->nrow = nrow;
+    T->ncol = ncol;
+    T->nrow_alloc = nrow > 0 ? nrow : 1;
+    T->T = malloc(T->nrow_alloc*ncol*sizeof(float));
+    if(T->T == NULL)
+    {
+        free(T);
+        return NULL;
+    }
+    ftab_conv_job_t J = {0};
+    J.kind = kind;
+    J.T = T;
+    J.in = data;
+    conv_run(&J);
+    return T;
+}
+
+ftab_t * ftab_new_from_f64(size_t nrow, size_t ncol, const double * data)
+{
+    return conv_new(CONV_FROM_F64, data, nrow, ncol);
+}
+
+ftab_t * ftab_new_from_u32(size_t nrow, size_t ncol, const uint32_t * data)
+{
+    return conv_new(CONV_FROM_U32, data, nrow, ncol);
+}
+
+ftab_t * ftab_new_from_i32(size_t nrow, size_t ncol, const int32_t * data)
+{
+    return conv_new(CONV_FROM_I32, data, nrow, ncol);
+}
+
+double * ftab_get_data_f64(const ftab_t * T)
+{
+    if(!ftab_has_data(T))
+    {
+        return NULL;
+    }
+    double * C = malloc(ftab_nel(T)*sizeof(double));
+    if(C == NULL)
+    {
+        return NULL;
+    }
+    ftab_to_f64(T, NULL, 0, C);
+    return C;
+}
+
+u32 *
+ftab_get_data_u32(const ftab_t * T)
+{
+    if(!ftab_has_data(T))
+    {
+        return NULL;
+    }
+    u32 * C = malloc(ftab_nel(T)*sizeof(u32));
+    if(C == NULL)
+    {
+        return NULL;
+    }
+    ftab_to_u32(T, NULL, 0, C, 0);
+    return C;
+}
+
+/*                          EXPRESSIONS
+ *                          ===========
+ *
+ * An expression is parsed once into a small stack based bytecode with
+ * column names resolved to indexes. The bytecode is then run over
+ * blocks of EX_BLOCK rows, one operation at a time over the whole
+ * block, so each operation is a simple loop that the compiler can
+ * vectorize and the intermediate values stay in cache. Blocks are
+ * processed in parallel for large tables.
+ *
+ * Grammar, lowest precedence first:
+ *   or   : and ('||' and)*
+ *   and  : cmp ('&&' cmp)*
+ *   cmp  : add (('<' | '<=' | '>' | '>=' | '==' | '!=') add)?
+ *   add  : mul (('+' | '-') mul)*
+ *   mul  : unary (('*' | '/') unary)*
+ *   unary: ('-' | '!')* prim
+ *   prim : number | column | `column` | name '(' args ')' | '(' or ')'
+ */
+
+#define EX_BLOCK 1024
+#define EX_MAX_NESTING 200
+
+enum {
+    EX_COL, EX_CONST,
+    /* unary */
+    EX_NEG, EX_NOT, EX_SQRT, EX_ABS, EX_EXP, EX_LOG, EX_LOG10,
+    EX_SIN, EX_COS, EX_TAN, EX_FLOOR, EX_CEIL, EX_ISNAN,
+    /* binary */
+    EX_ADD, EX_SUB, EX_MUL, EX_DIV, EX_LT, EX_LE, EX_GT, EX_GE,
+    EX_EQ, EX_NE, EX_AND, EX_OR, EX_POW, EX_MIN, EX_MAX, EX_ATAN2
+};
+
+#define EX_IS_BINARY(op) ((op) >= EX_ADD)
+
+static const struct {
+    const char * name;
+    int op;
+    int nargs;
+} ex_functions[] = {
+    {"sqrt", EX_SQRT, 1}, {"abs", EX_ABS, 1}, {"exp", EX_EXP, 1},
+    {"log", EX_LOG, 1}, {"log10", EX_LOG10, 1}, {"sin", EX_SIN, 1},
+    {"cos", EX_COS, 1}, {"tan", EX_TAN, 1}, {"floor", EX_FLOOR, 1},
+    {"ceil", EX_CEIL, 1}, {"isnan", EX_ISNAN, 1}, {"pow", EX_POW, 2},
+    {"min", EX_MIN, 2}, {"max", EX_MAX, 2}, {"atan2", EX_ATAN2, 2}
+};
+
+typedef struct {
+    int op;
+    int col; /* EX_COL */
+    float value; /* EX_CONST */
+} ftab_ex_instr_t;
+
+typedef struct {
+    const ftab_t * T;
+    const char * expr;
+    const char * pos;
+    ftab_ex_instr_t * code;
+    size_t ncode;
+    size_t ncode_alloc;
+    int depth; /* Stack depth after the emitted code */
+    int max_depth;
+    int nesting;
+    int error;
+} ftab_expr_t;
+
+/* Non-zero and not NAN */
+static inline float ex_truth(float v)
+{
+    return (float) ((v == v) & (v != 0));
+}
+
+/* out = op(a) or out = op(a, b). out may be a. */
+static void ex_apply(int op, float * out, const float * a,
+                     const float * b, size_t n)
+{
+    switch(op)
+    {
+    case EX_NEG:
+        for(size_t kk = 0; kk < n; kk++) { out[kk] = -a[kk]; }
+        break;
+    case EX_NOT:
+        for(size_t kk = 0; kk < n; kk++) { out[kk] = 1.0f - ex_truth(a[kk]); }
+        break;
+    case EX_SQRT:
+        for(size_t kk = 0; kk < n; kk++) { out[kk] = sqrtf(a[kk]); }
+        break;
+    case EX_ABS:
+        for(size_t kk = 0; kk < n; kk++) { out[kk] = fabsf(a[kk]); }
+        break;
+    case EX_EXP:
+        for(size_t kk = 0; kk < n; kk++) { out[kk] = expf(a[kk]); }
+        break;
+    case EX_LOG:
+        for(size_t kk = 0; kk < n; kk++) { out[kk] = logf(a[kk]); }
+        break;
+    case EX_LOG10:
+        for(size_t kk = 0; kk < n; kk++) { out[kk] = log10f(a[kk]); }
+        break;
+    case EX_SIN:
+        for(size_t kk = 0; kk < n; kk++) { out[kk] = sinf(a[kk]); }
+        break;
+    case EX_COS:
+        for(size_t kk = 0; kk < n; kk++) { out[kk] = cosf(a[kk]); }
+        break;
+    case EX_TAN:
+        for(size_t kk = 0; kk < n; kk++) { out[kk] = tanf(a[kk]); }
+        break;
+    case EX_FLOOR:
+        for(size_t kk = 0; kk < n; kk++) { out[kk] = floorf(a[kk]); }
+        break;
+    case EX_CEIL:
+        for(size_t kk = 0; kk < n; kk++) { out[kk] = ceilf(a[kk]); }
+        break;
+    case EX_ISNAN:
+        for(size_t kk = 0; kk < n; kk++) { out[kk] = (float) (a[kk] != a[kk]); }
+        break;
+    case EX_ADD:
+        for(size_t kk = 0; kk < n; kk++) { out[kk] = a[kk] + b[kk]; }
+        break;
+    case EX_SUB:
+        for(size_t kk = 0; kk < n; kk++) { out[kk] = a[kk] - b[kk]; }
+        break;
+    case EX_MUL:
+        for(size_t kk = 0; kk < n; kk++) { out[kk] = a[kk] * b[kk]; }
+        break;
+    case EX_DIV:
+        for(size_t kk = 0; kk < n; kk++) { out[kk] = a[kk] / b[kk]; }
+        break;
+    case EX_LT:
+        for(size_t kk = 0; kk < n; kk++) { out[kk] = (float) (a[kk] < b[kk]); }
+        break;
+    case EX_LE:
+        for(size_t kk = 0; kk < n; kk++) { out[kk] = (float) (a[kk] <= b[kk]); }
+        break;
+    case EX_GT:
+        for(size_t kk = 0; kk < n; kk++) { out[kk] = (float) (a[kk] > b[kk]); }
+        break;
+    case EX_GE:
+        for(size_t kk = 0; kk < n; kk++) { out[kk] = (float) (a[kk] >= b[kk]); }
+        break;
+    case EX_EQ:
+        for(size_t kk = 0; kk < n; kk++) { out[kk] = (float) (a[kk] == b[kk]); }
+        break;
+    case EX_NE:
+        for(size_t kk = 0; kk < n; kk++) { out[kk] = (float) (a[kk] != b[kk]); }
+        break;
+    case EX_AND:
+        for(size_t kk = 0; kk < n; kk++) { out[kk] = ex_truth(a[kk]) * ex_truth(b[kk]); }
+        break;
+    case EX_OR:
+        for(size_t kk = 0; kk < n; kk++)
+        {
+            out[kk] = ex_truth(ex_truth(a[kk]) + ex_truth(b[kk]));
+        }
+        break;
+    case EX_POW:
+        for(size_t kk = 0; kk < n; kk++) { out[kk] = powf(a[kk], b[kk]); }
+        break;
+    case EX_MIN:
+        /* fminf, with the compares on the inputs only so that the
+         * loop is vectorized */
+        for(size_t kk = 0; kk < n; kk++)
+        {
+            out[kk] = (a[kk] < b[kk] || b[kk] != b[kk]) ? a[kk] : b[kk];
+        }
+        break;
+    case EX_MAX:
+        for(size_t kk = 0; kk < n; kk++)
+        {
+            out[kk] = (a[kk] > b[kk] || b[kk] != b[kk]) ? a[kk] : b[kk];
+        }
+        break;
+    case EX_ATAN2:
+        for(size_t kk = 0; kk < n; kk++) { out[kk] = atan2f(a[kk], b[kk]); }
+        break;
+    default:
+        assert(0);
+    }
+}
+
+static void ex_error(ftab_expr_t * E, const char * msg)
+{
+    if(E->error == 0)
+    {
+        fprintf(stderr, "ftab: %s at position %zu in \"%s\"\n",
+                msg, (size_t) (E->pos - E->expr), E->expr);
+    }
+    E->error = 1;
+}
+
+static void ex_push(ftab_expr_t * E, ftab_ex_instr_t I)
+{
+    if(E->ncode == E->ncode_alloc)
+    {
+        E->ncode_alloc = E->ncode_alloc == 0 ? 16 : 2*E->ncode_alloc;
+        E->code = realloc(E->code, E->ncode_alloc*sizeof(ftab_ex_instr_t));
+        assert(E->code != NULL);
+    }
+    E->code[E->ncode++] = I;
+}
+
+static void ex_emit_const(ftab_expr_t * E, float value)
+{
+    ftab_ex_instr_t I = {EX_CONST, 0, value};
+    ex_push(E, I);
+    E->depth++;
+    E->max_depth = E->depth > E->max_depth ? E->depth : E->max_depth;
+}
+
+static void ex_emit_col(ftab_expr_t * E, int col)
+{
+    ftab_ex_instr_t I = {EX_COL, col, 0};
+    ex_push(E, I);
+    E->depth++;
+    E->max_depth = E->depth > E->max_depth ? E->depth : E->max_depth;
+}
+
+/* Emit an operation, constant operands are folded */
+static void ex_emit_op(ftab_expr_t * E, int op)
+{
+    int nargs = EX_IS_BINARY(op) ? 2 : 1;
+    if(E->error || E->ncode < (size_t) nargs)
+    {
+        E->error = 1;
+        return;
+    }
+    ftab_ex_instr_t * A = E->code + E->ncode - nargs;
+    if(A[0].op == EX_CONST && A[nargs-1].op == EX_CONST)
+    {
+        float value = A[0].value;
+        ex_apply(op, &value, &A[0].value, &A[nargs-1].value, 1);
+        E->ncode -= nargs;
+        E->depth -= nargs;
+        ex_emit_const(E, value);
+        return;
+    }
+    ftab_ex_instr_t I = {op, 0, 0};
+    ex_push(E, I);
+    E->depth -= nargs - 1;
 }
 
-ftab_t *
-ftab_new_from_data(int nrow, int ncol, const float * data)
+static void ex_skip_space(ftab_expr_t * E)
 {
-    ftab_t * T = calloc(1, sizeof(ftab_t));
-    if(T == NULL)
+    while(*E->pos == ' ' || *E->pos == '\t' || *E->pos == '\n')
     {
-        return T;
+        E->pos++;
     }
-    T->ncol = ncol;
-    T->nrow = nrow;
-    T->nrow_alloc = T->nrow;
-    T->T = calloc(nrow*ncol, sizeof(float));
-    if(T->T == NULL)
+}
+
+/* Consume tok if it comes next */
+static int ex_accept(ftab_expr_t * E, const char * tok)
+{
+    ex_skip_space(E);
+    size_t len = strlen(tok);
+    if(strncmp(E->pos, tok, len) == 0)
     {
-        free(T);
-        return NULL;
+        E->pos += len;
+        return 1;
     }
-    memcpy(T->T, data, nrow*ncol*sizeof(float));
-    return T;
+    return 0;
 }
 
-char * tempfilename(void)
+static void ex_or(ftab_expr_t * E);
+
+static char * ex_strndup(const char * s, size_t len)
 {
-    char * fname = calloc(1024, 1);
-    assert(fname != NULL);
-#ifdef WINDOWS
-    printf("TODO: Windows functionality\n");
-    sprintf(fname, "ftab-random");
-#else
-    sprintf(fname, "/tmp/ftab-XXXXXX");
-    int filedes = mkstemp(fname);
-    close(filedes);
-#endif
-    return fname;
+    char * d = malloc(len + 1);
+    assert(d != NULL);
+    memcpy(d, s, len);
+    d[len] = '\0';
+    return d;
 }
 
-int ftab_compare(const ftab_t * A, const ftab_t * B)
+static void ex_column(ftab_expr_t * E, const char * name)
 {
-    if(A == NULL)
+    int col = ftab_get_col(E->T, name);
+    if(col >= 0)
     {
-        return 1;
+        ex_emit_col(E, col);
+        return;
     }
-    if(B == NULL)
+    if(strcmp(name, "nan") == 0)
     {
-        return 1;
-    }
-    if(A->ncol != B->ncol)
+        ex_emit_const(E, NAN);
+    } else if(strcmp(name, "inf") == 0)
     {
-        return 1;
-    }
-    if(A->nrow != B->nrow)
+        ex_emit_const(E, INFINITY);
+    } else if(strcmp(name, "pi") == 0)
     {
-        return 1;
+        ex_emit_const(E, 3.14159265358979f);
+    } else {
+        ex_error(E, "unknown column");
     }
+}
 
-    int equal_colnames = 1;
-    if(A->colnames == NULL)
+static void ex_prim(ftab_expr_t * E)
+{
+    ex_skip_space(E);
+    const char * p = E->pos;
+    if(*p == '(')
     {
-        if(B->colnames != NULL)
+        E->pos++;
+        ex_or(E);
+        if(!ex_accept(E, ")"))
         {
-            equal_colnames = 0;
+            ex_error(E, "expected ')'");
         }
-
+        return;
     }
-    if(B->colnames == NULL)
+    if((*p >= '0' && *p <= '9') || *p == '.')
     {
-        if(A->colnames != NULL)
+        char * end = NULL;
+        float value = strtof(p, &end);
+        if(end == p)
         {
-            equal_colnames = 0;
+            ex_error(E, "invalid number");
+            return;
         }
+        E->pos = end;
+        ex_emit_const(E, value);
+        return;
     }
-    if(A->colnames != NULL && B->colnames != NULL)
+    if(*p == '`')
     {
-        for(size_t kk = 0; kk<A->ncol; kk++)
+        const char * end = strchr(p+1, '`');
+        if(end == NULL)
         {
-            if(strcmp(A->colnames[kk], A->colnames[kk]))
-            {
-                equal_colnames = 0;
-            }
+            ex_error(E, "unterminated `");
+            return;
         }
+        char * name = ex_strndup(p+1, end - p - 1);
+        E->pos = end + 1;
+        ex_column(E, name);
+        free(name);
+        return;
     }
-    if(equal_colnames == 0)
+    size_t len = 0;
+    while(p[len] == '_' || p[len] == '.' || (p[len] >= 'a' && p[len] <= 'z')
+          || (p[len] >= 'A' && p[len] <= 'Z')
+          || (len > 0 && p[len] >= '0' && p[len] <= '9'))
     {
-        return 1;
+        len++;
     }
-
-    if(A->nrow == 0 || A->nrow == 0)
+    if(len == 0)
     {
-        return 0;
+        ex_error(E, *p == '\0' ? "unexpected end" : "unexpected character");
+        return;
     }
-    // Compare data
-    return memcmp(A->T, B->T, A->ncol*A->nrow*sizeof(float));
-}
-
-int ftab_ut(int argc, char ** argv)
-{
-    printf("ftab version %s\n\n", ftab_version());
-    if(argc == 1)
+    char * name = ex_strndup(p, len);
+    E->pos = p + len;
+    if(!ex_accept(E, "("))
     {
-        printf("Running some self tests.\n");
-        printf("To test on a specific file, use:\n");
-        printf("%s file.csv\n", argv[0]);
-        printf("\n");
+        ex_column(E, name);
+        free(name);
+        return;
     }
-    if(argc > 1)
+    int fun = -1;
+    for(size_t kk = 0; kk < sizeof(ex_functions)/sizeof(ex_functions[0]); kk++)
     {
-        printf("Reading %s as CSV\n", argv[1]);
-        ftab_t * T = ftab_from_csv(argv[1]);
-        printf("\n");
-        if(T == NULL)
-        {
-            printf("Unable to read the file\n");
-            return EXIT_FAILURE;
-        }
-        printf("Table size: %lu x %lu\n", T->nrow, T->ncol);
-        if(T->colnames != NULL)
+        if(strcmp(name, ex_functions[kk].name) == 0)
         {
-            printf("Columns names\n");
-            for(int kk = 0; kk < (int) T->ncol; kk++)
-            {
-                printf("%2d '%s'\n", kk+1, T->colnames[kk]);
-            }
+            fun = kk;
         }
-        if(T->nrow > 0)
+    }
+    free(name);
+    if(fun < 0)
+    {
+        ex_error(E, "unknown function");
+        return;
+    }
+    for(int aa = 0; aa < ex_functions[fun].nargs; aa++)
+    {
+        if(aa > 0 && !ex_accept(E, ","))
         {
-            printf("First row:\n");
-            for(int kk = 0; kk < (int) T->ncol; kk++)
-            {
-                printf("%f\t", T->T[kk]);
-            }
-            printf("\n");
+            ex_error(E, "expected ','");
+            return;
         }
+        ex_or(E);
+    }
+    if(!ex_accept(E, ")"))
+    {
+        ex_error(E, "expected ')'");
+        return;
+    }
+    ex_emit_op(E, ex_functions[fun].op);
+}
 
-        char * fname = tempfilename();
-        printf("Temporary file: %s\n", fname);
-        ftab_write_tsv(T, fname);
-
-
-        ftab_t * T2 = ftab_from_tsv(fname);
-#ifndef WINDOWS
-        unlink(fname);
-#endif
-        free(fname);
+static void ex_unary(ftab_expr_t * E)
+{
+    if(++E->nesting > EX_MAX_NESTING)
+    {
+        ex_error(E, "too deeply nested");
+    }
+    if(E->error)
+    {
+        return;
+    }
+    if(ex_accept(E, "-"))
+    {
+        ex_unary(E);
+        ex_emit_op(E, EX_NEG);
+    } else if(ex_accept(E, "+"))
+    {
+        ex_unary(E);
+    } else if(ex_accept(E, "!"))
+    {
+        ex_unary(E);
+        ex_emit_op(E, EX_NOT);
+    } else {
+        ex_prim(E);
+    }
+    E->nesting--;
+}
 
-        int status = ftab_compare(T, T2);
-        ftab_free(T);
-        ftab_free(T2);
-        if(status == 0)
+static void ex_mul(ftab_expr_t * E)
+{
+    ex_unary(E);
+    while(!E->error)
+    {
+        int op = ex_accept(E, "*") ? EX_MUL : ex_accept(E, "/") ? EX_DIV : -1;
+        if(op < 0)
         {
-            printf("OK! File can be written and read back\n");
-            return EXIT_SUCCESS;
-        } else {
-            printf("Failed to write and read back this file\n");
-            return EXIT_FAILURE;
+            return;
         }
+        ex_unary(E);
+        ex_emit_op(E, op);
     }
+}
 
-    ftab_t * T = ftab_new(4);
-    assert(T != NULL);
-    printf("T: %zu x %zu\n", T->nrow, T->ncol);
-    ftab_set_colname(T, 0, "x");
-    ftab_set_colname(T, 1, "y");
-    ftab_set_colname(T, 2, "z");
-    ftab_set_colname(T, 3, "value");
-    ftab_print(stdout, T, "\t");
-
-    float row[4] = {1, 2, 3, 1.23};
-    ftab_insert(T, row);
-    ftab_print(stdout, T, "\t");
-
-    /* Save and read */
-    char * fname = tempfilename();
-
-    printf("Temporary file: %s\n", fname);
-    ftab_write_tsv(T, fname);
+static void ex_add(ftab_expr_t * E)
+{
+    ex_mul(E);
+    while(!E->error)
+    {
+        int op = ex_accept(E, "+") ? EX_ADD : ex_accept(E, "-") ? EX_SUB : -1;
+        if(op < 0)
+        {
+            return;
+        }
+        ex_mul(E);
+        ex_emit_op(E, op);
+    }
+}
 
+static void ex_cmp(ftab_expr_t * E)
+{
+    ex_add(E);
+    /* Longest tokens first */
+    static const struct {
+        const char * tok;
+        int op;
+    } ops[] = {{"<=", EX_LE}, {">=", EX_GE}, {"==", EX_EQ}, {"!=", EX_NE},
+               {"<", EX_LT}, {">", EX_GT}};
+    for(size_t kk = 0; kk < sizeof(ops)/sizeof(ops[0]) && !E->error; kk++)
+    {
+        if(ex_accept(E, ops[kk].tok))
+        {
+            ex_add(E);
+            ex_emit_op(E, ops[kk].op);
+            return;
+        }
+    }
+}
 
-    ftab_t * T2 = ftab_from_tsv(fname);
-    int status = ftab_compare(T, T2);
-    if( status != 0 )
+static void ex_and(ftab_expr_t * E)
+{
+    ex_cmp(E);
+    while(!E->error && ex_accept(E, "&&"))
     {
-        printf("Test failed\n");
+        ex_cmp(E);
+        ex_emit_op(E, EX_AND);
     }
+}
 
-#ifndef WINDOWS
-    unlink(fname);
-#endif
-    free(fname);
-    ftab_print(stdout, T, "\t");
-    ftab_free(T);
-    ftab_free(T2);
+static void ex_or(ftab_expr_t * E)
+{
+    ex_and(E);
+    while(!E->error && ex_accept(E, "||"))
+    {
+        ex_and(E);
+        ex_emit_op(E, EX_OR);
+    }
+}
 
+/* Parse expr into E. Returns EXIT_FAILURE on syntax errors or unknown
+ * columns */
+static int ex_compile(ftab_expr_t * E, const ftab_t * T, const char * expr)
+{
+    memset(E, 0, sizeof(ftab_expr_t));
+    E->T = T;
+    E->expr = expr;
+    E->pos = expr;
+    ex_or(E);
+    ex_skip_space(E);
+    if(!E->error && *E->pos != '\0')
+    {
+        ex_error(E, "unexpected character");
+    }
+    if(E->error || E->depth != 1)
+    {
+        free(E->code);
+        E->code = NULL;
+        return EXIT_FAILURE;
+    }
     return EXIT_SUCCESS;
 }
 
-void
-ftab_subselect_rows(ftab_t * tab, const u8 * selection)
+typedef struct {
+    const ftab_expr_t * E;
+    float * out; /* ftab_eval */
+    u8 * sel; /* ftab_filter */
+} ftab_ex_job_t;
+
+static void ex_worker(void * _J, int thread, int nthreads)
 {
-    u64 nsel = 0;
-    for(u64 kk = 0; kk < tab->nrow; kk++)
+    ftab_ex_job_t * J = _J;
+    const ftab_expr_t * E = J->E;
+    const ftab_t * T = E->T;
+    size_t nblock = (T->nrow + EX_BLOCK - 1) / EX_BLOCK;
+    size_t first, last;
+    thread_range(nblock, thread, nthreads, &first, &last);
+    float * stack = malloc(E->max_depth*EX_BLOCK*sizeof(float));
+    assert(stack != NULL);
+
+    for(size_t bb = first; bb < last; bb++)
     {
-        if(selection[kk] > 0)
+        size_t row0 = bb*EX_BLOCK;
+        size_t n = T->nrow - row0 < EX_BLOCK ? T->nrow - row0 : EX_BLOCK;
+        float * top = stack - EX_BLOCK; /* Top of the stack */
+        for(size_t ii = 0; ii < E->ncode; ii++)
         {
-            if(kk != nsel)
+            const ftab_ex_instr_t * I = E->code + ii;
+            switch(I->op)
             {
-                memcpy(tab->T + nsel*tab->ncol,
-                       tab->T + kk*tab->ncol,
-                       tab->ncol*sizeof(float));
+            case EX_COL:
+            {
+                top += EX_BLOCK;
+                const float * C = T->T + row0*T->ncol + I->col;
+                for(size_t kk = 0; kk < n; kk++)
+                {
+                    top[kk] = C[kk*T->ncol];
+                }
+                break;
+            }
+            case EX_CONST:
+                top += EX_BLOCK;
+                for(size_t kk = 0; kk < n; kk++)
+                {
+                    top[kk] = I->value;
+                }
+                break;
+            default:
+                if(EX_IS_BINARY(I->op))
+                {
+                    top -= EX_BLOCK;
+                    ex_apply(I->op, top, top, top + EX_BLOCK, n);
+                } else {
+                    ex_apply(I->op, top, top, NULL, n);
+                }
+            }
+        }
+        if(J->out != NULL)
+        {
+            memcpy(J->out + row0, top, n*sizeof(float));
+        } else {
+            for(size_t kk = 0; kk < n; kk++)
+            {
+                J->sel[row0 + kk] = ex_truth(top[kk]) != 0;
             }
-            nsel++;
         }
     }
-    tab->nrow = nsel;
-    return;
+    free(stack);
 }
 
+static void ex_run(const ftab_expr_t * E, float * out, u8 * sel)
+{
+    ftab_ex_job_t J = {E, out, sel};
+    run_parallel(nthreads_for(E->T->nrow, 1 << 15), ex_worker, &J);
+}
 
-double * ftab_get_data_f64(const ftab_t * T)
+float * ftab_eval(const ftab_t * T, const char * expr)
 {
-    if(!ftab_has_data(T))
+    if(T == NULL || expr == NULL)
     {
         return NULL;
     }
-    u64 n = ftab_nel(T);
-    double * C = calloc(n, sizeof(double));
-    if(C == NULL)
+    ftab_expr_t E;
+    if(ex_compile(&E, T, expr))
     {
         return NULL;
     }
-    for(u64 kk = 0; kk < n; kk++)
-    {
-        C[kk] = T->T[kk];
-    }
-    return C;
-}
-
-u64 ftab_nel(const ftab_t * T)
-{
-    if(ftab_has_data(T))
+    float * out = malloc((T->nrow > 0 ? T->nrow : 1)*sizeof(float));
+    if(out != NULL)
     {
-        return T->nrow*T->ncol;
-    } else {
-        return 0;
+        ex_run(&E, out, NULL);
     }
+    free(E.code);
+    return out;
 }
 
-
-u32 *
-ftab_get_data_u32(const ftab_t * T)
+int ftab_filter(ftab_t * T, const char * expr)
 {
-    if(!ftab_has_data(T))
+    if(T == NULL || expr == NULL)
     {
-        return NULL;
+        return EXIT_FAILURE;
     }
-    u64 n = ftab_nel(T);
-    u32 * C = calloc(n, sizeof(u32));
-    if(C == NULL)
+    ftab_expr_t E;
+    if(ex_compile(&E, T, expr))
     {
-        return NULL;
+        return EXIT_FAILURE;
     }
-    for(u64 kk = 0; kk < n; kk++)
+    if(T->nrow > 0)
     {
-        C[kk] = (u32) T->T[kk];
+        u8 * sel = malloc(T->nrow);
+        assert(sel != NULL);
+        ex_run(&E, NULL, sel);
+        ftab_subselect_rows(T, sel);
+        free(sel);
     }
-    return C;
+    free(E.code);
+    return EXIT_SUCCESS;
 }
 
 const char * ftab_version(void)
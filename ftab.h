@@ -26,12 +26,12 @@ extern "C" {
  *
  * The uggly:
  *
- * - Missing values will be parsed as 0
+ * - Missing values will be parsed as 0, unless the missing option is
+ *   used, see ftab_opts_t
  * - Always interprets the first line as a header
  *
  * TODO
  *
- * Use strtof instead of atof
  * Possibly support writing using %a for exactness
  * Decide what to do about missing values
  * Handle NAN and Inf
@@ -46,6 +46,36 @@ extern "C" {
  * 0.1.3 : build on windows with clang (added missing functions)
  * 0.1.4 : added convenience functions: ftab_get_data_f64, ftab_get_data_u32, ftab_nel and ftab_has_data
  * 0.1.5 : Fixed a few potential problems. Moved version from the header file.
+ * 0.1.6 : added ftab_from_fd and ftab_from_FILE. Single pass reader with
+ *         transparent gzip/zstd decompression and threaded parsing.
+ * 0.1.7 : added ftab_from_buffer and ftab_write_buffer.
+ * 0.1.8 : added ftab_topk.
+ * 0.1.9 : added a k-d tree, ftab_kdtree_build, with kNN and radius queries.
+ * 0.1.10 : added ftab_histogram and ftab_histogram_nd.
+ * 0.1.11 : added ftab_write_npy and ftab_from_npy.
+ * 0.1.12 : added Arrow IPC (Feather v2) reader and writer for float32 columns.
+ * 0.1.13 : added ftab_pack, compressed column encodings.
+ * 0.1.14 : added ftab_write_compressed, a compressed columnar file format.
+ * 0.1.15 : added ftab_lazy_open, columns of a csv/tsv file parsed on demand.
+ * 0.1.16 : added ftab_append_tsv/csv and ftab_tail_read for growing files.
+ * 0.1.17 : added ftab_ctx_t, a shared thread pool used by all parallel code.
+ * 0.1.18 : added ftab_to_f64/u32 and ftab_new_from_f64/u32/i32. Saturating
+ *          ftab_get_data_u32.
+ * 0.1.19 : added ftab_hash and ftab_compare_approx. ftab_compare now compares
+ *          the column names of both tables.
+ * 0.1.20 : added ftab_cache_enable, binary cache of parsed csv/tsv files.
+ * 0.1.21 : added ftab_eval and ftab_filter, expressions over columns.
+ * 0.1.22 : added ftab.hpp, a header-only C++17 wrapper.
+ * 0.1.23 : added ftab_merge_sorted.
+ * 0.1.24 : added validity bitmaps for missing values, ftab_from_file.
+ * 0.1.25 : added ftab_partition and ftab_write_partitioned.
+ * 0.1.26 : added ftab_distinct.
+ * 0.1.27 : added ftab_quantile, KLL quantile and HyperLogLog sketches.
+ * 0.1.28 : added ftab_sample, ftab_sample_stratified and sampling while
+ *          loading.
+ * 0.1.29 : added ftab_select_columns and ftab_hcat.
+ * 0.1.30 : added asynchronous file I/O with io_uring or threads,
+ *          ftab_io_configure.
  */
 
 #include <stdint.h>
@@ -61,8 +91,49 @@ typedef struct {
     size_t ncol;
     size_t nrow_alloc; /* To know if we need to extend the size */
     char ** colnames; /* Name of columns can be NULL. Also the pointer can be NULL */
+    void * map; /* Set when T points into a memory mapped file */
+    size_t map_size;
+    struct ftab_valid * valid; /* Missing values, NULL if there are none */
 } ftab_t;
 
+/* Execution context. All parallel work is done by the persistent
+ * thread pool of a context. By default a context with one thread per
+ * available CPU is used, or FTAB_NUM_THREADS if set. The CPUs
+ * available are limited by the affinity mask and a cgroup CPU quota.
+ * Small tables are processed serially.
+ */
+typedef struct ftab_ctx ftab_ctx_t;
+
+/* A context with nthreads threads, including the calling thread. 0
+ * for one per available CPU. With 1 everything runs serially. */
+ftab_ctx_t * ftab_ctx_new(int nthreads);
+void ftab_ctx_free(ftab_ctx_t * ctx);
+int ftab_ctx_nthreads(const ftab_ctx_t * ctx);
+/* Pin the worker threads to the CPUs, round robin. Linux only. */
+int ftab_ctx_set_affinity(ftab_ctx_t * ctx, const int * cpus, int ncpus);
+/* Use ctx for all calls from the calling thread, or the default
+ * context if NULL. ctx has to be valid until it is no longer used. */
+void ftab_ctx_use(ftab_ctx_t * ctx);
+
+/* Options for the readers. Zero-initialize for the defaults. */
+typedef struct {
+    /* The deliminator, e.g., "," or "\t". NULL means "," */
+    const char * dlm;
+    /* Maximum number of threads, 0 for all threads of the context */
+    int nthreads;
+    /* Context to use, NULL for the current one */
+    ftab_ctx_t * ctx;
+    /* If set, empty fields are missing values instead of 0, see
+     * ftab_is_missing */
+    int missing;
+    /* If in (0, 1), keep each line with this probability. Lines
+     * that are not kept are not parsed. Which lines are kept only
+     * depends on sample_seed and the line numbers, not on the number
+     * of threads */
+    double sample;
+    uint64_t sample_seed;
+} ftab_opts_t;
+
 /* Create a new table with a fixed number of columns
  * Set column names with ftab_set_colname */
 ftab_t * ftab_new(int ncol);
@@ -82,6 +153,124 @@ ftab_t * ftab_from_tsv(const char * fname);
 
 ftab_t * ftab_from_csv(const char * fname);
 
+/* Cache parsed csv/tsv files as binary snapshots in dir, which is
+ * created if needed. Later calls to ftab_from_tsv/csv for an unchanged
+ * file map the snapshot instead of parsing the file. A file is
+ * considered changed if its size, mtime or a hash of samples of the
+ * content differs. The least recently used snapshots are removed when
+ * the total size exceeds max_bytes. Disabled by default.
+ * @return EXIT_SUCCESS or EXIT_FAILURE
+ */
+int ftab_cache_enable(const char * dir, uint64_t max_bytes);
+
+void ftab_cache_disable(void);
+
+/* Read a table from an open FILE or file descriptor, e.g., stdin or a
+ * pipe. The input is read in a single pass until end of file and it
+ * is not closed. gzip (requires zlib) and zstd (requires libzstd)
+ * compressed input is detected and decompressed on the fly. This
+ * applies also to ftab_from_tsv and ftab_from_csv.
+ * @param dlm The deliminator, e.g., "," or "\t"
+ * @return NULL on failure
+ */
+ftab_t * ftab_from_FILE(FILE * fid, const char * dlm);
+
+ftab_t * ftab_from_fd(int fd, const char * dlm);
+
+/* Load a csv/tsv file with options, e.g., to track missing values.
+ * The parse cache is not used. */
+ftab_t * ftab_from_file(const char * fname, const ftab_opts_t * opts);
+
+/* How ftab_from_tsv/csv, ftab_from_file and ftab_write_tsv/csv access
+ * regular files. With the asynchronous backends a file is read or
+ * written in requests of request_size bytes with up to queue_depth of
+ * them in flight, while the thread pool parses or formats the rows.
+ * Small files use buffered stdio. */
+typedef enum {
+    FTAB_IO_AUTO = 0, /* io_uring if the kernel allows it, else threads */
+    FTAB_IO_URING,
+    FTAB_IO_THREADS, /* pread/pwrite on helper threads */
+    FTAB_IO_SYNC /* stdio only */
+} ftab_io_backend_t;
+
+typedef struct {
+    ftab_io_backend_t backend;
+    int queue_depth; /* In [1, 256], 0 for the default, 8 */
+    size_t request_size; /* Rounded up to 4 KiB, 0 for the default, 1 MiB */
+    int direct; /* Write with O_DIRECT, bypassing the page cache, if
+                 * the file system supports it */
+} ftab_io_opts_t;
+
+/* Set the I/O options of the process, NULL for the defaults. Fails if
+ * FTAB_IO_URING is requested but not available.
+ * @return EXIT_SUCCESS or EXIT_FAILURE
+ */
+int ftab_io_configure(const ftab_io_opts_t * opts);
+
+/* The backend in use, with FTAB_IO_AUTO resolved */
+ftab_io_backend_t ftab_io_backend(void);
+
+/* Parse a table from memory, i.e. the content of a tsv/csv file,
+ * possibly compressed. The buffer does not have to be
+ * NUL-terminated. opts can be NULL.
+ */
+ftab_t * ftab_from_buffer(const char * buf, size_t len, const ftab_opts_t * opts);
+
+/* Lazy loading of an uncompressed tsv/csv file. Opening only finds
+ * where each row starts, a column is parsed the first time that it
+ * is requested and then cached until ftab_lazy_close. Not thread
+ * safe. */
+typedef struct ftab_lazy ftab_lazy_t;
+
+ftab_lazy_t * ftab_lazy_open(const char * fname, const char * dlm);
+void ftab_lazy_close(ftab_lazy_t * L);
+size_t ftab_lazy_nrow(const ftab_lazy_t * L);
+size_t ftab_lazy_ncol(const ftab_lazy_t * L);
+const char * ftab_lazy_colname(const ftab_lazy_t * L, size_t col);
+/* Like ftab_get_col */
+int ftab_lazy_get_col(const ftab_lazy_t * L, const char * name);
+/* The values of a column, nrow floats owned by L */
+const float * ftab_lazy_column(ftab_lazy_t * L, size_t col);
+/* A new table with the given columns */
+ftab_t * ftab_lazy_select(ftab_lazy_t * L, const int * cols, size_t ncols);
+
+/* Write as a NumPy .npy file, a 2D C-order array of float32
+ * ('<f4'). The column names, if any, are written to fname.colnames
+ * with one name per line. */
+int ftab_write_npy(const ftab_t * T, const char * fname);
+
+/* Read a 2D (or 1D) C-order '<f4' .npy file. The file is memory
+ * mapped and used in place when possible. Column names are read from
+ * fname.colnames if that file exists. */
+ftab_t * ftab_from_npy(const char * fname);
+
+/* Write an Arrow IPC file (Feather v2) with one float32 column per
+ * column of the table, as a single record batch. Missing values are
+ * written as nulls. */
+int ftab_write_arrow(const ftab_t * T, const char * fname);
+
+/* Read an Arrow IPC file where all columns are float32. Null values
+ * are missing values, see ftab_is_missing. */
+ftab_t * ftab_from_arrow(const char * fname);
+
+/* Column access to an Arrow IPC file without copying. The file is
+ * memory mapped until ftab_arrow_close. */
+typedef struct ftab_arrow ftab_arrow_t;
+
+ftab_arrow_t * ftab_arrow_open(const char * fname);
+void ftab_arrow_close(ftab_arrow_t * A);
+size_t ftab_arrow_nrow(const ftab_arrow_t * A);
+size_t ftab_arrow_ncol(const ftab_arrow_t * A);
+size_t ftab_arrow_nbatch(const ftab_arrow_t * A);
+const char * ftab_arrow_colname(const ftab_arrow_t * A, size_t col);
+
+/* The data of a column in a record batch. Returns NULL if the column
+ * contains nulls, use ftab_from_arrow for those.
+ * @param[out] nrow The number of values
+ */
+const float *
+ftab_arrow_column(const ftab_arrow_t * A, size_t batch, size_t col, size_t * nrow);
+
 /* Write tsv file do disk */
 int ftab_write_tsv(const ftab_t * T, const char * fname);
 
@@ -91,6 +280,35 @@ int ftab_write_csv(const ftab_t * T, const char * fname);
 /* Write tsv file do disk */
 int ftab_write_csv(const ftab_t * T, const char * fname);
 
+/* Append the rows [first_row, nrow) of T to a tsv/csv file. The file
+ * is created, with a header, if it does not exist. Otherwise the header
+ * has to match the column names of T. The check and the append use
+ * the same open file under an exclusive advisory lock (flock), so
+ * concurrent calls, also from other processes, are serialized. Writers
+ * that do not take the lock are not. An incomplete last line, e.g.,
+ * from an interrupted writer, is removed before the rows are added. */
+int ftab_append_tsv(const ftab_t * T, const char * fname, size_t first_row);
+int ftab_append_csv(const ftab_t * T, const char * fname, size_t first_row);
+
+/* Follow a tsv/csv file that is being appended to. ftab_tail_read
+ * returns a new table with the rows completed since the previous
+ * call, possibly with 0 rows, or NULL on failure. Only the new part
+ * of the file is read. */
+typedef struct ftab_tail ftab_tail_t;
+
+ftab_tail_t * ftab_tail_open(const char * fname, const char * dlm);
+ftab_t * ftab_tail_read(ftab_tail_t * R);
+/* Bytes of the file consumed so far */
+uint64_t ftab_tail_offset(const ftab_tail_t * R);
+void ftab_tail_close(ftab_tail_t * R);
+
+/** Format the table as text in memory, same format as ftab_print
+ * @param[in] sep The separator, e.g., "," or "\t"
+ * @param[out] len The length of the returned string. Can be NULL
+ * @return A NUL-terminated string to be freed by the caller, or NULL
+ */
+char * ftab_write_buffer(const ftab_t * T, const char * sep, size_t * len);
+
 /** Print table to file
  * @param[in] fid An open FILE to write to
  * @param[in] T the table to write
@@ -119,10 +337,24 @@ int ftab_get_col(const ftab_t * T, const char * name);
  * @param T: table to receive data
  * @param col: column to write to
  * @param data: pointer to data to insert
+ * The column has no missing values afterwards.
  */
 
 int ftab_set_coldata(ftab_t * T, int col, const float * data);
 
+/* Missing values. Each column with missing values has a bitmap, 1 bit
+ * per row, and the missing cells contain NAN. The bitmaps are kept by
+ * ftab_insert, ftab_head, ftab_subselect_rows, ftab_filter, ftab_sort,
+ * ftab_copy, ftab_concatenate_rows/columns, ftab_hcat,
+ * ftab_select_columns and ftab_partition, and ftab_compare compares
+ * them. Writers leave missing cells empty. Other functions return
+ * tables where the missing values are just NAN.
+ */
+int ftab_is_missing(const ftab_t * T, size_t row, size_t col);
+/* Mark a cell as missing, its value is set to NAN */
+void ftab_set_missing(ftab_t * T, size_t row, size_t col);
+size_t ftab_count_missing(const ftab_t * T, size_t col);
+
 /** @brief Horizontal concatenation
  *
  * @param L : data on the left side
@@ -130,6 +362,14 @@ int ftab_set_coldata(ftab_t * T, int col, const float * data);
 */
 ftab_t * ftab_concatenate_columns(const ftab_t * L, const ftab_t * R);
 
+/* Horizontal concatenation of n tables with the same number of rows */
+ftab_t * ftab_hcat(const ftab_t ** tables, size_t n);
+
+/* Keep the n columns idx[0], ..., idx[n-1], in that order, in place.
+ * Columns can be dropped, reordered or repeated as long as n <= ncol.
+ * The column names and missing values follow the columns. */
+int ftab_select_columns(ftab_t * T, const int * idx, size_t n);
+
 /* Concatenate two tables vertically with T on the top and B on the bottom */
 ftab_t * ftab_concatenate_rows(const ftab_t * T, const ftab_t * B);
 
@@ -139,12 +379,140 @@ void ftab_subselect_rows(ftab_t * T, const uint8_t * row_selector);
 /* Keep n head rows */
 void ftab_head(ftab_t * T, int64_t n);
 
+/* Return a new table with the k rows that have the largest
+ * (descending=1) or smallest (descending=0) values in column col, in
+ * sorted order. Same result as ftab_sort + ftab_head but without
+ * sorting everything. T is not modified. NAN values are placed last.
+ */
+ftab_t * ftab_topk(const ftab_t * T, int col, size_t k, int descending);
+
+/* Merge n tables, each already sorted by column col in ascending
+ * (descending=0) or descending (descending=1) order with NAN last, into
+ * a new sorted table. O(N log n) instead of concatenating and sorting
+ * again. The merge is stable, rows with equal keys keep their order
+ * and rows from tables[i] come before rows from tables[i+1]. All tables
+ * need the same number of columns, the names are taken from the first
+ * table that has any. Returns NULL on failure.
+ */
+ftab_t * ftab_merge_sorted(const ftab_t ** tables, size_t n, int col,
+                           int descending);
+
+/* Split the rows of T by the values of column col, e.g., a label per
+ * cell or channel, with one counting pass and one scatter pass. The
+ * partitions are ordered by ascending key, NAN last, and rows keep
+ * their order within each partition. -0 and 0 are the same key, and
+ * so are all NAN. Returns NULL on failure. T is not modified.
+ */
+typedef struct ftab_partition ftab_partition_t;
+ftab_partition_t * ftab_partition(const ftab_t * T, int col);
+void ftab_partition_free(ftab_partition_t * P);
+/* Number of partitions, i.e., distinct keys */
+size_t ftab_partition_count(const ftab_partition_t * P);
+/* Key of partition k */
+float ftab_partition_key(const ftab_partition_t * P, size_t k);
+/* Partition k as a table. This is a view into the data of P, do not
+ * free or modify it, and do not use it after ftab_partition_free. */
+const ftab_t * ftab_partition_table(const ftab_partition_t * P, size_t k);
+/* All rows, grouped by key. Partition k is the rows [offsets[k],
+ * offsets[k+1]) where offsets has count + 1 elements */
+const ftab_t * ftab_partition_grouped(const ftab_partition_t * P);
+const size_t * ftab_partition_offsets(const ftab_partition_t * P);
+
+/* Write one file per key of column col, in parallel. The file names
+ * are given by pattern with one floating point conversion for the key,
+ * e.g., "cell_%.0f.tsv". Files ending with .csv are written as csv,
+ * others as tsv. Fails without writing anything if two keys give the
+ * same file name, e.g., 0.2 and 0.4 with %.0f. */
+int ftab_write_partitioned(const ftab_t * T, int col, const char * pattern);
+
+/* Remove duplicate rows, keeping the first occurrence of each, in the
+ * original order. Rows are compared by the n columns in cols, or all
+ * columns if cols is NULL, bit by bit. With canonical set, -0 equals 0
+ * and all NAN values are equal. Uses a hash set, no sorting.
+ */
+int ftab_distinct(ftab_t * T, const int * cols, size_t n, int canonical);
+
+/* Exact quantiles of column col, q has nq probabilities in [0, 1].
+ * Interpolates linearly between the closest ranks, like the default
+ * of numpy.quantile. NAN and missing values are ignored, out gets NAN
+ * if there are no other values. Uses one copy of the column and
+ * introselect, no sorting. */
+int ftab_quantile(const ftab_t * T, int col, const double * q, size_t nq,
+                  double * out);
+
+/* Mergeable sketches for columns that are too large, or arrive in too
+ * many pieces, for exact answers. Both are built in parallel by the
+ * _add_column functions, which can also be called once per batch from
+ * a streaming reader. NAN and missing values are ignored. Serialized
+ * sketches can be stored and merged later, in native byte order.
+ */
+
+/* KLL quantile sketch, k = 0 for the default 200, the rank error is
+ * about 1.7/k. Memory is O(k) regardless of the number of values. */
+typedef struct ftab_qsketch ftab_qsketch_t;
+ftab_qsketch_t * ftab_qsketch_new(int k);
+void ftab_qsketch_free(ftab_qsketch_t * S);
+void ftab_qsketch_add(ftab_qsketch_t * S, float value);
+int ftab_qsketch_add_column(ftab_qsketch_t * S, const ftab_t * T, int col);
+/* Add O to S, both need the same k */
+int ftab_qsketch_merge(ftab_qsketch_t * S, const ftab_qsketch_t * O);
+uint64_t ftab_qsketch_count(const ftab_qsketch_t * S);
+/* Approximate q-quantile, the exact min and max for q = 0 and q = 1 */
+double ftab_qsketch_quantile(const ftab_qsketch_t * S, double q);
+char * ftab_qsketch_serialize(const ftab_qsketch_t * S, size_t * len);
+ftab_qsketch_t * ftab_qsketch_deserialize(const char * buf, size_t len);
+
+/* HyperLogLog distinct count sketch with 2^p bytes, p = 0 for the
+ * default 14. The relative error is about 1.04/sqrt(2^p), i.e., 0.8%
+ * for p = 14. -0 and 0 count as the same value. */
+typedef struct ftab_hll ftab_hll_t;
+ftab_hll_t * ftab_hll_new(int p);
+void ftab_hll_free(ftab_hll_t * H);
+void ftab_hll_add(ftab_hll_t * H, float value);
+int ftab_hll_add_column(ftab_hll_t * H, const ftab_t * T, int col);
+/* Add O to H, both need the same p */
+int ftab_hll_merge(ftab_hll_t * H, const ftab_hll_t * O);
+double ftab_hll_estimate(const ftab_hll_t * H);
+char * ftab_hll_serialize(const ftab_hll_t * H, size_t * len);
+ftab_hll_t * ftab_hll_deserialize(const char * buf, size_t len);
+
+/* Uniform random sample of n rows, without replacement, as a new
+ * table with the rows in their original order. All rows if n >= nrow.
+ * The same seed gives the same sample regardless of the number of
+ * threads. Returns NULL if T is empty or memory runs out. See also the
+ * sample option of ftab_opts_t to sample while loading. */
+ftab_t * ftab_sample(const ftab_t * T, size_t n, uint64_t seed);
+
+/* Up to n random rows per distinct value of column col, keys as for
+ * ftab_partition. The rows are grouped by key, in ascending key order,
+ * and are in their original order within each key. */
+ftab_t * ftab_sample_stratified(const ftab_t * T, int col, size_t n,
+                                uint64_t seed);
+
 /* Subselect rows where row_selector > 0
  * The row_selector array needs to have as many elements as there are rows.
  * The table is modified.
  */
 void ftab_subselect_rows(ftab_t * T, const uint8_t * row_selector);
 
+/* Evaluate an expression for each row, e.g., "sqrt(x*x + y*y)" where x
+ * and y are column names. Names that are not valid identifiers can be
+ * quoted as `name`. Supported are + - * / unary -, comparisons
+ * < <= > >= == != (giving 0 or 1), && || !, parentheses, the constants
+ * nan, inf and pi and the functions sqrt, abs, exp, log, log10, sin,
+ * cos, tan, floor, ceil, isnan, pow, min, max and atan2.
+ * Returns an array with one value per row, to be freed by the
+ * caller, e.g., after ftab_set_coldata. NULL on failure, for example
+ * on syntax errors or unknown columns.
+ */
+float * ftab_eval(const ftab_t * T, const char * expr);
+
+/* Keep the rows where expr, as for ftab_eval, is non-zero and not NAN,
+ * e.g., "value/bg > 3 && !isnan(x)".
+ * @return EXIT_SUCCESS or EXIT_FAILURE, T is not modified on failure
+ */
+int ftab_filter(ftab_t * T, const char * expr);
+
 /** Create a deep copy */
 ftab_t * ftab_copy(const ftab_t * T);
 
@@ -155,6 +523,134 @@ ftab_t * ftab_copy(const ftab_t * T);
 */
 int ftab_compare(const ftab_t *, const ftab_t * );
 
+/* 64-bit hash of the size, the column names and the data (bitwise).
+ * Equal tables according to ftab_compare have the same hash. */
+uint64_t ftab_hash(const ftab_t * T);
+
+/* Compare the values of two tables with a tolerance, column names are
+ * not compared. Values a and b are considered equal if
+ * |a-b| <= abs_tol or |a-b| <= rel_tol*max(|a|, |b|), NAN is equal to
+ * NAN. Returns 0 if all values are equal, otherwise 1 and the first
+ * differing cell in row, col (both can be NULL). They are set to
+ * SIZE_MAX if the sizes differ. */
+int ftab_compare_approx(const ftab_t * A, const ftab_t * B,
+                        double abs_tol, double rel_tol,
+                        size_t * row, size_t * col);
+
+/* k-d tree over some columns of a table, e.g., x, y and z.
+ * The coordinates are copied so the table can be freed or
+ * modified after the tree is built. Rows with NAN are not included.
+ */
+typedef struct ftab_kdtree ftab_kdtree_t;
+
+/* Build a k-d tree using the ndim columns in cols, at most 32 */
+ftab_kdtree_t *
+ftab_kdtree_build(const ftab_t * T, const int * cols, int ndim);
+
+void ftab_kdtree_free(ftab_kdtree_t * K);
+
+/* Number of points in the tree */
+size_t ftab_kdtree_size(const ftab_kdtree_t * K);
+
+/** @brief Find the k nearest neighbours for a batch of points
+ * @param Q nq x ndim query coordinates, row major
+ * @param idx nq x k output, the row numbers in the table sorted by
+ * distance. -1 if there are less than k points.
+ * @param dist2 nq x k output, squared distances. Can be NULL
+ */
+int ftab_kdtree_knn(const ftab_kdtree_t * K,
+                    const float * Q, size_t nq, size_t k,
+                    int64_t * idx, float * dist2);
+
+/** @brief Find all points within a radius for a batch of points
+ * @param Q nq x ndim query coordinates, row major
+ * @param offsets Set to a new array of nq+1 elements. The points
+ * for query i are (*idx)[(*offsets)[i]] to (*idx)[(*offsets)[i+1]-1]
+ * @param idx Set to a new array with the row numbers of the points,
+ * in no particular order.
+ * Both arrays should be freed by the caller.
+ */
+int ftab_kdtree_radius(const ftab_kdtree_t * K,
+                       const float * Q, size_t nq, float radius,
+                       size_t ** offsets, int64_t ** idx);
+
+/** @brief Histogram of a column
+ *
+ * nbins bins of equal width over [lo, hi]. Values outside the range
+ * and NAN are not counted.
+ * @return A table with one row per bin and two columns, the bin
+ * center and "count".
+ */
+ftab_t *
+ftab_histogram(const ftab_t * T, int col, size_t nbins, float lo, float hi);
+
+/** @brief Multi-dimensional histogram, e.g., spatial bin counts
+ *
+ * Like ftab_histogram with nbins[d] bins over [lo[d], hi[d]] for each
+ * of the ndim columns in cols.
+ * @return A table with one row per bin (the last dimension varies
+ * fastest), with the bin centers followed by the "count" column.
+ * Note that counts above 2^24 can not be represented exactly.
+ */
+ftab_t *
+ftab_histogram_nd(const ftab_t * T, const int * cols, int ndim,
+                  const size_t * nbins, const float * lo, const float * hi);
+
+/* Compressed, read-only, copy of a table where each column is stored
+ * with the encoding that uses the least memory:
+ */
+typedef enum {
+    FTAB_ENC_RAW, /* float32 */
+    FTAB_ENC_DICT, /* Dictionary of distinct values + bit-packed codes */
+    FTAB_ENC_FOR, /* Integers: bit-packed offsets from the minimum value */
+    FTAB_ENC_F16 /* Half precision float */
+} ftab_encoding_t;
+
+typedef struct ftab_packed ftab_packed_t;
+
+/* Allow FTAB_ENC_F16 also when it is not exact */
+#define FTAB_PACK_LOSSY_F16 1
+
+/* Create a packed copy of T. Without FTAB_PACK_LOSSY_F16 the
+ * encoding is lossless, ftab_unpack gives back the same table. */
+ftab_packed_t * ftab_pack(const ftab_t * T, int flags);
+void ftab_packed_free(ftab_packed_t * P);
+ftab_t * ftab_unpack(const ftab_packed_t * P);
+
+size_t ftab_packed_nrow(const ftab_packed_t * P);
+size_t ftab_packed_ncol(const ftab_packed_t * P);
+ftab_encoding_t ftab_packed_encoding(const ftab_packed_t * P, int col);
+/* Approximate memory usage in bytes */
+size_t ftab_packed_bytes(const ftab_packed_t * P);
+
+/* Decode column col into out, which should have space for nrow values */
+int ftab_packed_decode(const ftab_packed_t * P, int col, float * out);
+
+typedef struct {
+    size_t n; /* Number of non-NAN values */
+    double sum;
+    float min; /* NAN if n = 0 */
+    float max;
+} ftab_colstats_t;
+
+/* Statistics of a column, computed on the encoded data */
+int ftab_packed_stats(const ftab_packed_t * P, int col, ftab_colstats_t * S);
+
+/* Set selection[i] to 1 if lo <= value <= hi for row i, otherwise
+ * 0. The selection can be used with ftab_subselect_rows. */
+int ftab_packed_select_range(const ftab_packed_t * P, int col,
+                             float lo, float hi, uint8_t * selection);
+
+/* Lossless compressed columnar file. Each column is stored in chunks
+ * that are filtered (byte shuffle or XOR delta) and compressed with
+ * zstd or zlib, whatever ftab was built with. */
+int ftab_write_compressed(const ftab_t * T, const char * fname);
+ftab_t * ftab_from_compressed(const char * fname);
+/* Only the rows where lo <= value <= hi in column col. Chunks
+ * that can't contain such values are not read. */
+ftab_t * ftab_from_compressed_range(const char * fname, int col,
+                                    float lo, float hi);
+
 /* Run some unit tests */
 int ftab_ut(int argc, char ** argv);
 
@@ -162,10 +658,28 @@ int ftab_ut(int argc, char ** argv);
 double *
 ftab_get_data_f64(const ftab_t *);
 
-/* Return a new array containing a copy of the data */
+/* Return a new array containing a copy of the data, converted as by
+ * ftab_to_u32 without checking */
 uint32_t *
 ftab_get_data_u32(const ftab_t *);
 
+/* Convert to caller provided buffers, nrow x ncols in row major
+ * order. cols lists the columns to convert, or NULL (with ncols
+ * ignored) for all of them. */
+int ftab_to_f64(const ftab_t * T, const int * cols, size_t ncols, double * out);
+
+/* Values are truncated. NAN and negative values saturate to 0 and
+ * values above UINT32_MAX to UINT32_MAX. If checked != 0,
+ * EXIT_FAILURE is returned if any value had to be saturated. */
+int ftab_to_u32(const ftab_t * T, const int * cols, size_t ncols,
+                uint32_t * out, int checked);
+
+/* New tables from row major data. Values are rounded to the nearest
+ * float, integers above 2^24 are not always exact. */
+ftab_t * ftab_new_from_f64(size_t nrow, size_t ncol, const double * data);
+ftab_t * ftab_new_from_u32(size_t nrow, size_t ncol, const uint32_t * data);
+ftab_t * ftab_new_from_i32(size_t nrow, size_t ncol, const int32_t * data);
+
 /* Return the number of elements in T, i.e.
 * number of rows x number of columns
 */
@@ -0,0 +1,560 @@
+#pragma once
+
+/*    Copyright (C) 2020 Erik L. G. Wernersson
+ *
+ *    This program is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/* Header-only C++17 wrapper around ftab.h.
+ *
+ * ftab::table<float> (or just ftab::table with C++17 deduction) owns an
+ * ftab_t and frees it when it goes out of scope. It is move-only, use
+ * copy() for a deep copy. ftab::table<double> and ftab::table<int32_t>
+ * hold the same row-major layout in another element type, converted
+ * once from a float table.
+ *
+ * Rows are contiguous and returned as ftab::span<T>, which is
+ * std::span with C++20. Columns are strided views. Both are thin
+ * pointer wrappers and the accessors are inline, so loops over them
+ * compile to the same code as loops over T->T, see ftab_hpp_bench.cpp.
+ *
+ * Failures in the C API are reported as ftab::error exceptions.
+ */
+
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <iterator>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#if __cplusplus >= 202002L && defined(__has_include)
+#if __has_include(<span>)
+#include <span>
+#define FTAB_HPP_STD_SPAN
+#endif
+#endif
+
+#include "ftab.h"
+
+namespace ftab {
+
+class error : public std::runtime_error
+{
+public:
+    using std::runtime_error::runtime_error;
+};
+
+#ifdef FTAB_HPP_STD_SPAN
+template <typename T>
+using span = std::span<T>;
+#else
+/* The subset of std::span used by the wrapper */
+template <typename T>
+class span
+{
+public:
+    using element_type = T;
+    using value_type = std::remove_cv_t<T>;
+    using size_type = std::size_t;
+    using iterator = T *;
+
+    constexpr span() noexcept = default;
+    constexpr span(T * data, size_type size) noexcept
+        : data_(data), size_(size) {}
+    template <typename U, typename = std::enable_if_t<
+                  std::is_convertible_v<U (*)[], T (*)[]>>>
+    constexpr span(const span<U> & other) noexcept
+        : data_(other.data()), size_(other.size()) {}
+
+    constexpr T * data() const noexcept { return data_; }
+    constexpr size_type size() const noexcept { return size_; }
+    constexpr bool empty() const noexcept { return size_ == 0; }
+    constexpr T & operator[](size_type idx) const noexcept { return data_[idx]; }
+    constexpr T * begin() const noexcept { return data_; }
+    constexpr T * end() const noexcept { return data_ + size_; }
+
+private:
+    T * data_ = nullptr;
+    size_type size_ = 0;
+};
+#endif
+
+/* A column, or any other strided sequence */
+template <typename T>
+class strided_view
+{
+public:
+    using value_type = std::remove_cv_t<T>;
+    using size_type = std::size_t;
+
+    class iterator
+    {
+    public:
+        using iterator_category = std::random_access_iterator_tag;
+        using value_type = std::remove_cv_t<T>;
+        using difference_type = std::ptrdiff_t;
+        using pointer = T *;
+        using reference = T &;
+
+        iterator() noexcept = default;
+        iterator(T * ptr, difference_type stride) noexcept
+            : ptr_(ptr), stride_(stride) {}
+
+        reference operator*() const noexcept { return *ptr_; }
+        pointer operator->() const noexcept { return ptr_; }
+        reference operator[](difference_type n) const noexcept
+        {
+            return ptr_[n*stride_];
+        }
+        iterator & operator++() noexcept { ptr_ += stride_; return *this; }
+        iterator operator++(int) noexcept { iterator it = *this; ++*this; return it; }
+        iterator & operator--() noexcept { ptr_ -= stride_; return *this; }
+        iterator operator--(int) noexcept { iterator it = *this; --*this; return it; }
+        iterator & operator+=(difference_type n) noexcept { ptr_ += n*stride_; return *this; }
+        iterator & operator-=(difference_type n) noexcept { ptr_ -= n*stride_; return *this; }
+        friend iterator operator+(iterator it, difference_type n) noexcept { return it += n; }
+        friend iterator operator+(difference_type n, iterator it) noexcept { return it += n; }
+        friend iterator operator-(iterator it, difference_type n) noexcept { return it -= n; }
+        friend difference_type operator-(const iterator & a, const iterator & b) noexcept
+        {
+            return (a.ptr_ - b.ptr_) / a.stride_;
+        }
+        friend bool operator==(const iterator & a, const iterator & b) noexcept { return a.ptr_ == b.ptr_; }
+        friend bool operator!=(const iterator & a, const iterator & b) noexcept { return a.ptr_ != b.ptr_; }
+        friend bool operator<(const iterator & a, const iterator & b) noexcept { return a.ptr_ < b.ptr_; }
+        friend bool operator>(const iterator & a, const iterator & b) noexcept { return a.ptr_ > b.ptr_; }
+        friend bool operator<=(const iterator & a, const iterator & b) noexcept { return a.ptr_ <= b.ptr_; }
+        friend bool operator>=(const iterator & a, const iterator & b) noexcept { return a.ptr_ >= b.ptr_; }
+
+    private:
+        T * ptr_ = nullptr;
+        difference_type stride_ = 1;
+    };
+
+    strided_view() noexcept = default;
+    strided_view(T * data, size_type size, size_type stride) noexcept
+        : data_(data), size_(size), stride_(stride) {}
+
+    T & operator[](size_type idx) const noexcept { return data_[idx*stride_]; }
+    size_type size() const noexcept { return size_; }
+    size_type stride() const noexcept { return stride_; }
+    bool empty() const noexcept { return size_ == 0; }
+    T * data() const noexcept { return data_; }
+    iterator begin() const noexcept
+    {
+        return iterator(data_, static_cast<std::ptrdiff_t>(stride_));
+    }
+    iterator end() const noexcept
+    {
+        return iterator(data_ + size_*stride_, static_cast<std::ptrdiff_t>(stride_));
+    }
+
+    /* Copy to a contiguous vector */
+    std::vector<value_type> to_vector() const
+    {
+        return std::vector<value_type>(begin(), end());
+    }
+
+private:
+    T * data_ = nullptr;
+    size_type size_ = 0;
+    size_type stride_ = 1;
+};
+
+/* Iterate over the rows of a row-major array, yielding span<T> */
+template <typename T>
+class row_range
+{
+public:
+    class iterator
+    {
+    public:
+        using iterator_category = std::random_access_iterator_tag;
+        using value_type = span<T>;
+        using difference_type = std::ptrdiff_t;
+        using pointer = void;
+        using reference = span<T>;
+
+        iterator() noexcept = default;
+        iterator(T * ptr, std::size_t ncol) noexcept : ptr_(ptr), ncol_(ncol) {}
+
+        reference operator*() const noexcept { return span<T>(ptr_, ncol_); }
+        reference operator[](difference_type n) const noexcept
+        {
+            return span<T>(ptr_ + n*static_cast<difference_type>(ncol_), ncol_);
+        }
+        iterator & operator++() noexcept { ptr_ += ncol_; return *this; }
+        iterator operator++(int) noexcept { iterator it = *this; ++*this; return it; }
+        iterator & operator--() noexcept { ptr_ -= ncol_; return *this; }
+        iterator operator--(int) noexcept { iterator it = *this; --*this; return it; }
+        iterator & operator+=(difference_type n) noexcept
+        {
+            ptr_ += n*static_cast<difference_type>(ncol_);
+            return *this;
+        }
+        iterator & operator-=(difference_type n) noexcept { return *this += -n; }
+        friend iterator operator+(iterator it, difference_type n) noexcept { return it += n; }
+        friend iterator operator-(iterator it, difference_type n) noexcept { return it -= n; }
+        friend difference_type operator-(const iterator & a, const iterator & b) noexcept
+        {
+            return (a.ptr_ - b.ptr_) / static_cast<difference_type>(a.ncol_);
+        }
+        friend bool operator==(const iterator & a, const iterator & b) noexcept { return a.ptr_ == b.ptr_; }
+        friend bool operator!=(const iterator & a, const iterator & b) noexcept { return a.ptr_ != b.ptr_; }
+        friend bool operator<(const iterator & a, const iterator & b) noexcept { return a.ptr_ < b.ptr_; }
+
+    private:
+        T * ptr_ = nullptr;
+        std::size_t ncol_ = 1;
+    };
+
+    row_range(T * data, std::size_t nrow, std::size_t ncol) noexcept
+        : data_(data), nrow_(nrow), ncol_(ncol) {}
+
+    iterator begin() const noexcept { return iterator(data_, ncol_); }
+    iterator end() const noexcept { return iterator(data_ + nrow_*ncol_, ncol_); }
+    std::size_t size() const noexcept { return nrow_; }
+
+private:
+    T * data_;
+    std::size_t nrow_;
+    std::size_t ncol_;
+};
+
+namespace detail {
+
+/* Views shared by all element types. Derived provides data(), nrow()
+ * and ncol(). */
+template <typename Derived, typename T>
+class table_views
+{
+public:
+    span<T> row(std::size_t r) noexcept
+    {
+        return span<T>(self().data() + r*self().ncol(), self().ncol());
+    }
+    span<const T> row(std::size_t r) const noexcept
+    {
+        return span<const T>(self().data() + r*self().ncol(), self().ncol());
+    }
+    strided_view<T> col(std::size_t c) noexcept
+    {
+        return strided_view<T>(self().data() + c, self().nrow(), self().ncol());
+    }
+    strided_view<const T> col(std::size_t c) const noexcept
+    {
+        return strided_view<const T>(self().data() + c, self().nrow(), self().ncol());
+    }
+    T & operator()(std::size_t r, std::size_t c) noexcept
+    {
+        return self().data()[r*self().ncol() + c];
+    }
+    const T & operator()(std::size_t r, std::size_t c) const noexcept
+    {
+        return self().data()[r*self().ncol() + c];
+    }
+    row_range<T> rows() noexcept
+    {
+        return row_range<T>(self().data(), self().nrow(), self().ncol());
+    }
+    row_range<const T> rows() const noexcept
+    {
+        return row_range<const T>(self().data(), self().nrow(), self().ncol());
+    }
+    /* Iterate over the rows */
+    typename row_range<T>::iterator begin() noexcept { return rows().begin(); }
+    typename row_range<T>::iterator end() noexcept { return rows().end(); }
+    typename row_range<const T>::iterator begin() const noexcept { return rows().begin(); }
+    typename row_range<const T>::iterator end() const noexcept { return rows().end(); }
+    /* All values, row by row */
+    span<T> values() noexcept
+    {
+        return span<T>(self().data(), self().nrow()*self().ncol());
+    }
+    span<const T> values() const noexcept
+    {
+        return span<const T>(self().data(), self().nrow()*self().ncol());
+    }
+    std::size_t size() const noexcept { return self().nrow(); }
+
+private:
+    Derived & self() noexcept { return static_cast<Derived &>(*this); }
+    const Derived & self() const noexcept { return static_cast<const Derived &>(*this); }
+};
+
+template <typename T>
+T * check(T * ptr, const char * what)
+{
+    if(ptr == nullptr)
+    {
+        throw error(std::string("ftab: ") + what + " failed");
+    }
+    return ptr;
+}
+
+inline void check(int status, const char * what)
+{
+    if(status != EXIT_SUCCESS)
+    {
+        throw error(std::string("ftab: ") + what + " failed");
+    }
+}
+
+} // namespace detail
+
+template <typename T = float>
+class table;
+
+/* The native storage, an owned ftab_t */
+template <>
+class table<float> : public detail::table_views<table<float>, float>
+{
+public:
+    using value_type = float;
+
+    table() noexcept = default;
+    explicit table(std::size_t ncol)
+        : T_(detail::check(ftab_new(static_cast<int>(ncol)), "ftab_new")) {}
+    table(std::size_t nrow, std::size_t ncol, const float * data)
+        : T_(detail::check(ftab_new_from_data(static_cast<int>(nrow),
+                                              static_cast<int>(ncol), data),
+                           "ftab_new_from_data")) {}
+    /* Take ownership of T */
+    explicit table(ftab_t * T) noexcept : T_(T) {}
+
+    table(const table &) = delete;
+    table & operator=(const table &) = delete;
+    table(table && other) noexcept : T_(std::exchange(other.T_, nullptr)) {}
+    table & operator=(table && other) noexcept
+    {
+        if(this != &other)
+        {
+            ftab_free(T_);
+            T_ = std::exchange(other.T_, nullptr);
+        }
+        return *this;
+    }
+    ~table() { ftab_free(T_); }
+
+    static table from_tsv(const std::string & fname)
+    {
+        return table(detail::check(ftab_from_tsv(fname.c_str()), "ftab_from_tsv"));
+    }
+    static table from_csv(const std::string & fname)
+    {
+        return table(detail::check(ftab_from_csv(fname.c_str()), "ftab_from_csv"));
+    }
+    static table from_buffer(const char * buf, std::size_t len,
+                             const ftab_opts_t * opts = nullptr)
+    {
+        return table(detail::check(ftab_from_buffer(buf, len, opts),
+                                   "ftab_from_buffer"));
+    }
+
+    table copy() const
+    {
+        return table(detail::check(ftab_copy(T_), "ftab_copy"));
+    }
+
+    ftab_t * get() const noexcept { return T_; }
+    /* Give up ownership */
+    ftab_t * release() noexcept { return std::exchange(T_, nullptr); }
+    explicit operator bool() const noexcept { return T_ != nullptr; }
+
+    /* Note that data() can change when rows are inserted */
+    float * data() noexcept { return T_ ? T_->T : nullptr; }
+    const float * data() const noexcept { return T_ ? T_->T : nullptr; }
+    std::size_t nrow() const noexcept { return T_ ? T_->nrow : 0; }
+    std::size_t ncol() const noexcept { return T_ ? T_->ncol : 0; }
+
+    using detail::table_views<table<float>, float>::col;
+    strided_view<float> col(const std::string & name)
+    {
+        return col(col_index(name));
+    }
+    strided_view<const float> col(const std::string & name) const
+    {
+        return col(col_index(name));
+    }
+    std::size_t col_index(const std::string & name) const
+    {
+        int c = ftab_get_col(T_, name.c_str());
+        if(c < 0)
+        {
+            throw error("ftab: no column named " + name);
+        }
+        return static_cast<std::size_t>(c);
+    }
+    /* Empty if the column has no name */
+    std::string colname(std::size_t c) const
+    {
+        if(T_ == nullptr || T_->colnames == nullptr || T_->colnames[c] == nullptr)
+        {
+            return std::string();
+        }
+        return T_->colnames[c];
+    }
+    void set_colname(std::size_t c, const std::string & name)
+    {
+        ftab_set_colname(T_, static_cast<int>(c), name.c_str());
+    }
+
+    void insert(span<const float> row)
+    {
+        if(row.size() != ncol())
+        {
+            throw error("ftab: wrong number of values in row");
+        }
+        ftab_insert(T_, const_cast<float *>(row.data()));
+    }
+
+    void write_tsv(const std::string & fname) const
+    {
+        detail::check(ftab_write_tsv(T_, fname.c_str()), "ftab_write_tsv");
+    }
+    void write_csv(const std::string & fname) const
+    {
+        detail::check(ftab_write_csv(T_, fname.c_str()), "ftab_write_csv");
+    }
+
+    std::vector<float> eval(const std::string & expr) const
+    {
+        std::unique_ptr<float, decltype(&std::free)>
+            v(detail::check(ftab_eval(T_, expr.c_str()), "ftab_eval"), &std::free);
+        return std::vector<float>(v.get(), v.get() + nrow());
+    }
+    void filter(const std::string & expr)
+    {
+        detail::check(ftab_filter(T_, expr.c_str()), "ftab_filter");
+    }
+
+    bool operator==(const table & other) const noexcept
+    {
+        return ftab_compare(T_, other.T_) == 0;
+    }
+    bool operator!=(const table & other) const noexcept { return !(*this == other); }
+
+private:
+    ftab_t * T_ = nullptr;
+};
+
+/* The same row-major layout with double or int32_t elements. The
+ * conversion from a float table is done once, by the vectorized and
+ * parallel code in ftab.c for double. Conversion to int32_t rounds to
+ * nearest and saturates, NAN becomes 0. */
+template <typename T>
+class table : public detail::table_views<table<T>, T>
+{
+    static_assert(std::is_same_v<T, double> || std::is_same_v<T, std::int32_t>,
+                  "ftab::table supports float, double and int32_t elements");
+
+public:
+    using value_type = T;
+
+    table() = default;
+    table(std::size_t nrow, std::size_t ncol)
+        : nrow_(nrow), ncol_(ncol), data_(nrow*ncol) {}
+    explicit table(const table<float> & F)
+        : nrow_(F.nrow()), ncol_(F.ncol()), data_(F.nrow()*F.ncol())
+    {
+        if(nrow_*ncol_ == 0)
+        {
+            return;
+        }
+        if constexpr(std::is_same_v<T, double>)
+        {
+            detail::check(ftab_to_f64(F.get(), nullptr, 0, data_.data()), "ftab_to_f64");
+        } else {
+            const float * src = F.data();
+            for(std::size_t kk = 0; kk < data_.size(); kk++)
+            {
+                float v = std::nearbyint(src[kk]);
+                v = v < 2147483520.0f ? v : 2147483520.0f;
+                v = v > -2147483648.0f ? v : -2147483648.0f;
+                data_[kk] = src[kk] == src[kk] ? static_cast<std::int32_t>(v) : 0;
+            }
+        }
+        colnames_.resize(ncol_);
+        for(std::size_t cc = 0; cc < ncol_; cc++)
+        {
+            colnames_[cc] = F.colname(cc);
+        }
+    }
+
+    table(const table &) = delete;
+    table & operator=(const table &) = delete;
+    table(table &&) noexcept = default;
+    table & operator=(table &&) noexcept = default;
+
+    table copy() const
+    {
+        table C(nrow_, ncol_);
+        C.data_ = data_;
+        C.colnames_ = colnames_;
+        return C;
+    }
+
+    /* Back to the native float storage */
+    table<float> to_float() const
+    {
+        ftab_t * F = nullptr;
+        if constexpr(std::is_same_v<T, double>)
+        {
+            F = ftab_new_from_f64(nrow_, ncol_, data_.data());
+        } else {
+            F = ftab_new_from_i32(nrow_, ncol_, data_.data());
+        }
+        table<float> R(detail::check(F, "ftab_new_from"));
+        for(std::size_t cc = 0; cc < colnames_.size(); cc++)
+        {
+            if(!colnames_[cc].empty())
+            {
+                R.set_colname(cc, colnames_[cc]);
+            }
+        }
+        return R;
+    }
+
+    T * data() noexcept { return data_.data(); }
+    const T * data() const noexcept { return data_.data(); }
+    std::size_t nrow() const noexcept { return nrow_; }
+    std::size_t ncol() const noexcept { return ncol_; }
+
+    std::string colname(std::size_t c) const
+    {
+        return c < colnames_.size() ? colnames_[c] : std::string();
+    }
+    void set_colname(std::size_t c, const std::string & name)
+    {
+        colnames_.resize(ncol_);
+        colnames_[c] = name;
+    }
+
+private:
+    std::size_t nrow_ = 0;
+    std::size_t ncol_ = 0;
+    std::vector<T> data_;
+    std::vector<std::string> colnames_;
+};
+
+table(std::size_t) -> table<float>;
+table(ftab_t *) -> table<float>;
+
+} // namespace ftab
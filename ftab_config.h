@@ -1,7 +1,7 @@
 // cmake generates ftab_config.h from ftab_config.h.in
 #define FTAB_VERSION_MAJOR "0"
 #define FTAB_VERSION_MINOR "1"
-#define FTAB_VERSION_PATCH "5"
+#define FTAB_VERSION_PATCH "30"
 #define FTAB_VERSION FTAB_VERSION_MAJOR "."     \
     FTAB_VERSION_MINOR "."                      \
     FTAB_VERSION_PATCH
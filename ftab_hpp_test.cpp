@@ -0,0 +1,172 @@
+/* Unit tests of the C++ wrapper, ftab.hpp.
+ *
+ * Build with `make ftab_hpp_test` or with CMake, where it is run by
+ * ctest.
+ */
+
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "ftab.hpp"
+
+/* A 3 x 4 table with the value 10*r + c in row r, column c */
+static ftab::table<float> small_table()
+{
+    ftab::table t(4);
+    for(int rr = 0; rr < 3; rr++)
+    {
+        float row[4];
+        for(int cc = 0; cc < 4; cc++)
+        {
+            row[cc] = 10*rr + cc;
+        }
+        t.insert(ftab::span<const float>(row, 4));
+    }
+    t.set_colname(0, "a");
+    t.set_colname(2, "c");
+    return t;
+}
+
+static int ut_move(void)
+{
+    int status = 0;
+    ftab::table t = small_table();
+    ftab_t * T = t.get();
+
+    /* Moving hands over the same ftab_t and leaves an empty table */
+    ftab::table m(std::move(t));
+    if(m.get() != T || t || t.get() != nullptr || t.nrow() != 0
+       || t.ncol() != 0 || t.data() != nullptr)
+    {
+        printf("ftab::table move constructor test failed\n");
+        status++;
+    }
+
+    ftab::table a = small_table();
+    a = std::move(m);
+    if(a.get() != T || m || a.nrow() != 3 || a(2, 3) != 23)
+    {
+        printf("ftab::table move assignment test failed\n");
+        status++;
+    }
+
+    /* copy() is deep */
+    ftab::table c = a.copy();
+    c(1, 1) = -1;
+    if(c.get() == a.get() || a(1, 1) != 11 || c == a || c.colname(2) != "c")
+    {
+        printf("ftab::table copy test failed\n");
+        status++;
+    }
+
+    ftab_t * R = a.release();
+    if(R != T || a)
+    {
+        printf("ftab::table release test failed\n");
+        status++;
+    }
+    ftab::table owner(R);
+
+    /* The typed tables are moved too */
+    ftab::table<double> d(owner);
+    const double * D = d.data();
+    ftab::table<double> d2(std::move(d));
+    if(d2.data() != D || d2.nrow() != 3 || d2(1, 2) != 12)
+    {
+        printf("ftab::table<double> move test failed\n");
+        status++;
+    }
+    return status;
+}
+
+static int ut_views(void)
+{
+    int status = 0;
+    ftab::table t = small_table();
+    float sum = 0;
+    for(float v : t.col("c"))
+    {
+        sum += v;
+    }
+    auto r = t.row(1);
+    size_t nrows = 0;
+    for(auto row : t)
+    {
+        nrows += row.size() == 4;
+    }
+    if(sum != 2 + 12 + 22 || r.size() != 4 || r[3] != 13 || nrows != 3
+       || t.col(3).to_vector() != std::vector<float>({3, 13, 23})
+       || t.col_index("a") != 0 || t.colname(1) != "")
+    {
+        printf("ftab::table views test failed\n");
+        status++;
+    }
+
+    bool thrown = false;
+    try
+    {
+        t.col("none");
+    } catch(const ftab::error &) {
+        thrown = true;
+    }
+    if(!thrown)
+    {
+        printf("ftab::table unknown column test failed\n");
+        status++;
+    }
+    return status;
+}
+
+static int ut_to_float(void)
+{
+    int status = 0;
+    ftab::table t = small_table();
+
+    /* Exact for double */
+    ftab::table<double> d(t);
+    if(d.to_float() != t || d.colname(0) != "a")
+    {
+        printf("ftab::table<double> to_float test failed\n");
+        status++;
+    }
+
+    /* Integers are exact for int32_t, other values are rounded, NAN
+     * becomes 0 and large values saturate */
+    ftab::table<int32_t> i(t);
+    if(i.to_float() != t)
+    {
+        printf("ftab::table<int32_t> to_float test failed\n");
+        status++;
+    }
+    ftab::table f(3);
+    float row[3] = {2.4f, NAN, 1e10f};
+    f.insert(ftab::span<const float>(row, 3));
+    ftab::table<int32_t> fi(f);
+    ftab::table back = fi.to_float();
+    if(fi(0, 0) != 2 || fi(0, 1) != 0 || fi(0, 2) != 2147483520
+       || back(0, 0) != 2 || back(0, 1) != 0)
+    {
+        printf("ftab::table<int32_t> conversion test failed\n");
+        status++;
+    }
+    return status;
+}
+
+int main(void)
+{
+    int status = 0;
+    status += ut_move();
+    status += ut_views();
+    status += ut_to_float();
+    if(status != 0)
+    {
+        printf("%d test(s) failed\n", status);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
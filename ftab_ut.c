@@ -4,6 +4,5 @@
 
 int main(int argc, char ** argv)
 {
-    ftab_ut(argc, argv);
-    return 0;
+    return ftab_ut(argc, argv);
 }